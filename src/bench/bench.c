@@ -0,0 +1,731 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+// Microbenchmarks for the output paths, plus end-to-end runs of the tools
+// built by "make fake". Every result is one JSON object per line.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "../cfj.h"
+#include "../common.h"
+#include "../compact.h"
+#include "../iokit.h"
+#include "../oss.h"
+
+#define BENCH_MIN_NS   200000000ULL
+#define BENCH_STR_SIZE 0x10000
+#define BENCH_NUMS     0x400
+
+typedef struct
+{
+    CFDataRef data;
+    io_name_t class;
+    io_name_t name;
+} bench_entry_t;
+
+typedef struct
+{
+    common_buf_t out;
+    common_ctx_t ctx;
+    const uint8_t *data;
+    size_t size;
+    CFTypeRef obj;
+    FILE *null;
+    size_t scanned;
+    oss_t oss;
+    bench_entry_t *entries;
+    size_t numEntries;
+    compact_reader_t reader;
+    uint64_t ints[BENCH_NUMS];
+    double floats[BENCH_NUMS];
+} bench_arg_t;
+
+static uint64_t benchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void benchReport(const char *name, uint64_t ops, uint64_t ns, uint64_t bytes, long rss)
+{
+    double sec = ns / 1e9;
+    printf("{\"bench\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.1f,\"bytes\":%llu,\"mb_per_s\":%.1f,\"peak_rss_kb\":%ld}\n",
+        name, (unsigned long long)ops, (double)ns / ops, (unsigned long long)bytes, sec > 0 ? bytes / sec / 1e6 : 0.0, rss);
+    fflush(stdout);
+}
+
+// Doubles the iteration count until a run takes long enough to be meaningful.
+static void benchMicro(const char *name, void (*fn)(bench_arg_t*), bench_arg_t *arg, size_t bytes)
+{
+    uint64_t ops = 1,
+             ns = 0;
+    while(true)
+    {
+        uint64_t start = benchNow();
+        for(uint64_t i = 0; i < ops; ++i)
+        {
+            arg->out.len = 0;
+            fn(arg);
+        }
+        ns = benchNow() - start;
+        if(ns >= BENCH_MIN_NS || ops >= (1ULL << 40))
+        {
+            break;
+        }
+        ops *= ns > 0 && ns < BENCH_MIN_NS / 64 ? 8 : 2;
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    benchReport(name, ops, ns, ops * bytes, ru.ru_maxrss);
+}
+
+static void benchStr(bench_arg_t *arg)
+{
+    common_print_str(&arg->ctx, (const char*)arg->data, arg->size);
+}
+
+// The scan on its own, against the byte loop it replaced.
+static void benchScan(bench_arg_t *arg)
+{
+    arg->scanned = common_str_scan((const char*)arg->data, arg->size);
+}
+
+static void benchScanBytes(bench_arg_t *arg)
+{
+    size_t i = 0;
+    for(; i < arg->size; ++i)
+    {
+        uint8_t c = arg->data[i];
+        if(c < 0x20 || c >= 0x80 || c == '"' || c == '\\')
+        {
+            break;
+        }
+    }
+    arg->scanned = i;
+}
+
+static void benchHexdump(bench_arg_t *arg)
+{
+    common_print_hexdump(&arg->ctx, arg->data, arg->size);
+}
+
+// The -k hexdump as it was before it was rendered a line at a time, at one level of indentation.
+static void benchStdioHexdump(bench_arg_t *arg)
+{
+    FILE *f = arg->null;
+    const uint8_t *data = arg->data;
+    int pad = 4;
+    fprintf(f, "<\n%*s", pad, "");
+    char cs[17] = {};
+    size_t i;
+    for(i = 0; i < arg->size; i++)
+    {
+        if(i != 0 && i % 0x10 == 0)
+        {
+            fprintf(f, " |%s|\n%*s", cs, pad, "");
+            memset(cs, 0, 17);
+        }
+        else if(i != 0 && i % 0x8 == 0)
+        {
+            fprintf(f, " ");
+        }
+        fprintf(f, "%02x ", data[i]);
+        cs[(i % 0x10)] = (data[i] >= 0x20 && data[i] <= 0x7e) ? data[i] : '.';
+    }
+    i = i % 0x10;
+    if(i != 0)
+    {
+        if(i <= 0x8)
+        {
+            fprintf(f, " ");
+        }
+        while(i++ < 0x10)
+        {
+            fprintf(f, "   ");
+        }
+    }
+    fprintf(f, " |%s|\n%*s>", cs, pad - 4, "");
+}
+
+// Escaping as it was done before output was buffered, one stdio call per byte.
+static void benchStdioStr(bench_arg_t *arg)
+{
+    FILE *f = arg->null;
+    fputc('"', f);
+    for(size_t i = 0; i < arg->size; ++i)
+    {
+        int8_t c = (int8_t)arg->data[i];
+        if(c < 0x20)
+        {
+            fprintf(f, "\\u%04hx", (unsigned char)c);
+            continue;
+        }
+        if(c == '\\' || c == '"')
+        {
+            fputc('\\', f);
+        }
+        fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void benchBase64(bench_arg_t *arg)
+{
+    common_print_base64(&arg->ctx, arg->data, arg->size);
+}
+
+// Number formatting, against what it used to be done with.
+static void benchDec(bench_arg_t *arg)
+{
+    for(size_t i = 0; i < BENCH_NUMS; ++i)
+    {
+        common_buf_dec(&arg->out, arg->ints[i]);
+    }
+}
+
+static void benchPrintfDec(bench_arg_t *arg)
+{
+    for(size_t i = 0; i < BENCH_NUMS; ++i)
+    {
+        common_buf_printf(&arg->out, "%llu", (unsigned long long)arg->ints[i]);
+    }
+}
+
+static void benchHex(bench_arg_t *arg)
+{
+    for(size_t i = 0; i < BENCH_NUMS; ++i)
+    {
+        common_buf_hex(&arg->out, arg->ints[i]);
+    }
+}
+
+static void benchPrintfHex(bench_arg_t *arg)
+{
+    for(size_t i = 0; i < BENCH_NUMS; ++i)
+    {
+        common_buf_printf(&arg->out, "0x%llx", (unsigned long long)arg->ints[i]);
+    }
+}
+
+static void benchDouble(bench_arg_t *arg)
+{
+    for(size_t i = 0; i < BENCH_NUMS; ++i)
+    {
+        common_buf_double(&arg->out, arg->floats[i]);
+    }
+}
+
+static void benchPrintfDouble(bench_arg_t *arg)
+{
+    for(size_t i = 0; i < BENCH_NUMS; ++i)
+    {
+        common_buf_printf(&arg->out, "%lf", arg->floats[i]);
+    }
+}
+
+static void benchCfj(bench_arg_t *arg)
+{
+    cfj_print(arg->null, arg->obj, true, false);
+}
+
+// Same output as benchOss, going through CF objects.
+static void benchUnser(bench_arg_t *arg)
+{
+    CFTypeRef obj = IOCFUnserializeWithSize((const char*)arg->data, arg->size, NULL, 0, NULL);
+    if(obj)
+    {
+        cfj_print_buf(&arg->out, obj, true, false);
+        CFRelease(obj);
+    }
+}
+
+static void benchOss(bench_arg_t *arg)
+{
+    oss_format(&arg->oss, arg->data, arg->size, true, false);
+}
+
+// These three go over every entry of the fake registry.
+static void benchOssRegistry(bench_arg_t *arg)
+{
+    for(size_t i = 0; i < arg->numEntries; ++i)
+    {
+        CFDataRef data = arg->entries[i].data;
+        oss_format(&arg->oss, CFDataGetBytePtr(data), CFDataGetLength(data), true, false);
+    }
+}
+
+static void benchCompactWrite(bench_arg_t *arg)
+{
+    compact_writer_t w;
+    compact_writer_init(&w);
+    for(size_t i = 0; i < arg->numEntries; ++i)
+    {
+        const bench_entry_t *e = &arg->entries[i];
+        compact_writer_entry(&w, e->class, e->name, 0, CFDataGetBytePtr(e->data), CFDataGetLength(e->data));
+    }
+    compact_writer_write(&w, arg->null);
+    compact_writer_free(&w);
+}
+
+static void benchCompactExpand(bench_arg_t *arg)
+{
+    compact_entry_t e;
+    compact_reader_open(&arg->reader, arg->data, arg->size);
+    while(compact_reader_next(&arg->reader, &e))
+    {
+        compact_reader_props(&arg->reader, &e, true, false);
+    }
+}
+
+// Output size of one cfj_print, so throughput can be reported.
+static size_t benchCfjSize(CFTypeRef obj)
+{
+    FILE *tmp = tmpfile();
+    if(!tmp)
+    {
+        return 0;
+    }
+    cfj_print(tmp, obj, true, false);
+    long size = ftell(tmp);
+    fclose(tmp);
+    return size > 0 ? (size_t)size : 0;
+}
+
+static CFNumberRef benchNumber(long long val)
+{
+    return CFNumberCreate(NULL, kCFNumberLongLongType, &val);
+}
+
+static CFArrayRef benchNumbers(void)
+{
+    CFTypeRef nums[0x400];
+    uint64_t val = 1;
+    for(size_t i = 0; i < 0x400; ++i)
+    {
+        if(i % 4 == 3)
+        {
+            double d = (double)i / 7.0;
+            nums[i] = CFNumberCreate(NULL, kCFNumberDoubleType, &d);
+        }
+        else
+        {
+            nums[i] = benchNumber((long long)(val >> (i % 64)));
+        }
+        val = val * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    CFArrayRef arr = CFArrayCreate(NULL, nums, 0x400, &kCFTypeArrayCallBacks);
+    for(size_t i = 0; i < 0x400; ++i)
+    {
+        CFRelease(nums[i]);
+    }
+    return arr;
+}
+
+// Two sub-dicts per level, plus a handful of scalars and a small array.
+static CFDictionaryRef benchNested(int depth)
+{
+    CFStringRef keys[7] =
+    {
+        CFSTR("IOClass"), CFSTR("IOProbeScore"), CFSTR("IOFakeEnabled"), CFSTR("IOFakeData"), CFSTR("IOFakeArray"), CFSTR("left"), CFSTR("right"),
+    };
+    CFTypeRef vals[7];
+    CFTypeRef arr[3];
+    uint8_t data[0x20];
+    memset(data, 0x41 + depth, sizeof(data));
+    vals[0] = CFStringCreateWithCString(NULL, "IOFakeNestedDevice", kCFStringEncodingUTF8);
+    vals[1] = benchNumber(depth * 1000);
+    vals[2] = CFRetain(kCFBooleanTrue);
+    vals[3] = CFDataCreate(NULL, data, sizeof(data));
+    for(int i = 0; i < 3; ++i)
+    {
+        arr[i] = benchNumber(i);
+    }
+    vals[4] = CFArrayCreate(NULL, arr, 3, &kCFTypeArrayCallBacks);
+    for(int i = 0; i < 3; ++i)
+    {
+        CFRelease(arr[i]);
+    }
+    CFIndex num = 5;
+    if(depth > 0)
+    {
+        vals[5] = benchNested(depth - 1);
+        vals[6] = benchNested(depth - 1);
+        num = 7;
+    }
+    CFDictionaryRef dict = CFDictionaryCreate(NULL, (const void**)keys, vals, num, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    for(CFIndex i = 0; i < num; ++i)
+    {
+        CFRelease(vals[i]);
+    }
+    return dict;
+}
+
+// Same entries as "ioprint -j" would go over, serialized the same way "ioprint -c" does.
+static bench_entry_t* benchRegistry(size_t *num)
+{
+    size_t cap = 0x400;
+    bench_entry_t *entries = malloc(cap * sizeof(*entries));
+    io_iterator_t it = MACH_PORT_NULL;
+    if(!entries || IORegistryCreateIterator(kIOMasterPortDefault, "IOService", kIORegistryIterateRecursively, &it) != KERN_SUCCESS)
+    {
+        free(entries);
+        return NULL;
+    }
+    *num = 0;
+    for(io_object_t o = IORegistryGetRootEntry(kIOMasterPortDefault); o; o = IOIteratorNext(it))
+    {
+        CFMutableDictionaryRef p = NULL;
+        bench_entry_t *e = &entries[*num];
+        if(IORegistryEntryGetName(o, e->name) == KERN_SUCCESS &&
+           _IOObjectGetClass(o, kIOClassNameOverrideNone, e->class) == KERN_SUCCESS &&
+           IORegistryEntryCreateCFProperties(o, &p, NULL, 0) == KERN_SUCCESS)
+        {
+            e->data = IOCFSerialize(p, kIOCFSerializeToBinary);
+            CFRelease(p);
+            if(e->data && ++*num >= cap)
+            {
+                cap *= 2;
+                bench_entry_t *tmp = realloc(entries, cap * sizeof(*entries));
+                if(!tmp)
+                {
+                    IOObjectRelease(o);
+                    break;
+                }
+                entries = tmp;
+            }
+        }
+        IOObjectRelease(o);
+    }
+    IOObjectRelease(it);
+    return entries;
+}
+
+// Compact dumps against plain serialized properties and JSON, in size and decode time.
+static void runCompact(bench_arg_t *arg)
+{
+    arg->entries = benchRegistry(&arg->numEntries);
+    FILE *tmp = tmpfile();
+    if(!arg->entries || !tmp)
+    {
+        ERR(COLOR_RED "Failed to set up compact benchmark." COLOR_RESET);
+        exit(-1);
+    }
+    size_t raw = 0,
+           json = 0;
+    compact_writer_t w;
+    compact_writer_init(&w);
+    for(size_t i = 0; i < arg->numEntries; ++i)
+    {
+        const bench_entry_t *e = &arg->entries[i];
+        raw += CFDataGetLength(e->data);
+        if(oss_format(&arg->oss, CFDataGetBytePtr(e->data), CFDataGetLength(e->data), true, false))
+        {
+            json += arg->oss.out.len;
+        }
+        compact_writer_entry(&w, e->class, e->name, 0, CFDataGetBytePtr(e->data), CFDataGetLength(e->data));
+    }
+    bool succ = compact_writer_write(&w, tmp);
+    compact_writer_free(&w);
+    long size = ftell(tmp);
+    uint8_t *compact = size > 0 ? malloc(size) : NULL;
+    if(!succ || !compact || fseek(tmp, 0, SEEK_SET) != 0 || fread(compact, 1, size, tmp) != (size_t)size)
+    {
+        ERR(COLOR_RED "Failed to write compact dump." COLOR_RESET);
+        exit(-1);
+    }
+    fclose(tmp);
+    printf("{\"bench\":\"compact/size\",\"entries\":%zu,\"oss_bytes\":%zu,\"compact_bytes\":%ld,\"json_bytes\":%zu}\n", arg->numEntries, raw, size, json);
+
+    benchMicro("oss/registry", benchOssRegistry, arg, raw);
+    benchMicro("compact/write", benchCompactWrite, arg, raw);
+    compact_reader_init(&arg->reader);
+    arg->data = compact;
+    arg->size = size;
+    benchMicro("compact/expand", benchCompactExpand, arg, size);
+    compact_reader_free(&arg->reader);
+
+    for(size_t i = 0; i < arg->numEntries; ++i)
+    {
+        CFRelease(arg->entries[i].data);
+    }
+    free(arg->entries);
+    free(compact);
+}
+
+// One-element dicts and arrays nested depth levels deep, for indentation and nesting overhead.
+static CFTypeRef benchDeep(int depth)
+{
+    CFStringRef key = CFSTR("IOFakeNested");
+    CFTypeRef obj = benchNumber(depth);
+    for(int i = 0; i < depth && obj; ++i)
+    {
+        CFTypeRef next = i % 2 == 0 ? (CFTypeRef)CFArrayCreate(NULL, &obj, 1, &kCFTypeArrayCallBacks)
+                                    : (CFTypeRef)CFDictionaryCreate(NULL, (const void**)&key, &obj, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        CFRelease(obj);
+        obj = next;
+    }
+    return obj;
+}
+
+static void runMicro(FILE *null)
+{
+    uint8_t *plain = malloc(BENCH_STR_SIZE),
+            *mixed = malloc(BENCH_STR_SIZE),
+            *binary = malloc(BENCH_STR_SIZE);
+    if(!plain || !mixed || !binary)
+    {
+        ERR(COLOR_RED "Failed to allocate benchmark data." COLOR_RESET);
+        exit(-1);
+    }
+    uint32_t seed = 0x12345678;
+    for(size_t i = 0; i < BENCH_STR_SIZE; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        plain[i] = 'a' + (i % 26);
+        mixed[i] = i % 16 == 15 ? "\"\\\n\t"[(seed >> 16) & 3] : plain[i];
+        binary[i] = (uint8_t)(seed >> 16);
+    }
+
+    bench_arg_t arg =
+    {
+        .ctx =
+        {
+            .true_json = true,
+            .bytes_raw = false,
+            .first = true,
+            .lvl = 0,
+            .out = &arg.out,
+        },
+        .null = null,
+    };
+    common_buf_init(&arg.out, NULL);
+
+    arg.data = plain;
+    arg.size = BENCH_STR_SIZE;
+    benchMicro("scan/plain", benchScan, &arg, arg.size);
+    benchMicro("scan/bytes", benchScanBytes, &arg, arg.size);
+    benchMicro("str/plain", benchStr, &arg, arg.size);
+    arg.data = mixed;
+    benchMicro("str/escapes", benchStr, &arg, arg.size);
+    arg.data = binary;
+    benchMicro("str/binary", benchStr, &arg, arg.size);
+    arg.data = plain;
+    benchMicro("stdio/str/plain", benchStdioStr, &arg, arg.size);
+    arg.data = mixed;
+    benchMicro("stdio/str/escapes", benchStdioStr, &arg, arg.size);
+    arg.data = binary;
+    benchMicro("stdio/str/binary", benchStdioStr, &arg, arg.size);
+    arg.size = 0x1000;
+    benchMicro("hexdump/4k", benchHexdump, &arg, arg.size);
+    benchMicro("stdio/hexdump/4k", benchStdioHexdump, &arg, arg.size);
+    arg.size = BENCH_STR_SIZE;
+    benchMicro("base64/64k", benchBase64, &arg, arg.size);
+    arg.size = 0x20;
+    benchMicro("base64/32", benchBase64, &arg, arg.size);
+
+    uint64_t val = 1;
+    for(size_t i = 0; i < BENCH_NUMS; ++i)
+    {
+        arg.ints[i] = val >> (i % 64);
+        arg.floats[i] = (double)(int64_t)(val >> (i % 64)) / (double)(i + 7);
+        val = val * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    benchMicro("fmt/dec", benchDec, &arg, BENCH_NUMS * sizeof(uint64_t));
+    benchMicro("printf/dec", benchPrintfDec, &arg, BENCH_NUMS * sizeof(uint64_t));
+    benchMicro("fmt/hex", benchHex, &arg, BENCH_NUMS * sizeof(uint64_t));
+    benchMicro("printf/hex", benchPrintfHex, &arg, BENCH_NUMS * sizeof(uint64_t));
+    benchMicro("fmt/double", benchDouble, &arg, BENCH_NUMS * sizeof(double));
+    benchMicro("printf/double", benchPrintfDouble, &arg, BENCH_NUMS * sizeof(double));
+
+    arg.obj = benchNumbers();
+    benchMicro("cfj/numbers", benchCfj, &arg, benchCfjSize(arg.obj));
+    CFRelease(arg.obj);
+    arg.obj = benchDeep(0x100);
+    benchMicro("cfj/deep", benchCfj, &arg, benchCfjSize(arg.obj));
+    CFRelease(arg.obj);
+    arg.obj = benchNested(8);
+    benchMicro("cfj/nested", benchCfj, &arg, benchCfjSize(arg.obj));
+
+    // Throughput of these is measured on the serialized input
+    oss_init(&arg.oss);
+    CFDataRef ser = IOCFSerialize(arg.obj, kIOCFSerializeToBinary);
+    CFRelease(arg.obj);
+    if(!ser)
+    {
+        ERR(COLOR_RED "Failed to serialize benchmark data." COLOR_RESET);
+        exit(-1);
+    }
+    arg.data = CFDataGetBytePtr(ser);
+    arg.size = CFDataGetLength(ser);
+    benchMicro("unser+cfj/nested", benchUnser, &arg, arg.size);
+    benchMicro("oss/nested", benchOss, &arg, arg.size);
+    CFRelease(ser);
+    runCompact(&arg);
+    oss_free(&arg.oss);
+
+    common_buf_free(&arg.out);
+    free(plain);
+    free(mixed);
+    free(binary);
+}
+
+// Runs a tool once with its output piped back here, so output size can be reported.
+// If save is given, the output is also written there.
+static bool runTool(const char *dir, const char *name, char *const argv[], uint32_t entries, FILE *save)
+{
+    char path[0x400],
+         num[0x20];
+    snprintf(path, sizeof(path), "%s/%s", dir, argv[0]);
+    snprintf(num, sizeof(num), "%u", entries);
+
+    int fds[2];
+    if(pipe(fds) != 0)
+    {
+        ERR(COLOR_RED "pipe: %s" COLOR_RESET, strerror(errno));
+        return false;
+    }
+    uint64_t start = benchNow();
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        ERR(COLOR_RED "fork: %s" COLOR_RESET, strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if(pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(fds[1], STDOUT_FILENO);
+        if(null >= 0)
+        {
+            dup2(null, STDERR_FILENO);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        setenv("IOFAKE_ENTRIES", num, 1);
+        execv(path, argv);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    char buf[0x10000];
+    uint64_t bytes = 0;
+    while(true)
+    {
+        ssize_t r = read(fds[0], buf, sizeof(buf));
+        if(r > 0)
+        {
+            bytes += r;
+            if(save)
+            {
+                fwrite(buf, 1, r, save);
+            }
+        }
+        else if(r == 0 || errno != EINTR)
+        {
+            break;
+        }
+    }
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage ru;
+    if(wait4(pid, &status, 0, &ru) != pid)
+    {
+        ERR(COLOR_RED "wait4: %s" COLOR_RESET, strerror(errno));
+        return false;
+    }
+    uint64_t ns = benchNow() - start;
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        ERR(COLOR_RED "%s failed with status 0x%x" COLOR_RESET, path, status);
+        return false;
+    }
+    char label[0x100];
+    snprintf(label, sizeof(label), "%s/%u", name, entries);
+    benchReport(label, entries, ns, bytes, ru.ru_maxrss);
+    return true;
+}
+
+static void runEndToEnd(const char *dir)
+{
+    static char *const ioprint[]  = { "ioprint", NULL };
+    static char *const ioprintj[] = { "ioprint", "-j", NULL };
+    static char *const ioprintc[] = { "ioprint", "-c", NULL };
+    static char *const ioprintn[] = { "ioprint", "--format", "ndjson", NULL };
+    static char *const ioscan[]   = { "ioscan", NULL };
+    static char *const ioscant[]  = { "ioscan", "-t", "0", NULL };
+    static const uint32_t sizes[] = { 1000, 10000, 100000 };
+    char tmp[] = "/tmp/iokit-utils-bench.XXXXXX";
+    int fd = mkstemp(tmp);
+    FILE *dump = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if(!dump)
+    {
+        ERR(COLOR_RED "mkstemp: %s" COLOR_RESET, strerror(errno));
+        exit(-1);
+    }
+    char *const ioexpand[] = { "ioexpand", tmp, NULL };
+    bool succ = true;
+    for(size_t i = 0; succ && i < sizeof(sizes)/sizeof(sizes[0]); ++i)
+    {
+        succ = runTool(dir, "ioprint", ioprint, sizes[i], NULL) &&
+               runTool(dir, "ioprint -j", ioprintj, sizes[i], NULL) &&
+               runTool(dir, "ioprint --format ndjson", ioprintn, sizes[i], NULL) &&
+               fseek(dump, 0, SEEK_SET) == 0 && ftruncate(fd, 0) == 0 &&
+               runTool(dir, "ioprint -c", ioprintc, sizes[i], dump) &&
+               fflush(dump) == 0 &&
+               runTool(dir, "ioexpand", ioexpand, sizes[i], NULL) &&
+               runTool(dir, "ioscan", ioscan, sizes[i], NULL) &&
+               runTool(dir, "ioscan -t 0", ioscant, sizes[i], NULL);
+    }
+    fclose(dump);
+    unlink(tmp);
+    if(!succ)
+    {
+        exit(-1);
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    if(argc > 2 || (argc == 2 && argv[1][0] == '-'))
+    {
+        fprintf(stderr, "Usage: %s [dir]\n"
+                        "    Runs the microbenchmarks, and end-to-end runs of the tools in dir if given.\n"
+                        , argv[0]);
+        return argc == 2 && strcmp(argv[1], "-h") == 0 ? 0 : -1;
+    }
+    FILE *null = fopen("/dev/null", "w");
+    if(!null)
+    {
+        ERR(COLOR_RED "/dev/null: %s" COLOR_RESET, strerror(errno));
+        return -1;
+    }
+    runMicro(null);
+    fclose(null);
+    if(argc == 2)
+    {
+        runEndToEnd(argv[1]);
+    }
+    return 0;
+}
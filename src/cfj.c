@@ -8,84 +8,199 @@
  * defined by the Mozilla Public License, v. 2.0.
 **/
 
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <CoreFoundation/CoreFoundation.h>
 
 #include "common.h"
 #include "cfj.h"
 
-static void cfj_dict_cb(const void *key, const void *val, void *context);
-static void cfj_arr_cb(const void *val, void *context);
-static void cfj_print_str(common_ctx_t *ctx, const CFStringRef str);
-static void cfj_print_internal(common_ctx_t *ctx, CFTypeRef obj);
+// Newline and indentation for up to CFJ_INDENT_MAX levels, written in one go.
+#define CFJ_SPACES      "                                "
+#define CFJ_INDENT_MAX  32
+static const char cfj_indent[] = ",\n" CFJ_SPACES CFJ_SPACES CFJ_SPACES CFJ_SPACES;
 
-static void cfj_dict_cb(const void *key, const void *val, void *context)
+// An open dict or array. Its values, preceded by its keys for dicts, are at items[base].
+typedef struct
 {
-    common_ctx_t *ctx = context;
-    if(ctx->first)
+    size_t base;
+    CFIndex num;
+    CFIndex idx;
+    bool dict;
+} cfj_frame_t;
+
+// Nesting is tracked here instead of on the call stack, so it can be arbitrarily deep.
+// Shallow objects don't need to allocate anything.
+typedef struct
+{
+    cfj_frame_t *frames;
+    size_t numFrames;
+    size_t capFrames;
+    const void **items;
+    size_t numItems;
+    size_t capItems;
+    cfj_frame_t localFrames[0x10];
+    const void *localItems[0x100];
+} cfj_stack_t;
+
+static void cfj_newline(common_ctx_t *ctx, bool comma)
+{
+    if(ctx->compact)
+    {
+        if(comma)
+        {
+            common_buf_putc(ctx->out, ',');
+        }
+        return;
+    }
+    const char *str = comma ? cfj_indent : cfj_indent + 1;
+    size_t len = comma ? 2 : 1;
+    if(ctx->lvl <= CFJ_INDENT_MAX)
     {
-        fprintf(ctx->stream, "\n");
-        ctx->first = false;
+        common_buf_write(ctx->out, str, len + ctx->lvl * 4);
     }
     else
     {
-        fprintf(ctx->stream, ",\n");
+        common_buf_write(ctx->out, str, len);
+        common_buf_pad(ctx->out, ctx->lvl * 4);
     }
-    fprintf(ctx->stream, "%*s", ctx->lvl * 4, "");
-    cfj_print_str(ctx, key);
-    fprintf(ctx->stream, ": ");
-    cfj_print_internal(ctx, val);
 }
 
-static void cfj_arr_cb(const void *val, void *context)
+static bool cfj_grow(void **buf, size_t *cap, size_t need, size_t size, const void *local)
 {
-    common_ctx_t *ctx = context;
-    if(ctx->first)
+    if(need <= *cap)
     {
-        fprintf(ctx->stream, "\n");
-        ctx->first = false;
+        return true;
     }
-    else
+    size_t num = *cap * 2;
+    while(num < need)
+    {
+        num *= 2;
+    }
+    void *ptr = *buf == local ? malloc(num * size) : realloc(*buf, num * size);
+    if(!ptr)
     {
-        fprintf(ctx->stream, ",\n");
+        return false;
     }
-    fprintf(ctx->stream, "%*s", ctx->lvl * 4, "");
-    cfj_print_internal(ctx, val);
+    if(*buf == local)
+    {
+        memcpy(ptr, local, *cap * size);
+    }
+    *buf = ptr;
+    *cap = num;
+    return true;
 }
 
-static void cfj_print_str(common_ctx_t *ctx, const CFStringRef str)
+// Strings that CF doesn't store as plain ASCII are transcoded into a
+// buffer that belongs to the calling thread and only ever grows.
+typedef struct
 {
-    fprintf(ctx->stream, "\"");
-    char buf[0x100];
-    for(CFIndex i = 0, len = CFStringGetLength(str); i < len; )
+    char *data;
+    size_t cap;
+} cfj_scratch_t;
+
+static pthread_key_t cfj_scratch_key;
+static pthread_once_t cfj_scratch_once = PTHREAD_ONCE_INIT;
+
+static void cfj_scratch_free(void *arg)
+{
+    cfj_scratch_t *scratch = arg;
+    free(scratch->data);
+    free(scratch);
+}
+
+static void cfj_scratch_init(void)
+{
+    pthread_key_create(&cfj_scratch_key, &cfj_scratch_free);
+}
+
+// The key is only there so the buffer is freed when the thread exits.
+static __thread cfj_scratch_t *cfj_scratch_tls = NULL;
+
+static char* cfj_scratch(size_t size)
+{
+    cfj_scratch_t *scratch = cfj_scratch_tls;
+    if(!scratch)
     {
-        CFIndex max = len - i,
-                out = 0;
-        CFRange range = CFRangeMake(i, max);
-        max = CFStringGetBytes(str, range, kCFStringEncodingUTF8, 0, false, (UInt8*)buf, sizeof(buf), &out);
-        if(ctx->true_json)
+        pthread_once(&cfj_scratch_once, &cfj_scratch_init);
+        scratch = calloc(1, sizeof(*scratch));
+        if(!scratch || pthread_setspecific(cfj_scratch_key, scratch) != 0)
         {
-            for(size_t j = 0; j < out; ++j)
-            {
-                common_print_char(ctx, buf[j]);
-            }
+            free(scratch);
+            return NULL;
         }
-        else
+        cfj_scratch_tls = scratch;
+    }
+    if(scratch->cap < size)
+    {
+        size_t cap = scratch->cap ? scratch->cap : 0x100;
+        while(cap < size)
         {
-            fwrite(buf, 1, out, ctx->stream);
+            cap *= 2;
         }
-        i += max;
+        char *data = realloc(scratch->data, cap);
+        if(!data)
+        {
+            return NULL;
+        }
+        scratch->data = data;
+        scratch->cap = cap;
     }
-    fprintf(ctx->stream, "\"");
+    return scratch->data;
 }
 
-static void cfj_print_internal(common_ctx_t *ctx, CFTypeRef obj)
+const char* cfj_cstr(CFStringRef str, size_t *len)
+{
+    CFIndex num = CFStringGetLength(str);
+    const char *ptr = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+    if(ptr)
+    {
+        *len = num;
+        return ptr;
+    }
+    CFIndex max = CFStringGetMaximumSizeForEncoding(num, kCFStringEncodingUTF8),
+            out = 0;
+    char *buf = max != kCFNotFound ? cfj_scratch(max + 1) : NULL;
+    if(!buf)
+    {
+        return NULL;
+    }
+    CFStringGetBytes(str, CFRangeMake(0, num), kCFStringEncodingUTF8, 0, false, (UInt8*)buf, max, &out);
+    buf[out] = '\0';
+    *len = out;
+    return buf;
+}
+
+static void cfj_print_str(common_ctx_t *ctx, const CFStringRef str)
+{
+    size_t len = 0;
+    const char *ptr = cfj_cstr(str, &len);
+    if(!ptr)
+    {
+        ctx->out->err = true;
+        return;
+    }
+    common_buf_putc(ctx->out, '"');
+    if(ctx->true_json)
+    {
+        common_print_str(ctx, ptr, len);
+    }
+    else
+    {
+        common_buf_write(ctx->out, ptr, len);
+    }
+    common_buf_putc(ctx->out, '"');
+}
+
+static void cfj_print_scalar(common_ctx_t *ctx, CFTypeRef obj, CFTypeID type)
 {
-    CFTypeID type = CFGetTypeID(obj);
     if(type == CFBooleanGetTypeID())
     {
-        fprintf(ctx->stream, "%s", CFBooleanGetValue(obj) ? "true" : "false");
+        common_buf_puts(ctx->out, CFBooleanGetValue(obj) ? "true" : "false");
         return;
     }
     else if(type == CFNumberGetTypeID())
@@ -95,7 +210,15 @@ static void cfj_print_internal(common_ctx_t *ctx, CFTypeRef obj)
             double val = 0;
             if(CFNumberGetValue(obj, kCFNumberDoubleType, &val))
             {
-                fprintf(ctx->stream, "%lf", val);
+                // JSON has no inf or nan
+                if(ctx->true_json && !isfinite(val))
+                {
+                    common_buf_puts(ctx->out, "null");
+                }
+                else
+                {
+                    common_buf_double(ctx->out, val);
+                }
                 return;
             }
         }
@@ -104,7 +227,14 @@ static void cfj_print_internal(common_ctx_t *ctx, CFTypeRef obj)
             unsigned long long val = 0;
             if(CFNumberGetValue(obj, kCFNumberLongLongType, &val))
             {
-                fprintf(ctx->stream, ctx->true_json ? "%llu" : "0x%llx", val);
+                if(ctx->true_json)
+                {
+                    common_buf_dec(ctx->out, val);
+                }
+                else
+                {
+                    common_buf_hex(ctx->out, val);
+                }
                 return;
             }
         }
@@ -123,88 +253,117 @@ static void cfj_print_internal(common_ctx_t *ctx, CFTypeRef obj)
         }
         else if(size > 0)
         {
-            int pad = (ctx->lvl + 1) * 4;
-            fprintf(ctx->stream, "<\n%*s", pad, "");
-            const UInt8 *data = CFDataGetBytePtr(obj);
-            char cs[17] = {};
-            int i;
-            for(i = 0; i < size; i++)
-            {
-                if(i != 0 && i % 0x10 == 0)
-                {
-                    fprintf(ctx->stream, " |%s|\n%*s", cs, pad, "");
-                    memset(cs, 0, 17);
-                }
-                else if(i != 0 && i % 0x8 == 0)
-                {
-                    fprintf(ctx->stream, " ");
-                }
-                fprintf(ctx->stream, "%02x ", data[i]);
-                cs[(i % 0x10)] = (data[i] >= 0x20 && data[i] <= 0x7e) ? data[i] : '.';
-            }
-            i = i % 0x10;
-            if(i != 0)
-            {
-                if(i <= 0x8)
-                {
-                    fprintf(ctx->stream, " ");
-                }
-                while(i++ < 0x10)
-                {
-                    fprintf(ctx->stream, "   ");
-                }
-            }
-            fprintf(ctx->stream, " |%s|\n%*s>", cs, pad - 4, "");
+            common_print_hexdump(ctx, CFDataGetBytePtr(obj), size);
         }
         return;
     }
-    else if(type == CFDictionaryGetTypeID())
+    else
     {
-        common_ctx_t newctx =
-        {
-            .true_json = ctx->true_json,
-            .bytes_raw = ctx->bytes_raw,
-            .first = true,
-            .lvl = ctx->lvl + 1,
-            .stream = ctx->stream,
-        };
-        fprintf(ctx->stream, "{");
-        CFDictionaryApplyFunction(obj, &cfj_dict_cb, &newctx);
-        if(!newctx.first)
-        {
-            fprintf(ctx->stream, "\n%*s", ctx->lvl * 4, "");
-        }
-        fprintf(ctx->stream, "}");
+        common_buf_puts(ctx->out, "<!-- ??? -->");
         return;
     }
-    else if(type == CFArrayGetTypeID())
+    common_buf_puts(ctx->out, "<!-- error -->");
+}
+
+// Prints obj if it's a scalar or an empty container, otherwise opens it.
+// Sets are printed as arrays, in whatever order CFSet hands out their values.
+// Returns false if there is no memory to open it.
+static bool cfj_print_value(common_ctx_t *ctx, cfj_stack_t *st, CFTypeRef obj)
+{
+    CFTypeID type = CFGetTypeID(obj);
+    bool dict = type == CFDictionaryGetTypeID(),
+         set  = type == CFSetGetTypeID();
+    if(!dict && !set && type != CFArrayGetTypeID())
+    {
+        cfj_print_scalar(ctx, obj, type);
+        return true;
+    }
+    CFIndex num = dict ? CFDictionaryGetCount(obj) : set ? CFSetGetCount(obj) : CFArrayGetCount(obj);
+    if(num <= 0)
+    {
+        common_buf_puts(ctx->out, dict ? "{}" : "[]");
+        return true;
+    }
+    size_t base = st->numItems,
+           need = base + (dict ? 2 : 1) * (size_t)num;
+    if(!cfj_grow((void**)&st->frames, &st->capFrames, st->numFrames + 1, sizeof(*st->frames), st->localFrames) ||
+       !cfj_grow((void**)&st->items, &st->capItems, need, sizeof(*st->items), st->localItems))
+    {
+        ctx->out->err = true;
+        return false;
+    }
+    if(dict)
+    {
+        CFDictionaryGetKeysAndValues(obj, st->items + base, st->items + base + num);
+    }
+    else if(set)
+    {
+        CFSetGetValues(obj, st->items + base);
+    }
+    else
     {
-        common_ctx_t newctx =
+        CFArrayGetValues(obj, CFRangeMake(0, num), st->items + base);
+    }
+    st->frames[st->numFrames++] = (cfj_frame_t)
+    {
+        .base = base,
+        .num = num,
+        .idx = 0,
+        .dict = dict,
+    };
+    st->numItems = need;
+    common_buf_putc(ctx->out, dict ? '{' : '[');
+    ++ctx->lvl;
+    return true;
+}
+
+static void cfj_print_internal(common_ctx_t *ctx, CFTypeRef obj)
+{
+    cfj_stack_t st;
+    st.frames = st.localFrames;
+    st.numFrames = 0;
+    st.capFrames = sizeof(st.localFrames) / sizeof(st.localFrames[0]);
+    st.items = st.localItems;
+    st.numItems = 0;
+    st.capItems = sizeof(st.localItems) / sizeof(st.localItems[0]);
+
+    bool succ = cfj_print_value(ctx, &st, obj);
+    while(succ && st.numFrames > 0)
+    {
+        cfj_frame_t *f = &st.frames[st.numFrames - 1];
+        if(f->idx >= f->num)
         {
-            .true_json = ctx->true_json,
-            .bytes_raw = ctx->bytes_raw,
-            .first = true,
-            .lvl = ctx->lvl + 1,
-            .stream = ctx->stream,
-        };
-        fprintf(ctx->stream, "[");
-        CFArrayApplyFunction(obj, CFRangeMake(0, CFArrayGetCount(obj)), &cfj_arr_cb, &newctx);
-        if(!newctx.first)
+            --ctx->lvl;
+            cfj_newline(ctx, false);
+            common_buf_putc(ctx->out, f->dict ? '}' : ']');
+            st.numItems = f->base;
+            --st.numFrames;
+            continue;
+        }
+        cfj_newline(ctx, f->idx > 0);
+        const void **items = st.items + f->base;
+        if(f->dict)
         {
-            fprintf(ctx->stream, "\n%*s", ctx->lvl * 4, "");
+            cfj_print_str(ctx, items[f->idx]);
+            common_buf_write(ctx->out, ": ", ctx->compact ? 1 : 2);
+            items += f->num;
         }
-        fprintf(ctx->stream, "]");
-        return;
+        // This may push a frame, which invalidates f.
+        succ = cfj_print_value(ctx, &st, items[f->idx++]);
     }
-    else
+    ctx->lvl -= st.numFrames;
+
+    if(st.frames != st.localFrames)
     {
-        fprintf(ctx->stream, "<!-- ??? -->");
-        return;
+        free(st.frames);
+    }
+    if(st.items != st.localItems)
+    {
+        free(st.items);
     }
-    fprintf(ctx->stream, "<!-- error -->");
 }
 
-void cfj_print(FILE *stream, CFTypeRef obj, bool true_json, bool bytes_raw)
+void cfj_print_buf(common_buf_t *out, CFTypeRef obj, bool true_json, bool bytes_raw)
 {
     common_ctx_t ctx =
     {
@@ -212,8 +371,31 @@ void cfj_print(FILE *stream, CFTypeRef obj, bool true_json, bool bytes_raw)
         .bytes_raw = bytes_raw,
         .first = false,
         .lvl = 0,
-        .stream = stream,
+        .out = out,
     };
     cfj_print_internal(&ctx, obj);
-    fprintf(stream, "\n");
+    common_buf_putc(out, '\n');
+}
+
+// Plain JSON on a single line, without a trailing newline.
+void cfj_print_compact(common_buf_t *out, CFTypeRef obj)
+{
+    common_ctx_t ctx =
+    {
+        .true_json = true,
+        .bytes_raw = false,
+        .first = false,
+        .compact = true,
+        .lvl = 0,
+        .out = out,
+    };
+    cfj_print_internal(&ctx, obj);
+}
+
+void cfj_print(FILE *stream, CFTypeRef obj, bool true_json, bool bytes_raw)
+{
+    common_buf_t out;
+    common_buf_init(&out, stream);
+    cfj_print_buf(&out, obj, true_json, bytes_raw);
+    common_buf_free(&out);
 }
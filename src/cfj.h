@@ -15,6 +15,14 @@
 #include <stdio.h>
 #include <CoreFoundation/CoreFoundation.h>
 
+#include "common.h"
+
+void cfj_print_buf(common_buf_t *out, CFTypeRef obj, bool true_json, bool bytes_raw);
 void cfj_print(FILE *stream, CFTypeRef obj, bool true_json, bool bytes_raw);
+void cfj_print_compact(common_buf_t *out, CFTypeRef obj);
+
+// UTF-8 contents of str, NUL-terminated, or NULL if out of memory. Either points into
+// str itself, or into a per-thread buffer that is reused by the next call on that thread.
+const char* cfj_cstr(CFStringRef str, size_t *len);
 
 #endif
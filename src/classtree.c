@@ -0,0 +1,466 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "classtree.h"
+#include "common.h"
+
+// Binary cache layout, in host byte order: header, classes, order, hash table, strings.
+// Each table is 8-byte aligned. The key identifies the kernel the cache was built for.
+#define CLASSTREE_MAGIC   "IOCLSTR\0"
+#define CLASSTREE_VERSION 1
+#define CLASSTREE_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num;
+    uint64_t tabCap;
+    uint64_t classesOff;
+    uint64_t orderOff;
+    uint64_t tabOff;
+    uint64_t strsOff;
+    uint64_t strsLen;
+    char key[0x100];
+} classtree_hdr_t;
+
+static uint32_t classtree_hash(const char *str)
+{
+    uint32_t h = 0x811c9dc5;
+    for(; *str; ++str)
+    {
+        h = (h ^ (uint8_t)*str) * 0x01000193;
+    }
+    return h;
+}
+
+void classtree_init(classtree_t *t)
+{
+    common_buf_init(&t->strs, NULL);
+    t->classes = NULL;
+    t->num = 0;
+    t->cap = 0;
+    t->tab = NULL;
+    t->tabCap = 0;
+    t->order = NULL;
+    t->map = NULL;
+    t->mapSize = 0;
+    // Offset 0 is the empty string
+    common_buf_putc(&t->strs, '\0');
+}
+
+void classtree_free(classtree_t *t)
+{
+    if(t->map)
+    {
+        munmap(t->map, t->mapSize);
+    }
+    else
+    {
+        common_buf_free(&t->strs);
+        free(t->classes);
+        free(t->tab);
+        free(t->order);
+    }
+    common_buf_init(&t->strs, NULL);
+    t->classes = NULL;
+    t->num = 0;
+    t->cap = 0;
+    t->tab = NULL;
+    t->tabCap = 0;
+    t->order = NULL;
+    t->map = NULL;
+    t->mapSize = 0;
+}
+
+const char* classtree_name(const classtree_t *t, uint32_t class)
+{
+    return t->strs.data + t->classes[class].name;
+}
+
+const char* classtree_bundle(const classtree_t *t, uint32_t class)
+{
+    uint32_t off = t->classes[class].bundle;
+    return off != 0 ? t->strs.data + off : NULL;
+}
+
+static size_t classtree_slot(const classtree_t *t, const char *name)
+{
+    size_t i = classtree_hash(name) & (t->tabCap - 1);
+    while(t->tab[i] != 0 && strcmp(classtree_name(t, t->tab[i] - 1), name) != 0)
+    {
+        i = (i + 1) & (t->tabCap - 1);
+    }
+    return i;
+}
+
+uint32_t classtree_find(const classtree_t *t, const char *name)
+{
+    if(t->tabCap == 0)
+    {
+        return CLASSTREE_NONE;
+    }
+    size_t i = classtree_slot(t, name);
+    return t->tab[i] != 0 ? t->tab[i] - 1 : CLASSTREE_NONE;
+}
+
+// Returns the index of the class, adding it without a superclass if it is new.
+uint32_t classtree_add(classtree_t *t, const char *name, bool *added)
+{
+    *added = false;
+    uint32_t idx = classtree_find(t, name);
+    if(idx != CLASSTREE_NONE)
+    {
+        return idx;
+    }
+    if((size_t)t->num * 2 >= t->tabCap)
+    {
+        size_t cap = t->tabCap ? t->tabCap * 2 : 0x400;
+        uint32_t *tab = calloc(cap, sizeof(uint32_t));
+        if(!tab)
+        {
+            return CLASSTREE_NONE;
+        }
+        free(t->tab);
+        t->tab = tab;
+        t->tabCap = cap;
+        for(uint32_t i = 0; i < t->num; ++i)
+        {
+            t->tab[classtree_slot(t, classtree_name(t, i))] = i + 1;
+        }
+    }
+    if(t->num >= t->cap)
+    {
+        uint32_t cap = t->cap ? t->cap * 2 : 0x400;
+        classtree_class_t *classes = realloc(t->classes, cap * sizeof(classtree_class_t));
+        if(!classes)
+        {
+            return CLASSTREE_NONE;
+        }
+        t->classes = classes;
+        t->cap = cap;
+    }
+    size_t off = t->strs.len;
+    common_buf_write(&t->strs, name, strlen(name) + 1);
+    if(t->strs.err)
+    {
+        return CLASSTREE_NONE;
+    }
+    idx = t->num++;
+    t->classes[idx].name = (uint32_t)off;
+    t->classes[idx].super = CLASSTREE_NONE;
+    t->classes[idx].bundle = 0;
+    t->classes[idx].pre = CLASSTREE_NONE;
+    t->classes[idx].end = CLASSTREE_NONE;
+    t->tab[classtree_slot(t, name)] = idx + 1;
+    *added = true;
+    return idx;
+}
+
+void classtree_set_super(classtree_t *t, uint32_t class, uint32_t super)
+{
+    t->classes[class].super = super;
+}
+
+bool classtree_set_bundle(classtree_t *t, uint32_t class, const char *bundle)
+{
+    size_t off = t->strs.len;
+    common_buf_write(&t->strs, bundle, strlen(bundle) + 1);
+    if(t->strs.err)
+    {
+        return false;
+    }
+    t->classes[class].bundle = (uint32_t)off;
+    return true;
+}
+
+// Numbers all classes in preorder, starting from the ones without a superclass.
+// Anything stuck in a superclass loop is never reached and keeps pre == CLASSTREE_NONE.
+bool classtree_build(classtree_t *t)
+{
+    free(t->order);
+    t->order = NULL;
+    uint32_t *first = malloc((t->num + 2) * sizeof(uint32_t)),
+             *next  = malloc((t->num + 1) * sizeof(uint32_t)),
+             *kids  = malloc((t->num ? t->num : 1) * sizeof(uint32_t)),
+             *order = malloc((t->num ? t->num : 1) * sizeof(uint32_t)),
+             *stack = malloc((t->num ? t->num : 1) * sizeof(uint32_t));
+    if(!first || !next || !kids || !order || !stack)
+    {
+        free(first);
+        free(next);
+        free(kids);
+        free(order);
+        free(stack);
+        return false;
+    }
+
+    // Children of class i are kids[first[i]] through kids[first[i + 1] - 1], roots are group t->num
+    memset(first, 0, (t->num + 2) * sizeof(uint32_t));
+    memset(next, 0, (t->num + 1) * sizeof(uint32_t));
+    for(uint32_t i = 0; i < t->num; ++i)
+    {
+        uint32_t s = t->classes[i].super < t->num ? t->classes[i].super : t->num;
+        ++first[s + 1];
+        t->classes[i].pre = CLASSTREE_NONE;
+        t->classes[i].end = CLASSTREE_NONE;
+    }
+    for(uint32_t i = 1; i <= t->num + 1; ++i)
+    {
+        first[i] += first[i - 1];
+    }
+    for(uint32_t i = 0; i < t->num; ++i)
+    {
+        uint32_t s = t->classes[i].super < t->num ? t->classes[i].super : t->num;
+        kids[first[s] + next[s]++] = i;
+    }
+    memset(next, 0, (t->num + 1) * sizeof(uint32_t));
+
+    uint32_t cnt = 0;
+    for(uint32_t r = first[t->num]; r < first[t->num + 1]; ++r)
+    {
+        uint32_t sp = 0;
+        stack[sp++] = kids[r];
+        t->classes[kids[r]].pre = cnt;
+        order[cnt++] = kids[r];
+        while(sp > 0)
+        {
+            uint32_t c = stack[sp - 1];
+            uint32_t k = first[c] + next[c];
+            if(k < first[c + 1])
+            {
+                ++next[c];
+                uint32_t kid = kids[k];
+                t->classes[kid].pre = cnt;
+                order[cnt++] = kid;
+                stack[sp++] = kid;
+            }
+            else
+            {
+                t->classes[c].end = cnt;
+                --sp;
+            }
+        }
+    }
+    // Classes stuck in a loop go last, so that order is still fully initialized when written out
+    for(uint32_t i = 0; i < t->num; ++i)
+    {
+        if(t->classes[i].pre == CLASSTREE_NONE)
+        {
+            order[cnt++] = i;
+        }
+    }
+
+    free(first);
+    free(kids);
+    free(stack);
+    free(next);
+    t->order = order;
+    return true;
+}
+
+bool classtree_extends(const classtree_t *t, uint32_t class, uint32_t super)
+{
+    const classtree_class_t *c = &t->classes[class],
+                            *s = &t->classes[super];
+    return c->pre != CLASSTREE_NONE && s->pre != CLASSTREE_NONE && s->pre <= c->pre && c->pre < s->end;
+}
+
+// One class per line, followed by its superclass if it has one, separated by a space.
+bool classtree_load(classtree_t *t, FILE *f)
+{
+    char line[0x1000];
+    while(fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *super = strchr(line, ' ');
+        if(super)
+        {
+            *super++ = '\0';
+        }
+        if(!line[0])
+        {
+            continue;
+        }
+        bool added;
+        uint32_t c = classtree_add(t, line, &added);
+        if(c == CLASSTREE_NONE)
+        {
+            return false;
+        }
+        if(super && super[0])
+        {
+            uint32_t s = classtree_add(t, super, &added);
+            if(s == CLASSTREE_NONE)
+            {
+                return false;
+            }
+            classtree_set_super(t, c, s);
+        }
+    }
+    return !ferror(f);
+}
+
+void classtree_save(const classtree_t *t, common_buf_t *out)
+{
+    for(uint32_t i = 0; i < t->num; ++i)
+    {
+        uint32_t s = t->classes[i].super;
+        common_buf_puts(out, classtree_name(t, i));
+        if(s != CLASSTREE_NONE)
+        {
+            common_buf_putc(out, ' ');
+            common_buf_puts(out, classtree_name(t, s));
+        }
+        common_buf_putc(out, '\n');
+    }
+}
+
+static bool classtree_range(size_t size, uint64_t off, uint64_t len)
+{
+    return off <= size && len <= size - off && (off & 7) == 0;
+}
+
+// Everything is validated up front, so lookups afterwards can't go out of bounds.
+// Fails quietly if the file is missing or was built for another kernel.
+bool classtree_map(classtree_t *t, const char *path, const char *key)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(classtree_hdr_t))
+    {
+        close(fd);
+        return false;
+    }
+    uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+    {
+        return false;
+    }
+    size_t size = st.st_size;
+    const classtree_hdr_t *hdr = (const classtree_hdr_t*)base;
+    bool ok = memcmp(hdr->magic, CLASSTREE_MAGIC, sizeof(hdr->magic)) == 0 &&
+              hdr->version == CLASSTREE_VERSION &&
+              strncmp(hdr->key, key, sizeof(hdr->key)) == 0 &&
+              hdr->tabCap > 0 && (hdr->tabCap & (hdr->tabCap - 1)) == 0 && hdr->tabCap <= SIZE_MAX / sizeof(uint32_t) &&
+              classtree_range(size, hdr->classesOff, (uint64_t)hdr->num * sizeof(classtree_class_t)) &&
+              classtree_range(size, hdr->orderOff, (uint64_t)hdr->num * sizeof(uint32_t)) &&
+              classtree_range(size, hdr->tabOff, hdr->tabCap * sizeof(uint32_t)) &&
+              classtree_range(size, hdr->strsOff, hdr->strsLen) &&
+              hdr->strsLen > 0 && hdr->strsLen <= UINT32_MAX && base[hdr->strsOff + hdr->strsLen - 1] == '\0';
+    const classtree_class_t *classes = (const classtree_class_t*)(base + hdr->classesOff);
+    const uint32_t *order = (const uint32_t*)(base + hdr->orderOff),
+                   *tab   = (const uint32_t*)(base + hdr->tabOff);
+    for(uint32_t i = 0; ok && i < hdr->num; ++i)
+    {
+        const classtree_class_t *c = &classes[i];
+        ok = c->name < hdr->strsLen && c->bundle < hdr->strsLen && order[i] < hdr->num &&
+             (c->super == CLASSTREE_NONE || c->super < hdr->num) &&
+             (c->pre == CLASSTREE_NONE ? c->end == CLASSTREE_NONE : c->pre < hdr->num && c->pre < c->end && c->end <= hdr->num);
+    }
+    // Lookups probe until they hit a free slot, so there has to be one.
+    uint64_t used = 0;
+    for(uint64_t i = 0; ok && i < hdr->tabCap; ++i)
+    {
+        ok = tab[i] <= hdr->num;
+        used += tab[i] != 0;
+    }
+    ok = ok && used < hdr->tabCap;
+    if(!ok)
+    {
+        munmap(base, size);
+        return false;
+    }
+
+    classtree_free(t);
+    t->strs.data = (char*)(base + hdr->strsOff);
+    t->strs.len = hdr->strsLen;
+    t->classes = (classtree_class_t*)classes;
+    t->num = hdr->num;
+    t->cap = hdr->num;
+    t->tab = (uint32_t*)tab;
+    t->tabCap = hdr->tabCap;
+    t->order = (uint32_t*)order;
+    t->map = base;
+    t->mapSize = size;
+    return true;
+}
+
+static bool classtree_fwrite(FILE *f, const void *buf, size_t size)
+{
+    static const char zero[8] = { 0 };
+    return fwrite(buf, 1, size, f) == size && fwrite(zero, 1, CLASSTREE_ALIGN(size) - size, f) == CLASSTREE_ALIGN(size) - size;
+}
+
+// Needs classtree_build() first. Written to a temporary file and renamed, so concurrent readers never see half a cache.
+bool classtree_write(const classtree_t *t, const char *path, const char *key)
+{
+    if(!t->order || t->tabCap == 0)
+    {
+        return false;
+    }
+    classtree_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CLASSTREE_MAGIC, sizeof(hdr.magic));
+    hdr.version    = CLASSTREE_VERSION;
+    hdr.num        = t->num;
+    hdr.tabCap     = t->tabCap;
+    hdr.classesOff = CLASSTREE_ALIGN(sizeof(hdr));
+    hdr.orderOff   = CLASSTREE_ALIGN(hdr.classesOff + (uint64_t)t->num * sizeof(classtree_class_t));
+    hdr.tabOff     = CLASSTREE_ALIGN(hdr.orderOff + (uint64_t)t->num * sizeof(uint32_t));
+    hdr.strsOff    = CLASSTREE_ALIGN(hdr.tabOff + (uint64_t)t->tabCap * sizeof(uint32_t));
+    hdr.strsLen    = t->strs.len;
+    strncpy(hdr.key, key, sizeof(hdr.key) - 1);
+
+    char tmp[0x400];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if(!f)
+    {
+        return false;
+    }
+    bool succ = classtree_fwrite(f, &hdr, sizeof(hdr)) &&
+                classtree_fwrite(f, t->classes, t->num * sizeof(classtree_class_t)) &&
+                classtree_fwrite(f, t->order, t->num * sizeof(uint32_t)) &&
+                classtree_fwrite(f, t->tab, t->tabCap * sizeof(uint32_t)) &&
+                classtree_fwrite(f, t->strs.data, t->strs.len);
+    if(fclose(f) != 0)
+    {
+        succ = false;
+    }
+    if(succ && rename(tmp, path) != 0)
+    {
+        succ = false;
+    }
+    if(!succ)
+    {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+    }
+    return succ;
+}
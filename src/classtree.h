@@ -0,0 +1,63 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#ifndef CLASSTREE_H
+#define CLASSTREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+
+#define CLASSTREE_NONE UINT32_MAX
+
+// After classtree_build(), the subtree of a class is order[pre] through order[end - 1],
+// so "A extends B" is just an interval check. Bundle 0 is the empty string, i.e. unknown.
+typedef struct
+{
+    uint32_t name;
+    uint32_t super;
+    uint32_t bundle;
+    uint32_t pre;
+    uint32_t end;
+} classtree_class_t;
+
+// If map is set, all tables point into a file mapped with classtree_map() and must not be modified.
+typedef struct
+{
+    common_buf_t strs;
+    classtree_class_t *classes;
+    uint32_t num;
+    uint32_t cap;
+    uint32_t *tab;
+    size_t tabCap;
+    uint32_t *order;
+    void *map;
+    size_t mapSize;
+} classtree_t;
+
+void classtree_init(classtree_t *t);
+void classtree_free(classtree_t *t);
+uint32_t classtree_add(classtree_t *t, const char *name, bool *added);
+uint32_t classtree_find(const classtree_t *t, const char *name);
+void classtree_set_super(classtree_t *t, uint32_t class, uint32_t super);
+bool classtree_set_bundle(classtree_t *t, uint32_t class, const char *bundle);
+const char* classtree_name(const classtree_t *t, uint32_t class);
+const char* classtree_bundle(const classtree_t *t, uint32_t class);
+bool classtree_build(classtree_t *t);
+bool classtree_extends(const classtree_t *t, uint32_t class, uint32_t super);
+bool classtree_load(classtree_t *t, FILE *f);
+void classtree_save(const classtree_t *t, common_buf_t *out);
+bool classtree_map(classtree_t *t, const char *path, const char *key);
+bool classtree_write(const classtree_t *t, const char *path, const char *key);
+
+#endif
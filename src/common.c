@@ -8,73 +8,756 @@
  * defined by the Mozilla Public License, v. 2.0.
 **/
 
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#   include <arm_neon.h>
+#   define COMMON_NEON 1
+#endif
 
 #include "common.h"
+#include "stats.h"
 
-extern size_t SecBase64Encode(void const *src, size_t srcSize, char *dest, size_t destLen);
+void common_buf_init(common_buf_t *out, FILE *stream)
+{
+    out->stream = stream;
+    out->data = NULL;
+    out->len = 0;
+    out->cap = 0;
+    out->err = false;
+}
 
-void common_print_bytes(common_ctx_t *ctx, const uint8_t *buf, size_t size)
+void common_buf_flush(common_buf_t *out)
 {
-    if(ctx->bytes_raw)
+    if(out->stream && out->len > 0)
     {
-        fprintf(ctx->stream, "\"");
-        for(size_t i = 0; i < size; ++i)
+        if(stats_fwrite(out->data, out->len, out->stream) != out->len)
         {
-            common_print_char(ctx, (char)buf[i]);
+            out->err = true;
         }
-        fprintf(ctx->stream, "\"");
+        out->len = 0;
     }
-    else
+}
+
+void common_buf_free(common_buf_t *out)
+{
+    common_buf_flush(out);
+    free(out->data);
+    out->data = NULL;
+    out->len = 0;
+    out->cap = 0;
+}
+
+// Returns space for at least size more bytes, caller bumps out->len after writing.
+char* common_buf_reserve(common_buf_t *out, size_t size)
+{
+    if(out->stream && out->len + size > COMMON_BUF_FLUSH)
+    {
+        common_buf_flush(out);
+    }
+    if(out->cap - out->len < size)
     {
-        size_t encoded_size = ((size + 2) / 3) * 4 + 1;
-        char *str = malloc(encoded_size);
-        if(!str)
+        size_t cap = out->cap ? out->cap : COMMON_BUF_FLUSH;
+        while(cap - out->len < size)
         {
-            fprintf(ctx->stream, "<!-- malloc -->");
+            cap *= 2;
         }
-        else
+        char *data = realloc(out->data, cap);
+        if(!data)
         {
-            str[encoded_size - 1] = '\0';
-            SecBase64Encode(buf, size, str, encoded_size);
-            fprintf(ctx->stream, "\"%s\"", str);
-            free(str);
+            out->err = true;
+            return NULL;
         }
+        out->data = data;
+        out->cap = cap;
     }
+    return out->data + out->len;
 }
 
-void common_print_char(common_ctx_t *ctx, char c)
+void common_buf_write(common_buf_t *out, const void *buf, size_t size)
 {
-    // This catches both <0x20 and >=0x80
-    if(c < 0x20)
+    // Don't bother copying large blocks if we're gonna flush them right away
+    if(out->stream && size >= COMMON_BUF_FLUSH)
     {
-        fprintf(ctx->stream, "\\u%04hx", (unsigned char)c);
+        common_buf_flush(out);
+        if(stats_fwrite(buf, size, out->stream) != size)
+        {
+            out->err = true;
+        }
         return;
     }
-    switch(c)
+    char *ptr = common_buf_reserve(out, size);
+    if(ptr)
+    {
+        memcpy(ptr, buf, size);
+        out->len += size;
+    }
+}
+
+void common_buf_puts(common_buf_t *out, const char *str)
+{
+    common_buf_write(out, str, strlen(str));
+}
+
+void common_buf_putc(common_buf_t *out, char c)
+{
+    char *ptr = common_buf_reserve(out, 1);
+    if(ptr)
+    {
+        *ptr = c;
+        out->len += 1;
+    }
+}
+
+void common_buf_pad(common_buf_t *out, size_t num)
+{
+    char *ptr = common_buf_reserve(out, num);
+    if(ptr)
+    {
+        memset(ptr, ' ', num);
+        out->len += num;
+    }
+}
+
+void common_buf_printf(common_buf_t *out, const char *fmt, ...)
+{
+    size_t avail = 0x100;
+    while(true)
     {
-        case '\n':
-            fputs("\\n", ctx->stream);
+        char *ptr = common_buf_reserve(out, avail);
+        if(!ptr)
+        {
             return;
-        case '\r':
-            fputs("\\r", ctx->stream);
+        }
+        va_list ap;
+        va_start(ap, fmt);
+        int len = vsnprintf(ptr, avail, fmt, ap);
+        va_end(ap);
+        if(len < 0)
+        {
+            out->err = true;
             return;
-        case '\t':
-            fputs("\\t", ctx->stream);
+        }
+        if((size_t)len < avail)
+        {
+            out->len += len;
             return;
-        case '\f':
-            fputs("\\f", ctx->stream);
+        }
+        avail = (size_t)len + 1;
+    }
+}
+
+static const char common_digits[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Same as "%llu", two digits at a time.
+void common_buf_dec(common_buf_t *out, uint64_t val)
+{
+    char tmp[20];
+    char *end = tmp + sizeof(tmp),
+         *ptr = end;
+    while(val >= 100)
+    {
+        ptr -= 2;
+        memcpy(ptr, &common_digits[(val % 100) * 2], 2);
+        val /= 100;
+    }
+    if(val >= 10)
+    {
+        ptr -= 2;
+        memcpy(ptr, &common_digits[val * 2], 2);
+    }
+    else
+    {
+        *--ptr = '0' + val;
+    }
+    common_buf_write(out, ptr, end - ptr);
+}
+
+// Same as "0x%llx".
+void common_buf_hex(common_buf_t *out, uint64_t val)
+{
+    char tmp[18];
+    char *end = tmp + sizeof(tmp),
+         *ptr = end;
+    do
+    {
+        *--ptr = "0123456789abcdef"[val & 0xf];
+        val >>= 4;
+    } while(val);
+    *--ptr = 'x';
+    *--ptr = '0';
+    common_buf_write(out, ptr, end - ptr);
+}
+
+// Shortest round-trip doubles, with Grisu3 (Loitsch, "Printing Floating-Point
+// Numbers Quickly and Accurately with Integers"). It gives up on about 0.5% of
+// all doubles, which then go through printf with increasing precision instead.
+
+typedef struct
+{
+    uint64_t f;
+    int e;
+} common_fp_t;
+
+// 10^k for every 8th k, as 64-bit significand and binary exponent.
+static const struct
+{
+    uint64_t f;
+    int16_t e;
+    int16_t k;
+} common_pow10[] =
+{
+    { 0xfa8fd5a0081c0288ULL, -1220, -348 },
+    { 0xbaaee17fa23ebf76ULL, -1193, -340 },
+    { 0x8b16fb203055ac76ULL, -1166, -332 },
+    { 0xcf42894a5dce35eaULL, -1140, -324 },
+    { 0x9a6bb0aa55653b2dULL, -1113, -316 },
+    { 0xe61acf033d1a45dfULL, -1087, -308 },
+    { 0xab70fe17c79ac6caULL, -1060, -300 },
+    { 0xff77b1fcbebcdc4fULL, -1034, -292 },
+    { 0xbe5691ef416bd60cULL, -1007, -284 },
+    { 0x8dd01fad907ffc3cULL,  -980, -276 },
+    { 0xd3515c2831559a83ULL,  -954, -268 },
+    { 0x9d71ac8fada6c9b5ULL,  -927, -260 },
+    { 0xea9c227723ee8bcbULL,  -901, -252 },
+    { 0xaecc49914078536dULL,  -874, -244 },
+    { 0x823c12795db6ce57ULL,  -847, -236 },
+    { 0xc21094364dfb5637ULL,  -821, -228 },
+    { 0x9096ea6f3848984fULL,  -794, -220 },
+    { 0xd77485cb25823ac7ULL,  -768, -212 },
+    { 0xa086cfcd97bf97f4ULL,  -741, -204 },
+    { 0xef340a98172aace5ULL,  -715, -196 },
+    { 0xb23867fb2a35b28eULL,  -688, -188 },
+    { 0x84c8d4dfd2c63f3bULL,  -661, -180 },
+    { 0xc5dd44271ad3cdbaULL,  -635, -172 },
+    { 0x936b9fcebb25c996ULL,  -608, -164 },
+    { 0xdbac6c247d62a584ULL,  -582, -156 },
+    { 0xa3ab66580d5fdaf6ULL,  -555, -148 },
+    { 0xf3e2f893dec3f126ULL,  -529, -140 },
+    { 0xb5b5ada8aaff80b8ULL,  -502, -132 },
+    { 0x87625f056c7c4a8bULL,  -475, -124 },
+    { 0xc9bcff6034c13053ULL,  -449, -116 },
+    { 0x964e858c91ba2655ULL,  -422, -108 },
+    { 0xdff9772470297ebdULL,  -396, -100 },
+    { 0xa6dfbd9fb8e5b88fULL,  -369,  -92 },
+    { 0xf8a95fcf88747d94ULL,  -343,  -84 },
+    { 0xb94470938fa89bcfULL,  -316,  -76 },
+    { 0x8a08f0f8bf0f156bULL,  -289,  -68 },
+    { 0xcdb02555653131b6ULL,  -263,  -60 },
+    { 0x993fe2c6d07b7facULL,  -236,  -52 },
+    { 0xe45c10c42a2b3b06ULL,  -210,  -44 },
+    { 0xaa242499697392d3ULL,  -183,  -36 },
+    { 0xfd87b5f28300ca0eULL,  -157,  -28 },
+    { 0xbce5086492111aebULL,  -130,  -20 },
+    { 0x8cbccc096f5088ccULL,  -103,  -12 },
+    { 0xd1b71758e219652cULL,   -77,   -4 },
+    { 0x9c40000000000000ULL,   -50,    4 },
+    { 0xe8d4a51000000000ULL,   -24,   12 },
+    { 0xad78ebc5ac620000ULL,     3,   20 },
+    { 0x813f3978f8940984ULL,    30,   28 },
+    { 0xc097ce7bc90715b3ULL,    56,   36 },
+    { 0x8f7e32ce7bea5c70ULL,    83,   44 },
+    { 0xd5d238a4abe98068ULL,   109,   52 },
+    { 0x9f4f2726179a2245ULL,   136,   60 },
+    { 0xed63a231d4c4fb27ULL,   162,   68 },
+    { 0xb0de65388cc8ada8ULL,   189,   76 },
+    { 0x83c7088e1aab65dbULL,   216,   84 },
+    { 0xc45d1df942711d9aULL,   242,   92 },
+    { 0x924d692ca61be758ULL,   269,  100 },
+    { 0xda01ee641a708deaULL,   295,  108 },
+    { 0xa26da3999aef774aULL,   322,  116 },
+    { 0xf209787bb47d6b85ULL,   348,  124 },
+    { 0xb454e4a179dd1877ULL,   375,  132 },
+    { 0x865b86925b9bc5c2ULL,   402,  140 },
+    { 0xc83553c5c8965d3dULL,   428,  148 },
+    { 0x952ab45cfa97a0b3ULL,   455,  156 },
+    { 0xde469fbd99a05fe3ULL,   481,  164 },
+    { 0xa59bc234db398c25ULL,   508,  172 },
+    { 0xf6c69a72a3989f5cULL,   534,  180 },
+    { 0xb7dcbf5354e9beceULL,   561,  188 },
+    { 0x88fcf317f22241e2ULL,   588,  196 },
+    { 0xcc20ce9bd35c78a5ULL,   614,  204 },
+    { 0x98165af37b2153dfULL,   641,  212 },
+    { 0xe2a0b5dc971f303aULL,   667,  220 },
+    { 0xa8d9d1535ce3b396ULL,   694,  228 },
+    { 0xfb9b7cd9a4a7443cULL,   720,  236 },
+    { 0xbb764c4ca7a44410ULL,   747,  244 },
+    { 0x8bab8eefb6409c1aULL,   774,  252 },
+    { 0xd01fef10a657842cULL,   800,  260 },
+    { 0x9b10a4e5e9913129ULL,   827,  268 },
+    { 0xe7109bfba19c0c9dULL,   853,  276 },
+    { 0xac2820d9623bf429ULL,   880,  284 },
+    { 0x80444b5e7aa7cf85ULL,   907,  292 },
+    { 0xbf21e44003acdd2dULL,   933,  300 },
+    { 0x8e679c2f5e44ff8fULL,   960,  308 },
+    { 0xd433179d9c8cb841ULL,   986,  316 },
+    { 0x9e19db92b4e31ba9ULL,  1013,  324 },
+    { 0xeb96bf6ebadf77d9ULL,  1039,  332 },
+    { 0xaf87023b9bf0ee6bULL,  1066,  340 },
+};
+
+static common_fp_t common_fp_mul(common_fp_t a, common_fp_t b)
+{
+    uint64_t ah = a.f >> 32, al = a.f & 0xffffffff,
+             bh = b.f >> 32, bl = b.f & 0xffffffff,
+             hh = ah * bh, hl = ah * bl, lh = al * bh, ll = al * bl,
+             mid = (ll >> 32) + (hl & 0xffffffff) + (lh & 0xffffffff) + (1ULL << 31);
+    return (common_fp_t){ .f = hh + (hl >> 32) + (lh >> 32) + (mid >> 32), .e = a.e + b.e + 64 };
+}
+
+static common_fp_t common_fp_norm(common_fp_t x)
+{
+    while(!(x.f & (1ULL << 63)))
+    {
+        x.f <<= 1;
+        --x.e;
+    }
+    return x;
+}
+
+// Moves the last digit down as long as that gets closer to w, then checks
+// whether the result is guaranteed to be the shortest and closest one.
+static bool common_grisu_weed(char *buf, int len, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t unit)
+{
+    uint64_t small = dist - unit,
+             big   = dist + unit;
+    while(rest < small && delta - rest >= ten_kappa && (rest + ten_kappa < small || small - rest >= rest + ten_kappa - small))
+    {
+        --buf[len - 1];
+        rest += ten_kappa;
+    }
+    if(rest < big && delta - rest >= ten_kappa && (rest + ten_kappa < big || big - rest > rest + ten_kappa - big))
+    {
+        return false;
+    }
+    return 2 * unit <= rest && rest <= delta - 4 * unit;
+}
+
+// Digits go to buf, and their value is buf * 10^*exp.
+static bool common_grisu(double val, char *buf, int *len, int *exp)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    uint64_t frac = bits & ((1ULL << 52) - 1);
+    int bexp = (bits >> 52) & 0x7ff;
+    common_fp_t v = bexp ? (common_fp_t){ .f = frac | (1ULL << 52), .e = bexp - 1075 } : (common_fp_t){ .f = frac, .e = -1074 };
+
+    // Boundaries halfway to the neighbouring doubles
+    common_fp_t hi = common_fp_norm((common_fp_t){ .f = (v.f << 1) + 1, .e = v.e - 1 }),
+                lo = frac == 0 && bexp > 1 ? (common_fp_t){ .f = (v.f << 2) - 1, .e = v.e - 2 } : (common_fp_t){ .f = (v.f << 1) - 1, .e = v.e - 1 };
+    lo.f <<= lo.e - hi.e;
+    lo.e = hi.e;
+    common_fp_t w = common_fp_norm(v);
+
+    // Scale by a power of ten that puts the exponent into [-60, -32]
+    int k = (int)ceil((-60 - (w.e + 64) + 63) * 0.30102999566398114);
+    size_t idx = (348 + k - 1) / 8 + 1;
+    common_fp_t c = { .f = common_pow10[idx].f, .e = common_pow10[idx].e };
+    w  = common_fp_mul(w, c);
+    hi = common_fp_mul(hi, c);
+    lo = common_fp_mul(lo, c);
+
+    uint64_t unit = 1,
+             top = hi.f + unit,
+             delta = top - (lo.f - unit);
+    int shift = -w.e;
+    uint64_t one = 1ULL << shift;
+    uint32_t ints = top >> shift;
+    uint64_t fracs = top & (one - 1);
+    uint32_t div = 1000000000;
+    int kappa = 10;
+    while(kappa > 0 && div > ints)
+    {
+        div /= 10;
+        --kappa;
+    }
+    *len = 0;
+    while(kappa > 0)
+    {
+        buf[(*len)++] = '0' + ints / div;
+        ints %= div;
+        --kappa;
+        uint64_t rest = ((uint64_t)ints << shift) + fracs;
+        if(rest < delta)
+        {
+            *exp = kappa - common_pow10[idx].k;
+            return common_grisu_weed(buf, *len, top - w.f, delta, rest, (uint64_t)div << shift, unit);
+        }
+        div /= 10;
+    }
+    while(true)
+    {
+        fracs *= 10;
+        unit  *= 10;
+        delta *= 10;
+        buf[(*len)++] = '0' + (fracs >> shift);
+        fracs &= one - 1;
+        --kappa;
+        if(fracs < delta)
+        {
+            *exp = kappa - common_pow10[idx].k;
+            return common_grisu_weed(buf, *len, (top - w.f) * unit, delta, fracs, one, unit);
+        }
+    }
+}
+
+// Same digits through printf, for when Grisu3 gives up. If some precision
+// reads back the same, so does every higher one, so it can be bisected.
+static void common_dtoa_slow(double val, char *buf, int *len, int *exp)
+{
+    char tmp[32];
+    int lo = 0,
+        hi = 16;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        snprintf(tmp, sizeof(tmp), "%.*e", mid, val);
+        if(strtod(tmp, NULL) == val)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+    snprintf(tmp, sizeof(tmp), "%.*e", lo, val);
+    char *ptr = tmp;
+    *len = 0;
+    for(; *ptr != 'e'; ++ptr)
+    {
+        if(*ptr != '.')
+        {
+            buf[(*len)++] = *ptr;
+        }
+    }
+    while(*len > 1 && buf[*len - 1] == '0')
+    {
+        --*len;
+    }
+    *exp = atoi(ptr + 1) - (*len - 1);
+}
+
+// The fewest digits that read back as the same double, plain for
+// magnitudes from 1e-4 to 1e17 and with an exponent otherwise.
+// Integral values keep a ".0", so that they still look like floats.
+void common_buf_double(common_buf_t *out, double val)
+{
+    if(isnan(val))
+    {
+        common_buf_puts(out, "nan");
+        return;
+    }
+    if(signbit(val))
+    {
+        common_buf_putc(out, '-');
+        val = -val;
+    }
+    if(isinf(val))
+    {
+        common_buf_puts(out, "inf");
+        return;
+    }
+    if(val <= 0x1p53 && val == (double)(uint64_t)val)
+    {
+        common_buf_dec(out, (uint64_t)val);
+        common_buf_write(out, ".0", 2);
+        return;
+    }
+    char digits[20];
+    int len, exp;
+    if(!common_grisu(val, digits, &len, &exp))
+    {
+        common_dtoa_slow(val, digits, &len, &exp);
+    }
+    // Worst case is "0.000" + 17 digits, or 17 digits with ".0"
+    char *start = common_buf_reserve(out, 32);
+    if(!start)
+    {
+        return;
+    }
+    char *ptr = start;
+    int point = len + exp;
+    if(point > 17 || point < -3)
+    {
+        *ptr++ = digits[0];
+        if(len > 1)
+        {
+            *ptr++ = '.';
+            memcpy(ptr, digits + 1, len - 1);
+            ptr += len - 1;
+        }
+        int e = point - 1;
+        *ptr++ = 'e';
+        *ptr++ = e < 0 ? '-' : '+';
+        e = e < 0 ? -e : e;
+        if(e >= 100)
+        {
+            *ptr++ = '0' + e / 100;
+        }
+        memcpy(ptr, &common_digits[(e % 100) * 2], 2);
+        ptr += 2;
+    }
+    else if(point <= 0)
+    {
+        *ptr++ = '0';
+        *ptr++ = '.';
+        memset(ptr, '0', -point);
+        ptr += -point;
+        memcpy(ptr, digits, len);
+        ptr += len;
+    }
+    else if(point >= len)
+    {
+        memcpy(ptr, digits, len);
+        ptr += len;
+        memset(ptr, '0', point - len);
+        ptr += point - len;
+        *ptr++ = '.';
+        *ptr++ = '0';
+    }
+    else
+    {
+        memcpy(ptr, digits, point);
+        ptr += point;
+        *ptr++ = '.';
+        memcpy(ptr, digits + point, len - point);
+        ptr += len - point;
+    }
+    out->len += ptr - start;
+}
+
+static const char common_b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Must be a multiple of 3, so that only the last chunk can ever need padding.
+#define COMMON_B64_CHUNK 0xc00
+
+// Encodes straight into the output buffer, chunk by chunk.
+void common_print_base64(common_ctx_t *ctx, const uint8_t *buf, size_t size)
+{
+    while(size > 0)
+    {
+        size_t num = size < COMMON_B64_CHUNK ? size : COMMON_B64_CHUNK;
+        char *start = common_buf_reserve(ctx->out, ((num + 2) / 3) * 4);
+        if(!start)
+        {
             return;
-        case '\b':
-            fputs("\\b", ctx->stream);
+        }
+        char *ptr = start;
+        size_t i = 0;
+        for(; i + 3 <= num; i += 3)
+        {
+            uint32_t v = ((uint32_t)buf[i] << 16) | ((uint32_t)buf[i + 1] << 8) | buf[i + 2];
+            ptr[0] = common_b64[(v >> 18) & 0x3f];
+            ptr[1] = common_b64[(v >> 12) & 0x3f];
+            ptr[2] = common_b64[(v >>  6) & 0x3f];
+            ptr[3] = common_b64[ v        & 0x3f];
+            ptr += 4;
+        }
+        if(i < num)
+        {
+            uint32_t v = (uint32_t)buf[i] << 16;
+            if(i + 1 < num)
+            {
+                v |= (uint32_t)buf[i + 1] << 8;
+            }
+            ptr[0] = common_b64[(v >> 18) & 0x3f];
+            ptr[1] = common_b64[(v >> 12) & 0x3f];
+            ptr[2] = i + 1 < num ? common_b64[(v >> 6) & 0x3f] : '=';
+            ptr[3] = '=';
+            ptr += 4;
+        }
+        ctx->out->len += ptr - start;
+        buf  += num;
+        size -= num;
+    }
+}
+
+void common_print_bytes(common_ctx_t *ctx, const uint8_t *buf, size_t size)
+{
+    common_buf_putc(ctx->out, '"');
+    if(ctx->bytes_raw)
+    {
+        common_print_str(ctx, (const char*)buf, size);
+    }
+    else
+    {
+        common_print_base64(ctx, buf, size);
+    }
+    common_buf_putc(ctx->out, '"');
+}
+
+static const char common_hex[] = "0123456789abcdef";
+
+// One hexdump line: 16 "xx " groups plus the gap after the 8th, then " |", the ASCII column and "|\n".
+#define COMMON_HEXDUMP_HEX  (0x10 * 3 + 1)
+#define COMMON_HEXDUMP_LINE (COMMON_HEXDUMP_HEX + 2 + 0x10 + 2)
+
+void common_print_hexdump(common_ctx_t *ctx, const uint8_t *buf, size_t size)
+{
+    size_t pad = (ctx->lvl + 1) * 4;
+    common_buf_write(ctx->out, "<\n", 2);
+    common_buf_pad(ctx->out, pad);
+    for(size_t off = 0; off < size; off += 0x10)
+    {
+        size_t num = size - off < 0x10 ? size - off : 0x10;
+        size_t indent = off + 0x10 < size ? pad : pad - 4;
+        char *line = common_buf_reserve(ctx->out, COMMON_HEXDUMP_LINE + indent);
+        if(!line)
+        {
             return;
-        case '\\':
-        case '"':
-            fputc('\\', ctx->stream);
+        }
+        const uint8_t *data = buf + off;
+        memset(line, ' ', COMMON_HEXDUMP_HEX);
+        for(size_t i = 0; i < num; ++i)
+        {
+            char *hex = line + i * 3 + (i >= 0x8 ? 1 : 0);
+            hex[0] = common_hex[data[i] >> 4];
+            hex[1] = common_hex[data[i] & 0xf];
+        }
+        char *ptr = line + COMMON_HEXDUMP_HEX;
+        *ptr++ = ' ';
+        *ptr++ = '|';
+        for(size_t i = 0; i < num; ++i)
+        {
+            *ptr++ = (data[i] >= 0x20 && data[i] <= 0x7e) ? data[i] : '.';
+        }
+        *ptr++ = '|';
+        *ptr++ = '\n';
+        memset(ptr, ' ', indent);
+        ptr += indent;
+        ctx->out->len += ptr - line;
+    }
+    common_buf_putc(ctx->out, '>');
+}
+
+static inline bool common_char_safe(uint8_t c)
+{
+    return c >= 0x20 && c < 0x80 && c != '"' && c != '\\';
+}
+
+// Returns the offset of the first byte that needs escaping, or size if there is none.
+size_t common_str_scan(const char *buf, size_t size)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i ctl  = _mm_set1_epi8(0x20),
+                  quot = _mm_set1_epi8('"'),
+                  bsl  = _mm_set1_epi8('\\');
+    for(; i + 0x10 <= size; i += 0x10)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        // Signed compare, so this catches both <0x20 and >=0x80
+        __m128i m = _mm_or_si128(_mm_cmplt_epi8(v, ctl), _mm_or_si128(_mm_cmpeq_epi8(v, quot), _mm_cmpeq_epi8(v, bsl)));
+        int mask = _mm_movemask_epi8(m);
+        if(mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(COMMON_NEON)
+    const int8x16_t ctl  = vdupq_n_s8(0x20),
+                    quot = vdupq_n_s8('"'),
+                    bsl  = vdupq_n_s8('\\');
+    for(; i + 0x10 <= size; i += 0x10)
+    {
+        int8x16_t v = vld1q_s8((const int8_t*)(buf + i));
+        // Same as above
+        uint8x16_t m = vorrq_u8(vcltq_s8(v, ctl), vorrq_u8(vceqq_s8(v, quot), vceqq_s8(v, bsl)));
+        if(vmaxvq_u8(m) != 0)
+        {
+            // Let the scalar loop find the exact position
             break;
+        }
+    }
+#endif
+    for(; i < size && common_char_safe((uint8_t)buf[i]); ++i);
+    return i;
+}
+
+// Escapes a whole string, copying runs of characters that need no escaping in one go.
+void common_print_str(common_ctx_t *ctx, const char *buf, size_t size)
+{
+    while(size > 0)
+    {
+        size_t run = common_str_scan(buf, size);
+        if(run > 0)
+        {
+            common_buf_write(ctx->out, buf, run);
+        }
+        if(run < size)
+        {
+            common_print_char(ctx, buf[run]);
+            ++run;
+        }
+        buf  += run;
+        size -= run;
+    }
+}
+
+void common_print_char(common_ctx_t *ctx, char c)
+{
+    uint8_t u = (uint8_t)c;
+    // This catches both <0x20 and >=0x80
+    if(u < 0x20 || u >= 0x80)
+    {
+        char esc[6] = { '\\', 'u', '0', '0', common_hex[u >> 4], common_hex[u & 0xf] };
+        common_buf_write(ctx->out, esc, sizeof(esc));
+        return;
+    }
+    if(c == '\\' || c == '"')
+    {
+        common_buf_putc(ctx->out, '\\');
+    }
+    common_buf_putc(ctx->out, c);
+}
+
+// Not cryptographic, just well distributed. Used to tell whether things changed.
+uint64_t common_mix(uint64_t h, uint64_t val)
+{
+    h ^= val + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+uint64_t common_hash(const void *buf, size_t size, uint64_t seed)
+{
+    const uint8_t *ptr = buf;
+    uint64_t h = common_mix(seed, size);
+    for(; size >= sizeof(uint64_t); ptr += sizeof(uint64_t), size -= sizeof(uint64_t))
+    {
+        uint64_t val;
+        memcpy(&val, ptr, sizeof(val));
+        h = common_mix(h, val);
+    }
+    if(size > 0)
+    {
+        uint64_t val = 0;
+        memcpy(&val, ptr, size);
+        h = common_mix(h, val);
     }
-    fputc(c, ctx->stream);
+    return h;
 }
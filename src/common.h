@@ -36,16 +36,50 @@ do \
 #define COLOR_CYAN   "\x1b[1;96m"
 #define COLOR_RESET  "\x1b[0m"
 
+// Output is collected here and handed to stream in blocks of this size.
+// If stream is NULL, the buffer just grows and the caller takes the data.
+#define COMMON_BUF_FLUSH 0x10000
+
+typedef struct
+{
+    FILE *stream;
+    char *data;
+    size_t len;
+    size_t cap;
+    bool err;
+} common_buf_t;
+
 typedef struct
 {
     bool true_json;
     bool bytes_raw;
     bool first;
+    bool compact;       // no whitespace at all, only for true_json
     int lvl;
-    FILE *stream;
+    common_buf_t *out;
 } common_ctx_t;
 
+void common_buf_init(common_buf_t *out, FILE *stream);
+void common_buf_flush(common_buf_t *out);
+void common_buf_free(common_buf_t *out);
+char* common_buf_reserve(common_buf_t *out, size_t size);
+void common_buf_write(common_buf_t *out, const void *buf, size_t size);
+void common_buf_puts(common_buf_t *out, const char *str);
+void common_buf_putc(common_buf_t *out, char c);
+void common_buf_pad(common_buf_t *out, size_t num);
+void common_buf_printf(common_buf_t *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void common_buf_dec(common_buf_t *out, uint64_t val);
+void common_buf_hex(common_buf_t *out, uint64_t val);
+void common_buf_double(common_buf_t *out, double val);
+
+size_t common_str_scan(const char *buf, size_t size);
+void common_print_hexdump(common_ctx_t *ctx, const uint8_t *buf, size_t size);
+void common_print_base64(common_ctx_t *ctx, const uint8_t *buf, size_t size);
 void common_print_bytes(common_ctx_t *ctx, const uint8_t *buf, size_t size);
+void common_print_str(common_ctx_t *ctx, const char *buf, size_t size);
 void common_print_char(common_ctx_t *ctx, char c);
 
+uint64_t common_mix(uint64_t h, uint64_t val);
+uint64_t common_hash(const void *buf, size_t size, uint64_t seed);
+
 #endif
@@ -0,0 +1,536 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "compact.h"
+#include "oss.h"
+#include "stats.h"
+
+#define COMPACT_PAD(x) (((x) + 3) & ~(size_t)3)
+
+void compact_writer_init(compact_writer_t *w)
+{
+    oss_init(&w->oss);
+    common_buf_init(&w->flat, NULL);
+    w->occ = NULL;
+    w->numOcc = 0;
+    w->capOcc = 0;
+    w->values = NULL;
+    w->numValues = 0;
+    w->capValues = 0;
+    w->tab = NULL;
+    w->tabCap = 0;
+    w->items = NULL;
+    w->numItems = 0;
+    w->capItems = 0;
+    w->objs = 0;
+    w->numTable = 0;
+    w->lastTable = 0;
+    w->err = false;
+}
+
+void compact_writer_free(compact_writer_t *w)
+{
+    oss_free(&w->oss);
+    common_buf_free(&w->flat);
+    free(w->occ);
+    free(w->values);
+    free(w->tab);
+    free(w->items);
+    compact_writer_init(w);
+}
+
+static uint32_t compact_word(const compact_writer_t *w, size_t off)
+{
+    uint32_t key;
+    memcpy(&key, w->flat.data + off, sizeof(key));
+    return key;
+}
+
+// Whether an object is the last one in its container depends on where it is, not what it is.
+static bool compact_equal(const compact_writer_t *w, size_t a, size_t b, size_t len)
+{
+    return ((compact_word(w, a) ^ compact_word(w, b)) & ~OSS_END) == 0 &&
+           memcmp(w->flat.data + a + sizeof(uint32_t), w->flat.data + b + sizeof(uint32_t), len - sizeof(uint32_t)) == 0;
+}
+
+static bool compact_rehash(compact_writer_t *w)
+{
+    size_t cap = w->tabCap ? w->tabCap * 2 : 0x1000;
+    uint32_t *tab = malloc(cap * sizeof(*tab));
+    if(!tab)
+    {
+        return false;
+    }
+    memset(tab, 0xff, cap * sizeof(*tab));
+    for(size_t i = 0; i < w->numValues; ++i)
+    {
+        size_t j = w->values[i].hash & (cap - 1);
+        while(tab[j] != COMPACT_NONE)
+        {
+            j = (j + 1) & (cap - 1);
+        }
+        tab[j] = (uint32_t)i;
+    }
+    free(w->tab);
+    w->tab = tab;
+    w->tabCap = cap;
+    return true;
+}
+
+static uint32_t compact_intern(compact_writer_t *w, uint64_t hash, size_t off, size_t len, uint32_t nodes, size_t occ)
+{
+    if(w->numValues * 2 >= w->tabCap && !compact_rehash(w))
+    {
+        return COMPACT_NONE;
+    }
+    size_t j = hash & (w->tabCap - 1);
+    for(; w->tab[j] != COMPACT_NONE; j = (j + 1) & (w->tabCap - 1))
+    {
+        compact_value_t *v = &w->values[w->tab[j]];
+        if(v->hash == hash && v->len == len && compact_equal(w, v->off, off, len))
+        {
+            ++v->count;
+            return w->tab[j];
+        }
+    }
+    if(w->numValues >= w->capValues)
+    {
+        size_t cap = w->capValues ? w->capValues * 2 : 0x400;
+        compact_value_t *values = cap < COMPACT_NONE ? realloc(w->values, cap * sizeof(*values)) : NULL;
+        if(!values)
+        {
+            return COMPACT_NONE;
+        }
+        w->values = values;
+        w->capValues = cap;
+    }
+    w->values[w->numValues] = (compact_value_t)
+    {
+        .hash = hash,
+        .off = off,
+        .len = len,
+        .nodes = nodes,
+        .count = 1,
+        .first = occ,
+        .ref = COMPACT_NONE,
+    };
+    w->tab[j] = (uint32_t)w->numValues;
+    return (uint32_t)w->numValues++;
+}
+
+// Hashes are built bottom-up, so every subtree that occurs more than once ends up as one value.
+static bool compact_walk(compact_writer_t *w, size_t *off, uint64_t *hash, uint32_t *nodes)
+{
+    if(w->numOcc >= w->capOcc)
+    {
+        size_t cap = w->capOcc ? w->capOcc * 2 : 0x1000;
+        uint32_t *occ = realloc(w->occ, cap * sizeof(*occ));
+        if(!occ)
+        {
+            return false;
+        }
+        w->occ = occ;
+        w->capOcc = cap;
+    }
+    size_t start = *off,
+           occ = w->numOcc++;
+    uint32_t key = compact_word(w, start) & ~OSS_END,
+             type = key & OSS_TYPE_MASK,
+             len = key & OSS_DATA_MASK,
+             n = 1;
+    uint64_t h = common_mix(0, key);
+    *off += sizeof(key);
+    if(type == OSS_DICT || type == OSS_ARRAY || type == OSS_SET)
+    {
+        bool end = len == 0;
+        while(!end)
+        {
+            uint64_t ch = 0;
+            uint32_t cn = 0;
+            if(type == OSS_DICT)
+            {
+                if(!compact_walk(w, off, &ch, &cn))
+                {
+                    return false;
+                }
+                h = common_mix(h, ch);
+                n += cn;
+            }
+            end = !!(compact_word(w, *off) & OSS_END);
+            if(!compact_walk(w, off, &ch, &cn))
+            {
+                return false;
+            }
+            h = common_mix(h, ch);
+            n += cn;
+        }
+    }
+    else
+    {
+        size_t size = type == OSS_NUMBER ? sizeof(uint64_t) : type == OSS_BOOLEAN ? 0 : len;
+        h = common_hash(w->flat.data + *off, size, h);
+        *off += COMPACT_PAD(size);
+    }
+    uint32_t id = compact_intern(w, h, start, *off - start, n, occ);
+    if(id == COMPACT_NONE)
+    {
+        return false;
+    }
+    w->occ[occ] = id;
+    *hash = h;
+    *nodes = n;
+    return true;
+}
+
+// Returns false without adding anything if ret is 0 but props can't be decoded.
+// Entries with a non-zero ret get an empty dict, and props is ignored.
+bool compact_writer_entry(compact_writer_t *w, const char *class, const char *name, int32_t ret, const void *props, size_t propsLen)
+{
+    if(w->err)
+    {
+        return false;
+    }
+    if(w->numItems >= w->capItems)
+    {
+        size_t cap = w->capItems ? w->capItems * 2 : 0x400;
+        compact_item_t *items = realloc(w->items, cap * sizeof(*items));
+        if(!items)
+        {
+            w->err = true;
+            return false;
+        }
+        w->items = items;
+        w->capItems = cap;
+    }
+    compact_item_t *item = &w->items[w->numItems];
+    item->ret = ret;
+    item->off = w->flat.len;
+    item->occ = w->numOcc;
+    size_t classLen = strlen(class),
+           nameLen = strlen(name);
+    oss_put(&w->flat, OSS_STRING | (uint32_t)classLen, class, classLen);
+    oss_put(&w->flat, OSS_STRING | (uint32_t)nameLen, name, nameLen);
+    if(ret != 0)
+    {
+        oss_put(&w->flat, OSS_DICT, NULL, 0);
+    }
+    else if(!props || !oss_flatten(&w->oss, props, propsLen, &w->flat))
+    {
+        w->err = w->flat.err;
+        w->flat.len = item->off;
+        return false;
+    }
+    if(w->flat.err)
+    {
+        w->err = true;
+        return false;
+    }
+    size_t off = item->off;
+    for(int i = 0; i < 3; ++i)
+    {
+        uint64_t hash = 0;
+        uint32_t nodes = 0;
+        if(!compact_walk(w, &off, &hash, &nodes))
+        {
+            w->err = true;
+            return false;
+        }
+    }
+    ++w->numItems;
+    return true;
+}
+
+// A back-reference costs a word, so only values that save more than that get into the table.
+static bool compact_worth(const compact_value_t *v)
+{
+    return v->count > 1 && (v->count - 1) * v->len > v->count * sizeof(uint32_t);
+}
+
+// Writes the object at *off in flat, or a back-reference to it if it's in the table,
+// unless self is set. Everything in it that is in the table is always referenced.
+static void compact_emit(compact_writer_t *w, common_buf_t *out, size_t *off, size_t *occ, bool last, bool self)
+{
+    const compact_value_t *v = &w->values[w->occ[*occ]];
+    uint32_t end = last ? OSS_END : 0;
+    if(!self && v->ref != COMPACT_NONE)
+    {
+        oss_put(out, OSS_OBJECT | v->ref | end, NULL, 0);
+        *off += v->len;
+        *occ += v->nodes;
+        return;
+    }
+    uint32_t key = compact_word(w, *off),
+             type = key & OSS_TYPE_MASK,
+             len = key & OSS_DATA_MASK;
+    *off += sizeof(key);
+    ++*occ;
+    ++w->objs;
+    if(type == OSS_DICT || type == OSS_ARRAY || type == OSS_SET)
+    {
+        oss_put(out, type | len | end, NULL, 0);
+        bool done = len == 0;
+        while(!done)
+        {
+            if(type == OSS_DICT)
+            {
+                compact_emit(w, out, off, occ, false, false);
+            }
+            done = !!(compact_word(w, *off) & OSS_END);
+            compact_emit(w, out, off, occ, done, false);
+        }
+    }
+    else
+    {
+        size_t size = type == OSS_NUMBER ? sizeof(uint64_t) : type == OSS_BOOLEAN ? 0 : len;
+        oss_put(out, type | len | end, w->flat.data + *off, size);
+        *off += COMPACT_PAD(size);
+    }
+}
+
+static void compact_table(compact_writer_t *w, common_buf_t *table, uint32_t id);
+
+// Puts every value worth it in the object at *off into the table, innermost first,
+// so that table entries only ever refer to earlier ones.
+static void compact_prepare(compact_writer_t *w, common_buf_t *table, size_t *off, size_t *occ, bool self)
+{
+    uint32_t id = w->occ[*occ];
+    const compact_value_t *v = &w->values[id];
+    if(!self && compact_worth(v))
+    {
+        if(v->ref == COMPACT_NONE)
+        {
+            compact_table(w, table, id);
+        }
+        *off += v->len;
+        *occ += v->nodes;
+        return;
+    }
+    uint32_t key = compact_word(w, *off),
+             type = key & OSS_TYPE_MASK,
+             len = key & OSS_DATA_MASK;
+    *off += sizeof(key);
+    ++*occ;
+    if(type == OSS_DICT || type == OSS_ARRAY || type == OSS_SET)
+    {
+        bool done = len == 0;
+        while(!done)
+        {
+            if(type == OSS_DICT)
+            {
+                compact_prepare(w, table, off, occ, false);
+            }
+            done = !!(compact_word(w, *off) & OSS_END);
+            compact_prepare(w, table, off, occ, false);
+        }
+    }
+    else
+    {
+        *off += COMPACT_PAD(type == OSS_NUMBER ? sizeof(uint64_t) : type == OSS_BOOLEAN ? 0 : len);
+    }
+}
+
+static void compact_table(compact_writer_t *w, common_buf_t *table, uint32_t id)
+{
+    compact_value_t *v = &w->values[id];
+    size_t off = v->off,
+           occ = v->first;
+    compact_prepare(w, table, &off, &occ, true);
+    // Back-references only have 24 bits, anything past that is written inline.
+    if(w->objs + v->nodes > OSS_DATA_MASK)
+    {
+        v->count = 1;
+        return;
+    }
+    v->ref = w->objs;
+    w->lastTable = table->len;
+    ++w->numTable;
+    off = v->off;
+    occ = v->first;
+    compact_emit(w, table, &off, &occ, false, true);
+}
+
+bool compact_writer_write(compact_writer_t *w, FILE *f)
+{
+    if(w->err || w->numItems > OSS_DATA_MASK)
+    {
+        ERR(COLOR_RED "Failed to build compact dump: %s" COLOR_RESET, strerror(ENOMEM));
+        return false;
+    }
+    common_buf_t head, table, entries;
+    common_buf_init(&head, NULL);
+    common_buf_init(&table, NULL);
+    common_buf_init(&entries, NULL);
+
+    // Top-level array, version and table are objects 0 to 2.
+    w->objs = 3;
+    w->numTable = 0;
+    for(size_t i = 0; i < w->numItems; ++i)
+    {
+        size_t off = w->items[i].off,
+               occ = w->items[i].occ;
+        for(int j = 0; j < 3; ++j)
+        {
+            compact_prepare(w, &table, &off, &occ, false);
+        }
+    }
+    if(w->numTable > 0 && !table.err)
+    {
+        uint32_t key;
+        memcpy(&key, table.data + w->lastTable, sizeof(key));
+        key |= OSS_END;
+        memcpy(table.data + w->lastTable, &key, sizeof(key));
+    }
+
+    for(size_t i = 0; i < w->numItems; ++i)
+    {
+        const compact_item_t *item = &w->items[i];
+        uint64_t ret = (uint32_t)item->ret,
+                 size = 0;
+        oss_put(&entries, OSS_ARRAY | 5 | (i + 1 == w->numItems ? OSS_END : 0), NULL, 0);
+        oss_put(&entries, OSS_NUMBER | 32, &ret, sizeof(ret));
+        w->objs += 2;
+        size_t off = item->off,
+               occ = item->occ;
+        compact_emit(w, &entries, &off, &occ, false, false);
+        compact_emit(w, &entries, &off, &occ, false, false);
+        size_t sizeOff = entries.len + sizeof(uint32_t);
+        oss_put(&entries, OSS_NUMBER | 64, &size, sizeof(size));
+        ++w->objs;
+        size_t start = entries.len;
+        compact_emit(w, &entries, &off, &occ, true, false);
+        if(!entries.err)
+        {
+            size = entries.len - start;
+            memcpy(entries.data + sizeOff, &size, sizeof(size));
+        }
+    }
+
+    uint64_t version = COMPACT_VERSION;
+    uint32_t magic = OSS_MAGIC;
+    common_buf_write(&head, &magic, sizeof(magic));
+    oss_put(&head, OSS_ARRAY | 3 | OSS_END, NULL, 0);
+    oss_put(&head, OSS_NUMBER | 32, &version, sizeof(version));
+    oss_put(&head, OSS_ARRAY | w->numTable, NULL, 0);
+    uint32_t tail = OSS_ARRAY | (uint32_t)w->numItems | OSS_END;
+
+    bool succ = !head.err && !table.err && !entries.err;
+    if(!succ)
+    {
+        ERR(COLOR_RED "Failed to build compact dump: %s" COLOR_RESET, strerror(ENOMEM));
+    }
+    else if(stats_fwrite(head.data, head.len, f) != head.len ||
+            stats_fwrite(table.data, table.len, f) != table.len ||
+            stats_fwrite(&tail, sizeof(tail), f) != sizeof(tail) ||
+            stats_fwrite(entries.data, entries.len, f) != entries.len ||
+            fflush(f) != 0)
+    {
+        ERR(COLOR_RED "Failed to write compact dump: %s" COLOR_RESET, strerror(errno));
+        succ = false;
+    }
+    common_buf_free(&head);
+    common_buf_free(&table);
+    common_buf_free(&entries);
+    return succ;
+}
+
+void compact_reader_init(compact_reader_t *r)
+{
+    oss_init(&r->oss);
+    r->numEntries = 0;
+    r->entry = 0;
+}
+
+void compact_reader_free(compact_reader_t *r)
+{
+    oss_free(&r->oss);
+}
+
+// Records the table, after which entries can be read one by one.
+bool compact_reader_open(compact_reader_t *r, const uint8_t *buf, size_t size)
+{
+    oss_item_t item;
+    r->numEntries = 0;
+    r->entry = 0;
+    if(!oss_open(&r->oss, buf, size) ||
+       !oss_next(&r->oss, &item) || item.type != OSS_ARRAY ||
+       !oss_next(&r->oss, &item) || item.type != OSS_NUMBER || item.val != COMPACT_VERSION ||
+       !oss_next(&r->oss, &item) || item.type != OSS_ARRAY)
+    {
+        return false;
+    }
+    for(uint32_t i = 0, num = item.len; i < num; ++i)
+    {
+        if(!oss_next_record(&r->oss))
+        {
+            return false;
+        }
+    }
+    if(!oss_next(&r->oss, &item) || item.type != OSS_ARRAY)
+    {
+        return false;
+    }
+    r->numEntries = item.len;
+    return true;
+}
+
+static bool compact_reader_str(compact_reader_t *r, const char **str, size_t *len)
+{
+    oss_item_t item;
+    if(!oss_next(&r->oss, &item) || (item.type != OSS_STRING && item.type != OSS_SYMBOL))
+    {
+        return false;
+    }
+    *str = (const char*)item.str;
+    *len = item.size;
+    return true;
+}
+
+// Returns false at the end, as well as on malformed input.
+bool compact_reader_next(compact_reader_t *r, compact_entry_t *e)
+{
+    oss_item_t item;
+    if(r->entry >= r->numEntries ||
+       !oss_next(&r->oss, &item) || item.type != OSS_ARRAY || item.len != 5 ||
+       !oss_next(&r->oss, &item) || item.type != OSS_NUMBER)
+    {
+        return false;
+    }
+    e->ret = (int32_t)(uint32_t)item.val;
+    if(!compact_reader_str(r, &e->class, &e->classLen) ||
+       !compact_reader_str(r, &e->name, &e->nameLen) ||
+       !oss_next(&r->oss, &item) || item.type != OSS_NUMBER || item.val > r->oss.size - r->oss.pos)
+    {
+        return false;
+    }
+    e->props = r->oss.pos;
+    r->oss.pos += item.val;
+    ++r->entry;
+    return true;
+}
+
+// Output goes to r->oss.out, followed by a newline, same as oss_format.
+bool compact_reader_props(compact_reader_t *r, const compact_entry_t *e, bool true_json, bool bytes_raw)
+{
+    if(!oss_format_at(&r->oss, e->props, 0, true_json, bytes_raw))
+    {
+        return false;
+    }
+    common_buf_putc(&r->oss.out, '\n');
+    return !r->oss.out.err;
+}
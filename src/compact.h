@@ -0,0 +1,101 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "oss.h"
+
+// Compact dumps are a single binary OSSerialize document, so IOCFUnserialize can read them too:
+//
+//   [ version, [ table... ], [ [ ret, class, name, propsSize, props ]... ] ]
+//
+// Keys, class names and any other value that occurs often enough to be worth it
+// are written to the table once, and everything after it refers to them with
+// back-references. propsSize is the size of props in bytes, so readers can skip
+// them. Entries only ever refer to the table, never to each other.
+
+#define COMPACT_VERSION 1
+#define COMPACT_NONE    UINT32_MAX
+
+typedef struct
+{
+    uint64_t hash;
+    size_t off;         // of the first occurrence in flat
+    size_t len;         // in bytes, including everything in it
+    uint32_t nodes;     // objects it is made of, including keys
+    uint32_t count;     // occurrences
+    size_t first;       // index of the first occurrence in occ
+    uint32_t ref;       // object index in the table, once written
+} compact_value_t;
+
+typedef struct
+{
+    int32_t ret;
+    size_t off;         // of the class in flat, followed by name and props
+    size_t occ;
+} compact_item_t;
+
+typedef struct
+{
+    oss_t oss;
+    common_buf_t flat;  // class, name and props of every entry, without back-references
+    uint32_t *occ;      // value of every object in flat, in order
+    size_t numOcc;
+    size_t capOcc;
+    compact_value_t *values;
+    size_t numValues;
+    size_t capValues;
+    uint32_t *tab;
+    size_t tabCap;
+    compact_item_t *items;
+    size_t numItems;
+    size_t capItems;
+    uint32_t objs;      // objects written so far
+    uint32_t numTable;
+    size_t lastTable;   // offset of the last table entry
+    bool err;
+} compact_writer_t;
+
+void compact_writer_init(compact_writer_t *w);
+void compact_writer_free(compact_writer_t *w);
+bool compact_writer_entry(compact_writer_t *w, const char *class, const char *name, int32_t ret, const void *props, size_t propsLen);
+bool compact_writer_write(compact_writer_t *w, FILE *f);
+
+typedef struct
+{
+    oss_t oss;
+    uint32_t numEntries;
+    uint32_t entry;
+} compact_reader_t;
+
+typedef struct
+{
+    int32_t ret;
+    const char *class;  // not NUL-terminated
+    size_t classLen;
+    const char *name;
+    size_t nameLen;
+    size_t props;       // offset for compact_reader_props
+} compact_entry_t;
+
+void compact_reader_init(compact_reader_t *r);
+void compact_reader_free(compact_reader_t *r);
+bool compact_reader_open(compact_reader_t *r, const uint8_t *buf, size_t size);
+bool compact_reader_next(compact_reader_t *r, compact_entry_t *e);
+bool compact_reader_props(compact_reader_t *r, const compact_entry_t *e, bool true_json, bool bytes_raw);
+
+#endif
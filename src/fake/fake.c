@@ -0,0 +1,2151 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+// In-process stand-in for the parts of IOKit.framework that the tools use.
+// Linked instead of the real framework by "make fake", see README.
+//
+// The registry is either synthetic or a snapshot written by "ioprint -w".
+// The synthetic one is shaped by these environment variables:
+//
+//   IOFAKE_ENTRIES   number of registry entries, including the root (default 1000)
+//   IOFAKE_DEPTH     depth of the tree below the root (default 6)
+//   IOFAKE_PROPSIZE  size of the IOFakeData property of every entry (default 64)
+//   IOFAKE_TYPES     number of user client types that can be spawned (default 2)
+//   IOFAKE_SNAPSHOT  path to a snapshot to serve instead
+//   IOFAKE_EVENTS    path to a script of registry changes for notification ports
+//
+// Every fourth service (by index) can spawn IOFAKE_TYPES user clients, every
+// other one of the rest refuses with kIOReturnNotPrivileged for type 0.
+//
+// Once the run loop source of a notification port is scheduled, the lines of
+// IOFAKE_EVENTS are played back one by one, each delivered on that run loop:
+//
+//   remove N   terminate entry N (by index) and everything below it
+//   add N      publish entry N and everything below it again, with new IDs
+//   set N      change a property of entry N
+//   sleep MS   wait MS milliseconds
+//
+// Empty lines and lines starting with # are skipped. The run loop is stopped
+// after the last line.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sysctl.h>
+#include <mach/mach.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "../cfj.h"
+#include "../classtree.h"
+#include "../common.h"
+#include "../iokit.h"
+#include "../snap.h"
+
+#define kIOReturnNoMemory         ((kern_return_t)0xe00002bd)
+#define kIOReturnNotPrivileged    ((kern_return_t)0xe00002c1)
+#define kIOReturnBadArgument      ((kern_return_t)0xe00002c2)
+#define kIOReturnUnsupported      ((kern_return_t)0xe00002c7)
+#define kIOReturnInternalError    ((kern_return_t)0xe00002c9)
+#define kIOReturnNoSpace          ((kern_return_t)0xe00002db)
+#define kIOReturnNotFound         ((kern_return_t)0xe00002f0)
+
+// Port names encode what they refer to, so no lookup table is needed for entries.
+#define FAKE_PORT_ENTRY  0x10000000U
+#define FAKE_PORT_CLIENT 0x20000000U
+#define FAKE_PORT_ITER   0x30000000U
+#define FAKE_PORT_NOTIFY 0x40000000U
+#define FAKE_PORT_KIND   0xf0000000U
+#define FAKE_PORT_INDEX  0x0fffffffU
+// Like real port names, client names carry a generation so that a closed
+// client's name is not immediately handed out again.
+#define FAKE_CLIENT_SLOT 0x000fffffU
+#define FAKE_CLIENT_GEN  20
+
+#define FAKE_NONE        UINT32_MAX
+#define FAKE_ID_BASE     0x100000000ULL
+#define FAKE_MAX_DEPTH   0x100
+
+typedef struct
+{
+    uint64_t id;
+    const char *name;       // NULL for synthetic entries
+    const uint8_t *props;   // NULL for synthetic entries
+    uint32_t propsLen;
+    int32_t propsRet;
+    uint32_t class;
+    uint32_t parent;
+    uint32_t firstChild;
+    uint32_t numChildren;
+    uint32_t gen;           // bumped by "set" events
+    bool gone;              // terminated by a "remove" event
+} fake_entry_t;
+
+typedef struct
+{
+    uint32_t entry;         // FAKE_NONE if the slot is free
+    uint32_t class;
+    uint32_t gen;
+} fake_client_t;
+
+typedef struct
+{
+    io_object_t *objs;
+    uint32_t num;
+    uint32_t cap;
+    uint32_t pos;
+    bool used;
+} fake_iter_t;
+
+typedef struct
+{
+    io_name_t class;
+    io_name_t name;
+    bool hasClass;
+    bool hasName;
+} fake_match_t;
+
+typedef enum
+{
+    FAKE_NOTIFY_FIRST,
+    FAKE_NOTIFY_TERMINATED,
+    FAKE_NOTIFY_INTEREST,
+} fake_notify_type_t;
+
+typedef struct
+{
+    IONotificationPortRef port;     // NULL if the slot is free
+    fake_notify_type_t type;
+    uint32_t entry;                 // for interest notifications
+    io_iterator_t it;               // for matching notifications
+    fake_match_t match;
+    IOServiceMatchingCallback matched;
+    IOServiceInterestCallback interest;
+    void *refcon;
+} fake_notify_t;
+
+// Events are handed from the script thread to the run loop one at a time.
+struct IONotificationPort
+{
+    CFRunLoopSourceRef source;
+    CFRunLoopRef loop;
+    pthread_t thread;
+    pthread_cond_t cond;
+    bool started;
+    bool pending;
+    bool dead;
+    char op;
+    uint32_t idx;
+};
+
+static struct
+{
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    classtree_t classes;
+    snap_t snap;
+    bool recorded;
+    fake_entry_t *entries;
+    const uint32_t *edges;  // NULL if children are consecutive entries
+    uint32_t num;
+    uint32_t depth;
+    uint32_t propSize;
+    uint32_t types;
+    uint32_t ucClass;
+    fake_client_t *clients;
+    uint32_t numClients;
+    fake_iter_t *iters;
+    uint32_t numIters;
+    fake_notify_t *notifs;
+    uint32_t numNotifs;
+    uint32_t freeNotif;     // no free slots below this
+    uint64_t nextId;
+} fake =
+{
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+const mach_port_t kIOMasterPortDefault = MACH_PORT_NULL;
+
+static uint32_t fakeEnv(const char *name, uint32_t def)
+{
+    const char *str = getenv(name);
+    if(!str || !*str)
+    {
+        return def;
+    }
+    char *end = NULL;
+    unsigned long val = strtoul(str, &end, 0);
+    if(*end != '\0' || val > FAKE_PORT_INDEX)
+    {
+        ERR(COLOR_RED "Invalid value for %s: %s" COLOR_RESET, name, str);
+        exit(-1);
+    }
+    return (uint32_t)val;
+}
+
+static uint32_t fakeClass(const char *name, const char *super, const char *bundle)
+{
+    bool added = false;
+    uint32_t class = classtree_add(&fake.classes, name, &added);
+    if(class == CLASSTREE_NONE)
+    {
+        ERR(COLOR_RED "Failed to allocate class tree." COLOR_RESET);
+        exit(-1);
+    }
+    if(added)
+    {
+        if(super)
+        {
+            classtree_set_super(&fake.classes, class, classtree_find(&fake.classes, super));
+        }
+        classtree_set_bundle(&fake.classes, class, bundle);
+    }
+    return class;
+}
+
+static void fakeSynthetic(void)
+{
+    uint32_t num = fakeEnv("IOFAKE_ENTRIES", 1000),
+             depth = fakeEnv("IOFAKE_DEPTH", 6);
+    if(num < 1)
+    {
+        num = 1;
+    }
+    if(depth < 1)
+    {
+        depth = 1;
+    }
+    fake.depth = depth;
+
+    // Smallest fanout that fits all entries within the requested depth.
+    uint64_t fanout = 1;
+    while(true)
+    {
+        uint64_t total = 1,
+                 level = 1;
+        for(uint32_t i = 0; i < depth && total < num; ++i)
+        {
+            level *= fanout;
+            total += level;
+        }
+        if(total >= num)
+        {
+            break;
+        }
+        ++fanout;
+    }
+
+    uint32_t device[8];
+    for(uint32_t i = 0; i < 8; ++i)
+    {
+        char name[0x20];
+        snprintf(name, sizeof(name), "FakeDevice%u", i);
+        device[i] = fakeClass(name, "IOService", "net.siguza.iokit-utils.fake");
+    }
+
+    fake.entries = calloc(num, sizeof(*fake.entries));
+    if(!fake.entries)
+    {
+        ERR(COLOR_RED "Failed to allocate fake registry." COLOR_RESET);
+        exit(-1);
+    }
+    fake.num = num;
+    for(uint32_t i = 0; i < num; ++i)
+    {
+        fake_entry_t *e = &fake.entries[i];
+        uint64_t first = fanout * i + 1;
+        e->id = FAKE_ID_BASE + i;
+        e->class = i == 0 ? classtree_find(&fake.classes, "IORegistryEntry") : device[i % 8];
+        e->parent = i == 0 ? FAKE_NONE : (uint32_t)((i - 1) / fanout);
+        e->firstChild = first < num ? (uint32_t)first : 0;
+        e->numChildren = first < num ? (uint32_t)(num - first < fanout ? num - first : fanout) : 0;
+    }
+}
+
+static void fakeRecorded(const char *path)
+{
+    if(!snap_open(&fake.snap, path))
+    {
+        exit(-1);
+    }
+    const snap_hdr_t *hdr = fake.snap.hdr;
+    uint32_t *map = malloc((hdr->numClasses ? hdr->numClasses : 1) * sizeof(*map));
+    fake.entries = calloc(hdr->numEntries ? hdr->numEntries : 1, sizeof(*fake.entries));
+    if(!map || !fake.entries)
+    {
+        ERR(COLOR_RED "Failed to allocate fake registry." COLOR_RESET);
+        exit(-1);
+    }
+    for(uint32_t i = 0; i < hdr->numClasses; ++i)
+    {
+        map[i] = fakeClass(snap_class_name(&fake.snap, i), NULL, "");
+    }
+    for(uint32_t i = 0; i < hdr->numClasses; ++i)
+    {
+        uint32_t super = fake.snap.classes[i].super;
+        if(super < hdr->numClasses)
+        {
+            classtree_set_super(&fake.classes, map[i], map[super]);
+        }
+    }
+    for(uint32_t i = 0; i < hdr->numEntries; ++i)
+    {
+        const snap_entry_t *s = &fake.snap.entries[i];
+        fake_entry_t *e = &fake.entries[i];
+        size_t size = 0;
+        e->id = s->id;
+        e->name = snap_str(&fake.snap, s->name);
+        e->props = snap_props(&fake.snap, s, &size);
+        e->propsLen = e->props ? (uint32_t)size : 0;
+        e->propsRet = s->propsRet;
+        e->class = s->class < hdr->numClasses ? map[s->class] : classtree_find(&fake.classes, "IORegistryEntry");
+        e->parent = s->parent;
+        // snap_open only checks the tables, not the indices in them
+        bool valid = s->firstChild <= hdr->numEdges && s->numChildren <= hdr->numEdges - s->firstChild;
+        e->firstChild = valid ? s->firstChild : 0;
+        e->numChildren = valid ? s->numChildren : 0;
+        for(uint32_t j = 0; j < e->numChildren; ++j)
+        {
+            if(fake.snap.edges[e->firstChild + j] >= hdr->numEntries)
+            {
+                e->numChildren = 0;
+                break;
+            }
+        }
+    }
+    free(map);
+    fake.edges = fake.snap.edges;
+    fake.num = hdr->numEntries;
+    fake.recorded = true;
+}
+
+static void fakeSetup(void)
+{
+    classtree_init(&fake.classes);
+    fakeClass("OSObject", NULL, "com.apple.kernel");
+    fakeClass("IORegistryEntry", "OSObject", "com.apple.kernel");
+    fakeClass("IOService", "IORegistryEntry", "com.apple.kernel");
+    fakeClass("IOUserClient", "IOService", "com.apple.kernel");
+
+    const char *path = getenv("IOFAKE_SNAPSHOT");
+    if(path && *path)
+    {
+        fakeRecorded(path);
+    }
+    else
+    {
+        fakeSynthetic();
+    }
+    if(fake.num == 0)
+    {
+        ERR(COLOR_RED "Fake registry is empty." COLOR_RESET);
+        exit(-1);
+    }
+
+    fake.propSize = fakeEnv("IOFAKE_PROPSIZE", 64);
+    fake.types = fakeEnv("IOFAKE_TYPES", 2);
+    fake.ucClass = fake.classes.num;
+    for(uint32_t i = 0; i < fake.types; ++i)
+    {
+        char name[0x20];
+        snprintf(name, sizeof(name), "FakeUserClient%u", i);
+        fakeClass(name, "IOUserClient", "net.siguza.iokit-utils.fake");
+    }
+    if(!classtree_build(&fake.classes))
+    {
+        ERR(COLOR_RED "Failed to build class tree." COLOR_RESET);
+        exit(-1);
+    }
+    // Above anything a user client can get.
+    fake.nextId = FAKE_ID_BASE + fake.num + FAKE_PORT_INDEX + 1;
+}
+
+static inline void fakeInit(void)
+{
+    pthread_once(&fake.once, fakeSetup);
+}
+
+static uint32_t fakeEntry(io_object_t o)
+{
+    fakeInit();
+    uint32_t idx = o & FAKE_PORT_INDEX;
+    return (o & FAKE_PORT_KIND) == FAKE_PORT_ENTRY && idx < fake.num ? idx : FAKE_NONE;
+}
+
+static bool fakeClient(io_object_t o, fake_client_t *client)
+{
+    fakeInit();
+    if((o & FAKE_PORT_KIND) != FAKE_PORT_CLIENT)
+    {
+        return false;
+    }
+    uint32_t idx = o & FAKE_CLIENT_SLOT;
+    pthread_mutex_lock(&fake.lock);
+    bool valid = idx < fake.numClients && fake.clients[idx].entry != FAKE_NONE && fake.clients[idx].gen == (o & FAKE_PORT_INDEX) >> FAKE_CLIENT_GEN;
+    if(valid)
+    {
+        *client = fake.clients[idx];
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return valid;
+}
+
+static uint32_t fakeObjectClass(io_object_t o)
+{
+    uint32_t idx = fakeEntry(o);
+    if(idx != FAKE_NONE)
+    {
+        return fake.entries[idx].class;
+    }
+    fake_client_t client;
+    return fakeClient(o, &client) ? client.class : FAKE_NONE;
+}
+
+static io_iterator_t fakeIterator(io_object_t *objs, uint32_t num)
+{
+    pthread_mutex_lock(&fake.lock);
+    uint32_t slot = 0;
+    while(slot < fake.numIters && fake.iters[slot].used)
+    {
+        ++slot;
+    }
+    if(slot == fake.numIters)
+    {
+        uint32_t cap = fake.numIters ? fake.numIters * 2 : 0x10;
+        fake_iter_t *iters = realloc(fake.iters, cap * sizeof(*iters));
+        if(!iters)
+        {
+            pthread_mutex_unlock(&fake.lock);
+            free(objs);
+            return MACH_PORT_NULL;
+        }
+        memset(iters + fake.numIters, 0, (cap - fake.numIters) * sizeof(*iters));
+        fake.iters = iters;
+        fake.numIters = cap;
+    }
+    fake.iters[slot] = (fake_iter_t){ .objs = objs, .num = num, .cap = num, .pos = 0, .used = true };
+    pthread_mutex_unlock(&fake.lock);
+    return FAKE_PORT_ITER | slot;
+}
+
+// Must be called with the lock held.
+static bool fakeIterAppend(io_iterator_t it, io_object_t o)
+{
+    fake_iter_t *iter = &fake.iters[it & FAKE_PORT_INDEX];
+    if(iter->num >= iter->cap)
+    {
+        uint32_t cap = iter->cap ? iter->cap * 2 : 0x10;
+        io_object_t *objs = realloc(iter->objs, cap * sizeof(*objs));
+        if(!objs)
+        {
+            return false;
+        }
+        iter->objs = objs;
+        iter->cap = cap;
+    }
+    iter->objs[iter->num++] = o;
+    return true;
+}
+
+static inline uint32_t fakeChild(const fake_entry_t *e, uint32_t i)
+{
+    return fake.edges ? fake.edges[e->firstChild + i] : e->firstChild + i;
+}
+
+// Static children that haven't been removed, followed by any user clients currently open on the entry.
+// Returns the number of objects written, or FAKE_NONE if out is too small.
+static uint32_t fakeChildren(uint32_t idx, io_object_t *out, uint32_t max)
+{
+    const fake_entry_t *e = &fake.entries[idx];
+    uint32_t num = 0;
+    for(uint32_t i = 0; i < e->numChildren; ++i)
+    {
+        uint32_t child = fakeChild(e, i);
+        if(fake.entries[child].gone)
+        {
+            continue;
+        }
+        if(num >= max)
+        {
+            return FAKE_NONE;
+        }
+        out[num++] = FAKE_PORT_ENTRY | child;
+    }
+    for(uint32_t i = 0; i < fake.numClients; ++i)
+    {
+        if(fake.clients[i].entry == idx)
+        {
+            if(num >= max)
+            {
+                return FAKE_NONE;
+            }
+            out[num++] = FAKE_PORT_CLIENT | (fake.clients[i].gen << FAKE_CLIENT_GEN) | i;
+        }
+    }
+    return num;
+}
+
+static void fakeName(io_object_t o, io_name_t name)
+{
+    uint32_t idx = fakeEntry(o);
+    if(idx != FAKE_NONE && fake.entries[idx].name)
+    {
+        snprintf(name, sizeof(io_name_t), "%s", fake.entries[idx].name);
+    }
+    else if(idx == 0)
+    {
+        snprintf(name, sizeof(io_name_t), "Root");
+    }
+    else if(idx != FAKE_NONE)
+    {
+        snprintf(name, sizeof(io_name_t), "%s@%x", classtree_name(&fake.classes, fake.entries[idx].class), idx);
+    }
+    else
+    {
+        snprintf(name, sizeof(io_name_t), "%s", classtree_name(&fake.classes, fakeObjectClass(o)));
+    }
+}
+
+static void fakeSetNumber(CFMutableDictionaryRef dict, CFStringRef key, long long val)
+{
+    CFNumberRef num = CFNumberCreate(NULL, kCFNumberLongLongType, &val);
+    if(num)
+    {
+        CFDictionarySetValue(dict, key, num);
+        CFRelease(num);
+    }
+}
+
+static void fakeSetString(CFMutableDictionaryRef dict, CFStringRef key, const char *val)
+{
+    CFStringRef str = CFStringCreateWithCString(NULL, val, kCFStringEncodingUTF8);
+    if(str)
+    {
+        CFDictionarySetValue(dict, key, str);
+        CFRelease(str);
+    }
+}
+
+static CFMutableDictionaryRef fakeDict(void)
+{
+    return CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+}
+
+static kern_return_t fakeSyntheticProperties(uint32_t idx, uint32_t gen, CFMutableDictionaryRef dict)
+{
+    char str[0x100];
+    const fake_entry_t *e = &fake.entries[idx];
+    fakeSetString(dict, CFSTR("IOClass"), classtree_name(&fake.classes, e->class));
+    if(gen > 0)
+    {
+        fakeSetNumber(dict, CFSTR("IOFakeGeneration"), gen);
+    }
+    if(idx == 0)
+    {
+        CFMutableDictionaryRef diag = fakeDict(),
+                               classes = fakeDict();
+        if(!diag || !classes)
+        {
+            if(diag) CFRelease(diag);
+            if(classes) CFRelease(classes);
+            return kIOReturnNoMemory;
+        }
+        for(uint32_t i = 0; i < fake.classes.num; ++i)
+        {
+            CFStringRef name = CFStringCreateWithCString(NULL, classtree_name(&fake.classes, i), kCFStringEncodingUTF8);
+            if(name)
+            {
+                fakeSetNumber(classes, name, 1);
+                CFRelease(name);
+            }
+        }
+        CFDictionarySetValue(diag, CFSTR("Classes"), classes);
+        CFDictionarySetValue(dict, CFSTR("IOKitDiagnostics"), diag);
+        CFRelease(classes);
+        CFRelease(diag);
+        snprintf(str, sizeof(str), "Fake IOKit, %u entries", fake.num);
+        fakeSetString(dict, CFSTR("IOKitBuildVersion"), str);
+        return KERN_SUCCESS;
+    }
+
+    fakeSetNumber(dict, CFSTR("IOFakeIndex"), idx);
+    fakeSetNumber(dict, CFSTR("IOProbeScore"), idx % 1000);
+    snprintf(str, sizeof(str), "Fake \"device\"\t%u", idx);
+    fakeSetString(dict, CFSTR("IOFakeName"), str);
+    CFDictionarySetValue(dict, CFSTR("IOFakeEnabled"), idx & 1 ? kCFBooleanTrue : kCFBooleanFalse);
+
+    uint8_t *data = malloc(fake.propSize ? fake.propSize : 1);
+    if(data)
+    {
+        for(uint32_t i = 0; i < fake.propSize; ++i)
+        {
+            data[i] = (uint8_t)(idx + i * 31);
+        }
+        CFDataRef obj = CFDataCreate(NULL, data, fake.propSize);
+        if(obj)
+        {
+            CFDictionarySetValue(dict, CFSTR("IOFakeData"), obj);
+            CFRelease(obj);
+        }
+        free(data);
+    }
+
+    // Narrow numbers, negative on every other entry
+    int8_t  s8  = idx & 1 ? -(int8_t)(idx % 100)  : (int8_t)(idx % 100);
+    int16_t s16 = idx & 1 ? -(int16_t)(idx % 10000) : (int16_t)(idx % 10000);
+    int32_t s32 = idx & 1 ? -(int32_t)idx : (int32_t)idx;
+    CFNumberRef narrow[3] =
+    {
+        CFNumberCreate(NULL, kCFNumberSInt8Type, &s8),
+        CFNumberCreate(NULL, kCFNumberSInt16Type, &s16),
+        CFNumberCreate(NULL, kCFNumberSInt32Type, &s32),
+    };
+    if(narrow[0] && narrow[1] && narrow[2])
+    {
+        CFArrayRef arr = CFArrayCreate(NULL, (const void**)narrow, 3, &kCFTypeArrayCallBacks);
+        if(arr)
+        {
+            CFDictionarySetValue(dict, CFSTR("IOFakeSigned"), arr);
+            CFRelease(arr);
+        }
+    }
+    for(uint32_t i = 0; i < 3; ++i)
+    {
+        if(narrow[i]) CFRelease(narrow[i]);
+    }
+
+    long long vals[4] = { idx, (long long)idx * 1000, (long long)idx << 32, e->numChildren };
+    CFNumberRef nums[4] = {};
+    for(uint32_t i = 0; i < 4; ++i)
+    {
+        nums[i] = CFNumberCreate(NULL, kCFNumberLongLongType, &vals[i]);
+    }
+    if(nums[0] && nums[1] && nums[2] && nums[3])
+    {
+        CFArrayRef arr = CFArrayCreate(NULL, (const void**)nums, 4, &kCFTypeArrayCallBacks);
+        if(arr)
+        {
+            CFDictionarySetValue(dict, CFSTR("IOFakeArray"), arr);
+            CFRelease(arr);
+        }
+    }
+    for(uint32_t i = 0; i < 4; ++i)
+    {
+        if(nums[i]) CFRelease(nums[i]);
+    }
+
+    CFMutableDictionaryRef pm = fakeDict();
+    if(pm)
+    {
+        fakeSetNumber(pm, CFSTR("CurrentPowerState"), 2);
+        fakeSetNumber(pm, CFSTR("DevicePowerState"), 2);
+        fakeSetNumber(pm, CFSTR("MaxPowerState"), 2);
+        CFDictionarySetValue(dict, CFSTR("IOPowerManagement"), pm);
+        CFRelease(pm);
+    }
+    return KERN_SUCCESS;
+}
+
+static kern_return_t fakeProperties(io_object_t o, CFMutableDictionaryRef *props)
+{
+    uint32_t idx = fakeEntry(o),
+             gen = 0;
+    fake_client_t client;
+    if(idx != FAKE_NONE)
+    {
+        pthread_mutex_lock(&fake.lock);
+        gen = fake.entries[idx].gen;
+        pthread_mutex_unlock(&fake.lock);
+    }
+    if(idx != FAKE_NONE && fake.recorded)
+    {
+        const fake_entry_t *e = &fake.entries[idx];
+        if(e->propsRet != KERN_SUCCESS)
+        {
+            return e->propsRet;
+        }
+        CFTypeRef obj = IOCFUnserializeWithSize((const char*)e->props, e->propsLen, NULL, 0, NULL);
+        if(!obj || CFGetTypeID(obj) != CFDictionaryGetTypeID())
+        {
+            if(obj) CFRelease(obj);
+            return kIOReturnInternalError;
+        }
+        if(gen > 0)
+        {
+            fakeSetNumber((CFMutableDictionaryRef)obj, CFSTR("IOFakeGeneration"), gen);
+        }
+        *props = (CFMutableDictionaryRef)obj;
+        return KERN_SUCCESS;
+    }
+    if(idx == FAKE_NONE && !fakeClient(o, &client))
+    {
+        return kIOReturnBadArgument;
+    }
+
+    CFMutableDictionaryRef dict = fakeDict();
+    if(!dict)
+    {
+        return kIOReturnNoMemory;
+    }
+    kern_return_t ret = KERN_SUCCESS;
+    if(idx != FAKE_NONE)
+    {
+        ret = fakeSyntheticProperties(idx, gen, dict);
+    }
+    else
+    {
+        char str[0x40];
+        snprintf(str, sizeof(str), "pid %d, fake", getpid());
+        fakeSetString(dict, CFSTR("IOUserClientCreator"), str);
+        fakeSetString(dict, CFSTR("IOUserClientClass"), classtree_name(&fake.classes, client.class));
+    }
+    if(ret != KERN_SUCCESS)
+    {
+        CFRelease(dict);
+        return ret;
+    }
+    *props = dict;
+    return KERN_SUCCESS;
+}
+
+// ---------- Serialization ----------
+
+static void fakeSerializeItem(common_buf_t *buf, uint32_t type, uint32_t len, bool last, const void *data, size_t size)
+{
+    static const uint8_t zero[4] = {};
+    uint32_t key = type | len | (last ? kOSSerializeEndCollection : 0);
+    common_buf_write(buf, &key, sizeof(key));
+    if(size)
+    {
+        common_buf_write(buf, data, size);
+        common_buf_write(buf, zero, (4 - (size & 3)) & 3);
+    }
+}
+
+static bool fakeSerialize(common_buf_t *buf, CFTypeRef obj, bool last, unsigned depth)
+{
+    if(depth > FAKE_MAX_DEPTH)
+    {
+        return false;
+    }
+    CFTypeID type = CFGetTypeID(obj);
+    if(type == CFDictionaryGetTypeID())
+    {
+        CFIndex num = CFDictionaryGetCount(obj);
+        if((uint64_t)num > kOSSerializeDataMask)
+        {
+            return false;
+        }
+        const void **keys = malloc((num ? num : 1) * 2 * sizeof(*keys));
+        if(!keys)
+        {
+            return false;
+        }
+        const void **vals = keys + (num ? num : 1);
+        CFDictionaryGetKeysAndValues(obj, keys, vals);
+        fakeSerializeItem(buf, kOSSerializeDictionary, (uint32_t)num, last, NULL, 0);
+        bool succ = true;
+        for(CFIndex i = 0; succ && i < num; ++i)
+        {
+            if(CFGetTypeID(keys[i]) != CFStringGetTypeID())
+            {
+                succ = false;
+                break;
+            }
+            CFIndex max = CFStringGetMaximumSizeForEncoding(CFStringGetLength(keys[i]), kCFStringEncodingUTF8) + 1;
+            char *str = malloc(max);
+            succ = str && CFStringGetCString(keys[i], str, max, kCFStringEncodingUTF8);
+            size_t len = succ ? strlen(str) + 1 : 0;
+            succ = succ && len <= kOSSerializeDataMask;
+            if(succ)
+            {
+                fakeSerializeItem(buf, kOSSerializeSymbol, (uint32_t)len, false, str, len);
+                succ = fakeSerialize(buf, vals[i], i == num - 1, depth + 1);
+            }
+            free(str);
+        }
+        free(keys);
+        return succ;
+    }
+    if(type == CFArrayGetTypeID())
+    {
+        CFIndex num = CFArrayGetCount(obj);
+        if((uint64_t)num > kOSSerializeDataMask)
+        {
+            return false;
+        }
+        fakeSerializeItem(buf, kOSSerializeArray, (uint32_t)num, last, NULL, 0);
+        for(CFIndex i = 0; i < num; ++i)
+        {
+            if(!fakeSerialize(buf, CFArrayGetValueAtIndex(obj, i), i == num - 1, depth + 1))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    if(type == CFSetGetTypeID())
+    {
+        CFIndex num = CFSetGetCount(obj);
+        if((uint64_t)num > kOSSerializeDataMask)
+        {
+            return false;
+        }
+        const void **vals = malloc((num ? num : 1) * sizeof(*vals));
+        if(!vals)
+        {
+            return false;
+        }
+        CFSetGetValues(obj, vals);
+        fakeSerializeItem(buf, kOSSerializeSet, (uint32_t)num, last, NULL, 0);
+        bool succ = true;
+        for(CFIndex i = 0; succ && i < num; ++i)
+        {
+            succ = fakeSerialize(buf, vals[i], i == num - 1, depth + 1);
+        }
+        free(vals);
+        return succ;
+    }
+    if(type == CFStringGetTypeID())
+    {
+        CFIndex max = CFStringGetMaximumSizeForEncoding(CFStringGetLength(obj), kCFStringEncodingUTF8) + 1;
+        char *str = malloc(max);
+        bool succ = str && CFStringGetCString(obj, str, max, kCFStringEncodingUTF8);
+        size_t len = succ ? strlen(str) : 0;
+        succ = succ && len <= kOSSerializeDataMask;
+        if(succ)
+        {
+            fakeSerializeItem(buf, kOSSerializeString, (uint32_t)len, last, str, len);
+        }
+        free(str);
+        return succ;
+    }
+    if(type == CFDataGetTypeID())
+    {
+        CFIndex len = CFDataGetLength(obj);
+        if((uint64_t)len > kOSSerializeDataMask)
+        {
+            return false;
+        }
+        fakeSerializeItem(buf, kOSSerializeData, (uint32_t)len, last, CFDataGetBytePtr(obj), len);
+        return true;
+    }
+    if(type == CFNumberGetTypeID())
+    {
+        long long val = 0;
+        if(CFNumberIsFloatType(obj) || !CFNumberGetValue(obj, kCFNumberLongLongType, &val))
+        {
+            return false;
+        }
+        uint32_t bits = 64;
+        switch(CFNumberGetType(obj))
+        {
+            case kCFNumberSInt8Type:
+            case kCFNumberCharType:
+                bits = 8;
+                break;
+            case kCFNumberSInt16Type:
+            case kCFNumberShortType:
+                bits = 16;
+                break;
+            case kCFNumberSInt32Type:
+            case kCFNumberIntType:
+                bits = 32;
+                break;
+            default:
+                break;
+        }
+        fakeSerializeItem(buf, kOSSerializeNumber, bits, last, &val, sizeof(val));
+        return true;
+    }
+    if(type == CFBooleanGetTypeID())
+    {
+        fakeSerializeItem(buf, kOSSerializeBoolean, CFBooleanGetValue(obj) ? 1 : 0, last, NULL, 0);
+        return true;
+    }
+    return false;
+}
+
+CFDataRef IOCFSerialize(CFTypeRef object, CFOptionFlags options)
+{
+    if(!object || !(options & kIOCFSerializeToBinary))
+    {
+        return NULL;
+    }
+    common_buf_t buf;
+    common_buf_init(&buf, NULL);
+    uint32_t magic = kOSSerializeMagic;
+    common_buf_write(&buf, &magic, sizeof(magic));
+    CFDataRef data = NULL;
+    if(fakeSerialize(&buf, object, true, 0) && !buf.err)
+    {
+        data = CFDataCreate(NULL, (const UInt8*)buf.data, buf.len);
+    }
+    common_buf_free(&buf);
+    return data;
+}
+
+typedef struct
+{
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+    CFTypeRef *objs;
+    size_t numObjs;
+    size_t capObjs;
+} fake_unser_t;
+
+static bool fakeUnserWord(fake_unser_t *u, uint32_t *out)
+{
+    if(u->len - u->pos < sizeof(*out))
+    {
+        return false;
+    }
+    memcpy(out, u->buf + u->pos, sizeof(*out));
+    u->pos += sizeof(*out);
+    return true;
+}
+
+static const uint8_t* fakeUnserBytes(fake_unser_t *u, size_t size)
+{
+    size_t padded = (size + 3) & ~(size_t)3;
+    if(u->len - u->pos < padded)
+    {
+        return NULL;
+    }
+    const uint8_t *ptr = u->buf + u->pos;
+    u->pos += padded;
+    return ptr;
+}
+
+static bool fakeUnserAdd(fake_unser_t *u, CFTypeRef obj)
+{
+    if(u->numObjs >= u->capObjs)
+    {
+        size_t cap = u->capObjs ? u->capObjs * 2 : 0x40;
+        CFTypeRef *objs = realloc(u->objs, cap * sizeof(*objs));
+        if(!objs)
+        {
+            return false;
+        }
+        u->objs = objs;
+        u->capObjs = cap;
+    }
+    u->objs[u->numObjs++] = obj;
+    return true;
+}
+
+// Returns a retained object. Objects are recorded before their contents,
+// same as the kernel does, so back-references into parents are possible.
+static CFTypeRef fakeUnserialize(fake_unser_t *u, bool *last, unsigned depth)
+{
+    uint32_t key;
+    if(depth > FAKE_MAX_DEPTH || !fakeUnserWord(u, &key))
+    {
+        return NULL;
+    }
+    uint32_t len = key & kOSSerializeDataMask;
+    *last = !!(key & kOSSerializeEndCollection);
+
+    CFTypeRef obj = NULL;
+    const uint8_t *ptr = NULL;
+    switch(key & kOSSerializeTypeMask)
+    {
+        case kOSSerializeObject:
+            if(len >= u->numObjs)
+            {
+                return NULL;
+            }
+            return CFRetain(u->objs[len]);
+        case kOSSerializeDictionary:
+        {
+            CFMutableDictionaryRef dict = fakeDict();
+            if(!dict || !fakeUnserAdd(u, dict))
+            {
+                if(dict) CFRelease(dict);
+                return NULL;
+            }
+            bool end = len == 0;
+            while(!end)
+            {
+                bool dummy;
+                CFTypeRef k = fakeUnserialize(u, &dummy, depth + 1);
+                if(!k || CFGetTypeID(k) != CFStringGetTypeID())
+                {
+                    if(k) CFRelease(k);
+                    CFRelease(dict);
+                    return NULL;
+                }
+                CFTypeRef v = fakeUnserialize(u, &end, depth + 1);
+                if(!v)
+                {
+                    CFRelease(k);
+                    CFRelease(dict);
+                    return NULL;
+                }
+                CFDictionarySetValue(dict, k, v);
+                CFRelease(k);
+                CFRelease(v);
+            }
+            return dict;
+        }
+        // Sets come back as CFSet, same as from the real IOCFUnserialize
+        case kOSSerializeArray:
+        case kOSSerializeSet:
+        {
+            bool set = (key & kOSSerializeTypeMask) == kOSSerializeSet;
+            CFTypeRef coll = set ? (CFTypeRef)CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks) : (CFTypeRef)CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+            if(!coll || !fakeUnserAdd(u, coll))
+            {
+                if(coll) CFRelease(coll);
+                return NULL;
+            }
+            bool end = len == 0;
+            while(!end)
+            {
+                CFTypeRef v = fakeUnserialize(u, &end, depth + 1);
+                if(!v)
+                {
+                    CFRelease(coll);
+                    return NULL;
+                }
+                if(set)
+                {
+                    CFSetAddValue((CFMutableSetRef)coll, v);
+                }
+                else
+                {
+                    CFArrayAppendValue((CFMutableArrayRef)coll, v);
+                }
+                CFRelease(v);
+            }
+            return coll;
+        }
+        case kOSSerializeNumber:
+        {
+            uint64_t val;
+            if(!(ptr = fakeUnserBytes(u, sizeof(val))))
+            {
+                return NULL;
+            }
+            memcpy(&val, ptr, sizeof(val));
+            // Same as IOKit, narrow numbers come out signed
+            int8_t  v8  = (int8_t)val;
+            int16_t v16 = (int16_t)val;
+            int32_t v32 = (int32_t)val;
+            int64_t v64 = len == 0 ? 0 : len < 64 ? (int64_t)(val << (64 - len)) >> (64 - len) : (int64_t)val;
+            obj = len == 8  ? CFNumberCreate(NULL, kCFNumberSInt8Type,  &v8)  :
+                  len == 16 ? CFNumberCreate(NULL, kCFNumberSInt16Type, &v16) :
+                  len == 32 ? CFNumberCreate(NULL, kCFNumberSInt32Type, &v32) :
+                              CFNumberCreate(NULL, kCFNumberSInt64Type, &v64);
+            break;
+        }
+        case kOSSerializeSymbol:
+        case kOSSerializeString:
+            if(!(ptr = fakeUnserBytes(u, len)))
+            {
+                return NULL;
+            }
+            if((key & kOSSerializeTypeMask) == kOSSerializeSymbol && len > 0 && ptr[len - 1] == '\0')
+            {
+                --len;
+            }
+            obj = CFStringCreateWithBytes(NULL, ptr, len, kCFStringEncodingUTF8, false);
+            break;
+        case kOSSerializeData:
+            if(!(ptr = fakeUnserBytes(u, len)))
+            {
+                return NULL;
+            }
+            obj = CFDataCreate(NULL, ptr, len);
+            break;
+        case kOSSerializeBoolean:
+            obj = CFRetain(len ? kCFBooleanTrue : kCFBooleanFalse);
+            break;
+        default:
+            return NULL;
+    }
+    if(obj && !fakeUnserAdd(u, obj))
+    {
+        CFRelease(obj);
+        obj = NULL;
+    }
+    return obj;
+}
+
+CFTypeRef IOCFUnserializeWithSize(const char *buf, size_t len, CFAllocatorRef allocator, CFOptionFlags options, CFStringRef *err)
+{
+    fake_unser_t u =
+    {
+        .buf = (const uint8_t*)buf,
+        .len = buf ? len : 0,
+    };
+    uint32_t magic = 0;
+    bool last = false;
+    CFTypeRef obj = NULL;
+    if(fakeUnserWord(&u, &magic) && magic == kOSSerializeMagic)
+    {
+        obj = fakeUnserialize(&u, &last, 0);
+    }
+    free(u.objs);
+    if(!obj && err)
+    {
+        *err = CFStringCreateWithCString(NULL, "Invalid binary serialization", kCFStringEncodingUTF8);
+    }
+    return obj;
+}
+
+// ---------- Objects ----------
+
+// Must be called with the lock held.
+static void fakeNotifyFree(uint32_t slot)
+{
+    fake.notifs[slot] = (fake_notify_t){};
+    if(slot < fake.freeNotif)
+    {
+        fake.freeNotif = slot;
+    }
+}
+
+// Releasing the iterator of a matching notification also removes the notification.
+kern_return_t IOObjectRelease(io_object_t object)
+{
+    uint32_t kind = object & FAKE_PORT_KIND,
+             idx = object & FAKE_PORT_INDEX;
+    if(kind != FAKE_PORT_ITER && kind != FAKE_PORT_NOTIFY)
+    {
+        return KERN_SUCCESS;
+    }
+    kern_return_t ret = KERN_INVALID_ARGUMENT;
+    pthread_mutex_lock(&fake.lock);
+    if(kind == FAKE_PORT_NOTIFY)
+    {
+        if(idx < fake.numNotifs && fake.notifs[idx].port && fake.notifs[idx].type == FAKE_NOTIFY_INTEREST)
+        {
+            fakeNotifyFree(idx);
+            ret = KERN_SUCCESS;
+        }
+    }
+    else if(idx < fake.numIters && fake.iters[idx].used)
+    {
+        free(fake.iters[idx].objs);
+        fake.iters[idx] = (fake_iter_t){};
+        for(uint32_t i = 0; i < fake.numNotifs; ++i)
+        {
+            if(fake.notifs[i].port && fake.notifs[i].type != FAKE_NOTIFY_INTEREST && fake.notifs[i].it == object)
+            {
+                fakeNotifyFree(i);
+            }
+        }
+        ret = KERN_SUCCESS;
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return ret;
+}
+
+kern_return_t _IOObjectGetClass(io_object_t object, uint64_t options, io_name_t name)
+{
+    uint32_t class = fakeObjectClass(object);
+    if(class == FAKE_NONE)
+    {
+        return kIOReturnBadArgument;
+    }
+    snprintf(name, sizeof(io_name_t), "%s", classtree_name(&fake.classes, class));
+    return KERN_SUCCESS;
+}
+
+kern_return_t IOObjectGetClass(io_object_t object, io_name_t name)
+{
+    return _IOObjectGetClass(object, 0, name);
+}
+
+boolean_t IOObjectConformsTo(io_object_t object, const io_name_t name)
+{
+    uint32_t class = fakeObjectClass(object),
+             super = classtree_find(&fake.classes, name);
+    return class != FAKE_NONE && super != CLASSTREE_NONE && classtree_extends(&fake.classes, class, super);
+}
+
+static CFStringRef fakeClassString(CFStringRef name, bool bundle)
+{
+    fakeInit();
+    size_t len = 0;
+    const char *str = name ? cfj_cstr(name, &len) : NULL;
+    if(!str)
+    {
+        return NULL;
+    }
+    uint32_t class = classtree_find(&fake.classes, str);
+    if(class == CLASSTREE_NONE)
+    {
+        return NULL;
+    }
+    const char *ret = NULL;
+    if(bundle)
+    {
+        ret = classtree_bundle(&fake.classes, class);
+    }
+    else if(fake.classes.classes[class].super != CLASSTREE_NONE)
+    {
+        ret = classtree_name(&fake.classes, fake.classes.classes[class].super);
+    }
+    return ret && *ret ? CFStringCreateWithCString(NULL, ret, kCFStringEncodingUTF8) : NULL;
+}
+
+CFStringRef IOObjectCopySuperclassForClass(CFStringRef name)
+{
+    return fakeClassString(name, false);
+}
+
+CFStringRef IOObjectCopyBundleIdentifierForClass(CFStringRef name)
+{
+    return fakeClassString(name, true);
+}
+
+// ---------- Registry ----------
+
+io_registry_entry_t IORegistryGetRootEntry(mach_port_t master)
+{
+    fakeInit();
+    return FAKE_PORT_ENTRY | 0;
+}
+
+kern_return_t IORegistryEntryGetName(io_registry_entry_t entry, io_name_t name)
+{
+    if(fakeObjectClass(entry) == FAKE_NONE)
+    {
+        return kIOReturnBadArgument;
+    }
+    fakeName(entry, name);
+    return KERN_SUCCESS;
+}
+
+kern_return_t IORegistryEntryGetRegistryEntryID(io_registry_entry_t entry, uint64_t *entryID)
+{
+    uint32_t idx = fakeEntry(entry);
+    fake_client_t client;
+    if(idx != FAKE_NONE)
+    {
+        pthread_mutex_lock(&fake.lock);
+        *entryID = fake.entries[idx].id;
+        pthread_mutex_unlock(&fake.lock);
+        return KERN_SUCCESS;
+    }
+    if(fakeClient(entry, &client))
+    {
+        *entryID = FAKE_ID_BASE + fake.num + (entry & FAKE_PORT_INDEX);
+        return KERN_SUCCESS;
+    }
+    return kIOReturnBadArgument;
+}
+
+// Same format as the real one, minus locations. The root is just "Plane:/".
+kern_return_t IORegistryEntryGetPath(io_registry_entry_t entry, const io_name_t plane, io_string_t path)
+{
+    uint32_t idx = fakeEntry(entry);
+    fake_client_t client;
+    io_name_t name = "";
+    if(idx == FAKE_NONE)
+    {
+        if(!fakeClient(entry, &client))
+        {
+            return kIOReturnBadArgument;
+        }
+        fakeName(entry, name);
+        idx = client.entry;
+    }
+    uint32_t chain[FAKE_MAX_DEPTH],
+             num = 0;
+    for(; idx != 0 && idx < fake.num && num < FAKE_MAX_DEPTH; idx = fake.entries[idx].parent)
+    {
+        chain[num++] = idx;
+    }
+    size_t len = snprintf(path, sizeof(io_string_t), "%s:", plane);
+    if(num == 0 && !name[0])
+    {
+        len += snprintf(path + len, sizeof(io_string_t) - len, "/");
+    }
+    while(num > 0 && len < sizeof(io_string_t))
+    {
+        io_name_t part;
+        fakeName(FAKE_PORT_ENTRY | chain[--num], part);
+        len += snprintf(path + len, sizeof(io_string_t) - len, "/%s", part);
+    }
+    if(name[0] && len < sizeof(io_string_t))
+    {
+        len += snprintf(path + len, sizeof(io_string_t) - len, "/%s", name);
+    }
+    return len < sizeof(io_string_t) ? KERN_SUCCESS : kIOReturnNoSpace;
+}
+
+kern_return_t IORegistryEntryCreateCFProperties(io_registry_entry_t entry, CFMutableDictionaryRef *properties, CFAllocatorRef allocator, uint32_t options)
+{
+    return fakeProperties(entry, properties);
+}
+
+CFTypeRef IORegistryEntryCreateCFProperty(io_registry_entry_t entry, CFStringRef key, CFAllocatorRef allocator, uint32_t options)
+{
+    CFMutableDictionaryRef props = NULL;
+    if(fakeProperties(entry, &props) != KERN_SUCCESS)
+    {
+        return NULL;
+    }
+    CFTypeRef val = CFDictionaryGetValue(props, key);
+    if(val)
+    {
+        CFRetain(val);
+    }
+    CFRelease(props);
+    return val;
+}
+
+kern_return_t IORegistryEntryGetProperty(io_registry_entry_t entry, const io_name_t name, io_struct_inband_t buffer, uint32_t *size)
+{
+    CFStringRef key = CFStringCreateWithCString(NULL, name, kCFStringEncodingUTF8);
+    if(!key)
+    {
+        return kIOReturnNoMemory;
+    }
+    CFTypeRef val = IORegistryEntryCreateCFProperty(entry, key, NULL, 0);
+    CFRelease(key);
+    if(!val)
+    {
+        return kIOReturnNotFound;
+    }
+    kern_return_t ret = KERN_SUCCESS;
+    if(CFGetTypeID(val) == CFStringGetTypeID())
+    {
+        if(!CFStringGetCString(val, buffer, *size, kCFStringEncodingUTF8))
+        {
+            ret = kIOReturnNoSpace;
+        }
+        else
+        {
+            *size = (uint32_t)strlen(buffer) + 1;
+        }
+    }
+    else if(CFGetTypeID(val) == CFDataGetTypeID())
+    {
+        CFIndex len = CFDataGetLength(val);
+        if((uint64_t)len > *size)
+        {
+            ret = kIOReturnNoSpace;
+        }
+        else
+        {
+            memcpy(buffer, CFDataGetBytePtr(val), len);
+            *size = (uint32_t)len;
+        }
+    }
+    else
+    {
+        ret = kIOReturnBadArgument;
+    }
+    CFRelease(val);
+    return ret;
+}
+
+kern_return_t IORegistryEntrySetCFProperties(io_registry_entry_t entry, CFTypeRef properties)
+{
+    return kIOReturnUnsupported;
+}
+
+// ---------- Iterators ----------
+
+kern_return_t IORegistryEntryGetChildIterator(io_registry_entry_t entry, const io_name_t plane, io_iterator_t *it)
+{
+    uint32_t idx = fakeEntry(entry);
+    fake_client_t client;
+    if(idx == FAKE_NONE)
+    {
+        if(!fakeClient(entry, &client))
+        {
+            return kIOReturnBadArgument;
+        }
+        *it = fakeIterator(NULL, 0);
+        return MACH_PORT_VALID(*it) ? KERN_SUCCESS : kIOReturnNoMemory;
+    }
+    pthread_mutex_lock(&fake.lock);
+    uint32_t max = fake.entries[idx].numChildren + fake.numClients;
+    io_object_t *objs = malloc((max ? max : 1) * sizeof(*objs));
+    uint32_t num = objs ? fakeChildren(idx, objs, max) : 0;
+    pthread_mutex_unlock(&fake.lock);
+    if(!objs)
+    {
+        return kIOReturnNoMemory;
+    }
+    *it = fakeIterator(objs, num);
+    return MACH_PORT_VALID(*it) ? KERN_SUCCESS : kIOReturnNoMemory;
+}
+
+// Preorder, root excluded. Must be called with the lock held.
+static io_object_t* fakePreorder(uint32_t *count)
+{
+    uint32_t max = fake.num + fake.numClients;
+    io_object_t *objs = malloc(max * sizeof(*objs)),
+                *stack = malloc(max * sizeof(*stack));
+    if(!objs || !stack)
+    {
+        free(objs);
+        free(stack);
+        return NULL;
+    }
+    // Children are pushed in reverse so they pop in order.
+    uint32_t num = 0,
+             sp = fakeChildren(0, stack, max);
+    for(uint32_t i = 0, j = sp - 1; sp != FAKE_NONE && i < j; ++i, --j)
+    {
+        io_object_t tmp = stack[i];
+        stack[i] = stack[j];
+        stack[j] = tmp;
+    }
+    while(sp != FAKE_NONE && sp > 0)
+    {
+        io_object_t o = stack[--sp];
+        objs[num++] = o;
+        if((o & FAKE_PORT_KIND) == FAKE_PORT_ENTRY)
+        {
+            uint32_t n = fakeChildren(o & FAKE_PORT_INDEX, stack + sp, max - sp);
+            if(n == FAKE_NONE)
+            {
+                // Only possible if the snapshot is not a tree
+                break;
+            }
+            for(uint32_t i = sp, j = sp + n - 1; n && i < j; ++i, --j)
+            {
+                io_object_t tmp = stack[i];
+                stack[i] = stack[j];
+                stack[j] = tmp;
+            }
+            sp += n;
+        }
+        if(num >= max)
+        {
+            break;
+        }
+    }
+    free(stack);
+    *count = num;
+    return objs;
+}
+
+kern_return_t IORegistryCreateIterator(mach_port_t master, const io_name_t plane, uint32_t options, io_iterator_t *it)
+{
+    if(!(options & kIORegistryIterateRecursively))
+    {
+        return IORegistryEntryGetChildIterator(IORegistryGetRootEntry(master), plane, it);
+    }
+    fakeInit();
+    uint32_t num = 0;
+    pthread_mutex_lock(&fake.lock);
+    io_object_t *objs = fakePreorder(&num);
+    pthread_mutex_unlock(&fake.lock);
+    if(!objs)
+    {
+        return kIOReturnNoMemory;
+    }
+    *it = fakeIterator(objs, num);
+    return MACH_PORT_VALID(*it) ? KERN_SUCCESS : kIOReturnNoMemory;
+}
+
+static CFMutableDictionaryRef fakeMatching(CFStringRef key, const char *name)
+{
+    CFMutableDictionaryRef dict = fakeDict();
+    if(dict)
+    {
+        fakeSetString(dict, key, name);
+    }
+    return dict;
+}
+
+CFMutableDictionaryRef IOServiceMatching(const char *name)
+{
+    return fakeMatching(CFSTR("IOProviderClass"), name);
+}
+
+CFMutableDictionaryRef IOServiceNameMatching(const char *name)
+{
+    return fakeMatching(CFSTR("IONameMatch"), name);
+}
+
+// Only IOProviderClass and IONameMatch with a single string are supported. Consumes the dict.
+static kern_return_t fakeMatchInit(CFDictionaryRef matching, fake_match_t *m)
+{
+    fakeInit();
+    if(!matching)
+    {
+        return kIOReturnBadArgument;
+    }
+    CFStringRef val = CFDictionaryGetValue(matching, CFSTR("IOProviderClass"));
+    m->hasClass = val && CFGetTypeID(val) == CFStringGetTypeID() && CFStringGetCString(val, m->class, sizeof(m->class), kCFStringEncodingUTF8);
+    val = CFDictionaryGetValue(matching, CFSTR("IONameMatch"));
+    m->hasName = val && CFGetTypeID(val) == CFStringGetTypeID() && CFStringGetCString(val, m->name, sizeof(m->name), kCFStringEncodingUTF8);
+    CFRelease(matching);
+    return m->hasClass || m->hasName ? KERN_SUCCESS : kIOReturnUnsupported;
+}
+
+static bool fakeMatchTest(const fake_match_t *m, io_object_t o)
+{
+    if(!IOObjectConformsTo(o, "IOService") || (m->hasClass && !IOObjectConformsTo(o, m->class)))
+    {
+        return false;
+    }
+    if(m->hasName)
+    {
+        io_name_t buf;
+        fakeName(o, buf);
+        if(strcmp(buf, m->name) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static io_iterator_t fakeMatchIterator(const fake_match_t *m)
+{
+    uint32_t num = 0;
+    pthread_mutex_lock(&fake.lock);
+    io_object_t *objs = fakePreorder(&num);
+    pthread_mutex_unlock(&fake.lock);
+    if(!objs)
+    {
+        return MACH_PORT_NULL;
+    }
+    uint32_t out = 0;
+    for(uint32_t i = 0; i < num; ++i)
+    {
+        if(fakeMatchTest(m, objs[i]))
+        {
+            objs[out++] = objs[i];
+        }
+    }
+    return fakeIterator(objs, out);
+}
+
+kern_return_t IOServiceGetMatchingServices(mach_port_t master, CFDictionaryRef matching, io_iterator_t *it)
+{
+    fake_match_t m;
+    kern_return_t ret = fakeMatchInit(matching, &m);
+    if(ret != KERN_SUCCESS)
+    {
+        return ret;
+    }
+    *it = fakeMatchIterator(&m);
+    return MACH_PORT_VALID(*it) ? KERN_SUCCESS : kIOReturnNoMemory;
+}
+
+io_object_t IOIteratorNext(io_iterator_t it)
+{
+    uint32_t idx = it & FAKE_PORT_INDEX;
+    io_object_t o = MACH_PORT_NULL;
+    if((it & FAKE_PORT_KIND) != FAKE_PORT_ITER)
+    {
+        return o;
+    }
+    pthread_mutex_lock(&fake.lock);
+    if(idx < fake.numIters && fake.iters[idx].used && fake.iters[idx].pos < fake.iters[idx].num)
+    {
+        o = fake.iters[idx].objs[fake.iters[idx].pos++];
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return o;
+}
+
+// ---------- Notifications ----------
+
+// Must be called with the lock held. Returns FAKE_NONE if out of memory.
+static uint32_t fakeNotifySlot(void)
+{
+    uint32_t slot = fake.freeNotif;
+    while(slot < fake.numNotifs && fake.notifs[slot].port)
+    {
+        ++slot;
+    }
+    if(slot == fake.numNotifs)
+    {
+        uint32_t cap = fake.numNotifs ? fake.numNotifs * 2 : 0x100;
+        fake_notify_t *notifs = cap <= FAKE_PORT_INDEX ? realloc(fake.notifs, cap * sizeof(*notifs)) : NULL;
+        if(!notifs)
+        {
+            return FAKE_NONE;
+        }
+        memset(notifs + fake.numNotifs, 0, (cap - fake.numNotifs) * sizeof(*notifs));
+        fake.notifs = notifs;
+        fake.numNotifs = cap;
+    }
+    fake.freeNotif = slot + 1;
+    return slot;
+}
+
+// Preorder list of idx and everything below it that is gone (or not).
+// Must be called with the lock held.
+static uint32_t* fakeSubtree(uint32_t idx, bool gone, uint32_t *count)
+{
+    uint32_t *list = malloc(fake.num * sizeof(*list)),
+             *stack = malloc(fake.num * sizeof(*stack));
+    if(!list || !stack)
+    {
+        free(list);
+        free(stack);
+        return NULL;
+    }
+    uint32_t num = 0,
+             sp = 0;
+    stack[sp++] = idx;
+    // Bounded by the number of entries, in case a snapshot is not a tree.
+    while(sp > 0 && num < fake.num)
+    {
+        uint32_t cur = stack[--sp];
+        const fake_entry_t *e = &fake.entries[cur];
+        list[num++] = cur;
+        for(uint32_t i = e->numChildren; i-- > 0 && sp < fake.num; )
+        {
+            uint32_t child = fakeChild(e, i);
+            if(fake.entries[child].gone == gone)
+            {
+                stack[sp++] = child;
+            }
+        }
+    }
+    free(stack);
+    *count = num;
+    return list;
+}
+
+typedef struct
+{
+    uint32_t slot;
+    io_object_t obj;        // for interest notifications
+} fake_delivery_t;
+
+static bool fakeDelivery(fake_delivery_t **out, uint32_t *num, uint32_t *cap, uint32_t slot, io_object_t obj)
+{
+    if(*num >= *cap)
+    {
+        uint32_t newCap = *cap ? *cap * 2 : 0x40;
+        fake_delivery_t *tmp = realloc(*out, newCap * sizeof(*tmp));
+        if(!tmp)
+        {
+            return false;
+        }
+        *out = tmp;
+        *cap = newCap;
+    }
+    (*out)[(*num)++] = (fake_delivery_t){ .slot = slot, .obj = obj };
+    return true;
+}
+
+// Runs on the run loop. Applies one scripted change, then calls everyone who is
+// interested in it, without the lock held so that callbacks can use the registry.
+static void fakeApply(IONotificationPortRef port, char op, uint32_t idx)
+{
+    pthread_mutex_lock(&fake.lock);
+    const fake_entry_t *e = &fake.entries[idx];
+    bool valid = op == 'r' ? idx != 0 && !e->gone :
+                 op == 'a' ? e->gone && (e->parent >= fake.num || !fake.entries[e->parent].gone) :
+                 !e->gone;
+    uint32_t num = 0;
+    uint32_t *list = valid ? fakeSubtree(idx, op == 'a', &num) : NULL;
+    bool *hit = list ? calloc(fake.num, sizeof(*hit)) : NULL;
+    if(list && op == 's')
+    {
+        num = 1;
+    }
+    for(uint32_t i = 0; hit && i < num; ++i)
+    {
+        fake_entry_t *cur = &fake.entries[list[i]];
+        hit[list[i]] = true;
+        if(op == 'r')
+        {
+            cur->gone = true;
+        }
+        else if(op == 'a')
+        {
+            cur->gone = false;
+            cur->id = fake.nextId++;
+        }
+        else
+        {
+            ++cur->gen;
+        }
+    }
+
+    fake_delivery_t *out = NULL;
+    uint32_t numOut = 0,
+             capOut = 0;
+    bool succ = hit != NULL;
+    // Interest messages go out while services terminate, matching notifications after.
+    for(uint32_t i = 0; succ && op != 'a' && i < fake.numNotifs; ++i)
+    {
+        const fake_notify_t *n = &fake.notifs[i];
+        if(n->port == port && n->type == FAKE_NOTIFY_INTEREST && hit[n->entry])
+        {
+            succ = fakeDelivery(&out, &numOut, &capOut, i, FAKE_PORT_ENTRY | n->entry);
+        }
+    }
+    for(uint32_t i = 0; succ && op != 's' && i < fake.numNotifs; ++i)
+    {
+        const fake_notify_t *n = &fake.notifs[i];
+        if(n->port != port || n->type != (op == 'a' ? FAKE_NOTIFY_FIRST : FAKE_NOTIFY_TERMINATED))
+        {
+            continue;
+        }
+        // Parents are published before and terminated after their children.
+        bool any = false;
+        for(uint32_t j = 0; succ && j < num; ++j)
+        {
+            io_object_t o = FAKE_PORT_ENTRY | list[op == 'a' ? j : num - 1 - j];
+            if(fakeMatchTest(&n->match, o))
+            {
+                succ = fakeIterAppend(n->it, o);
+                any = true;
+            }
+        }
+        if(succ && any)
+        {
+            succ = fakeDelivery(&out, &numOut, &capOut, i, MACH_PORT_NULL);
+        }
+    }
+    pthread_mutex_unlock(&fake.lock);
+    if(valid && !succ)
+    {
+        ERR(COLOR_RED "Failed to allocate notifications." COLOR_RESET);
+    }
+    free(hit);
+    free(list);
+
+    for(uint32_t i = 0; i < numOut; ++i)
+    {
+        // Earlier callbacks may have removed this one.
+        pthread_mutex_lock(&fake.lock);
+        fake_notify_t n = fake.notifs[out[i].slot];
+        pthread_mutex_unlock(&fake.lock);
+        if(n.port != port)
+        {
+            continue;
+        }
+        if(n.type == FAKE_NOTIFY_INTEREST)
+        {
+            n.interest(n.refcon, out[i].obj, op == 'r' ? kIOMessageServiceIsTerminated : kIOMessageServicePropertyChange, NULL);
+        }
+        else
+        {
+            n.matched(n.refcon, n.it);
+        }
+    }
+    free(out);
+}
+
+static void fakePerform(void *info)
+{
+    IONotificationPortRef port = info;
+    pthread_mutex_lock(&fake.lock);
+    bool pending = port->pending;
+    char op = port->op;
+    uint32_t idx = port->idx;
+    pthread_mutex_unlock(&fake.lock);
+    if(!pending)
+    {
+        return;
+    }
+    if(op == 'q')
+    {
+        CFRunLoopStop(CFRunLoopGetCurrent());
+    }
+    else
+    {
+        fakeApply(port, op, idx);
+    }
+    pthread_mutex_lock(&fake.lock);
+    port->pending = false;
+    pthread_cond_broadcast(&port->cond);
+    pthread_mutex_unlock(&fake.lock);
+}
+
+// Hands one event to the run loop and waits until it has been delivered.
+// Returns false if the port was destroyed in the meantime.
+static bool fakePost(IONotificationPortRef port, char op, uint32_t idx)
+{
+    pthread_mutex_lock(&fake.lock);
+    port->op = op;
+    port->idx = idx;
+    port->pending = true;
+    pthread_mutex_unlock(&fake.lock);
+    CFRunLoopSourceSignal(port->source);
+    CFRunLoopWakeUp(port->loop);
+    pthread_mutex_lock(&fake.lock);
+    while(port->pending && !port->dead)
+    {
+        pthread_cond_wait(&port->cond, &fake.lock);
+    }
+    bool alive = !port->dead;
+    pthread_mutex_unlock(&fake.lock);
+    return alive;
+}
+
+static void* fakeScript(void *arg)
+{
+    IONotificationPortRef port = arg;
+    const char *path = getenv("IOFAKE_EVENTS");
+    FILE *f = fopen(path, "r");
+    if(!f)
+    {
+        ERR(COLOR_RED "Failed to open %s: %s" COLOR_RESET, path, strerror(errno));
+    }
+    char line[0x100];
+    bool alive = true;
+    while(f && alive && fgets(line, sizeof(line), f))
+    {
+        char *str = line + strspn(line, " \t");
+        str[strcspn(str, "\r\n")] = '\0';
+        if(*str == '\0' || *str == '#')
+        {
+            continue;
+        }
+        char op[0x10];
+        unsigned long val = 0;
+        char kind = '\0';
+        if(sscanf(str, "%15s %lu", op, &val) == 2)
+        {
+            kind = strcmp(op, "remove") == 0 ? 'r' :
+                   strcmp(op, "add")    == 0 ? 'a' :
+                   strcmp(op, "set")    == 0 ? 's' :
+                   strcmp(op, "sleep")  == 0 ? 'z' : '\0';
+        }
+        if(kind == 'z')
+        {
+            struct timespec ts = { .tv_sec = val / 1000, .tv_nsec = (val % 1000) * 1000000 };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        if(kind == '\0' || val >= fake.num)
+        {
+            ERR(COLOR_RED "Invalid event: %s" COLOR_RESET, str);
+            break;
+        }
+        alive = fakePost(port, kind, (uint32_t)val);
+    }
+    if(f)
+    {
+        fclose(f);
+    }
+    if(alive)
+    {
+        fakePost(port, 'q', 0);
+    }
+    return NULL;
+}
+
+static void fakeSchedule(void *info, CFRunLoopRef loop, CFStringRef mode)
+{
+    IONotificationPortRef port = info;
+    const char *path = getenv("IOFAKE_EVENTS");
+    if(port->started || !path || !*path)
+    {
+        return;
+    }
+    port->loop = loop;
+    int r = pthread_create(&port->thread, NULL, &fakeScript, port);
+    if(r != 0)
+    {
+        ERR(COLOR_RED "Failed to spawn event thread: %s" COLOR_RESET, strerror(r));
+        return;
+    }
+    port->started = true;
+}
+
+IONotificationPortRef IONotificationPortCreate(mach_port_t master)
+{
+    fakeInit();
+    IONotificationPortRef port = calloc(1, sizeof(*port));
+    if(port)
+    {
+        pthread_cond_init(&port->cond, NULL);
+    }
+    return port;
+}
+
+CFRunLoopSourceRef IONotificationPortGetRunLoopSource(IONotificationPortRef port)
+{
+    if(!port->source)
+    {
+        CFRunLoopSourceContext ctx =
+        {
+            .version = 0,
+            .info = port,
+            .schedule = &fakeSchedule,
+            .perform = &fakePerform,
+        };
+        port->source = CFRunLoopSourceCreate(NULL, 0, &ctx);
+    }
+    return port->source;
+}
+
+void IONotificationPortDestroy(IONotificationPortRef port)
+{
+    if(!port)
+    {
+        return;
+    }
+    pthread_mutex_lock(&fake.lock);
+    port->dead = true;
+    pthread_cond_broadcast(&port->cond);
+    for(uint32_t i = 0; i < fake.numNotifs; ++i)
+    {
+        if(fake.notifs[i].port == port)
+        {
+            fakeNotifyFree(i);
+        }
+    }
+    pthread_mutex_unlock(&fake.lock);
+    if(port->started)
+    {
+        pthread_join(port->thread, NULL);
+    }
+    if(port->source)
+    {
+        CFRunLoopSourceInvalidate(port->source);
+        CFRelease(port->source);
+    }
+    pthread_cond_destroy(&port->cond);
+    free(port);
+}
+
+kern_return_t IOServiceAddMatchingNotification(IONotificationPortRef port, const io_name_t type, CFDictionaryRef matching, IOServiceMatchingCallback callback, void *refcon, io_iterator_t *it)
+{
+    fake_notify_t n =
+    {
+        .port = port,
+        .matched = callback,
+        .refcon = refcon,
+    };
+    kern_return_t ret = fakeMatchInit(matching, &n.match);
+    if(ret != KERN_SUCCESS)
+    {
+        return ret;
+    }
+    if(!port || !callback)
+    {
+        return kIOReturnBadArgument;
+    }
+    if(strcmp(type, kIOFirstMatchNotification) == 0)
+    {
+        n.type = FAKE_NOTIFY_FIRST;
+        n.it = fakeMatchIterator(&n.match);
+    }
+    else if(strcmp(type, kIOTerminatedNotification) == 0)
+    {
+        n.type = FAKE_NOTIFY_TERMINATED;
+        n.it = fakeIterator(NULL, 0);
+    }
+    else
+    {
+        return kIOReturnUnsupported;
+    }
+    if(!MACH_PORT_VALID(n.it))
+    {
+        return kIOReturnNoMemory;
+    }
+    pthread_mutex_lock(&fake.lock);
+    uint32_t slot = fakeNotifySlot();
+    if(slot != FAKE_NONE)
+    {
+        fake.notifs[slot] = n;
+    }
+    pthread_mutex_unlock(&fake.lock);
+    if(slot == FAKE_NONE)
+    {
+        IOObjectRelease(n.it);
+        return kIOReturnNoMemory;
+    }
+    *it = n.it;
+    return KERN_SUCCESS;
+}
+
+kern_return_t IOServiceAddInterestNotification(IONotificationPortRef port, io_service_t service, const io_name_t type, IOServiceInterestCallback callback, void *refcon, io_object_t *notification)
+{
+    uint32_t idx = fakeEntry(service);
+    if(!port || !callback || idx == FAKE_NONE)
+    {
+        return kIOReturnBadArgument;
+    }
+    if(strcmp(type, kIOGeneralInterest) != 0)
+    {
+        return kIOReturnUnsupported;
+    }
+    pthread_mutex_lock(&fake.lock);
+    uint32_t slot = fakeNotifySlot();
+    if(slot != FAKE_NONE)
+    {
+        fake.notifs[slot] = (fake_notify_t)
+        {
+            .port = port,
+            .type = FAKE_NOTIFY_INTEREST,
+            .entry = idx,
+            .interest = callback,
+            .refcon = refcon,
+        };
+    }
+    pthread_mutex_unlock(&fake.lock);
+    if(slot == FAKE_NONE)
+    {
+        return kIOReturnNoMemory;
+    }
+    *notification = FAKE_PORT_NOTIFY | slot;
+    return KERN_SUCCESS;
+}
+
+// ---------- User clients ----------
+
+kern_return_t IOServiceOpen(io_service_t service, task_t task, uint32_t type, io_connect_t *client)
+{
+    uint32_t idx = fakeEntry(service);
+    if(idx == FAKE_NONE)
+    {
+        return kIOReturnBadArgument;
+    }
+    if(idx % 4 == 3 && type == 0)
+    {
+        return kIOReturnNotPrivileged;
+    }
+    if(idx % 4 != 1 || type >= fake.types)
+    {
+        return kIOReturnUnsupported;
+    }
+    pthread_mutex_lock(&fake.lock);
+    uint32_t slot = 0;
+    while(slot < fake.numClients && fake.clients[slot].entry != FAKE_NONE)
+    {
+        ++slot;
+    }
+    if(slot == fake.numClients)
+    {
+        uint32_t cap = fake.numClients ? fake.numClients * 2 : 0x10;
+        if(cap > FAKE_CLIENT_SLOT + 1)
+        {
+            pthread_mutex_unlock(&fake.lock);
+            return kIOReturnNoMemory;
+        }
+        fake_client_t *clients = realloc(fake.clients, cap * sizeof(*clients));
+        if(!clients)
+        {
+            pthread_mutex_unlock(&fake.lock);
+            return kIOReturnNoMemory;
+        }
+        for(uint32_t i = fake.numClients; i < cap; ++i)
+        {
+            clients[i].entry = FAKE_NONE;
+            clients[i].gen = 0;
+        }
+        fake.clients = clients;
+        fake.numClients = cap;
+    }
+    fake.clients[slot].entry = idx;
+    fake.clients[slot].class = fake.ucClass + type;
+    fake.clients[slot].gen = (fake.clients[slot].gen + 1) & (FAKE_PORT_INDEX >> FAKE_CLIENT_GEN);
+    *client = FAKE_PORT_CLIENT | (fake.clients[slot].gen << FAKE_CLIENT_GEN) | slot;
+    pthread_mutex_unlock(&fake.lock);
+    return KERN_SUCCESS;
+}
+
+kern_return_t IOServiceClose(io_connect_t client)
+{
+    uint32_t idx = client & FAKE_CLIENT_SLOT;
+    kern_return_t ret = kIOReturnBadArgument;
+    if((client & FAKE_PORT_KIND) != FAKE_PORT_CLIENT)
+    {
+        return ret;
+    }
+    pthread_mutex_lock(&fake.lock);
+    if(idx < fake.numClients && fake.clients[idx].entry != FAKE_NONE && fake.clients[idx].gen == (client & FAKE_PORT_INDEX) >> FAKE_CLIENT_GEN)
+    {
+        fake.clients[idx].entry = FAKE_NONE;
+        ret = KERN_SUCCESS;
+    }
+    pthread_mutex_unlock(&fake.lock);
+    return ret;
+}
+
+// ---------- Mach ----------
+
+task_t mach_task_self(void)
+{
+    return 1;
+}
+
+const char* mach_error_string(kern_return_t ret)
+{
+    switch(ret)
+    {
+        case KERN_SUCCESS:              return "(os/kern) successful";
+        case KERN_INVALID_ARGUMENT:     return "(os/kern) invalid argument";
+        case KERN_FAILURE:              return "(os/kern) failure";
+        case kIOReturnNoMemory:         return "(iokit/common) memory allocation error";
+        case kIOReturnNotPrivileged:    return "(iokit/common) privilege violation";
+        case kIOReturnBadArgument:      return "(iokit/common) invalid argument";
+        case kIOReturnUnsupported:      return "(iokit/common) unsupported function";
+        case kIOReturnInternalError:    return "(iokit/common) internal error";
+        case kIOReturnNoSpace:          return "(iokit/common) no space available";
+        case kIOReturnNotFound:         return "(iokit/common) data was not found";
+    }
+    return "unknown error code";
+}
+
+int sysctlbyname(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen)
+{
+    fakeInit();
+    char buf[0x200];
+    if(strcmp(name, "kern.uuid") == 0)
+    {
+        snprintf(buf, sizeof(buf), "00000000-0000-0000-0000-%012x", fake.num);
+    }
+    else if(strcmp(name, "kern.version") == 0)
+    {
+        const char *path = getenv("IOFAKE_SNAPSHOT");
+        if(fake.recorded)
+        {
+            snprintf(buf, sizeof(buf), "Fake IOKit: snapshot %s", path);
+        }
+        else
+        {
+            snprintf(buf, sizeof(buf), "Fake IOKit: %u entries, depth %u, %u types", fake.num, fake.depth, fake.types);
+        }
+    }
+    else
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    size_t len = strlen(buf) + 1;
+    if(newp)
+    {
+        errno = EPERM;
+        return -1;
+    }
+    if(oldp)
+    {
+        if(*oldlenp < len)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(oldp, buf, len);
+    }
+    *oldlenp = len;
+    return 0;
+}
@@ -0,0 +1,36 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+// Just enough of <mach/mach.h> for the tools to build against the fake backend.
+
+#ifndef FAKE_MACH_H
+#define FAKE_MACH_H
+
+#include <stdint.h>
+
+typedef uint32_t mach_port_t;
+typedef mach_port_t task_t;
+typedef int kern_return_t;
+typedef int boolean_t;
+typedef uint64_t mach_vm_address_t;
+typedef uint64_t mach_vm_size_t;
+
+#define KERN_SUCCESS            0
+#define KERN_INVALID_ARGUMENT   4
+#define KERN_FAILURE            5
+
+#define MACH_PORT_NULL          ((mach_port_t)0)
+#define MACH_PORT_DEAD          ((mach_port_t)~0)
+#define MACH_PORT_VALID(name)   ((name) != MACH_PORT_NULL && (name) != MACH_PORT_DEAD)
+
+const char* mach_error_string(kern_return_t ret);
+task_t mach_task_self(void);
+
+#endif
@@ -0,0 +1 @@
+#include "mach.h"
@@ -0,0 +1,222 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+// Fuzz target for the OSSerialize decoder and the compact dump reader. Built for libFuzzer by default,
+// or with -DFUZZ_STANDALONE as a small mutating driver for other compilers.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common.h"
+#include "../compact.h"
+#include "../oss.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static oss_t oss;
+    static compact_reader_t r;
+    static common_buf_t expect, flat;
+    static bool init = false;
+    if(!init)
+    {
+        oss_init(&oss);
+        compact_reader_init(&r);
+        common_buf_init(&expect, NULL);
+        common_buf_init(&flat, NULL);
+        init = true;
+    }
+    // Anything that prints has to print the same after flattening.
+    if(oss_format(&oss, data, size, true, false))
+    {
+        uint32_t magic = OSS_MAGIC;
+        expect.len = 0;
+        common_buf_write(&expect, oss.out.data, oss.out.len);
+        flat.len = 0;
+        common_buf_write(&flat, &magic, sizeof(magic));
+        if(!oss_flatten(&oss, data, size, &flat) ||
+           !oss_format(&oss, (const uint8_t*)flat.data, flat.len, true, false) ||
+           oss.out.len != expect.len || memcmp(oss.out.data, expect.data, expect.len) != 0)
+        {
+            abort();
+        }
+    }
+    oss_format(&oss, data, size, false, true);
+    if(compact_reader_open(&r, data, size))
+    {
+        compact_entry_t e;
+        while(compact_reader_next(&r, &e))
+        {
+            compact_reader_props(&r, &e, true, false);
+        }
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+// {"a": [1, "b", <01>], "b": true, "c": {"a": ref to the array}, ref to "b": ref to "c"}
+static const uint32_t seed[] =
+{
+    0x000000d3,
+    0x01000004,
+    0x08000002, 0x61,
+    0x02000003,
+    0x04000040, 0x1, 0x0,
+    0x09000001, 0x62,
+    0x8a000001, 0x1,
+    0x08000002, 0x62,
+    0x0b000001,
+    0x08000002, 0x63,
+    0x01000001,
+    0x0c000001,
+    0x8c000002,
+    0x0c000006,
+    0x8c000009,
+};
+
+static uint32_t fuzzRand(uint32_t *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+int main(int argc, const char **argv)
+{
+    unsigned long iter = 0;
+    int aoff = 1;
+    if(argc > 2 && strcmp(argv[1], "-n") == 0)
+    {
+        iter = strtoul(argv[2], NULL, 0);
+        aoff = 3;
+    }
+    if(aoff < argc && argv[aoff][0] == '-')
+    {
+        fprintf(stderr, "Usage: %s [-n iterations] [file...]\n"
+                        "    Runs every file once, then mutates them (or a built-in seed) for the given number of iterations.\n"
+                        , argv[0]);
+        return strcmp(argv[aoff], "-h") == 0 ? 0 : -1;
+    }
+
+    size_t numInputs = argc > aoff ? argc - aoff : 1;
+    uint8_t **inputs = calloc(numInputs, sizeof(*inputs));
+    size_t *sizes = calloc(numInputs, sizeof(*sizes));
+    size_t maxSize = sizeof(seed);
+    if(!inputs || !sizes)
+    {
+        ERR(COLOR_RED "Failed to allocate inputs." COLOR_RESET);
+        return -1;
+    }
+    if(argc > aoff)
+    {
+        for(size_t i = 0; i < numInputs; ++i)
+        {
+            const char *path = argv[aoff + i];
+            FILE *f = fopen(path, "rb");
+            if(!f)
+            {
+                ERR(COLOR_RED "Failed to open %s" COLOR_RESET, path);
+                return -1;
+            }
+            common_buf_t buf;
+            common_buf_init(&buf, NULL);
+            char tmp[0x1000];
+            size_t r;
+            while((r = fread(tmp, 1, sizeof(tmp), f)) > 0)
+            {
+                common_buf_write(&buf, tmp, r);
+            }
+            fclose(f);
+            // Exact size copy, so that ASan catches reads past the end
+            inputs[i] = malloc(buf.len ? buf.len : 1);
+            if(buf.err || !inputs[i])
+            {
+                ERR(COLOR_RED "Failed to read %s" COLOR_RESET, path);
+                return -1;
+            }
+            memcpy(inputs[i], buf.data, buf.len);
+            sizes[i] = buf.len;
+            maxSize = buf.len > maxSize ? buf.len : maxSize;
+            common_buf_free(&buf);
+            LLVMFuzzerTestOneInput(inputs[i], sizes[i]);
+        }
+    }
+    else
+    {
+        inputs[0] = malloc(sizeof(seed));
+        if(!inputs[0])
+        {
+            ERR(COLOR_RED "Failed to allocate inputs." COLOR_RESET);
+            return -1;
+        }
+        memcpy(inputs[0], seed, sizeof(seed));
+        sizes[0] = sizeof(seed);
+        LLVMFuzzerTestOneInput(inputs[0], sizes[0]);
+    }
+
+    uint32_t state = 0x1337;
+    uint8_t *work = malloc(maxSize);
+    if(!work)
+    {
+        ERR(COLOR_RED "Failed to allocate inputs." COLOR_RESET);
+        return -1;
+    }
+    for(unsigned long n = 0; n < iter; ++n)
+    {
+        size_t i = fuzzRand(&state) % numInputs,
+               size = sizes[i];
+        memcpy(work, inputs[i], size);
+        for(uint32_t m = 0, num = 1 + fuzzRand(&state) % 4; m < num && size > 0; ++m)
+        {
+            size_t off = fuzzRand(&state) % size;
+            switch(fuzzRand(&state) % 4)
+            {
+                case 0: // bit flip
+                    work[off] ^= 1 << (fuzzRand(&state) % 8);
+                    break;
+                case 1: // small index or length
+                    work[off] = fuzzRand(&state) % 0x10;
+                    break;
+                case 2: // truncate
+                    size = off;
+                    break;
+                case 3: // type byte
+                    if((off | 3) < size)
+                    {
+                        work[off | 3] = (fuzzRand(&state) % 2 ? 0x80 : 0) | (1 + fuzzRand(&state) % 0xc);
+                    }
+                    break;
+            }
+        }
+        // Copy again at the final size, so ASan sees the real end
+        uint8_t *exact = malloc(size ? size : 1);
+        if(!exact)
+        {
+            ERR(COLOR_RED "Failed to allocate inputs." COLOR_RESET);
+            return -1;
+        }
+        memcpy(exact, work, size);
+        LLVMFuzzerTestOneInput(exact, size);
+        free(exact);
+    }
+    free(work);
+    for(size_t i = 0; i < numInputs; ++i)
+    {
+        free(inputs[i]);
+    }
+    free(inputs);
+    free(sizes);
+    return 0;
+}
+
+#endif
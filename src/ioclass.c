@@ -1,4 +1,4 @@
-/* Copyright (c) 2017-2018 Siguza
+/* Copyright (c) 2017-2022 Siguza
  *
  * This Source Code Form is subject to the terms of the Mozilla Public
  * License, v. 2.0. If a copy of the MPL was not distributed with this
@@ -8,19 +8,305 @@
  * defined by the Mozilla Public License, v. 2.0.
 **/
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/sysctl.h>
 #include <mach/mach.h>
 #include <CoreFoundation/CoreFoundation.h>
+#ifdef __APPLE__
+#   include <TargetConditionals.h>
+#endif
 
+#include "cfj.h"
+#include "classtree.h"
 #include "common.h"
 #include "iokit.h"
+#include "stats.h"
+
+// Every superclass is asked for exactly once, chains stop as soon as they reach a known class.
+static bool loadKernelClasses(classtree_t *tree)
+{
+    io_registry_entry_t root = STATS(STATS_ROOT_ENTRY, IORegistryGetRootEntry(kIOMasterPortDefault));
+    CFDictionaryRef diag = STATS(STATS_PROPERTY, IORegistryEntryCreateCFProperty(root, CFSTR("IOKitDiagnostics"), NULL, 0));
+    IOObjectRelease(root);
+    if(!diag)
+    {
+        ERR(COLOR_RED "Failed to get IOKitDiagnostics." COLOR_RESET);
+        return false;
+    }
+    CFDictionaryRef classes = CFDictionaryGetValue(diag, CFSTR("Classes"));
+    CFIndex num = classes ? CFDictionaryGetCount(classes) : 0;
+    CFStringRef *names = malloc((num ? num : 1) * sizeof(CFStringRef));
+    if(!names)
+    {
+        ERR(COLOR_RED "Failed to allocate class list." COLOR_RESET);
+        CFRelease(diag);
+        return false;
+    }
+    if(classes)
+    {
+        CFDictionaryGetKeysAndValues(classes, (const void**)names, NULL);
+    }
+
+    bool succ = true;
+    for(CFIndex i = 0; succ && i < num; ++i)
+    {
+        size_t len = 0;
+        const char *classStr = cfj_cstr(names[i], &len);
+        if(!classStr)
+        {
+            ERR(COLOR_RED "Failed to convert class name to UTF-8." COLOR_RESET);
+            succ = false;
+            break;
+        }
+        bool added = false;
+        uint32_t cur = classtree_add(tree, classStr, &added);
+        CFStringRef current = names[i];
+        CFRetain(current);
+        while(added)
+        {
+            CFStringRef super = STATS(STATS_SUPERCLASS, IOObjectCopySuperclassForClass(current));
+            CFRelease(current);
+            current = super;
+            if(!current)
+            {
+                break;
+            }
+            if(!(classStr = cfj_cstr(current, &len)))
+            {
+                ERR(COLOR_RED "Failed to convert class name to UTF-8." COLOR_RESET);
+                succ = false;
+                break;
+            }
+            uint32_t next = classtree_add(tree, classStr, &added);
+            if(next == CLASSTREE_NONE)
+            {
+                break;
+            }
+            classtree_set_super(tree, cur, next);
+            cur = next;
+        }
+        if(current)
+        {
+            CFRelease(current);
+        }
+        if(cur == CLASSTREE_NONE)
+        {
+            ERR(COLOR_RED "Failed to allocate class tree." COLOR_RESET);
+            succ = false;
+        }
+    }
+
+    free(names);
+    CFRelease(diag);
+    return succ;
+}
+
+static bool loadKernelBundles(classtree_t *tree)
+{
+    for(uint32_t i = 0; i < tree->num; ++i)
+    {
+        CFStringRef class = CFStringCreateWithCString(NULL, classtree_name(tree, i), kCFStringEncodingUTF8);
+        CFStringRef bndl = class ? STATS(STATS_BUNDLE, IOObjectCopyBundleIdentifierForClass(class)) : NULL;
+        if(class)
+        {
+            CFRelease(class);
+        }
+        if(bndl)
+        {
+            size_t len = 0;
+            const char *bundleStr = cfj_cstr(bndl, &len);
+            bool succ = bundleStr && classtree_set_bundle(tree, i, bundleStr);
+            CFRelease(bndl);
+            if(!succ)
+            {
+                ERR(COLOR_RED "Failed to allocate class tree." COLOR_RESET);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+#if TARGET_OS_OSX
+// Every kext load gets a higher tag than the last, so the number of loaded kexts and
+// the highest tag change whenever classes may have been added or removed.
+static void kextKey(char *buf, size_t size)
+{
+    const void *key = CFSTR("OSBundleLoadTag");
+    CFArrayRef keys = CFArrayCreate(NULL, &key, 1, &kCFTypeArrayCallBacks);
+    CFDictionaryRef kexts = keys ? KextManagerCopyLoadedKextInfo(NULL, keys) : NULL;
+    if(keys)
+    {
+        CFRelease(keys);
+    }
+    if(!kexts)
+    {
+        snprintf(buf, size, "?");
+        return;
+    }
+    CFIndex num = CFDictionaryGetCount(kexts);
+    CFTypeRef *infos = malloc((num ? num : 1) * sizeof(CFTypeRef));
+    uint32_t maxTag = 0;
+    if(infos)
+    {
+        CFDictionaryGetKeysAndValues(kexts, NULL, (const void**)infos);
+        for(CFIndex i = 0; i < num; ++i)
+        {
+            uint32_t tag = 0;
+            CFNumberRef n = CFGetTypeID(infos[i]) == CFDictionaryGetTypeID() ? CFDictionaryGetValue(infos[i], key) : NULL;
+            if(n && CFGetTypeID(n) == CFNumberGetTypeID() && CFNumberGetValue(n, kCFNumberSInt32Type, &tag) && tag > maxTag)
+            {
+                maxTag = tag;
+            }
+        }
+        free(infos);
+    }
+    CFRelease(kexts);
+    snprintf(buf, size, "%ld:%u", (long)num, maxTag);
+}
+#else
+// Kexts can't be loaded after boot here.
+static void kextKey(char *buf, size_t size)
+{
+    snprintf(buf, size, "-");
+}
+#endif
+
+static void kernelKey(char *buf, size_t size)
+{
+    char uuid[0x40] = "",
+         version[0x100] = "",
+         kexts[0x40];
+    size_t len = sizeof(uuid) - 1;
+    sysctlbyname("kern.uuid", uuid, &len, NULL, 0);
+    len = sizeof(version) - 1;
+    sysctlbyname("kern.version", version, &len, NULL, 0);
+    kextKey(kexts, sizeof(kexts));
+    snprintf(buf, size, "%s %s %s", uuid, kexts, version);
+}
+
+static void cachePath(char *buf, size_t size)
+{
+    const char *home = getenv("HOME");
+    snprintf(buf, size, "%s/.ioclass.cache", home ? home : "/tmp");
+}
+
+// Classes, superclasses and bundle IDs all come from the cache if it matches the running kernel.
+// Otherwise everything is fetched once and the cache is rewritten.
+static bool loadTree(classtree_t *tree, const char *path, bool refresh)
+{
+    char key[0x100];
+    kernelKey(key, sizeof(key));
+    if(!refresh && classtree_map(tree, path, key))
+    {
+        return true;
+    }
+    classtree_free(tree);
+    classtree_init(tree);
+    if(!loadKernelClasses(tree) || !loadKernelBundles(tree))
+    {
+        return false;
+    }
+    if(!classtree_build(tree))
+    {
+        ERR(COLOR_RED "Failed to build class tree." COLOR_RESET);
+        return false;
+    }
+    if(!classtree_write(tree, path, key))
+    {
+        ERR(COLOR_YELLOW "Failed to write cache %s: %s" COLOR_RESET, path, strerror(errno));
+    }
+    return true;
+}
+
+static bool printBundle(common_buf_t *out, const classtree_t *tree, uint32_t idx, bool cached, bool withClass)
+{
+    const char *classStr = classtree_name(tree, idx);
+    if(cached)
+    {
+        const char *bundleStr = classtree_bundle(tree, idx);
+        if(!withClass)
+        {
+            common_buf_printf(out, "%s\n", bundleStr ? bundleStr : "");
+        }
+        else if(bundleStr)
+        {
+            common_buf_printf(out, "%s (%s)\n", classStr, bundleStr);
+        }
+        else
+        {
+            common_buf_printf(out, "%s\n", classStr);
+        }
+        return true;
+    }
+    CFStringRef class = CFStringCreateWithCStringNoCopy(NULL, classStr, kCFStringEncodingUTF8, kCFAllocatorNull);
+    CFStringRef bndl = class ? STATS(STATS_BUNDLE, IOObjectCopyBundleIdentifierForClass(class)) : NULL;
+    if(class)
+    {
+        CFRelease(class);
+    }
+    size_t len = 0;
+    const char *bundleStr = bndl ? cfj_cstr(bndl, &len) : "";
+    if(!bundleStr)
+    {
+        ERR(COLOR_RED "Failed to convert bundle name to UTF-8." COLOR_RESET);
+        CFRelease(bndl);
+        return false;
+    }
+    if(!withClass)
+    {
+        common_buf_printf(out, "%s\n", bundleStr);
+    }
+    else if(bundleStr[0])
+    {
+        common_buf_printf(out, "%s (%s)\n", classStr, bundleStr);
+    }
+    else
+    {
+        common_buf_printf(out, "%s\n", classStr);
+    }
+    if(bndl)
+    {
+        CFRelease(bndl);
+    }
+    return true;
+}
+
+static void print_help(const char *self)
+{
+    fprintf(stderr, "Usage:\n"
+                    "    %s [options] ClassName\n"
+                    "    %s [options] -l\n"
+                    "\n"
+                    "Description:\n"
+                    "    Print the class hierarchy of an IOKit class.\n"
+                    "\n"
+                    "Options:\n"
+                    "    -b          Print the bundle ID of the class instead\n"
+                    "    -c file     Use this cache file (default: ~/.ioclass.cache)\n"
+                    "    -e          Print all classes extending the class instead\n"
+                    "    -f file     Read the class list from file instead of the kernel or cache\n"
+                    "    -h          Print this help and exit\n"
+                    "    -l          Print all classes and their superclass\n"
+                    "    -r          Rebuild the cache, if it went stale in a way that isn't detected\n"
+                    "    --stats     Print call counts, latencies, bytes written and peak RSS to stderr on exit\n"
+                    "                (--stats=json for a single JSON object instead of a table)\n"
+           , self, self
+    );
+}
 
 int main(int argc, const char **argv)
 {
     bool bundle  = false,
-         extends = false;
+         extends = false,
+         list    = false,
+         refresh = false;
+    const char *file = NULL,
+               *cache = NULL;
     int aoff;
     for(aoff = 1; aoff < argc; ++aoff)
     {
@@ -36,110 +322,138 @@ int main(int argc, const char **argv)
         {
             extends = true;
         }
+        else if(strcmp(argv[aoff], "-h") == 0)
+        {
+            print_help(argv[0]);
+            return -1;
+        }
+        else if(strcmp(argv[aoff], "-l") == 0)
+        {
+            list = true;
+        }
+        else if(strcmp(argv[aoff], "-r") == 0)
+        {
+            refresh = true;
+        }
+        else if(strcmp(argv[aoff], "--stats") == 0 || strcmp(argv[aoff], "--stats=json") == 0)
+        {
+            stats_enable(argv[aoff][7] == '=');
+        }
+        else if(strcmp(argv[aoff], "-c") == 0 || strcmp(argv[aoff], "-f") == 0)
+        {
+            if(aoff + 1 >= argc)
+            {
+                ERR(COLOR_RED "Missing argument to %s" COLOR_RESET, argv[aoff]);
+                return -1;
+            }
+            *(argv[aoff][1] == 'c' ? &cache : &file) = argv[aoff + 1];
+            ++aoff;
+        }
         else
         {
             ERR(COLOR_RED "Unrecognized argument: %s" COLOR_RESET, argv[aoff]);
+            print_help(argv[0]);
             return -1;
         }
     }
 
-    if(argc - aoff < 1)
+    if(!list && argc - aoff < 1)
     {
-        ERR("Usage: %s [-b] [-e] ClassName", argv[0]);
+        print_help(argv[0]);
         return -1;
     }
 
-    CFStringRef class = CFStringCreateWithCStringNoCopy(NULL, argv[aoff], kCFStringEncodingUTF8, kCFAllocatorNull);
-    if(extends)
+    char path[0x400];
+    if(cache)
     {
-        io_registry_entry_t root = IORegistryGetRootEntry(kIOMasterPortDefault);
-        CFDictionaryRef diag = IORegistryEntryCreateCFProperty(root, CFSTR("IOKitDiagnostics"), NULL, 0);
-        CFDictionaryRef classes = CFDictionaryGetValue(diag, CFSTR("Classes"));
-        CFIndex num = CFDictionaryGetCount(classes);
-        CFStringRef *names = malloc(num * sizeof(CFStringRef));
-        CFDictionaryGetKeysAndValues(classes, (const void**)names, NULL);
+        strlcpy(path, cache, sizeof(path));
+    }
+    else
+    {
+        cachePath(path, sizeof(path));
+    }
 
-        for(size_t i = 0; i < num; ++i)
+    classtree_t tree;
+    classtree_init(&tree);
+    bool succ;
+    if(file)
+    {
+        FILE *f = fopen(file, "r");
+        if(!f)
         {
-            CFStringRef actual = names[i];
-            CFStringRef current = actual;
-            CFRetain(current);
-            while(current != NULL)
-            {
-                if(CFEqual(current, class))
-                {
-                    char classStr[512];
-                    if(!CFStringGetCString(actual, classStr, sizeof(classStr), kCFStringEncodingUTF8))
-                    {
-                        ERR(COLOR_RED "Failed to convert class name to UTF-8." COLOR_RESET);
-                        return -1;
-                    }
-                    if(bundle)
-                    {
-                        CFStringRef bndl = IOObjectCopyBundleIdentifierForClass(actual);
-                        char bundleStr[512];
-                        if(!CFStringGetCString(bndl, bundleStr, sizeof(bundleStr), kCFStringEncodingUTF8))
-                        {
-                            ERR(COLOR_RED "Failed to convert bundle name to UTF-8." COLOR_RESET);
-                            return -1;
-                        }
-                        LOG("%s (%s)", classStr, bundleStr);
-                        CFRelease(bndl);
-                    }
-                    else
-                    {
-                        LOG("%s", classStr);
-                    }
-                    CFRelease(current);
-                    break;
-                }
-                CFStringRef super = IOObjectCopySuperclassForClass(current);
-                CFRelease(current);
-                current = super;
-            }
+            ERR(COLOR_RED "Failed to open %s" COLOR_RESET, file);
+            classtree_free(&tree);
+            return -1;
         }
+        succ = classtree_load(&tree, f);
+        fclose(f);
+        if(!succ)
+        {
+            ERR(COLOR_RED "Failed to read %s" COLOR_RESET, file);
+        }
+        else if(!classtree_build(&tree))
+        {
+            ERR(COLOR_RED "Failed to build class tree." COLOR_RESET);
+            succ = false;
+        }
+    }
+    else
+    {
+        succ = loadTree(&tree, path, refresh);
+    }
 
-        free(names);
-        CFRelease(diag);
-        IOObjectRelease(root);
-        CFRelease(class);
+    uint32_t idx = CLASSTREE_NONE;
+    if(succ && !list)
+    {
+        idx = classtree_find(&tree, argv[aoff]);
     }
-    else if(bundle)
+
+    common_buf_t out;
+    common_buf_init(&out, stdout);
+    uint64_t t = stats_begin(STATS_FORMAT);
+    if(!succ)
     {
-        CFStringRef bndl = IOObjectCopyBundleIdentifierForClass(class);
-        if(bndl)
+        // Nothing to do
+    }
+    else if(list)
+    {
+        classtree_save(&tree, &out);
+    }
+    else if(idx == CLASSTREE_NONE)
+    {
+        common_buf_puts(&out, COLOR_RED "Class not found" COLOR_RESET "\n");
+    }
+    else if(extends)
+    {
+        const classtree_class_t *c = &tree.classes[idx];
+        for(uint32_t i = c->pre; succ && c->pre != CLASSTREE_NONE && i < c->end; ++i)
         {
-            char bundleStr[512];
-            if(!CFStringGetCString(bndl, bundleStr, sizeof(bundleStr), kCFStringEncodingUTF8))
+            if(bundle)
             {
-                ERR(COLOR_RED "Failed to convert bundle name to UTF-8." COLOR_RESET);
-                return -1;
+                succ = printBundle(&out, &tree, tree.order[i], !file, true);
+            }
+            else
+            {
+                common_buf_printf(&out, "%s\n", classtree_name(&tree, tree.order[i]));
             }
-            LOG("%s", bundleStr);
-        }
-        else
-        {
-            LOG(COLOR_RED "Class not found" COLOR_RESET);
         }
-        CFRelease(bndl);
-        CFRelease(class);
+    }
+    else if(bundle)
+    {
+        succ = printBundle(&out, &tree, idx, !file, false);
     }
     else
     {
-        for(int i = 0; class != NULL; ++i)
+        // Bounded, in case the list has a loop in it
+        for(uint32_t i = 0; idx != CLASSTREE_NONE && i < tree.num; ++i)
         {
-            char classStr[512];
-            if(!CFStringGetCString(class, classStr, sizeof(classStr), kCFStringEncodingUTF8))
-            {
-                ERR(COLOR_RED "Failed to convert class name to UTF-8." COLOR_RESET);
-                return -1;
-            }
-            LOG("%*s%s", i, "", classStr);
-            CFStringRef super = IOObjectCopySuperclassForClass(class);
-            CFRelease(class);
-            class = super;
+            common_buf_printf(&out, "%*s%s\n", (int)i, "", classtree_name(&tree, idx));
+            idx = tree.classes[idx].super;
         }
     }
+    stats_end(STATS_FORMAT, t);
+    common_buf_free(&out);
 
-    return 0;
+    classtree_free(&tree);
+    return succ ? 0 : -1;
 }
@@ -0,0 +1,448 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "oss.h"
+#include "snap.h"
+
+// Registry trees aren't nearly this deep, but a corrupt snapshot could loop
+#define DIFF_MAX_DEPTH 0x400
+
+typedef struct
+{
+    const snap_t *snap;
+    oss_t oss;
+} diff_side_t;
+
+typedef struct
+{
+    diff_side_t old;
+    diff_side_t new;
+    common_buf_t out;
+    bool quiet;
+    bool cfj;
+    size_t changed;
+    size_t added;
+    size_t removed;
+} diff_t;
+
+typedef struct
+{
+    uint64_t id;
+    uint64_t tree;
+    uint32_t idx;
+    uint32_t pos;
+    bool used;
+} diff_child_t;
+
+static const snap_entry_t* getEntry(const snap_t *snap, uint32_t idx)
+{
+    return idx < snap->hdr->numEntries ? &snap->entries[idx] : NULL;
+}
+
+static bool getChildren(const snap_t *snap, const snap_entry_t *entry, const uint32_t **edges, uint32_t *num)
+{
+    if(entry->firstChild > snap->hdr->numEdges || entry->numChildren > snap->hdr->numEdges - entry->firstChild)
+    {
+        ERR(COLOR_RED "Corrupt snapshot: child list out of bounds" COLOR_RESET);
+        return false;
+    }
+    *edges = snap->edges + entry->firstChild;
+    *num = entry->numChildren;
+    return true;
+}
+
+static void printEntryLine(diff_t *d, const snap_t *snap, const snap_entry_t *entry, char sign, const char *color)
+{
+    const char *names[DIFF_MAX_DEPTH];
+    size_t num = 0;
+    for(const snap_entry_t *e = entry; e && e->parent != SNAP_NONE && num < DIFF_MAX_DEPTH; e = getEntry(snap, e->parent))
+    {
+        names[num++] = snap_str(snap, e->name);
+    }
+    common_buf_printf(&d->out, "%s%c %s:", color, sign, snap->hdr->plane);
+    if(num == 0)
+    {
+        common_buf_putc(&d->out, '/');
+    }
+    while(num > 0)
+    {
+        common_buf_putc(&d->out, '/');
+        common_buf_puts(&d->out, names[--num]);
+    }
+    common_buf_printf(&d->out, " (%s)%s\n", snap_class_name(snap, entry->class), COLOR_RESET);
+}
+
+static bool printSubtree(diff_t *d, const snap_t *snap, const snap_entry_t *entry, char sign, const char *color, size_t *count, unsigned depth)
+{
+    if(depth > DIFF_MAX_DEPTH)
+    {
+        ERR(COLOR_RED "Corrupt snapshot: tree too deep" COLOR_RESET);
+        return false;
+    }
+    printEntryLine(d, snap, entry, sign, color);
+    ++*count;
+    const uint32_t *edges = NULL;
+    uint32_t num = 0;
+    if(!getChildren(snap, entry, &edges, &num))
+    {
+        return false;
+    }
+    for(uint32_t i = 0; i < num; ++i)
+    {
+        const snap_entry_t *child = getEntry(snap, edges[i]);
+        if(!child || !printSubtree(d, snap, child, sign, color, count, depth + 1))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void printKey(diff_t *d, diff_side_t *side, const oss_key_t *key, char sign, const char *color)
+{
+    common_ctx_t ctx =
+    {
+        .true_json = !d->cfj,
+        .bytes_raw = d->cfj,
+        .first = false,
+        .lvl = 1,
+        .out = &d->out,
+    };
+    common_buf_printf(&d->out, "    %s%c%s \"", color, sign, COLOR_RESET);
+    if(ctx.true_json)
+    {
+        common_print_str(&ctx, (const char*)key->str, key->len);
+    }
+    else
+    {
+        common_buf_write(&d->out, key->str, key->len);
+    }
+    common_buf_write(&d->out, "\": ", 3);
+    if(oss_format_at(&side->oss, key->off, 1, ctx.true_json, ctx.bytes_raw))
+    {
+        common_buf_write(&d->out, side->oss.out.data, side->oss.out.len);
+    }
+    else
+    {
+        common_buf_puts(&d->out, "<!-- error -->");
+    }
+    common_buf_putc(&d->out, '\n');
+}
+
+static void diffProps(diff_t *d, const snap_entry_t *a, const snap_entry_t *b)
+{
+    size_t sizeA = 0,
+           sizeB = 0;
+    const uint8_t *propsA = a->propsRet == 0 ? snap_props(d->old.snap, a, &sizeA) : NULL,
+                  *propsB = b->propsRet == 0 ? snap_props(d->new.snap, b, &sizeB) : NULL;
+    if(!propsA || !propsB || !oss_keys(&d->old.oss, propsA, sizeA) || !oss_keys(&d->new.oss, propsB, sizeB))
+    {
+        common_buf_printf(&d->out, "    properties unavailable (0x%x -> 0x%x)\n", a->propsRet, b->propsRet);
+        return;
+    }
+    const oss_key_t *keysA = d->old.oss.keys,
+                    *keysB = d->new.oss.keys;
+    size_t numA = d->old.oss.numKeys,
+           numB = d->new.oss.numKeys;
+    for(size_t i = 0, j = 0; i < numA || j < numB; )
+    {
+        int cmp = i >= numA ? 1 : j >= numB ? -1 : oss_key_cmp(&keysA[i], &keysB[j]);
+        if(cmp <= 0 && (cmp < 0 || keysA[i].hash != keysB[j].hash))
+        {
+            printKey(d, &d->old, &keysA[i], '-', COLOR_RED);
+        }
+        if(cmp >= 0 && (cmp > 0 || keysA[i].hash != keysB[j].hash))
+        {
+            printKey(d, &d->new, &keysB[j], '+', COLOR_GREEN);
+        }
+        i += cmp <= 0;
+        j += cmp >= 0;
+    }
+}
+
+// First by name and class, then subtree hash, so that unchanged entries are easy to pair up.
+static int childCmpTree(const void *a, const void *b)
+{
+    const diff_child_t *x = a,
+                       *y = b;
+    if(x->id != y->id)     return x->id < y->id ? -1 : 1;
+    if(x->tree != y->tree) return x->tree < y->tree ? -1 : 1;
+    return x->pos < y->pos ? -1 : x->pos > y->pos ? 1 : 0;
+}
+
+// Unpaired entries first, by name and class, then in registry order.
+static int childCmpPos(const void *a, const void *b)
+{
+    const diff_child_t *x = a,
+                       *y = b;
+    if(x->used != y->used) return x->used ? 1 : -1;
+    if(x->id != y->id)     return x->id < y->id ? -1 : 1;
+    return x->pos < y->pos ? -1 : x->pos > y->pos ? 1 : 0;
+}
+
+static int pairCmp(const void *a, const void *b)
+{
+    const diff_child_t *x = a,
+                       *y = b;
+    return x->pos < y->pos ? -1 : x->pos > y->pos ? 1 : 0;
+}
+
+static diff_child_t* loadChildren(const snap_t *snap, const snap_entry_t *entry, uint32_t *num)
+{
+    const uint32_t *edges = NULL;
+    if(!getChildren(snap, entry, &edges, num))
+    {
+        return NULL;
+    }
+    diff_child_t *children = malloc((*num ? *num : 1) * sizeof(*children));
+    if(!children)
+    {
+        ERR(COLOR_RED "Failed to allocate children: %s" COLOR_RESET, strerror(errno));
+        return NULL;
+    }
+    for(uint32_t i = 0; i < *num; ++i)
+    {
+        const snap_entry_t *child = getEntry(snap, edges[i]);
+        if(!child)
+        {
+            ERR(COLOR_RED "Corrupt snapshot: child index out of bounds" COLOR_RESET);
+            free(children);
+            return NULL;
+        }
+        children[i] = (diff_child_t)
+        {
+            .id = snap_id_hash(snap, child),
+            .tree = child->tree,
+            .idx = edges[i],
+            .pos = i,
+            .used = false,
+        };
+    }
+    return children;
+}
+
+static bool diffEntry(diff_t *d, const snap_entry_t *a, const snap_entry_t *b, unsigned depth);
+
+// Children with equal subtrees are paired first and skipped, then the rest are paired
+// by name and class in registry order. Whatever is left over was added or removed.
+static bool diffChildren(diff_t *d, const snap_entry_t *a, const snap_entry_t *b, unsigned depth)
+{
+    uint32_t numA = 0,
+             numB = 0;
+    diff_child_t *childA = loadChildren(d->old.snap, a, &numA),
+                 *childB = childA ? loadChildren(d->new.snap, b, &numB) : NULL;
+    diff_child_t *pairs = childB ? malloc(((numA < numB ? numA : numB) + 1) * 2 * sizeof(*pairs)) : NULL;
+    if(!pairs)
+    {
+        free(childA);
+        free(childB);
+        return false;
+    }
+
+    qsort(childA, numA, sizeof(*childA), &childCmpTree);
+    qsort(childB, numB, sizeof(*childB), &childCmpTree);
+    for(uint32_t i = 0, j = 0; i < numA && j < numB; )
+    {
+        int cmp = childA[i].id != childB[j].id ? (childA[i].id < childB[j].id ? -1 : 1) :
+                  childA[i].tree != childB[j].tree ? (childA[i].tree < childB[j].tree ? -1 : 1) : 0;
+        if(cmp == 0)
+        {
+            childA[i].used = childB[j].used = true;
+        }
+        i += cmp <= 0;
+        j += cmp >= 0;
+    }
+
+    qsort(childA, numA, sizeof(*childA), &childCmpPos);
+    qsort(childB, numB, sizeof(*childB), &childCmpPos);
+    size_t numPairs = 0,
+           numRemoved = 0,
+           numAdded = 0;
+    uint32_t i = 0,
+             j = 0;
+    while((i < numA && !childA[i].used) || (j < numB && !childB[j].used))
+    {
+        bool leftA = i < numA && !childA[i].used,
+             leftB = j < numB && !childB[j].used;
+        int cmp = !leftA ? 1 : !leftB ? -1 : childA[i].id != childB[j].id ? (childA[i].id < childB[j].id ? -1 : 1) : 0;
+        if(cmp == 0)
+        {
+            // Pairs are kept as (new, old), sorted by position in the new tree below
+            pairs[numPairs * 2]     = childB[j];
+            pairs[numPairs * 2 + 1] = childA[i];
+            ++numPairs;
+        }
+        else if(cmp < 0)
+        {
+            childA[numRemoved++] = childA[i];
+        }
+        else
+        {
+            childB[numAdded++] = childB[j];
+        }
+        i += cmp <= 0;
+        j += cmp >= 0;
+    }
+    qsort(childA, numRemoved, sizeof(*childA), &pairCmp);
+    qsort(childB, numAdded, sizeof(*childB), &pairCmp);
+    qsort(pairs, numPairs, 2 * sizeof(*pairs), &pairCmp);
+
+    bool succ = true;
+    for(size_t k = 0; succ && k < numRemoved; ++k)
+    {
+        succ = printSubtree(d, d->old.snap, getEntry(d->old.snap, childA[k].idx), '-', COLOR_RED, &d->removed, depth + 1);
+    }
+    for(size_t k = 0; succ && k < numAdded; ++k)
+    {
+        succ = printSubtree(d, d->new.snap, getEntry(d->new.snap, childB[k].idx), '+', COLOR_GREEN, &d->added, depth + 1);
+    }
+    for(size_t k = 0; succ && k < numPairs; ++k)
+    {
+        succ = diffEntry(d, getEntry(d->old.snap, pairs[k * 2 + 1].idx), getEntry(d->new.snap, pairs[k * 2].idx), depth + 1);
+    }
+    free(childA);
+    free(childB);
+    free(pairs);
+    return succ;
+}
+
+static bool diffEntry(diff_t *d, const snap_entry_t *a, const snap_entry_t *b, unsigned depth)
+{
+    if(a->tree == b->tree)
+    {
+        return true;
+    }
+    if(depth > DIFF_MAX_DEPTH)
+    {
+        ERR(COLOR_RED "Corrupt snapshot: tree too deep" COLOR_RESET);
+        return false;
+    }
+    if(a->hash != b->hash)
+    {
+        ++d->changed;
+        printEntryLine(d, d->new.snap, b, '~', COLOR_YELLOW);
+        if(!d->quiet)
+        {
+            diffProps(d, a, b);
+        }
+    }
+    return diffChildren(d, a, b, depth);
+}
+
+static void print_help(const char *self)
+{
+    fprintf(stderr, "Usage:\n"
+                    "    %s [options] Old New\n"
+                    "\n"
+                    "Description:\n"
+                    "    Compare two registry snapshots written with \"ioprint -w\".\n"
+                    "    Prints added (+), removed (-) and changed (~) entries, and for changed ones the properties that differ.\n"
+                    "    Exits with 0 if the snapshots are equal and 1 if they are not.\n"
+                    "\n"
+                    "Options:\n"
+                    "    -h          Print this help and exit\n"
+                    "    -k          Print values in mix between JSON and hexdump\n"
+                    "    -q          Only print entries, not properties\n"
+           , self
+    );
+}
+
+int main(int argc, const char **argv)
+{
+    diff_t d =
+    {
+        .quiet = false,
+        .cfj = false,
+    };
+    int aoff;
+    for(aoff = 1; aoff < argc; ++aoff)
+    {
+        if(argv[aoff][0] != '-')
+        {
+            break;
+        }
+        if(strcmp(argv[aoff], "-h") == 0)
+        {
+            print_help(argv[0]);
+            return -1;
+        }
+        else if(strcmp(argv[aoff], "-k") == 0)
+        {
+            d.cfj = true;
+        }
+        else if(strcmp(argv[aoff], "-q") == 0)
+        {
+            d.quiet = true;
+        }
+        else
+        {
+            ERR(COLOR_RED "Unrecognized argument: %s" COLOR_RESET, argv[aoff]);
+            print_help(argv[0]);
+            return -1;
+        }
+    }
+    if(argc - aoff != 2)
+    {
+        print_help(argv[0]);
+        return -1;
+    }
+
+    snap_t old, new;
+    if(!snap_open(&old, argv[aoff]))
+    {
+        return -1;
+    }
+    if(!snap_open(&new, argv[aoff + 1]))
+    {
+        snap_close(&old);
+        return -1;
+    }
+    if(strcmp(old.hdr->plane, new.hdr->plane) != 0)
+    {
+        ERR(COLOR_YELLOW "Comparing different planes: %s and %s" COLOR_RESET, old.hdr->plane, new.hdr->plane);
+    }
+    d.old.snap = &old;
+    d.new.snap = &new;
+    oss_init(&d.old.oss);
+    oss_init(&d.new.oss);
+    common_buf_init(&d.out, stdout);
+
+    bool succ = diffEntry(&d, &old.entries[0], &new.entries[0], 0);
+
+    common_buf_free(&d.out);
+    oss_free(&d.old.oss);
+    oss_free(&d.new.oss);
+    snap_close(&old);
+    snap_close(&new);
+    if(!succ)
+    {
+        return -1;
+    }
+    // A diff that didn't make it out doesn't count as either result
+    if(fflush(stdout) != 0 || ferror(stdout) || d.out.err)
+    {
+        ERR(COLOR_RED "Failed to write output" COLOR_RESET);
+        return -1;
+    }
+    if(d.changed || d.added || d.removed)
+    {
+        ERR("%zu changed, %zu added, %zu removed", d.changed, d.added, d.removed);
+        return 1;
+    }
+    return 0;
+}
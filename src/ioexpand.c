@@ -0,0 +1,181 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mach/mach.h>
+
+#include "common.h"
+#include "compact.h"
+
+static bool readAll(FILE *f, common_buf_t *buf)
+{
+    while(true)
+    {
+        char *ptr = common_buf_reserve(buf, COMMON_BUF_FLUSH);
+        if(!ptr)
+        {
+            return false;
+        }
+        size_t num = fread(ptr, 1, COMMON_BUF_FLUSH, f);
+        buf->len += num;
+        if(num < COMMON_BUF_FLUSH)
+        {
+            return !ferror(f);
+        }
+    }
+}
+
+// Output is the same as "ioprint -j", "-k" or "-o" on the same entries.
+static bool expand(common_buf_t *out, compact_reader_t *r, bool hdr, bool cfj, bool json)
+{
+    compact_entry_t e;
+    while(compact_reader_next(r, &e))
+    {
+        if(hdr)
+        {
+            common_buf_printf(out, "%s%.*s(%.*s):%s %s%s%s\n",
+                COLOR_CYAN, (int)e.classLen, e.class, (int)e.nameLen, e.name, COLOR_RESET,
+                e.ret == KERN_SUCCESS ? COLOR_GREEN : COLOR_YELLOW, mach_error_string(e.ret), COLOR_RESET
+            );
+        }
+        if(e.ret != KERN_SUCCESS)
+        {
+            continue;
+        }
+        if(cfj)
+        {
+            if(!compact_reader_props(r, &e, false, true))
+            {
+                return false;
+            }
+            common_buf_write(out, r->oss.out.data, r->oss.out.len);
+        }
+        if(json)
+        {
+            if(!compact_reader_props(r, &e, true, false))
+            {
+                return false;
+            }
+            common_buf_write(out, r->oss.out.data, r->oss.out.len);
+        }
+    }
+    return r->entry == r->numEntries;
+}
+
+static void print_help(const char *self)
+{
+    fprintf(stderr, "Usage:\n"
+                    "    %s [options] [File]\n"
+                    "\n"
+                    "Description:\n"
+                    "    Print a compact dump written with \"ioprint -c\" the same way \"ioprint -j\" would have.\n"
+                    "    Reads from stdin if no file is given.\n"
+                    "\n"
+                    "Options:\n"
+                    "    -h          Print this help and exit\n"
+                    "    -j          Print properties in JSON format (default)\n"
+                    "    -k          Print properties in mix between JSON and hexdump\n"
+                    "    -o          Print only properties and nothing else\n"
+           , self
+    );
+}
+
+int main(int argc, const char **argv)
+{
+    bool hdr  = true,
+         cfj  = false,
+         json = false;
+    int aoff;
+    for(aoff = 1; aoff < argc; ++aoff)
+    {
+        if(argv[aoff][0] != '-' || argv[aoff][1] == '\0')
+        {
+            break;
+        }
+        if(strcmp(argv[aoff], "-h") == 0)
+        {
+            print_help(argv[0]);
+            return -1;
+        }
+        else if(strcmp(argv[aoff], "-j") == 0)
+        {
+            json = true;
+        }
+        else if(strcmp(argv[aoff], "-k") == 0)
+        {
+            cfj = true;
+        }
+        else if(strcmp(argv[aoff], "-o") == 0)
+        {
+            hdr = false;
+        }
+        else
+        {
+            ERR(COLOR_RED "Unrecognized argument: %s" COLOR_RESET, argv[aoff]);
+            print_help(argv[0]);
+            return -1;
+        }
+    }
+    if(argc - aoff > 1)
+    {
+        print_help(argv[0]);
+        return -1;
+    }
+    if(!cfj && !json)
+    {
+        json = true;
+    }
+
+    const char *path = aoff < argc && strcmp(argv[aoff], "-") != 0 ? argv[aoff] : NULL;
+    FILE *f = path ? fopen(path, "rb") : stdin;
+    if(!f)
+    {
+        ERR(COLOR_RED "fopen(%s): %s" COLOR_RESET, path, strerror(errno));
+        return -1;
+    }
+    common_buf_t in;
+    common_buf_init(&in, NULL);
+    bool succ = readAll(f, &in);
+    if(path)
+    {
+        fclose(f);
+    }
+    if(!succ)
+    {
+        ERR(COLOR_RED "Failed to read %s: %s" COLOR_RESET, path ? path : "stdin", strerror(errno));
+        common_buf_free(&in);
+        return -1;
+    }
+
+    compact_reader_t r;
+    compact_reader_init(&r);
+    common_buf_t out;
+    common_buf_init(&out, stdout);
+    succ = compact_reader_open(&r, (const uint8_t*)in.data, in.len) && expand(&out, &r, hdr, cfj, json);
+    common_buf_free(&out);
+    if(!succ)
+    {
+        ERR(COLOR_RED "Malformed compact dump at entry %u" COLOR_RESET, r.entry);
+    }
+    // Write errors may only show up on the final flush
+    else if(fflush(stdout) != 0 || ferror(stdout) || out.err)
+    {
+        ERR(COLOR_RED "Failed to write output" COLOR_RESET);
+        succ = false;
+    }
+    compact_reader_free(&r);
+    common_buf_free(&in);
+    return succ ? 0 : -1;
+}
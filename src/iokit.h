@@ -15,6 +15,13 @@ typedef io_object_t io_registry_entry_t;
 typedef io_object_t io_service_t;
 typedef io_object_t io_connect_t;
 typedef io_object_t io_iterator_t;
+typedef struct IONotificationPort *IONotificationPortRef;
+typedef void (*IOServiceMatchingCallback)(void *refcon, io_iterator_t it);
+typedef void (*IOServiceInterestCallback)(void *refcon, io_service_t service, uint32_t messageType, void *messageArgument);
+
+#define kIOFirstMatchNotification       "IOServiceFirstMatch"
+#define kIOTerminatedNotification       "IOServiceTerminate"
+#define kIOGeneralInterest              "IOGeneralInterest"
 
 enum
 {
@@ -37,6 +44,12 @@ enum
     kIORegistryIterateParents       = 0x00000002U,
 };
 
+enum
+{
+    kIOMessageServiceIsTerminated   = 0xe0000010U,
+    kIOMessageServicePropertyChange = 0xe0000130U,
+};
+
 enum
 {
     kOSSerializeDictionary          = 0x01000000U,
@@ -73,6 +86,8 @@ CFStringRef _IOObjectCopyClass(io_object_t object, uint64_t options);
 CFStringRef IOObjectCopySuperclassForClass(CFStringRef name);
 CFStringRef IOObjectCopyBundleIdentifierForClass(CFStringRef name);
 
+CFDictionaryRef KextManagerCopyLoadedKextInfo(CFArrayRef kextIdentifiers, CFArrayRef infoKeys);
+
 io_registry_entry_t IORegistryGetRootEntry(mach_port_t master);
 io_registry_entry_t IORegistryEntryFromPath(mach_port_t master, const io_string_t path);
 kern_return_t IORegistryEntryGetName(io_registry_entry_t entry, io_name_t name);
@@ -83,6 +98,10 @@ kern_return_t IORegistryEntryCreateCFProperties(io_registry_entry_t entry, CFMut
 CFTypeRef IORegistryEntryCreateCFProperty(io_registry_entry_t entry, CFStringRef key, CFAllocatorRef allocator, uint32_t options);
 kern_return_t IORegistryEntrySetCFProperties(io_registry_entry_t entry, CFTypeRef properties);
 
+IONotificationPortRef IONotificationPortCreate(mach_port_t master);
+void IONotificationPortDestroy(IONotificationPortRef port);
+CFRunLoopSourceRef IONotificationPortGetRunLoopSource(IONotificationPortRef port);
+
 kern_return_t IORegistryCreateIterator(mach_port_t master, const io_name_t plane, uint32_t options, io_iterator_t *it);
 kern_return_t IORegistryEntryCreateIterator(io_registry_entry_t entry, const io_name_t plane, uint32_t options, io_iterator_t *it);
 kern_return_t IORegistryEntryGetChildIterator(io_registry_entry_t entry, const io_name_t plane, io_iterator_t *it);
@@ -95,6 +114,8 @@ CFMutableDictionaryRef IOServiceMatching(const char *name) CF_RETURNS_RETAINED;
 CFMutableDictionaryRef IOServiceNameMatching(const char *name) CF_RETURNS_RETAINED;
 io_service_t IOServiceGetMatchingService(mach_port_t master, CFDictionaryRef matching CF_RELEASES_ARGUMENT);
 kern_return_t IOServiceGetMatchingServices(mach_port_t master, CFDictionaryRef matching CF_RELEASES_ARGUMENT, io_iterator_t *it);
+kern_return_t IOServiceAddMatchingNotification(IONotificationPortRef port, const io_name_t type, CFDictionaryRef matching CF_RELEASES_ARGUMENT, IOServiceMatchingCallback callback, void *refcon, io_iterator_t *it);
+kern_return_t IOServiceAddInterestNotification(IONotificationPortRef port, io_service_t service, const io_name_t type, IOServiceInterestCallback callback, void *refcon, io_object_t *notification);
 kern_return_t _IOServiceGetAuthorizationID(io_service_t service, uint64_t *authID);
 kern_return_t _IOServiceSetAuthorizationID(io_service_t service, uint64_t authID);
 kern_return_t IOServiceGetBusyStateAndTime(io_service_t service, uint64_t *state, uint32_t *busyState, uint64_t *busyTime);
@@ -8,103 +8,1337 @@
  * defined by the Mozilla Public License, v. 2.0.
 **/
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <mach/mach.h>
 #include <CoreFoundation/CoreFoundation.h>
 
 #include "cfj.h"
 #include "common.h"
+#include "compact.h"
 #include "iokit.h"
+#include "match.h"
+#include "oss.h"
+#include "snap.h"
+#include "stats.h"
 
-static bool printEntry(io_object_t o, const char *match, bool hdr, bool xml, bool cfj, bool json, bool set)
+typedef enum
 {
-    static CFDictionaryRef dict = NULL;
-    if(set && dict == NULL)
+    FORMAT_PRETTY,
+    FORMAT_COMPACT,
+    FORMAT_NDJSON,
+} ioprint_format_t;
+
+// Snapshot paths are built from parent links, same as in iodiff.
+#define PATH_MAX_DEPTH 0x100
+
+static void printProps(common_buf_t *out, CFTypeRef p, bool xml, bool cfj, bool json, ioprint_format_t format)
+{
+    if(xml)
+    {
+        CFDataRef prop = CFPropertyListCreateData(NULL, p, kCFPropertyListXMLFormat_v1_0, 0, NULL);
+        if(prop)
+        {
+            common_buf_write(out, CFDataGetBytePtr(prop), CFDataGetLength(prop));
+            common_buf_putc(out, '\n');
+            CFRelease(prop);
+        }
+        else
+        {
+            CFShow(p);
+        }
+    }
+    if(cfj)
+    {
+        cfj_print_buf(out, p, false, true);
+    }
+    if(json && format == FORMAT_PRETTY)
+    {
+        cfj_print_buf(out, p, true, false);
+    }
+    else if(json)
+    {
+        cfj_print_compact(out, p);
+        common_buf_putc(out, '\n');
+    }
+}
+
+static void printJsonStr(common_buf_t *out, const char *str)
+{
+    common_ctx_t ctx =
+    {
+        .true_json = true,
+        .bytes_raw = false,
+        .first = false,
+        .compact = true,
+        .lvl = 0,
+        .out = out,
+    };
+    common_buf_putc(out, '"');
+    common_print_str(&ctx, str, strlen(str));
+    common_buf_putc(out, '"');
+}
+
+// An --format ndjson record is one line per entry:
+//   {"class":...,"name":...,"id":...,"path":...,"properties":{...}}
+// The properties go between head and tail. If they couldn't be fetched,
+// they are null and the error is given after them instead.
+static void printRecordHead(common_buf_t *out, const char *class, const char *name, uint64_t id, const char *path)
+{
+    common_buf_puts(out, "{\"class\":");
+    printJsonStr(out, class);
+    common_buf_puts(out, ",\"name\":");
+    printJsonStr(out, name);
+    common_buf_puts(out, ",\"id\":");
+    common_buf_dec(out, id);
+    common_buf_puts(out, ",\"path\":");
+    if(path)
+    {
+        printJsonStr(out, path);
+    }
+    else
+    {
+        common_buf_puts(out, "null");
+    }
+    common_buf_puts(out, ",\"properties\":");
+}
+
+static void printRecordTail(common_buf_t *out, kern_return_t ret)
+{
+    if(ret != KERN_SUCCESS)
+    {
+        common_buf_puts(out, "null,\"error\":");
+        printJsonStr(out, mach_error_string(ret));
+    }
+    common_buf_puts(out, "}\n");
+}
+
+// Same as IORegistryEntryGetPath, but without locations.
+static bool snapPath(const snap_t *snap, const snap_entry_t *entry, io_string_t path)
+{
+    const char *names[PATH_MAX_DEPTH];
+    size_t num = 0;
+    const snap_entry_t *e = entry;
+    for(; e->parent != SNAP_NONE && num < PATH_MAX_DEPTH; e = &snap->entries[e->parent])
+    {
+        if(e->parent >= snap->hdr->numEntries)
+        {
+            return false;
+        }
+        names[num++] = snap_str(snap, e->name);
+    }
+    if(e->parent != SNAP_NONE)
+    {
+        return false;
+    }
+    size_t len = snprintf(path, sizeof(io_string_t), "%s:%s", snap->hdr->plane, num == 0 ? "/" : "");
+    while(num > 0 && len < sizeof(io_string_t))
+    {
+        len += snprintf(path + len, sizeof(io_string_t) - len, "/%s", names[--num]);
+    }
+    return len < sizeof(io_string_t);
+}
+
+static CFMutableDictionaryRef newProps(void)
+{
+    return CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+}
+
+// With keys, each one is fetched on its own so the kernel doesn't serialize the whole dict.
+static kern_return_t copyProps(io_object_t o, CFArrayRef keys, CFMutableDictionaryRef *p)
+{
+    if(!keys)
+    {
+        return STATS(STATS_PROPERTIES, IORegistryEntryCreateCFProperties(o, p, NULL, 0));
+    }
+    CFMutableDictionaryRef dict = newProps();
+    if(!dict)
+    {
+        return KERN_FAILURE;
+    }
+    for(CFIndex i = 0, num = CFArrayGetCount(keys); i < num; ++i)
+    {
+        CFStringRef key = CFArrayGetValueAtIndex(keys, i);
+        CFTypeRef val = STATS(STATS_PROPERTY, IORegistryEntryCreateCFProperty(o, key, NULL, 0));
+        if(val)
+        {
+            CFDictionarySetValue(dict, key, val);
+            CFRelease(val);
+        }
+    }
+    *p = dict;
+    return KERN_SUCCESS;
+}
+
+// Same as above, for properties that were already fetched as a whole.
+static CFTypeRef filterProps(CFTypeRef p, CFArrayRef keys)
+{
+    if(!keys || CFGetTypeID(p) != CFDictionaryGetTypeID())
+    {
+        return p;
+    }
+    CFMutableDictionaryRef dict = newProps();
+    if(dict)
+    {
+        for(CFIndex i = 0, num = CFArrayGetCount(keys); i < num; ++i)
+        {
+            CFStringRef key = CFArrayGetValueAtIndex(keys, i);
+            CFTypeRef val = CFDictionaryGetValue(p, key);
+            if(val)
+            {
+                CFDictionarySetValue(dict, key, val);
+            }
+        }
+    }
+    CFRelease(p);
+    return dict;
+}
+
+// Output goes to out, so that workers can format entries in parallel.
+// If set is non-NULL, it is applied as properties to every matching entry.
+// If keys is non-NULL, only those properties are fetched and printed.
+static bool printEntry(common_buf_t *out, io_object_t o, const char *plane, const char *match, bool hdr, bool xml, bool cfj, bool json, ioprint_format_t format, CFDictionaryRef set, CFArrayRef keys)
+{
+    io_name_t name;
+    kern_return_t ret = STATS(STATS_GET_NAME, IORegistryEntryGetName(o, name));
+    if(ret != KERN_SUCCESS)
+    {
+        ERR(COLOR_RED "IORegistryEntryGetName: %s" COLOR_RESET, mach_error_string(ret));
+        return false;
+    }
+    if(!match || STATS(STATS_CONFORMS, IOObjectConformsTo(o, match)) || strcmp(name, match) == 0)
+    {
+        io_name_t class;
+        ret = STATS(STATS_GET_CLASS, _IOObjectGetClass(o, kIOClassNameOverrideNone, class));
+        if(ret != KERN_SUCCESS)
+        {
+            ERR(COLOR_RED "class(%s): %s" COLOR_RESET, name, mach_error_string(ret));
+            return false;
+        }
+
+        if(format == FORMAT_NDJSON)
+        {
+            uint64_t id = 0;
+            io_string_t path;
+            STATS(STATS_ENTRY_ID, IORegistryEntryGetRegistryEntryID(o, &id));
+            bool hasPath = STATS(STATS_GET_PATH, IORegistryEntryGetPath(o, plane, path)) == KERN_SUCCESS;
+            CFMutableDictionaryRef p = NULL;
+            ret = copyProps(o, keys, &p);
+            uint64_t t = stats_begin(STATS_FORMAT);
+            printRecordHead(out, class, name, id, hasPath ? path : NULL);
+            if(ret == KERN_SUCCESS)
+            {
+                cfj_print_compact(out, p);
+                CFRelease(p);
+            }
+            printRecordTail(out, ret);
+            stats_end(STATS_FORMAT, t);
+            return true;
+        }
+        if(set)
+        {
+            kern_return_t ret = STATS(STATS_SET_PROPERTIES, IORegistryEntrySetCFProperties(o, set));
+            if(hdr)
+            {
+                common_buf_printf(out, "%s%s(%s):%s %s%s%s\n",
+                    COLOR_CYAN, class, name, COLOR_RESET,
+                    ret == KERN_SUCCESS ? COLOR_GREEN : COLOR_YELLOW, mach_error_string(ret), COLOR_RESET
+                );
+            }
+        }
+        if(xml || cfj || json)
+        {
+            CFMutableDictionaryRef p = NULL;
+            kern_return_t ret = copyProps(o, keys, &p);
+            if(hdr && !set)
+            {
+                common_buf_printf(out, "%s%s(%s):%s %s%s%s\n",
+                    COLOR_CYAN, class, name, COLOR_RESET,
+                    ret == KERN_SUCCESS ? COLOR_GREEN : COLOR_YELLOW, mach_error_string(ret), COLOR_RESET
+                );
+            }
+            if(ret == KERN_SUCCESS)
+            {
+                uint64_t t = stats_begin(STATS_FORMAT);
+                printProps(out, p, xml, cfj, json, format);
+                stats_end(STATS_FORMAT, t);
+                CFRelease(p);
+            }
+        }
+        else if(hdr && !set)
+        {
+            common_buf_printf(out, "%s%s(%s)%s\n", COLOR_CYAN, class, name, COLOR_RESET);
+        }
+    }
+    return true;
+}
+
+// Unless XML or only some keys are wanted, properties are printed straight from the snapshot.
+static void printSnapEntry(common_buf_t *out, oss_t *oss, const snap_t *snap, const snap_entry_t *entry, const char *match, bool hdr, bool xml, bool cfj, bool json, ioprint_format_t format, CFArrayRef keys)
+{
+    const char *name  = snap_str(snap, entry->name),
+               *class = snap_class_name(snap, entry->class);
+    if(match && !snap_conforms(snap, entry, match) && strcmp(name, match) != 0)
+    {
+        return;
+    }
+    if(xml || cfj || json)
+    {
+        kern_return_t ret = entry->propsRet;
+        CFTypeRef p = NULL;
+        bool raw = !xml && !keys;
+        size_t size = 0;
+        const uint8_t *data = NULL;
+        if(ret == KERN_SUCCESS)
+        {
+            data = snap_props(snap, entry, &size);
+            if(raw)
+            {
+                bool ok = format == FORMAT_PRETTY ? oss_format(oss, data, size, !cfj, cfj) : oss_format_compact(oss, data, size);
+                if(!data || !ok)
+                {
+                    ret = KERN_FAILURE;
+                }
+            }
+            else
+            {
+                p = data ? IOCFUnserializeWithSize((const char*)data, size, NULL, 0, NULL) : NULL;
+                p = p ? filterProps(p, keys) : NULL;
+                if(!p)
+                {
+                    ret = KERN_FAILURE;
+                }
+            }
+        }
+        if(format == FORMAT_NDJSON)
+        {
+            io_string_t path;
+            printRecordHead(out, class, name, entry->id, snapPath(snap, entry, path) ? path : NULL);
+            if(raw && ret == KERN_SUCCESS)
+            {
+                common_buf_write(out, oss->out.data, oss->out.len);
+            }
+            else if(p)
+            {
+                cfj_print_compact(out, p);
+                CFRelease(p);
+            }
+            printRecordTail(out, ret);
+            return;
+        }
+        if(hdr)
+        {
+            common_buf_printf(out, "%s%s(%s):%s %s%s%s\n",
+                COLOR_CYAN, class, name, COLOR_RESET,
+                ret == KERN_SUCCESS ? COLOR_GREEN : COLOR_YELLOW, mach_error_string(ret), COLOR_RESET
+            );
+        }
+        if(raw && ret == KERN_SUCCESS)
+        {
+            common_buf_write(out, oss->out.data, oss->out.len);
+            if(format == FORMAT_COMPACT)
+            {
+                common_buf_putc(out, '\n');
+            }
+            if(cfj && json && oss_format(oss, data, size, true, false))
+            {
+                common_buf_write(out, oss->out.data, oss->out.len);
+            }
+        }
+        if(p)
+        {
+            printProps(out, p, xml, cfj, json, format);
+            CFRelease(p);
+        }
+    }
+    else if(hdr)
+    {
+        common_buf_printf(out, "%s%s(%s)%s\n", COLOR_CYAN, class, name, COLOR_RESET);
+    }
+}
+
+// Entries after the root, either straight from the plane or, with -m and a name
+// filter on the IOService plane, from a list of kernel-side matches.
+typedef struct
+{
+    io_iterator_t it;
+    io_object_t *objs;
+    size_t num;
+    size_t idx;
+} ioprint_source_t;
+
+static void openSource(ioprint_source_t *src, const char *plane, const char *match, bool kmatch)
+{
+    src->it = MACH_PORT_NULL;
+    src->objs = NULL;
+    src->num = 0;
+    src->idx = 0;
+    if(!match || !kmatch || !match_services(plane, match, &src->objs, &src->num))
+    {
+        STATS(STATS_CREATE_ITERATOR, IORegistryCreateIterator(kIOMasterPortDefault, plane, kIORegistryIterateRecursively, &src->it));
+    }
+}
+
+static io_object_t nextEntry(ioprint_source_t *src)
+{
+    if(src->objs)
+    {
+        return src->idx < src->num ? src->objs[src->idx++] : MACH_PORT_NULL;
+    }
+    return MACH_PORT_VALID(src->it) ? STATS(STATS_ITERATOR_NEXT, IOIteratorNext(src->it)) : MACH_PORT_NULL;
+}
+
+static void closeSource(ioprint_source_t *src)
+{
+    if(src->objs)
+    {
+        while(src->idx < src->num)
+        {
+            IOObjectRelease(src->objs[src->idx++]);
+        }
+        free(src->objs);
+        src->objs = NULL;
+    }
+    if(MACH_PORT_VALID(src->it))
+    {
+        IOObjectRelease(src->it);
+        src->it = MACH_PORT_NULL;
+    }
+}
+
+// Frees out, if given, and flushes stdout. Write errors may only show up
+// here, since stdio buffers as well.
+static bool finishOutput(common_buf_t *out)
+{
+    bool err = false;
+    if(out)
+    {
+        common_buf_free(out);
+        err = out->err;
+    }
+    if(fflush(stdout) != 0 || ferror(stdout) || err)
+    {
+        ERR(COLOR_RED "Failed to write output" COLOR_RESET);
+        return false;
+    }
+    return true;
+}
+
+// Entries are handed out in iteration order through a window of slots.
+// Workers format them into the slot's buffer, and the main thread writes
+// finished slots out in order, so output is the same as with one thread.
+typedef struct
+{
+    io_object_t obj;
+    bool done;
+    bool succ;
+    common_buf_t out;
+} ioprint_slot_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    ioprint_slot_t *slots;
+    size_t window;
+    size_t queued;
+    size_t taken;
+    size_t written;
+    bool finished;
+    bool failed;
+    const char *plane;
+    const char *match;
+    bool hdr;
+    bool xml;
+    bool cfj;
+    bool json;
+    ioprint_format_t format;
+    CFDictionaryRef set;
+    CFArrayRef keys;
+} ioprint_pool_t;
+
+static void* printWorker(void *arg)
+{
+    ioprint_pool_t *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while(true)
+    {
+        while(pool->taken == pool->queued && !pool->finished)
+        {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if(pool->taken == pool->queued)
+        {
+            break;
+        }
+        ioprint_slot_t *slot = &pool->slots[pool->taken++ % pool->window];
+        pthread_mutex_unlock(&pool->lock);
+
+        slot->out.len = 0;
+        slot->succ = printEntry(&slot->out, slot->obj, pool->plane, pool->match, pool->hdr, pool->xml, pool->cfj, pool->json, pool->format, pool->set, pool->keys);
+        IOObjectRelease(slot->obj);
+
+        pthread_mutex_lock(&pool->lock);
+        slot->done = true;
+        pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Called with the lock held. Writes out finished slots in order.
+// If block is set, waits until at least the oldest one has been written.
+static void writeSlots(ioprint_pool_t *pool, bool block)
+{
+    while(pool->written < pool->queued)
+    {
+        ioprint_slot_t *slot = &pool->slots[pool->written % pool->window];
+        if(!slot->done)
+        {
+            if(!block)
+            {
+                break;
+            }
+            pthread_cond_wait(&pool->done, &pool->lock);
+            continue;
+        }
+        // Nobody else touches a finished slot, so the lock isn't needed for the write.
+        pthread_mutex_unlock(&pool->lock);
+        if(!slot->succ)
+        {
+            pool->failed = true;
+        }
+        else if(!pool->failed && slot->out.len > 0 && stats_fwrite(slot->out.data, slot->out.len, stdout) != slot->out.len)
+        {
+            pool->failed = true;
+        }
+        pthread_mutex_lock(&pool->lock);
+        ++pool->written;
+        block = false;
+    }
+}
+
+static bool queueEntry(ioprint_pool_t *pool, io_object_t o)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(pool->queued - pool->written >= pool->window)
+    {
+        writeSlots(pool, true);
+    }
+    ioprint_slot_t *slot = &pool->slots[pool->queued % pool->window];
+    slot->obj = o;
+    slot->done = false;
+    ++pool->queued;
+    pthread_cond_signal(&pool->work);
+    writeSlots(pool, false);
+    bool succ = !pool->failed;
+    pthread_mutex_unlock(&pool->lock);
+    return succ;
+}
+
+static bool printParallel(const char *plane, long threads, const char *match, bool kmatch, bool hdr, bool xml, bool cfj, bool json, ioprint_format_t format, CFDictionaryRef set, CFArrayRef keys)
+{
+    ioprint_pool_t pool =
+    {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .work = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+        .slots = NULL,
+        .window = threads * 16,
+        .queued = 0,
+        .taken = 0,
+        .written = 0,
+        .finished = false,
+        .failed = false,
+        .plane = plane,
+        .match = match,
+        .hdr = hdr,
+        .xml = xml,
+        .cfj = cfj,
+        .json = json,
+        .format = format,
+        .set = set,
+        .keys = keys,
+    };
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    pool.slots = malloc(pool.window * sizeof(ioprint_slot_t));
+    if(!workers || !pool.slots)
+    {
+        ERR(COLOR_RED "Failed to allocate workers: %s" COLOR_RESET, strerror(errno));
+        free(workers);
+        free(pool.slots);
+        return false;
+    }
+    for(size_t i = 0; i < pool.window; ++i)
+    {
+        common_buf_init(&pool.slots[i].out, NULL);
+    }
+    long started = 0;
+    for(; started < threads; ++started)
+    {
+        int r = pthread_create(&workers[started], NULL, &printWorker, &pool);
+        if(r != 0)
+        {
+            ERR(COLOR_YELLOW "Failed to spawn thread %ld: %s" COLOR_RESET, started, strerror(r));
+            break;
+        }
+    }
+
+    bool succ = started > 0;
+    if(succ)
+    {
+        succ = queueEntry(&pool, STATS(STATS_ROOT_ENTRY, IORegistryGetRootEntry(kIOMasterPortDefault)));
+        if(succ)
+        {
+            ioprint_source_t src;
+            openSource(&src, plane, match, kmatch);
+            io_object_t o;
+            while(succ && (o = nextEntry(&src)) != 0)
+            {
+                succ = queueEntry(&pool, o);
+            }
+            closeSource(&src);
+        }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.finished = true;
+    pthread_cond_broadcast(&pool.work);
+    while(pool.written < pool.queued)
+    {
+        writeSlots(&pool, true);
+    }
+    succ = succ && !pool.failed;
+    pthread_mutex_unlock(&pool.lock);
+    for(long t = 0; t < started; ++t)
+    {
+        pthread_join(workers[t], NULL);
+    }
+
+    for(size_t i = 0; i < pool.window; ++i)
+    {
+        common_buf_free(&pool.slots[i].out);
+    }
+    free(pool.slots);
+    free(workers);
+    return finishOutput(NULL) && succ;
+}
+
+// Superclasses are looked up once per class, not once per entry.
+static uint32_t snapClass(snap_writer_t *w, const char *name)
+{
+    bool added = false;
+    uint32_t idx = snap_writer_class(w, name, &added),
+             cur = idx;
+    CFStringRef class = added ? CFStringCreateWithCString(NULL, name, kCFStringEncodingUTF8) : NULL;
+    while(class && added && cur != SNAP_NONE)
+    {
+        CFStringRef super = STATS(STATS_SUPERCLASS, IOObjectCopySuperclassForClass(class));
+        CFRelease(class);
+        class = super;
+        size_t len = 0;
+        const char *str = class ? cfj_cstr(class, &len) : NULL;
+        if(!str)
+        {
+            break;
+        }
+        uint32_t next = snap_writer_class(w, str, &added);
+        snap_writer_super(w, cur, next);
+        cur = next;
+    }
+    if(class)
+    {
+        CFRelease(class);
+    }
+    return idx;
+}
+
+static uint32_t snapEntry(snap_writer_t *w, io_object_t o, uint32_t parent, uint32_t depth)
+{
+    io_name_t name,
+              class;
+    uint64_t id = 0;
+    if(STATS(STATS_GET_NAME, IORegistryEntryGetName(o, name)) != KERN_SUCCESS)
+    {
+        name[0] = '\0';
+    }
+    if(STATS(STATS_GET_CLASS, _IOObjectGetClass(o, kIOClassNameOverrideNone, class)) != KERN_SUCCESS)
+    {
+        class[0] = '\0';
+    }
+    STATS(STATS_ENTRY_ID, IORegistryEntryGetRegistryEntryID(o, &id));
+
+    CFMutableDictionaryRef p = NULL;
+    CFDataRef data = NULL;
+    kern_return_t ret = STATS(STATS_PROPERTIES, IORegistryEntryCreateCFProperties(o, &p, NULL, 0));
+    if(ret == KERN_SUCCESS)
+    {
+        data = IOCFSerialize(p, kIOCFSerializeToBinary);
+        CFRelease(p);
+        if(!data)
+        {
+            ret = KERN_FAILURE;
+        }
+    }
+    uint32_t idx = snap_writer_entry(w, id, name, snapClass(w, class), parent, depth, ret,
+                                     data ? CFDataGetBytePtr(data) : NULL, data ? CFDataGetLength(data) : 0);
+    if(data)
+    {
+        CFRelease(data);
+    }
+    return idx;
+}
+
+typedef struct
+{
+    io_iterator_t it;
+    uint32_t idx;
+    uint32_t depth;
+} snap_level_t;
+
+// Same order as a recursive registry iterator, but we need to know parents.
+static bool dumpPlane(const char *plane, const char *path)
+{
+    snap_writer_t w;
+    snap_writer_init(&w);
+
+    size_t num = 0x40,
+           lvl = 0;
+    snap_level_t *stack = malloc(num * sizeof(snap_level_t));
+    if(!stack)
+    {
+        ERR(COLOR_RED "Failed to allocate stack: %s" COLOR_RESET, strerror(errno));
+        snap_writer_free(&w);
+        return false;
+    }
+
+    io_object_t o = STATS(STATS_ROOT_ENTRY, IORegistryGetRootEntry(kIOMasterPortDefault));
+    uint32_t idx = snapEntry(&w, o, SNAP_NONE, 0);
+    if(STATS(STATS_CHILD_ITERATOR, IORegistryEntryGetChildIterator(o, plane, &stack[lvl].it)) == KERN_SUCCESS)
+    {
+        stack[lvl].idx = idx;
+        stack[lvl].depth = 1;
+        ++lvl;
+    }
+    IOObjectRelease(o);
+
+    bool succ = true;
+    while(lvl > 0)
+    {
+        snap_level_t *cur = &stack[lvl - 1];
+        o = STATS(STATS_ITERATOR_NEXT, IOIteratorNext(cur->it));
+        if(!o)
+        {
+            IOObjectRelease(cur->it);
+            --lvl;
+            continue;
+        }
+        idx = snapEntry(&w, o, cur->idx, cur->depth);
+        if(lvl >= num)
+        {
+            num *= 2;
+            snap_level_t *tmp = realloc(stack, num * sizeof(snap_level_t));
+            if(!tmp)
+            {
+                ERR(COLOR_RED "Failed to reallocate stack: %s" COLOR_RESET, strerror(errno));
+                IOObjectRelease(o);
+                succ = false;
+                break;
+            }
+            stack = tmp;
+            cur = &stack[lvl - 1];
+        }
+        if(STATS(STATS_CHILD_ITERATOR, IORegistryEntryGetChildIterator(o, plane, &stack[lvl].it)) == KERN_SUCCESS)
+        {
+            stack[lvl].idx = idx;
+            stack[lvl].depth = cur->depth + 1;
+            ++lvl;
+        }
+        IOObjectRelease(o);
+    }
+    while(lvl > 0)
+    {
+        IOObjectRelease(stack[--lvl].it);
+    }
+    free(stack);
+
+    if(succ)
+    {
+        succ = snap_writer_save(&w, path, plane);
+    }
+    snap_writer_free(&w);
+    return succ;
+}
+
+// Entries whose properties can't be decoded are kept, as if fetching them had failed.
+static bool compactAdd(compact_writer_t *w, const char *class, const char *name, kern_return_t ret, const void *props, size_t size)
+{
+    uint64_t t = stats_begin(STATS_FORMAT);
+    bool succ = compact_writer_entry(w, class, name, ret, props, size) ||
+                (!w->err && compact_writer_entry(w, class, name, KERN_FAILURE, NULL, 0));
+    stats_end(STATS_FORMAT, t);
+    return succ;
+}
+
+static bool compactEntry(compact_writer_t *w, io_object_t o, const char *match, CFArrayRef keys)
+{
+    io_name_t name;
+    kern_return_t ret = STATS(STATS_GET_NAME, IORegistryEntryGetName(o, name));
+    if(ret != KERN_SUCCESS)
+    {
+        ERR(COLOR_RED "IORegistryEntryGetName: %s" COLOR_RESET, mach_error_string(ret));
+        return false;
+    }
+    if(match && !STATS(STATS_CONFORMS, IOObjectConformsTo(o, match)) && strcmp(name, match) != 0)
+    {
+        return true;
+    }
+    io_name_t class;
+    ret = STATS(STATS_GET_CLASS, _IOObjectGetClass(o, kIOClassNameOverrideNone, class));
+    if(ret != KERN_SUCCESS)
+    {
+        ERR(COLOR_RED "class(%s): %s" COLOR_RESET, name, mach_error_string(ret));
+        return false;
+    }
+    CFMutableDictionaryRef p = NULL;
+    CFDataRef data = NULL;
+    ret = copyProps(o, keys, &p);
+    if(ret == KERN_SUCCESS)
+    {
+        data = IOCFSerialize(p, kIOCFSerializeToBinary);
+        CFRelease(p);
+        if(!data)
+        {
+            ret = KERN_FAILURE;
+        }
+    }
+    bool succ = compactAdd(w, class, name, ret, data ? CFDataGetBytePtr(data) : NULL, data ? CFDataGetLength(data) : 0);
+    if(data)
+    {
+        CFRelease(data);
+    }
+    return succ;
+}
+
+static bool compactSnapEntry(compact_writer_t *w, const snap_t *snap, const snap_entry_t *entry, const char *match, CFArrayRef keys)
+{
+    const char *name  = snap_str(snap, entry->name),
+               *class = snap_class_name(snap, entry->class);
+    if(match && !snap_conforms(snap, entry, match) && strcmp(name, match) != 0)
+    {
+        return true;
+    }
+    kern_return_t ret = entry->propsRet;
+    size_t size = 0;
+    const uint8_t *data = ret == KERN_SUCCESS ? snap_props(snap, entry, &size) : NULL;
+    CFDataRef filtered = NULL;
+    if(data && keys)
+    {
+        CFTypeRef p = IOCFUnserializeWithSize((const char*)data, size, NULL, 0, NULL);
+        p = p ? filterProps(p, keys) : NULL;
+        if(p)
+        {
+            filtered = IOCFSerialize(p, kIOCFSerializeToBinary);
+            CFRelease(p);
+        }
+        data = filtered ? CFDataGetBytePtr(filtered) : NULL;
+        size = filtered ? CFDataGetLength(filtered) : 0;
+    }
+    bool succ = compactAdd(w, class, name, ret, data, size);
+    if(filtered)
+    {
+        CFRelease(filtered);
+    }
+    return succ;
+}
+
+// Same entries as -j would print, but as one compact dump for ioexpand.
+static bool dumpCompact(const char *plane, const char *snapIn, const char *match, bool kmatch, CFArrayRef keys)
+{
+    if(isatty(STDOUT_FILENO))
+    {
+        ERR(COLOR_RED "Not writing a compact dump to a terminal, redirect stdout" COLOR_RESET);
+        return false;
+    }
+    compact_writer_t w;
+    compact_writer_init(&w);
+    bool succ = true;
+    if(snapIn)
+    {
+        snap_t snap;
+        succ = snap_open(&snap, snapIn);
+        if(succ)
+        {
+            for(uint32_t i = 0; succ && i < snap.hdr->numEntries; ++i)
+            {
+                succ = compactSnapEntry(&w, &snap, &snap.entries[i], match, keys);
+            }
+            snap_close(&snap);
+        }
+    }
+    else
+    {
+        io_object_t o = STATS(STATS_ROOT_ENTRY, IORegistryGetRootEntry(kIOMasterPortDefault));
+        succ = compactEntry(&w, o, match, keys);
+        IOObjectRelease(o);
+        if(succ)
+        {
+            ioprint_source_t src;
+            openSource(&src, plane, match, kmatch);
+            while(succ && (o = nextEntry(&src)) != 0)
+            {
+                succ = compactEntry(&w, o, match, keys);
+                IOObjectRelease(o);
+            }
+            closeSource(&src);
+        }
+    }
+    if(succ)
+    {
+        succ = compact_writer_write(&w, stdout);
+    }
+    compact_writer_free(&w);
+    return succ;
+}
+
+// Services seen by --watch, with their properties as of the last record,
+// so that a change notification can be turned into a list of changed keys.
+typedef struct
+{
+    uint64_t id;
+    io_object_t obj;
+    io_object_t notif;
+    CFDataRef props;
+    io_name_t class;
+    io_name_t name;
+} watch_entry_t;
+
+typedef struct
+{
+    watch_entry_t **entries;    // sorted by registry ID
+    size_t num;
+    size_t cap;
+    IONotificationPortRef port;
+    oss_t old;
+    oss_t new;
+    common_buf_t out;
+    const char *match;
+    bool xml;
+    bool cfj;
+    bool json;
+    CFArrayRef keys;
+    bool failed;
+} watch_t;
+
+// Returns whether id is known, and either way the position where it is or would go.
+static bool watchFind(const watch_t *w, uint64_t id, size_t *pos)
+{
+    size_t lo = 0,
+           hi = w->num;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        uint64_t cur = w->entries[mid]->id;
+        if(cur == id)
+        {
+            *pos = mid;
+            return true;
+        }
+        if(cur < id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    return false;
+}
+
+static void watchFail(watch_t *w)
+{
+    w->failed = true;
+    CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+static void watchFlush(watch_t *w)
+{
+    common_buf_flush(&w->out);
+    if(fflush(stdout) != 0 || w->out.err)
+    {
+        watchFail(w);
+    }
+}
+
+static void watchLine(watch_t *w, const watch_entry_t *e, char sign, const char *color)
+{
+    common_buf_printf(&w->out, "%s%c 0x%llx %s(%s)%s\n", color, sign, (unsigned long long)e->id, e->class, e->name, COLOR_RESET);
+}
+
+// Returns the serialized properties, and prints them if print is set.
+static CFDataRef watchProps(watch_t *w, const watch_entry_t *e, bool print)
+{
+    CFMutableDictionaryRef p = NULL;
+    kern_return_t ret = copyProps(e->obj, w->keys, &p);
+    if(ret != KERN_SUCCESS)
+    {
+        if(print)
+        {
+            common_buf_printf(&w->out, "    %sproperties: %s%s\n", COLOR_YELLOW, mach_error_string(ret), COLOR_RESET);
+        }
+        return NULL;
+    }
+    if(print)
+    {
+        uint64_t t = stats_begin(STATS_FORMAT);
+        printProps(&w->out, p, w->xml, w->cfj, w->json, FORMAT_PRETTY);
+        stats_end(STATS_FORMAT, t);
+    }
+    CFDataRef data = IOCFSerialize(p, kIOCFSerializeToBinary);
+    CFRelease(p);
+    return data;
+}
+
+static void watchKey(watch_t *w, oss_t *oss, const oss_key_t *key, char sign, const char *color)
+{
+    common_ctx_t ctx =
     {
-        CFStringRef key = CFSTR("herp");
-        CFStringRef val = CFSTR("derp");
-        dict = CFDictionaryCreate(NULL, (const void**)&key, (const void**)&val, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-        if(dict == NULL)
+        .true_json = !w->cfj,
+        .bytes_raw = w->cfj,
+        .first = false,
+        .lvl = 1,
+        .out = &w->out,
+    };
+    common_buf_printf(&w->out, "    %s%c%s \"", color, sign, COLOR_RESET);
+    if(ctx.true_json)
+    {
+        common_print_str(&ctx, (const char*)key->str, key->len);
+    }
+    else
+    {
+        common_buf_write(&w->out, key->str, key->len);
+    }
+    common_buf_write(&w->out, "\": ", 3);
+    if(oss_format_at(oss, key->off, 1, ctx.true_json, ctx.bytes_raw))
+    {
+        common_buf_write(&w->out, oss->out.data, oss->out.len);
+    }
+    else
+    {
+        common_buf_puts(&w->out, "<!-- error -->");
+    }
+    common_buf_putc(&w->out, '\n');
+}
+
+static void watchDiff(watch_t *w, CFDataRef a, CFDataRef b)
+{
+    if(!a || !b || !oss_keys(&w->old, CFDataGetBytePtr(a), CFDataGetLength(a)) || !oss_keys(&w->new, CFDataGetBytePtr(b), CFDataGetLength(b)))
+    {
+        common_buf_puts(&w->out, "    properties unavailable\n");
+        return;
+    }
+    const oss_key_t *keysA = w->old.keys,
+                    *keysB = w->new.keys;
+    size_t numA = w->old.numKeys,
+           numB = w->new.numKeys;
+    for(size_t i = 0, j = 0; i < numA || j < numB; )
+    {
+        int cmp = i >= numA ? 1 : j >= numB ? -1 : oss_key_cmp(&keysA[i], &keysB[j]);
+        if(cmp <= 0 && (cmp < 0 || keysA[i].hash != keysB[j].hash))
         {
-            ERR(COLOR_RED "Failed to create dict" COLOR_RESET);
-            return false;
+            watchKey(w, &w->old, &keysA[i], '-', COLOR_RED);
+        }
+        if(cmp >= 0 && (cmp > 0 || keysA[i].hash != keysB[j].hash))
+        {
+            watchKey(w, &w->new, &keysB[j], '+', COLOR_GREEN);
+        }
+        i += cmp <= 0;
+        j += cmp >= 0;
+    }
+}
+
+static void watchFree(watch_entry_t *e)
+{
+    if(MACH_PORT_VALID(e->notif))
+    {
+        IOObjectRelease(e->notif);
+    }
+    if(e->props)
+    {
+        CFRelease(e->props);
+    }
+    IOObjectRelease(e->obj);
+    free(e);
+}
+
+static void watchInterest(void *refcon, io_service_t service, uint32_t messageType, void *messageArgument)
+{
+    watch_t *w = refcon;
+    uint64_t id = 0;
+    size_t pos = 0;
+    if(messageType != kIOMessageServicePropertyChange || STATS(STATS_ENTRY_ID, IORegistryEntryGetRegistryEntryID(service, &id)) != KERN_SUCCESS || !watchFind(w, id, &pos))
+    {
+        return;
+    }
+    watch_entry_t *e = w->entries[pos];
+    CFDataRef data = watchProps(w, e, false);
+    if((!data && !e->props) || (data && e->props && CFEqual(data, e->props)))
+    {
+        if(data)
+        {
+            CFRelease(data);
         }
+        return;
     }
+    watchLine(w, e, '~', COLOR_CYAN);
+    uint64_t t = stats_begin(STATS_FORMAT);
+    watchDiff(w, e->props, data);
+    stats_end(STATS_FORMAT, t);
+    if(e->props)
+    {
+        CFRelease(e->props);
+    }
+    e->props = data;
+    watchFlush(w);
+}
 
+// Takes the reference to o.
+static void watchAdd(watch_t *w, io_object_t o)
+{
+    uint64_t id = 0;
+    size_t pos = 0;
     io_name_t name;
-    kern_return_t ret = IORegistryEntryGetName(o, name);
-    if(ret != KERN_SUCCESS)
+    if(STATS(STATS_ENTRY_ID, IORegistryEntryGetRegistryEntryID(o, &id)) != KERN_SUCCESS || watchFind(w, id, &pos) ||
+       STATS(STATS_GET_NAME, IORegistryEntryGetName(o, name)) != KERN_SUCCESS ||
+       (w->match && !STATS(STATS_CONFORMS, IOObjectConformsTo(o, w->match)) && strcmp(name, w->match) != 0))
     {
-        ERR(COLOR_RED "IORegistryEntryGetName: %s" COLOR_RESET, mach_error_string(ret));
+        IOObjectRelease(o);
+        return;
+    }
+    if(w->num >= w->cap)
+    {
+        size_t cap = w->cap ? w->cap * 2 : 0x100;
+        watch_entry_t **entries = realloc(w->entries, cap * sizeof(*entries));
+        if(!entries)
+        {
+            ERR(COLOR_RED "Failed to allocate watch list: %s" COLOR_RESET, strerror(errno));
+            IOObjectRelease(o);
+            watchFail(w);
+            return;
+        }
+        w->entries = entries;
+        w->cap = cap;
+    }
+    watch_entry_t *e = malloc(sizeof(*e));
+    if(!e)
+    {
+        ERR(COLOR_RED "Failed to allocate watch entry: %s" COLOR_RESET, strerror(errno));
+        IOObjectRelease(o);
+        watchFail(w);
+        return;
+    }
+    e->id = id;
+    e->obj = o;
+    e->notif = MACH_PORT_NULL;
+    e->props = NULL;
+    strlcpy(e->name, name, sizeof(e->name));
+    if(STATS(STATS_GET_CLASS, _IOObjectGetClass(o, kIOClassNameOverrideNone, e->class)) != KERN_SUCCESS)
+    {
+        e->class[0] = '\0';
+    }
+    memmove(&w->entries[pos + 1], &w->entries[pos], (w->num - pos) * sizeof(*w->entries));
+    w->entries[pos] = e;
+    ++w->num;
+
+    // Subscribe before fetching, so that no change can slip in between.
+    STATS(STATS_INTEREST_NOTIFICATION, IOServiceAddInterestNotification(w->port, o, kIOGeneralInterest, &watchInterest, w, &e->notif));
+    watchLine(w, e, '+', COLOR_GREEN);
+    e->props = watchProps(w, e, w->xml || w->cfj || w->json);
+}
+
+static void watchAdded(void *refcon, io_iterator_t it)
+{
+    watch_t *w = refcon;
+    io_object_t o;
+    while((o = STATS(STATS_ITERATOR_NEXT, IOIteratorNext(it))) != 0)
+    {
+        watchAdd(w, o);
+    }
+    watchFlush(w);
+}
+
+static void watchRemoved(void *refcon, io_iterator_t it)
+{
+    watch_t *w = refcon;
+    io_object_t o;
+    while((o = STATS(STATS_ITERATOR_NEXT, IOIteratorNext(it))) != 0)
+    {
+        uint64_t id = 0;
+        size_t pos = 0;
+        if(STATS(STATS_ENTRY_ID, IORegistryEntryGetRegistryEntryID(o, &id)) == KERN_SUCCESS && watchFind(w, id, &pos))
+        {
+            watch_entry_t *e = w->entries[pos];
+            watchLine(w, e, '-', COLOR_RED);
+            memmove(&w->entries[pos], &w->entries[pos + 1], (w->num - pos - 1) * sizeof(*w->entries));
+            --w->num;
+            watchFree(e);
+        }
+        IOObjectRelease(o);
+    }
+    watchFlush(w);
+}
+
+// Prints all matching services once, then only what changes, until the run loop is stopped.
+static bool watchServices(const char *match, bool xml, bool cfj, bool json, CFArrayRef keys)
+{
+    watch_t w =
+    {
+        .entries = NULL,
+        .num = 0,
+        .cap = 0,
+        .port = IONotificationPortCreate(kIOMasterPortDefault),
+        .match = match,
+        .xml = xml,
+        .cfj = cfj,
+        .json = json,
+        .keys = keys,
+        .failed = false,
+    };
+    if(!w.port)
+    {
+        ERR(COLOR_RED "Failed to create notification port" COLOR_RESET);
         return false;
     }
-    if(!match || IOObjectConformsTo(o, match) || strcmp(name, match) == 0)
+    oss_init(&w.old);
+    oss_init(&w.new);
+    common_buf_init(&w.out, stdout);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), IONotificationPortGetRunLoopSource(w.port), kCFRunLoopDefaultMode);
+
+    CFMutableDictionaryRef dicts[2];
+    io_iterator_t added[2] = {},
+                  removed[2] = {};
+    size_t num = match_dicts(match, dicts);
+    bool succ = num > 0;
+    for(size_t i = 0; i < num; ++i)
     {
-        io_name_t class;
-        ret = _IOObjectGetClass(o, kIOClassNameOverrideNone, class);
+        // Both calls consume the dict.
+        CFRetain(dicts[i]);
+        kern_return_t ret = STATS(STATS_MATCHING_NOTIFICATION, IOServiceAddMatchingNotification(w.port, kIOFirstMatchNotification, dicts[i], &watchAdded, &w, &added[i]));
+        if(ret == KERN_SUCCESS)
+        {
+            ret = STATS(STATS_MATCHING_NOTIFICATION, IOServiceAddMatchingNotification(w.port, kIOTerminatedNotification, dicts[i], &watchRemoved, &w, &removed[i]));
+        }
+        else
+        {
+            CFRelease(dicts[i]);
+        }
         if(ret != KERN_SUCCESS)
         {
-            ERR(COLOR_RED "class(%s): %s" COLOR_RESET, name, mach_error_string(ret));
-            return false;
+            ERR(COLOR_RED "IOServiceAddMatchingNotification: %s" COLOR_RESET, mach_error_string(ret));
+            succ = false;
+        }
+    }
+    if(succ)
+    {
+        // Draining the iterators prints the initial state and arms the notifications.
+        for(size_t i = 0; i < num; ++i)
+        {
+            watchAdded(&w, added[i]);
+            watchRemoved(&w, removed[i]);
+        }
+        if(!w.failed)
+        {
+            CFRunLoopRun();
         }
+        succ = !w.failed;
+    }
 
-        if(set)
+    for(size_t i = 0; i < num; ++i)
+    {
+        if(MACH_PORT_VALID(added[i]))
         {
-            kern_return_t ret = IORegistryEntrySetCFProperties(o, dict);
-            if(hdr)
-            {
-                LOG("%s%s(%s):%s %s%s%s",
-                    COLOR_CYAN, class, name, COLOR_RESET,
-                    ret == KERN_SUCCESS ? COLOR_GREEN : COLOR_YELLOW, mach_error_string(ret), COLOR_RESET
-                );
-            }
+            IOObjectRelease(added[i]);
         }
-        if(xml || cfj || json)
+        if(MACH_PORT_VALID(removed[i]))
         {
-            CFMutableDictionaryRef p = NULL;
-            kern_return_t ret = IORegistryEntryCreateCFProperties(o, &p, NULL, 0);
-            if(hdr && !set)
-            {
-                LOG("%s%s(%s):%s %s%s%s",
-                    COLOR_CYAN, class, name, COLOR_RESET,
-                    ret == KERN_SUCCESS ? COLOR_GREEN : COLOR_YELLOW, mach_error_string(ret), COLOR_RESET
-                );
-            }
-            if(ret == KERN_SUCCESS)
+            IOObjectRelease(removed[i]);
+        }
+    }
+    for(size_t i = 0; i < w.num; ++i)
+    {
+        watchFree(w.entries[i]);
+    }
+    free(w.entries);
+    IONotificationPortDestroy(w.port);
+    common_buf_free(&w.out);
+    oss_free(&w.old);
+    oss_free(&w.new);
+    return succ;
+}
+
+static CFArrayRef parseKeys(const char *list)
+{
+    size_t max = 1;
+    for(const char *c = list; *c; ++c)
+    {
+        if(*c == ',')
+        {
+            ++max;
+        }
+    }
+    CFStringRef *strs = malloc(max * sizeof(CFStringRef));
+    if(!strs)
+    {
+        ERR(COLOR_RED "Failed to allocate key list: %s" COLOR_RESET, strerror(errno));
+        return NULL;
+    }
+    size_t num = 0;
+    bool succ = true;
+    for(const char *start = list; succ; ++start)
+    {
+        const char *end = strchr(start, ',');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        if(len > 0)
+        {
+            strs[num] = CFStringCreateWithBytes(NULL, (const UInt8*)start, len, kCFStringEncodingUTF8, false);
+            if(!strs[num])
             {
-                if(xml)
-                {
-                    CFDataRef prop = CFPropertyListCreateData(NULL, p, kCFPropertyListXMLFormat_v1_0, 0, NULL);
-                    if(prop)
-                    {
-                        LOG("%.*s", (int)CFDataGetLength(prop), CFDataGetBytePtr(prop));
-                        CFRelease(prop);
-                    }
-                    else
-                    {
-                        CFShow(p);
-                    }
-                }
-                if(cfj)
-                {
-                    cfj_print(stdout, p, false, true);
-                }
-                if(json)
-                {
-                    cfj_print(stdout, p, true, false);
-                }
-                CFRelease(p);
+                ERR(COLOR_RED "Invalid key: %.*s" COLOR_RESET, (int)len, start);
+                succ = false;
+                break;
             }
+            ++num;
         }
-        else if(hdr && !set)
+        if(!end)
         {
-            LOG("%s%s(%s)%s", COLOR_CYAN, class, name, COLOR_RESET);
+            break;
         }
+        start = end;
     }
-    return true;
+    CFArrayRef keys = NULL;
+    if(succ)
+    {
+        keys = CFArrayCreate(NULL, (const void**)strs, num, &kCFTypeArrayCallBacks);
+        if(!keys)
+        {
+            ERR(COLOR_RED "Failed to create key list" COLOR_RESET);
+        }
+    }
+    for(size_t i = 0; i < num; ++i)
+    {
+        CFRelease(strs[i]);
+    }
+    free(strs);
+    return keys;
 }
 
 static void print_help(const char *self)
@@ -117,13 +1351,24 @@ static void print_help(const char *self)
                     "    If name is given, only entries with matching class or instance name are considered.\n"
                     "\n"
                     "Options:\n"
+                    "    -c          Write a compact dump of the entries and their properties to stdout, for ioexpand\n"
                     "    -d          Print IOKit properties in XML format\n"
                     "    -h          Print this help and exit\n"
                     "    -j          Print IOKit properties in JSON format\n"
                     "    -k          Print IOKit properties in mix between JSON and hexdump\n"
+                    "    -K keys     Only fetch and print the given comma-separated properties (implies -j if no other format is given)\n"
+                    "    -m          Let the kernel find services matching name (IOService plane only, see README)\n"
                     "    -o          Print only IOKit properties and nothing else\n"
                     "    -p plane    Iterate over the given registry plane (default: IOService)\n"
+                    "    -r file     Read entries from a snapshot file instead of the live registry\n"
                     "    -s          Try to set the entries' properties\n"
+                    "    -t num      Fetch and format properties on num threads, 0 for one per CPU (default: 1)\n"
+                    "    -w file     Write a snapshot of the whole plane to file and exit\n"
+                    "    --format f  Print -j output as pretty (default), compact (no whitespace) or ndjson\n"
+                    "                (one JSON object per entry with class, name, id, path and properties)\n"
+                    "    --stats     Print call counts, latencies, bytes written and peak RSS to stderr on exit\n"
+                    "                (--stats=json for a single JSON object instead of a table)\n"
+                    "    --watch     Print all matching services, then only services that appear, disappear or change\n"
            , self
     );
 }
@@ -134,8 +1379,16 @@ int main(int argc, const char **argv)
          xml  = false,
          cfj  = false,
          json = false,
-         set  = false;
-    const char *plane = "IOService";
+         set  = false,
+         compact = false,
+         kmatch = false,
+         watch = false;
+    ioprint_format_t format = FORMAT_PRETTY;
+    long threads = 1;
+    const char *plane = "IOService",
+               *keyList = NULL,
+               *snapIn = NULL,
+               *snapOut = NULL;
     int aoff;
     for(aoff = 1; aoff < argc; ++aoff)
     {
@@ -143,6 +1396,44 @@ int main(int argc, const char **argv)
         {
             break;
         }
+        if(strcmp(argv[aoff], "--watch") == 0)
+        {
+            watch = true;
+            continue;
+        }
+        if(strcmp(argv[aoff], "--stats") == 0 || strcmp(argv[aoff], "--stats=json") == 0)
+        {
+            stats_enable(argv[aoff][7] == '=');
+            continue;
+        }
+        if(strcmp(argv[aoff], "--format") == 0)
+        {
+            if(++aoff >= argc)
+            {
+                ERR(COLOR_RED "Missing argument to --format" COLOR_RESET);
+                printf("\n");
+                print_help(argv[0]);
+                return -1;
+            }
+            if(strcmp(argv[aoff], "pretty") == 0)
+            {
+                format = FORMAT_PRETTY;
+            }
+            else if(strcmp(argv[aoff], "compact") == 0)
+            {
+                format = FORMAT_COMPACT;
+            }
+            else if(strcmp(argv[aoff], "ndjson") == 0)
+            {
+                format = FORMAT_NDJSON;
+            }
+            else
+            {
+                ERR(COLOR_RED "Unknown format: %s" COLOR_RESET, argv[aoff]);
+                return -1;
+            }
+            continue;
+        }
         bool opt = true;
         for(size_t i = 1; opt; ++i)
         {
@@ -157,6 +1448,10 @@ int main(int argc, const char **argv)
                     print_help(argv[0]);
                     return -1;
 
+                case 'c':
+                    compact = true;
+                    break;
+
                 case 'd':
                     xml = true;
                     break;
@@ -169,6 +1464,10 @@ int main(int argc, const char **argv)
                     cfj = true;
                     break;
 
+                case 'm':
+                    kmatch = true;
+                    break;
+
                 case 'o':
                     hdr = false;
                     break;
@@ -189,6 +1488,40 @@ int main(int argc, const char **argv)
                     opt = false;
                     break;
 
+                case 't':
+                {
+                    if(argv[aoff][i+1] != '\0' || ++aoff >= argc)
+                    {
+                        ERR(COLOR_RED "Missing argument to -t" COLOR_RESET);
+                        printf("\n");
+                        print_help(argv[0]);
+                        return -1;
+                    }
+                    char *end = NULL;
+                    threads = strtol(argv[aoff], &end, 0);
+                    if(*end != '\0' || threads < 0)
+                    {
+                        ERR(COLOR_RED "Invalid thread count: %s" COLOR_RESET, argv[aoff]);
+                        return -1;
+                    }
+                    opt = false;
+                    break;
+                }
+
+                case 'K':
+                case 'r':
+                case 'w':
+                    if(argv[aoff][i+1] != '\0' || ++aoff >= argc)
+                    {
+                        ERR(COLOR_RED "Missing argument to -%c" COLOR_RESET, c);
+                        printf("\n");
+                        print_help(argv[0]);
+                        return -1;
+                    }
+                    *(c == 'K' ? &keyList : c == 'r' ? &snapIn : &snapOut) = argv[aoff];
+                    opt = false;
+                    break;
+
                 default:
                     ERR(COLOR_RED "Unrecognized argument: %s" COLOR_RESET, argv[aoff]);
                     printf("\n");
@@ -199,21 +1532,155 @@ int main(int argc, const char **argv)
     }
 
     const char *match = aoff < argc ? argv[aoff] : NULL;
-    io_object_t o = IORegistryGetRootEntry(kIOMasterPortDefault);
-    bool succ = printEntry(o, match, hdr, xml, cfj, json, set);
-    IOObjectRelease(o);
-    if(!succ)
+    if(snapOut)
+    {
+        if(match || snapIn || set || keyList || compact || watch || format != FORMAT_PRETTY)
+        {
+            ERR(COLOR_RED "-w always snapshots the whole live plane" COLOR_RESET);
+            return -1;
+        }
+        return dumpPlane(plane, snapOut) ? 0 : -1;
+    }
+
+    if(compact && (xml || cfj || json || set || !hdr || watch))
+    {
+        ERR(COLOR_RED "-c can't be combined with -d, -j, -k, -o, -s or --watch" COLOR_RESET);
+        return -1;
+    }
+    if(format != FORMAT_PRETTY)
+    {
+        if(xml || cfj || set || compact || watch)
+        {
+            ERR(COLOR_RED "--format only applies to -j, and can't be combined with -c, -d, -k, -s or --watch" COLOR_RESET);
+            return -1;
+        }
+        json = true;
+    }
+    if(watch && (snapIn || set || !hdr || strcmp(plane, "IOService") != 0))
     {
+        ERR(COLOR_RED "--watch only works on the live IOService plane, and not with -o, -r or -s" COLOR_RESET);
         return -1;
     }
 
-    int retval = 0;
-    io_iterator_t it = MACH_PORT_NULL;
-    if(IORegistryCreateIterator(kIOMasterPortDefault, plane, kIORegistryIterateRecursively, &it) == KERN_SUCCESS)
+    CFArrayRef keys = NULL;
+    if(keyList)
+    {
+        keys = parseKeys(keyList);
+        if(!keys)
+        {
+            return -1;
+        }
+        if(!xml && !cfj && !json && !compact)
+        {
+            json = true;
+        }
+    }
+    if(compact)
+    {
+        bool succ = dumpCompact(plane, snapIn, match, kmatch, keys);
+        if(keys)
+        {
+            CFRelease(keys);
+        }
+        return succ ? 0 : -1;
+    }
+    if(watch)
+    {
+        bool succ = watchServices(match, xml, cfj, json, keys);
+        if(keys)
+        {
+            CFRelease(keys);
+        }
+        return succ ? 0 : -1;
+    }
+    if(snapIn)
+    {
+        if(set)
+        {
+            ERR(COLOR_RED "Can't set properties on a snapshot" COLOR_RESET);
+            return -1;
+        }
+        snap_t snap;
+        if(!snap_open(&snap, snapIn))
+        {
+            if(keys)
+            {
+                CFRelease(keys);
+            }
+            return -1;
+        }
+        common_buf_t out;
+        common_buf_init(&out, stdout);
+        oss_t oss;
+        oss_init(&oss);
+        for(uint32_t i = 0; i < snap.hdr->numEntries; ++i)
+        {
+            uint64_t t = stats_begin(STATS_FORMAT);
+            printSnapEntry(&out, &oss, &snap, &snap.entries[i], match, hdr, xml, cfj, json, format, keys);
+            stats_end(STATS_FORMAT, t);
+        }
+        oss_free(&oss);
+        bool succ = finishOutput(&out);
+        snap_close(&snap);
+        if(keys)
+        {
+            CFRelease(keys);
+        }
+        return succ ? 0 : -1;
+    }
+
+    CFDictionaryRef dict = NULL;
+    if(set)
+    {
+        CFStringRef key = CFSTR("herp");
+        CFStringRef val = CFSTR("derp");
+        dict = CFDictionaryCreate(NULL, (const void**)&key, (const void**)&val, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if(dict == NULL)
+        {
+            ERR(COLOR_RED "Failed to create dict" COLOR_RESET);
+            if(keys)
+            {
+                CFRelease(keys);
+            }
+            return -1;
+        }
+    }
+    if(threads == 0)
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if(threads < 1)
+        {
+            threads = 1;
+        }
+    }
+    if(threads > 1)
+    {
+        bool succ = printParallel(plane, threads, match, kmatch, hdr, xml, cfj, json, format, dict, keys);
+        if(dict)
+        {
+            CFRelease(dict);
+        }
+        if(keys)
+        {
+            CFRelease(keys);
+        }
+        return succ ? 0 : -1;
+    }
+
+    common_buf_t out;
+    common_buf_init(&out, stdout);
+    io_object_t o = STATS(STATS_ROOT_ENTRY, IORegistryGetRootEntry(kIOMasterPortDefault));
+    bool succ = printEntry(&out, o, plane, match, hdr, xml, cfj, json, format, dict, keys);
+    IOObjectRelease(o);
+
+    int retval = succ ? 0 : -1;
+    if(succ)
     {
-        while((o = IOIteratorNext(it)) != 0)
+        ioprint_source_t src;
+        openSource(&src, plane, match, kmatch);
+        while((o = nextEntry(&src)) != 0)
         {
-            succ = printEntry(o, match, hdr, xml, cfj, json, set);
+            succ = printEntry(&out, o, plane, match, hdr, xml, cfj, json, format, dict, keys);
             IOObjectRelease(o);
             if(!succ)
             {
@@ -221,7 +1688,19 @@ int main(int argc, const char **argv)
                 break;
             }
         }
-        IOObjectRelease(it);
+        closeSource(&src);
+    }
+    if(!finishOutput(&out))
+    {
+        retval = -1;
+    }
+    if(dict)
+    {
+        CFRelease(dict);
+    }
+    if(keys)
+    {
+        CFRelease(keys);
     }
     return retval;
 }
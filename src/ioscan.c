@@ -10,10 +10,12 @@
 
 #include <errno.h>              // errno
 #include <math.h>               // floor, log2
+#include <pthread.h>            // pthread_create, pthread_join
 #include <stdbool.h>            // bool, true, false
 #include <stdint.h>             // uint32_t, uint64_t
 #include <stdlib.h>             // strtol, malloc
 #include <string.h>             // strerror, strlcpy
+#include <unistd.h>             // getpid, sysconf
 
 #include <mach/kern_return.h>   // kern_return_t, KERN_SUCCESS
 #include <mach/mach_error.h>    // mach_error_string
@@ -23,109 +25,520 @@
 
 #include "common.h"
 #include "iokit.h"
+#include "match.h"
+#include "stats.h"
 
-typedef struct ioscan
+// Strings live in one pool per store and rows refer to them by offset.
+// Offset 0 is always the empty string.
+typedef struct
 {
-    struct ioscan *next;
-    io_name_t class;
-    io_name_t ucClass;
-    io_name_t name;
+    uint32_t class;
+    uint32_t name;
+    uint32_t ucClass;
     uint32_t type;
     kern_return_t spawn;
     io_connect_t one;
     io_connect_t two;
 } ioscan_t;
 
-static ioscan_t** processEntry(io_object_t o, const char *plane, const char *match, uint32_t min, uint32_t max, bool only_success, ioscan_t **ptr)
+typedef struct
+{
+    int class;
+    int name;
+    int type;
+    int spawn;
+    int uc;
+    int one;
+    int two;
+} ioscan_width_t;
+
+typedef struct
+{
+    char *strs;
+    size_t strsLen;
+    size_t strsCap;
+    uint32_t *tab;
+    size_t tabCap;
+    size_t tabUsed;
+    ioscan_t *rows;
+    size_t num;
+    size_t cap;
+    ioscan_width_t width;
+} ioscan_store_t;
+
+static uint32_t hashString(const char *str, size_t len)
+{
+    uint32_t h = 0x811c9dc5;
+    for(size_t i = 0; i < len; ++i)
+    {
+        h = (h ^ (uint8_t)str[i]) * 0x01000193;
+    }
+    return h;
+}
+
+static bool initStore(ioscan_store_t *store)
+{
+    memset(store, 0, sizeof(*store));
+    store->strsCap = 0x1000;
+    store->strs = malloc(store->strsCap);
+    if(!store->strs)
+    {
+        return false;
+    }
+    store->strs[0] = '\0';
+    store->strsLen = 1;
+    return true;
+}
+
+static void freeStore(ioscan_store_t *store)
+{
+    free(store->strs);
+    free(store->tab);
+    free(store->rows);
+    memset(store, 0, sizeof(*store));
+}
+
+static bool growTable(ioscan_store_t *store)
+{
+    size_t cap = store->tabCap ? store->tabCap * 2 : 0x100;
+    uint32_t *tab = calloc(cap, sizeof(uint32_t));
+    if(!tab)
+    {
+        return false;
+    }
+    for(size_t i = 0; i < store->tabCap; ++i)
+    {
+        uint32_t off = store->tab[i];
+        if(off != 0)
+        {
+            const char *str = store->strs + off;
+            size_t j = hashString(str, strlen(str)) & (cap - 1);
+            while(tab[j] != 0)
+            {
+                j = (j + 1) & (cap - 1);
+            }
+            tab[j] = off;
+        }
+    }
+    free(store->tab);
+    store->tab = tab;
+    store->tabCap = cap;
+    return true;
+}
+
+// Returns the offset of the string in the pool, or UINT32_MAX on allocation failure.
+static uint32_t internString(ioscan_store_t *store, const char *str)
+{
+    if(!str[0])
+    {
+        return 0;
+    }
+    if(store->tabUsed * 2 >= store->tabCap && !growTable(store))
+    {
+        return UINT32_MAX;
+    }
+    size_t len = strlen(str),
+           i   = hashString(str, len) & (store->tabCap - 1);
+    for(; store->tab[i] != 0; i = (i + 1) & (store->tabCap - 1))
+    {
+        if(strcmp(store->strs + store->tab[i], str) == 0)
+        {
+            return store->tab[i];
+        }
+    }
+    if(store->strsCap - store->strsLen < len + 1)
+    {
+        size_t cap = store->strsCap * 2;
+        while(cap - store->strsLen < len + 1)
+        {
+            cap *= 2;
+        }
+        char *strs = realloc(store->strs, cap);
+        if(!strs)
+        {
+            return UINT32_MAX;
+        }
+        store->strs = strs;
+        store->strsCap = cap;
+    }
+    uint32_t off = (uint32_t)store->strsLen;
+    memcpy(store->strs + off, str, len + 1);
+    store->strsLen += len + 1;
+    store->tab[i] = off;
+    ++store->tabUsed;
+    return off;
+}
+
+// Column widths are tracked as rows come in, so printing needs no extra pass.
+static bool addRow(ioscan_store_t *store, const ioscan_t *row)
+{
+    if(store->num >= store->cap)
+    {
+        size_t cap = store->cap ? store->cap * 2 : 0x100;
+        ioscan_t *rows = realloc(store->rows, cap * sizeof(ioscan_t));
+        if(!rows)
+        {
+            return false;
+        }
+        store->rows = rows;
+        store->cap = cap;
+    }
+    store->rows[store->num++] = *row;
+
+    ioscan_width_t *w = &store->width;
+    int l = row->class ? strlen(store->strs + row->class) : strlen("failed");
+    if(l > w->class) w->class = l;
+    l = row->name ? strlen(store->strs + row->name) : strlen("failed");
+    if(l > w->name) w->name = l;
+    l = 1 + (row->type == 0 ? 0 : (int)floor(log10(row->type))); // Decimal
+    if(l > w->type) w->type = l;
+    l = strlen(mach_error_string(row->spawn));
+    if(l > w->spawn) w->spawn = l;
+    l = strlen(store->strs + row->ucClass);
+    if(l > w->uc) w->uc = l;
+    l = 1 + (row->one == 0 ? 0 : (int)floor(log2(row->one) / 4)); // Hex
+    if(l > w->one) w->one = l;
+    l = 1 + (row->two == 0 ? 0 : (int)floor(log2(row->two) / 4)); // Hex
+    if(l > w->two) w->two = l;
+    return true;
+}
+
+typedef enum
+{
+    FORMAT_TABLE,
+    FORMAT_JSONL,
+    FORMAT_TSV,
+} ioscan_format_t;
+
+// Rows of objs[i] are rows[first] through rows[first + count - 1] of worker number store.
+typedef struct
+{
+    uint32_t store;
+    uint32_t first;
+    uint32_t count;
+} ioscan_span_t;
+
+typedef struct
+{
+    io_object_t *objs;
+    ioscan_span_t *spans;
+    size_t num;
+    size_t next;
+    bool failed;
+    const char *plane;
+    const char *match;
+    uint32_t min;
+    uint32_t max;
+    bool only_success;
+    ioscan_format_t format;
+} ioscan_pool_t;
+
+typedef struct
+{
+    ioscan_pool_t *pool;
+    ioscan_store_t store;
+    common_buf_t line;
+    uint32_t id;
+    pthread_t thread;
+} ioscan_worker_t;
+
+static void emitJsonStr(common_ctx_t *ctx, const char *str)
+{
+    if(!str[0])
+    {
+        common_buf_puts(ctx->out, "null");
+        return;
+    }
+    common_buf_putc(ctx->out, '"');
+    common_print_str(ctx, str, strlen(str));
+    common_buf_putc(ctx->out, '"');
+}
+
+// Streaming formats write each row out as soon as we have it, no state is kept.
+// Rows aren't flushed one by one, stdio already does that for a terminal.
+static bool emitRow(common_buf_t *line, ioscan_format_t format, const char *class, const char *name, const char *ucClass, const ioscan_t *row)
+{
+    uint64_t t = stats_begin(STATS_FORMAT);
+    line->len = 0;
+    if(format == FORMAT_JSONL)
+    {
+        common_ctx_t ctx =
+        {
+            .true_json = true,
+            .bytes_raw = false,
+            .first = false,
+            .lvl = 0,
+            .out = line,
+        };
+        common_buf_puts(line, "{\"class\":");
+        emitJsonStr(&ctx, class);
+        common_buf_puts(line, ",\"name\":");
+        emitJsonStr(&ctx, name);
+        common_buf_printf(line, ",\"type\":%u,\"spawn\":%u,\"spawnString\":", row->type, (uint32_t)row->spawn);
+        emitJsonStr(&ctx, mach_error_string(row->spawn));
+        common_buf_puts(line, ",\"uc\":");
+        emitJsonStr(&ctx, ucClass);
+        common_buf_printf(line, ",\"one\":%u,\"two\":%u}\n", row->one, row->two);
+    }
+    else
+    {
+        common_buf_printf(line, "%s\t%s\t%u\t0x%x\t%s\t%x\t%x\t%s\n",
+            class, name, row->type, (uint32_t)row->spawn, ucClass, row->one, row->two,
+            row->two == 0 ? "" : row->one == row->two ? "==" : "!=");
+    }
+    stats_end(STATS_FORMAT, t);
+    // Single fwrite so that lines from different threads don't interleave
+    return stats_fwrite(line->data, line->len, stdout) == line->len;
+}
+
+// Children of a service that we already looked at, sorted by port name. We keep our reference
+// to them, so the kernel hands us the same port name again the next time we see them.
+typedef struct
+{
+    io_object_t *objs;
+    size_t num;
+    size_t cap;
+} ioscan_seen_t;
+
+// Index of obj in seen, or where it would have to be inserted.
+static size_t findSeen(const ioscan_seen_t *seen, io_object_t obj)
+{
+    size_t lo = 0,
+           hi = seen->num;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(seen->objs[mid] < obj)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool addSeen(ioscan_seen_t *seen, size_t idx, io_object_t obj)
+{
+    if(seen->num >= seen->cap)
+    {
+        size_t cap = seen->cap ? seen->cap * 2 : 0x20;
+        io_object_t *objs = realloc(seen->objs, cap * sizeof(io_object_t));
+        if(!objs)
+        {
+            return false;
+        }
+        seen->objs = objs;
+        seen->cap = cap;
+    }
+    memmove(seen->objs + idx + 1, seen->objs + idx, (seen->num - idx) * sizeof(io_object_t));
+    seen->objs[idx] = obj;
+    ++seen->num;
+    return true;
+}
+
+static void releaseSeen(ioscan_seen_t *seen)
+{
+    for(size_t i = 0; i < seen->num; ++i)
+    {
+        IOObjectRelease(seen->objs[i]);
+    }
+    free(seen->objs);
+    seen->objs = NULL;
+    seen->num = 0;
+    seen->cap = 0;
+}
+
+// Adds every child not in seen yet, and returns the number of IPC calls that took.
+// With ucClass, our client is among those new children. Only they need their creator checked,
+// everything else costs a single IOIteratorNext. Every child ends up in seen afterwards, including ours,
+// so that it isn't mistaken for the next type's client if it hangs around after closing.
+static size_t scanChildren(io_object_t o, const char *plane, ioscan_seen_t *seen, char *ucClass)
+{
+    size_t ipc = 1;
+    io_iterator_t it = MACH_PORT_NULL;
+    if(STATS(STATS_CHILD_ITERATOR, IORegistryEntryGetChildIterator(o, plane, &it)) == KERN_SUCCESS)
+    {
+        io_object_t client = MACH_PORT_NULL;
+        while(++ipc, (client = STATS(STATS_ITERATOR_NEXT, IOIteratorNext(it))) != 0)
+        {
+            size_t idx = findSeen(seen, client);
+            if(idx < seen->num && seen->objs[idx] == client)
+            {
+                IOObjectRelease(client);
+                continue;
+            }
+            if(ucClass && !ucClass[0])
+            {
+                io_struct_inband_t buf;
+                uint32_t len = sizeof(buf);
+                ++ipc;
+                if(STATS(STATS_GET_PROPERTY, IORegistryEntryGetProperty(client, "IOUserClientCreator", buf, &len)) == KERN_SUCCESS)
+                {
+                    uint32_t pid;
+                    if(sscanf(buf, "pid %u,", &pid) == 1 && pid == getpid())
+                    {
+                        ++ipc;
+                        if(STATS(STATS_GET_CLASS, _IOObjectGetClass(client, kIOClassNameOverrideNone, ucClass)) != KERN_SUCCESS)
+                        {
+                            ucClass[0] = '\0';
+                        }
+                    }
+                }
+            }
+            if(!addSeen(seen, idx, client))
+            {
+                IOObjectRelease(client);
+            }
+        }
+        IOObjectRelease(it);
+    }
+    return ipc;
+}
+
+static bool processEntry(io_object_t o, ioscan_pool_t *pool, ioscan_worker_t *worker)
 {
     io_name_t name;
-    kern_return_t ret = IORegistryEntryGetName(o, name);
+    kern_return_t ret = STATS(STATS_GET_NAME, IORegistryEntryGetName(o, name));
     if(ret != KERN_SUCCESS)
     {
         name[0] = '\0';
     }
-    if(!match || IOObjectConformsTo(o, match) || (name[0] && strcmp(name, match) == 0))
+    const char *match = pool->match;
+    if(!match || STATS(STATS_CONFORMS, IOObjectConformsTo(o, match)) || (name[0] && strcmp(name, match) == 0))
     {
+        ioscan_store_t *store = &worker->store;
         io_name_t class;
-        ret = _IOObjectGetClass(o, kIOClassNameOverrideNone, class);
+        ret = STATS(STATS_GET_CLASS, _IOObjectGetClass(o, kIOClassNameOverrideNone, class));
         if(ret != KERN_SUCCESS)
         {
             class[0] = '\0';
         }
-        for(uint32_t i = min; i <= max; ++i)
+        uint32_t nameOff  = UINT32_MAX,
+                 classOff = UINT32_MAX;
+        ioscan_seen_t seen =
+        {
+            .objs = NULL,
+            .num = 0,
+            .cap = 0,
+        };
+        // Children that exist before we open anything can't be ours
+        stats_count(STATS_CLIENT_IPC, scanChildren(o, pool->plane, &seen, NULL));
+        for(uint32_t i = pool->min; i <= pool->max; ++i)
         {
             io_connect_t one = MACH_PORT_NULL,
                          two = MACH_PORT_NULL;
-            ret = IOServiceOpen(o, mach_task_self(), i, &one);
+            ret = STATS(STATS_SERVICE_OPEN, IOServiceOpen(o, mach_task_self(), i, &one));
             if(ret == KERN_SUCCESS && MACH_PORT_VALID(one))
             {
-                IOServiceOpen(o, mach_task_self(), i, &two);
+                STATS(STATS_SERVICE_OPEN, IOServiceOpen(o, mach_task_self(), i, &two));
             }
 
-            if(!only_success || ret == KERN_SUCCESS)
+            if(!pool->only_success || ret == KERN_SUCCESS)
             {
-                ioscan_t *data = malloc(sizeof(ioscan_t));
-                if(!data)
+                ioscan_t row =
                 {
-                    ERR(COLOR_RED "Failed to allocate entry for %s: %s" COLOR_RESET, name, strerror(errno));
-                    return NULL;
-                }
-                data->next = NULL;
-                data->class[0] = '\0';
-                data->ucClass[0] = '\0';
-                data->name[0] = '\0';
-                data->type = i;
-                data->spawn = ret;
-                data->one = one;
-                data->two = two;
-
-                strlcpy(data->name, name, sizeof(io_name_t));
-                strlcpy(data->class, class, sizeof(io_name_t));
+                    .class = 0,
+                    .name = 0,
+                    .ucClass = 0,
+                    .type = i,
+                    .spawn = ret,
+                    .one = one,
+                    .two = two,
+                };
+                io_name_t ucClass;
+                ucClass[0] = '\0';
 
                 if(ret == KERN_SUCCESS && MACH_PORT_VALID(one))
                 {
-                    io_iterator_t it = MACH_PORT_NULL;
-                    if(IORegistryEntryGetChildIterator(o, plane, &it) == KERN_SUCCESS)
+                    stats_count(STATS_USER_CLIENTS, 1);
+                    stats_count(STATS_CLIENT_IPC, scanChildren(o, pool->plane, &seen, ucClass));
+                }
+
+                if(pool->format != FORMAT_TABLE)
+                {
+                    if(!emitRow(&worker->line, pool->format, class, name, ucClass, &row))
                     {
-                        io_object_t client = MACH_PORT_NULL;
-                        while((client = IOIteratorNext(it)) != 0)
-                        {
-                            io_struct_inband_t buf;
-                            uint32_t len = sizeof(buf);
-                            ret = IORegistryEntryGetProperty(client, "IOUserClientCreator", buf, &len);
-                            if(ret == KERN_SUCCESS)
-                            {
-                                uint32_t pid;
-                                if(sscanf(buf, "pid %u,", &pid) == 1)
-                                {
-                                    if(pid == getpid())
-                                    {
-                                        io_name_t ucClass;
-                                        ret = _IOObjectGetClass(client, kIOClassNameOverrideNone, ucClass);
-                                        if(ret == KERN_SUCCESS)
-                                        {
-                                            strlcpy(data->ucClass, ucClass, sizeof(io_name_t));
-                                        }
-                                        IOObjectRelease(client);
-                                        break;
-                                    }
-                                }
-                            }
-                            IOObjectRelease(client);
-                        }
-                        IOObjectRelease(it);
+                        // Reported once all workers are done
+                        if(one) STATS(STATS_SERVICE_CLOSE, IOServiceClose(one));
+                        if(two) STATS(STATS_SERVICE_CLOSE, IOServiceClose(two));
+                        releaseSeen(&seen);
+                        return false;
+                    }
+                }
+                else
+                {
+                    if(nameOff == UINT32_MAX)
+                    {
+                        nameOff  = internString(store, name);
+                        classOff = internString(store, class);
+                    }
+                    row.name = nameOff;
+                    row.class = classOff;
+                    row.ucClass = internString(store, ucClass);
+                    if(row.name == UINT32_MAX || row.class == UINT32_MAX || row.ucClass == UINT32_MAX || !addRow(store, &row))
+                    {
+                        ERR(COLOR_RED "Failed to allocate entry for %s: %s" COLOR_RESET, name, strerror(errno));
+                        if(one) STATS(STATS_SERVICE_CLOSE, IOServiceClose(one));
+                        if(two) STATS(STATS_SERVICE_CLOSE, IOServiceClose(two));
+                        releaseSeen(&seen);
+                        return false;
                     }
                 }
-
-                *ptr = data;
-                ptr = &data->next;
             }
 
-            if(one) IOServiceClose(one);
-            if(two) IOServiceClose(two);
+            if(one) STATS(STATS_SERVICE_CLOSE, IOServiceClose(one));
+            if(two) STATS(STATS_SERVICE_CLOSE, IOServiceClose(two));
         }
+        releaseSeen(&seen);
     }
-    return ptr;
+    return true;
+}
+
+// Frees out, if given, and flushes stdout. Write errors may only show up
+// here, since stdio buffers as well.
+static bool finishOutput(common_buf_t *out)
+{
+    bool err = false;
+    if(out)
+    {
+        common_buf_free(out);
+        err = out->err;
+    }
+    if(fflush(stdout) != 0 || ferror(stdout) || err)
+    {
+        ERR(COLOR_RED "Failed to write output" COLOR_RESET);
+        return false;
+    }
+    return true;
+}
+
+// Workers grab one object at a time and record which of their rows belong to it,
+// so that results can be printed in registry order afterwards.
+static void* scanWorker(void *arg)
+{
+    ioscan_worker_t *worker = arg;
+    ioscan_pool_t *pool = worker->pool;
+    while(!__atomic_load_n(&pool->failed, __ATOMIC_RELAXED))
+    {
+        size_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if(i >= pool->num)
+        {
+            break;
+        }
+        size_t first = worker->store.num;
+        if(!processEntry(pool->objs[i], pool, worker))
+        {
+            __atomic_store_n(&pool->failed, true, __ATOMIC_RELAXED);
+        }
+        pool->spans[i].store = worker->id;
+        pool->spans[i].first = (uint32_t)first;
+        pool->spans[i].count = (uint32_t)(worker->store.num - first);
+        IOObjectRelease(pool->objs[i]);
+    }
+    return NULL;
 }
 
 static void print_help(const char *self)
@@ -141,15 +554,23 @@ static void print_help(const char *self)
            "\n"
            "Options:\n"
            "    -h          Print this help and exit\n"
+           "    -m          Let the kernel find services matching name (IOService plane only, see README)\n"
            "    -p plane    Iterate over the given registry plane (default: IOService)\n"
            "    -s          Print only successful spawning attempts\n"
+           "    -t num      Scan with num threads, 0 for one per CPU (default: 1)\n"
+           "    --format f  Print rows as they come in, as jsonl or tsv, instead of a table\n"
+           "    --stats     Print user client lookup statistics, call counts, latencies, bytes written\n"
+           "                and peak RSS to stderr (--stats=json for a single JSON object on exit)\n"
            , self
     );
 }
 
 int main(int argc, const char **argv)
 {
-    bool only_success = false;
+    bool only_success = false,
+         kmatch = false;
+    long threads = 1;
+    ioscan_format_t format = FORMAT_TABLE;
     const char *plane = "IOService";
     int aoff;
     for(aoff = 1; aoff < argc; ++aoff)
@@ -163,6 +584,10 @@ int main(int argc, const char **argv)
             print_help(argv[0]);
             return -1;
         }
+        else if(strcmp(argv[aoff], "-m") == 0)
+        {
+            kmatch = true;
+        }
         else if(strcmp(argv[aoff], "-p") == 0)
         {
             ++aoff;
@@ -179,6 +604,52 @@ int main(int argc, const char **argv)
         {
             only_success = true;
         }
+        else if(strcmp(argv[aoff], "-t") == 0)
+        {
+            ++aoff;
+            if(aoff >= argc)
+            {
+                ERR(COLOR_RED "Missing argument to -t" COLOR_RESET);
+                printf("\n");
+                print_help(argv[0]);
+                return -1;
+            }
+            char *end = NULL;
+            threads = strtol(argv[aoff], &end, 0);
+            if(*end != '\0' || threads < 0)
+            {
+                ERR(COLOR_RED "Invalid thread count: %s" COLOR_RESET, argv[aoff]);
+                return -1;
+            }
+        }
+        else if(strcmp(argv[aoff], "--stats") == 0 || strcmp(argv[aoff], "--stats=json") == 0)
+        {
+            stats_enable(argv[aoff][7] == '=');
+        }
+        else if(strcmp(argv[aoff], "--format") == 0)
+        {
+            ++aoff;
+            if(aoff >= argc)
+            {
+                ERR(COLOR_RED "Missing argument to --format" COLOR_RESET);
+                printf("\n");
+                print_help(argv[0]);
+                return -1;
+            }
+            if(strcmp(argv[aoff], "jsonl") == 0)
+            {
+                format = FORMAT_JSONL;
+            }
+            else if(strcmp(argv[aoff], "tsv") == 0)
+            {
+                format = FORMAT_TSV;
+            }
+            else
+            {
+                ERR(COLOR_RED "Unknown format: %s" COLOR_RESET, argv[aoff]);
+                return -1;
+            }
+        }
         else
         {
             ERR(COLOR_RED "Unrecognized argument: %s" COLOR_RESET, argv[aoff]);
@@ -217,12 +688,30 @@ int main(int argc, const char **argv)
         return -1;
     }
 
-    objs[idx++] = IORegistryGetRootEntry(kIOMasterPortDefault);
+    objs[idx++] = STATS(STATS_ROOT_ENTRY, IORegistryGetRootEntry(kIOMasterPortDefault));
+    io_object_t *matched = NULL;
+    size_t numMatched = 0;
     io_iterator_t it = MACH_PORT_NULL;
-    if(IORegistryCreateIterator(kIOMasterPortDefault, plane, kIORegistryIterateRecursively, &it) == KERN_SUCCESS)
+    if(match && kmatch && match_services(plane, match, &matched, &numMatched))
+    {
+        if(idx + numMatched > num)
+        {
+            num = idx + numMatched;
+            objs = realloc(objs, num * sizeof(io_object_t));
+            if(!objs)
+            {
+                ERR(COLOR_RED "Failed to reallocate objects buffer: %s" COLOR_RESET, strerror(errno));
+                return -1;
+            }
+        }
+        memcpy(objs + idx, matched, numMatched * sizeof(io_object_t));
+        idx += numMatched;
+        free(matched);
+    }
+    else if(STATS(STATS_CREATE_ITERATOR, IORegistryCreateIterator(kIOMasterPortDefault, plane, kIORegistryIterateRecursively, &it)) == KERN_SUCCESS)
     {
         io_object_t o;
-        while((o = IOIteratorNext(it)) != 0)
+        while((o = STATS(STATS_ITERATOR_NEXT, IOIteratorNext(it))) != 0)
         {
             if(idx >= num)
             {
@@ -239,32 +728,118 @@ int main(int argc, const char **argv)
         IOObjectRelease(it);
     }
 
-    ioscan_t *head = NULL,
-             **ptr = &head;
-    for(size_t i = 0; i < idx; ++i)
+    if(threads == 0)
     {
-        ptr = processEntry(objs[i], plane, match, min, max, only_success, ptr);
-        if(!ptr)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if(threads < 1)
         {
-            for(; i < idx; ++i)
-            {
-                IOObjectRelease(objs[i]);
-            }
-            free(objs);
-            objs = NULL;
-            for(ioscan_t *node = head; node != NULL; )
-            {
-                ioscan_t *next = node->next;
-                free(node);
-                node = next;
-            }
-            return -1;
+            threads = 1;
         }
+    }
+    if((size_t)threads > idx)
+    {
+        threads = idx;
+    }
+
+    ioscan_pool_t pool =
+    {
+        .objs = objs,
+        .spans = calloc(idx, sizeof(ioscan_span_t)),
+        .num = idx,
+        .next = 0,
+        .failed = false,
+        .plane = plane,
+        .match = match,
+        .min = min,
+        .max = max,
+        .only_success = only_success,
+        .format = format,
+    };
+    ioscan_worker_t *workers = calloc(threads, sizeof(ioscan_worker_t));
+    bool succ = pool.spans && workers;
+    for(long t = 0; succ && t < threads; ++t)
+    {
+        workers[t].pool = &pool;
+        workers[t].id = (uint32_t)t;
+        common_buf_init(&workers[t].line, NULL);
+        succ = initStore(&workers[t].store);
+    }
+    if(!succ)
+    {
+        ERR(COLOR_RED "Failed to allocate thread pool: %s" COLOR_RESET, strerror(errno));
+        for(size_t i = 0; i < idx; ++i)
+        {
+            IOObjectRelease(objs[i]);
+        }
+        free(objs);
+        free(pool.spans);
+        for(long t = 0; workers && t < threads; ++t)
+        {
+            freeStore(&workers[t].store);
+            common_buf_free(&workers[t].line);
+        }
+        free(workers);
+        return -1;
+    }
+
+    if(format == FORMAT_TSV)
+    {
+        static const char hdr[] = "class\tname\ttype\tspawn\tuc\tone\ttwo\tequal\n";
+        stats_fwrite(hdr, sizeof(hdr) - 1, stdout);
+    }
+
+    // Worker 0 is us
+    long started = 1;
+    for(; started < threads; ++started)
+    {
+        int r = pthread_create(&workers[started].thread, NULL, &scanWorker, &workers[started]);
+        if(r != 0)
+        {
+            ERR(COLOR_YELLOW "Failed to spawn thread %ld: %s" COLOR_RESET, started, strerror(r));
+            break;
+        }
+    }
+    scanWorker(&workers[0]);
+    for(long t = 1; t < started; ++t)
+    {
+        pthread_join(workers[t].thread, NULL);
+    }
+
+    // Anything past this was never handed out
+    for(size_t i = pool.next; i < idx; ++i)
+    {
         IOObjectRelease(objs[i]);
     }
     free(objs);
     objs = NULL;
 
+    if(pool.failed)
+    {
+        // Only says something if it was a write that failed
+        finishOutput(NULL);
+        for(long t = 0; t < threads; ++t)
+        {
+            freeStore(&workers[t].store);
+            common_buf_free(&workers[t].line);
+        }
+        free(workers);
+        free(pool.spans);
+        return -1;
+    }
+
+    // Rows have already been printed
+    if(format != FORMAT_TABLE)
+    {
+        for(long t = 0; t < threads; ++t)
+        {
+            freeStore(&workers[t].store);
+            common_buf_free(&workers[t].line);
+        }
+        free(workers);
+        free(pool.spans);
+        return finishOutput(NULL) ? 0 : -1;
+    }
+
     int classLen = strlen("Class"),
         nameLen  = strlen("Name"),
         typeLen  = strlen("Type"),
@@ -274,29 +849,22 @@ int main(int argc, const char **argv)
         twoLen   = strlen("Two"),
         equalLen = strlen("Equal");
 
-    for(ioscan_t *node = head; node != NULL; node = node->next)
+    for(long t = 0; t < threads; ++t)
     {
-        int l  = strlen(node->class[0] ? node->class : "failed");
-        if(l > classLen) classLen = l;
-        l = strlen(node->name);
-        if(l == 0)
-        {
-            l = strlen("failed");
-        }
-        if(l > nameLen) nameLen = l;
-        l = 1 + (node->type == 0 ? 0 : (int)floor(log10(node->type))); // Decimal
-        if(l > typeLen) typeLen = l;
-        l = strlen(mach_error_string(node->spawn));
-        if(l > spawnLen) spawnLen = l;
-        l = strlen(node->ucClass);
-        if(l > ucLen) ucLen = l;
-        l = 1 + (node->one == 0 ? 0 : (int)floor(log2(node->one) / 4)); // Hex
-        if(l > oneLen) oneLen = l;
-        l = 1 + (node->two == 0 ? 0 : (int)floor(log2(node->two) / 4)); // Hex
-        if(l > twoLen) twoLen = l;
+        const ioscan_width_t *w = &workers[t].store.width;
+        if(w->class > classLen) classLen = w->class;
+        if(w->name  > nameLen)  nameLen  = w->name;
+        if(w->type  > typeLen)  typeLen  = w->type;
+        if(w->spawn > spawnLen) spawnLen = w->spawn;
+        if(w->uc    > ucLen)    ucLen    = w->uc;
+        if(w->one   > oneLen)   oneLen   = w->one;
+        if(w->two   > twoLen)   twoLen   = w->two;
     }
 
-    LOG(COLOR_CYAN "%-*s %-*s %*s %-*s %-*s %*s %*s %-*s" COLOR_RESET,
+    common_buf_t out;
+    common_buf_init(&out, stdout);
+    uint64_t t = stats_begin(STATS_FORMAT);
+    common_buf_printf(&out, COLOR_CYAN "%-*s %-*s %*s %-*s %-*s %*s %*s %-*s" COLOR_RESET "\n",
         classLen, "Class",
         nameLen,  "Name",
         typeLen,  "Type",
@@ -306,21 +874,34 @@ int main(int argc, const char **argv)
         twoLen,   "Two",
         equalLen, "Equal"
     );
-    for(ioscan_t *node = head; node != NULL; )
-    {
-        ioscan_t *next = node->next;
-        LOG("%s%-*s%s %s%-*s%s %s%*u%s %s%-*s%s %s%-*s%s %*x %*x %-*s",
-            node->class[0] ? "" : COLOR_RED, classLen, node->class[0] ? node->class : "failed", node->class[0] ? "" : COLOR_RESET,
-            node->name[0]  ? "" : COLOR_RED, nameLen,  node->name[0]  ? node->name  : "failed", node->name[0]  ? "" : COLOR_RESET,
-            COLOR_PURPLE, typeLen, node->type, COLOR_RESET,
-            node->spawn == KERN_SUCCESS ? COLOR_GREEN : COLOR_YELLOW, spawnLen, mach_error_string(node->spawn), COLOR_RESET,
-            COLOR_BLUE, ucLen, node->ucClass, COLOR_RESET,
-            oneLen, node->one,
-            twoLen, node->two,
-            equalLen, node->two == 0 ? "" : node->one == node->two ? "==" : "!=");
-        free(node);
-        node = next;
-    }
-
-    return 0;
+    for(size_t i = 0; i < idx; ++i)
+    {
+        const ioscan_store_t *store = &workers[pool.spans[i].store].store;
+        for(uint32_t j = 0; j < pool.spans[i].count; ++j)
+        {
+            const ioscan_t *row = &store->rows[pool.spans[i].first + j];
+            const char *class = store->strs + row->class,
+                       *name  = store->strs + row->name;
+            common_buf_printf(&out, "%s%-*s%s %s%-*s%s %s%*u%s %s%-*s%s %s%-*s%s %*x %*x %-*s\n",
+                class[0] ? "" : COLOR_RED, classLen, class[0] ? class : "failed", class[0] ? "" : COLOR_RESET,
+                name[0]  ? "" : COLOR_RED, nameLen,  name[0]  ? name  : "failed", name[0]  ? "" : COLOR_RESET,
+                COLOR_PURPLE, typeLen, row->type, COLOR_RESET,
+                row->spawn == KERN_SUCCESS ? COLOR_GREEN : COLOR_YELLOW, spawnLen, mach_error_string(row->spawn), COLOR_RESET,
+                COLOR_BLUE, ucLen, store->strs + row->ucClass, COLOR_RESET,
+                oneLen, row->one,
+                twoLen, row->two,
+                equalLen, row->two == 0 ? "" : row->one == row->two ? "==" : "!=");
+        }
+    }
+    stats_end(STATS_FORMAT, t);
+    succ = finishOutput(&out);
+
+    for(long t = 0; t < threads; ++t)
+    {
+        freeStore(&workers[t].store);
+        common_buf_free(&workers[t].line);
+    }
+    free(workers);
+    free(pool.spans);
+    return succ ? 0 : -1;
 }
@@ -0,0 +1,222 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mach/mach.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "common.h"
+#include "iokit.h"
+#include "match.h"
+#include "stats.h"
+
+typedef enum
+{
+    MATCH_UNKNOWN,  // not a class, so only instance names can match
+    MATCH_SERVICE,  // IOService or a subclass
+    MATCH_OTHER,    // a class the kernel can't match on, like IORegistryEntry
+} match_kind_t;
+
+static match_kind_t match_kind(const char *name)
+{
+    if(strcmp(name, "IOService") == 0)
+    {
+        return MATCH_SERVICE;
+    }
+    if(strcmp(name, "OSObject") == 0)
+    {
+        return MATCH_OTHER;
+    }
+    CFStringRef cur = CFStringCreateWithCString(NULL, name, kCFStringEncodingUTF8);
+    if(!cur)
+    {
+        return MATCH_OTHER;
+    }
+    match_kind_t kind = MATCH_UNKNOWN;
+    while(true)
+    {
+        CFStringRef super = STATS(STATS_SUPERCLASS, IOObjectCopySuperclassForClass(cur));
+        CFRelease(cur);
+        cur = super;
+        if(!cur)
+        {
+            break;
+        }
+        kind = MATCH_OTHER;
+        if(CFEqual(cur, CFSTR("IOService")))
+        {
+            CFRelease(cur);
+            kind = MATCH_SERVICE;
+            break;
+        }
+    }
+    return kind;
+}
+
+static int match_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a,
+             y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Appends all services matched by the dict, skipping those whose registry ID is in skip.
+// Consumes the dict. IDs of added services are appended to ids.
+static bool match_collect(CFMutableDictionaryRef dict, io_object_t **objs, uint64_t **ids, size_t *num, size_t *cap, const uint64_t *skip, size_t numSkip)
+{
+    if(!dict)
+    {
+        return false;
+    }
+    io_iterator_t it = MACH_PORT_NULL;
+    if(STATS(STATS_MATCHING, IOServiceGetMatchingServices(kIOMasterPortDefault, dict, &it)) != KERN_SUCCESS)
+    {
+        return false;
+    }
+    bool succ = true;
+    io_object_t o;
+    while((o = STATS(STATS_ITERATOR_NEXT, IOIteratorNext(it))) != 0)
+    {
+        uint64_t id = 0;
+        if(STATS(STATS_ENTRY_ID, IORegistryEntryGetRegistryEntryID(o, &id)) == KERN_SUCCESS && numSkip > 0 && bsearch(&id, skip, numSkip, sizeof(*skip), &match_cmp))
+        {
+            IOObjectRelease(o);
+            continue;
+        }
+        if(*num >= *cap)
+        {
+            size_t newCap = *cap ? *cap * 2 : 0x40;
+            io_object_t *newObjs = realloc(*objs, newCap * sizeof(**objs));
+            if(newObjs)
+            {
+                *objs = newObjs;
+            }
+            uint64_t *newIds = realloc(*ids, newCap * sizeof(**ids));
+            if(newIds)
+            {
+                *ids = newIds;
+            }
+            if(!newObjs || !newIds)
+            {
+                ERR(COLOR_RED "Failed to allocate match list: %s" COLOR_RESET, strerror(errno));
+                IOObjectRelease(o);
+                succ = false;
+                break;
+            }
+            *cap = newCap;
+        }
+        (*objs)[*num] = o;
+        (*ids)[*num] = id;
+        ++*num;
+    }
+    IOObjectRelease(it);
+    return succ;
+}
+
+// Lets the kernel find all services whose class extends name or whose name is name,
+// rather than looking at every entry in the plane. Class matches come first, then
+// services that only match by name, each in the order the kernel returns them.
+// Only registered services are found, so user clients and anything not (yet)
+// registered are left out, which is why callers only use this when asked to.
+// Returns false if the plane has to be scanned instead, in which case objs is NULL.
+// Otherwise the caller must release all objects and free the array.
+bool match_services(const char *plane, const char *name, io_object_t **objs, size_t *num)
+{
+    *objs = NULL;
+    *num = 0;
+    if(strcmp(plane, "IOService") != 0)
+    {
+        return false;
+    }
+    match_kind_t kind = match_kind(name);
+    if(kind == MATCH_OTHER)
+    {
+        return false;
+    }
+
+    uint64_t *ids = NULL,
+             *sorted = NULL;
+    size_t cap = 0,
+           numClass = 0;
+    bool succ = true;
+    if(kind == MATCH_SERVICE)
+    {
+        succ = match_collect(IOServiceMatching(name), objs, &ids, num, &cap, NULL, 0);
+        numClass = *num;
+    }
+    if(succ && numClass > 0)
+    {
+        sorted = malloc(numClass * sizeof(*sorted));
+        if(!sorted)
+        {
+            ERR(COLOR_RED "Failed to allocate match list: %s" COLOR_RESET, strerror(errno));
+            succ = false;
+        }
+        else
+        {
+            memcpy(sorted, ids, numClass * sizeof(*sorted));
+            qsort(sorted, numClass, sizeof(*sorted), &match_cmp);
+        }
+    }
+    if(succ)
+    {
+        succ = match_collect(IOServiceNameMatching(name), objs, &ids, num, &cap, sorted, numClass);
+    }
+    free(sorted);
+    free(ids);
+    if(!succ)
+    {
+        for(size_t i = 0; i < *num; ++i)
+        {
+            IOObjectRelease((*objs)[i]);
+        }
+        free(*objs);
+        *objs = NULL;
+        *num = 0;
+    }
+    return succ;
+}
+
+// Matching dicts for notifications on the same services as above. Without a name,
+// or if the kernel can't match on it, all services are matched. Callers still have
+// to filter and drop services that match both dicts. Returns the number of dicts.
+size_t match_dicts(const char *name, CFMutableDictionaryRef dicts[2])
+{
+    match_kind_t kind = name ? match_kind(name) : MATCH_OTHER;
+    size_t num = 0;
+    if(kind != MATCH_UNKNOWN)
+    {
+        dicts[num++] = IOServiceMatching(kind == MATCH_SERVICE ? name : "IOService");
+    }
+    if(kind != MATCH_OTHER)
+    {
+        dicts[num++] = IOServiceNameMatching(name);
+    }
+    for(size_t i = 0; i < num; ++i)
+    {
+        if(!dicts[i])
+        {
+            for(size_t j = 0; j < num; ++j)
+            {
+                if(dicts[j])
+                {
+                    CFRelease(dicts[j]);
+                }
+            }
+            return 0;
+        }
+    }
+    return num;
+}
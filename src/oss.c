@@ -0,0 +1,753 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "oss.h"
+
+// Nesting is followed recursively, unlike in cfj, so there's a limit. See README.
+#define OSS_MAX_DEPTH   0x100
+// Nodes that may be visited per buffer, including those reached through back-references
+#define OSS_BUDGET(size) (((size) / 4 + 1) * 0x10)
+
+void oss_init(oss_t *oss)
+{
+    oss->buf = NULL;
+    oss->size = 0;
+    oss->objs = NULL;
+    oss->numObjs = 0;
+    oss->capObjs = 0;
+    oss->budget = 0;
+    oss->keys = NULL;
+    oss->numKeys = 0;
+    oss->capKeys = 0;
+    oss->pos = 0;
+    common_buf_init(&oss->out, NULL);
+}
+
+void oss_free(oss_t *oss)
+{
+    free(oss->objs);
+    oss->objs = NULL;
+    oss->numObjs = 0;
+    oss->capObjs = 0;
+    free(oss->keys);
+    oss->keys = NULL;
+    oss->numKeys = 0;
+    oss->capKeys = 0;
+    common_buf_free(&oss->out);
+}
+
+static bool oss_word(const oss_t *oss, size_t *pos, uint32_t *key)
+{
+    if(oss->size - *pos < sizeof(*key))
+    {
+        return false;
+    }
+    memcpy(key, oss->buf + *pos, sizeof(*key));
+    *pos += sizeof(*key);
+    return true;
+}
+
+static const uint8_t* oss_bytes(const oss_t *oss, size_t *pos, size_t size)
+{
+    size_t padded = (size + 3) & ~(size_t)3;
+    if(oss->size - *pos < padded)
+    {
+        return NULL;
+    }
+    const uint8_t *ptr = oss->buf + *pos;
+    *pos += padded;
+    return ptr;
+}
+
+// Numbers narrower than 64 bits are signed, the way IOKit hands them to CF.
+static bool oss_number(const oss_t *oss, size_t *pos, uint32_t len, uint64_t *val)
+{
+    const uint8_t *ptr = oss_bytes(oss, pos, sizeof(*val));
+    if(!ptr)
+    {
+        return false;
+    }
+    memcpy(val, ptr, sizeof(*val));
+    if(len == 0)
+    {
+        *val = 0;
+    }
+    else if(len < 64)
+    {
+        *val = (uint64_t)((int64_t)(*val << (64 - len)) >> (64 - len));
+    }
+    return true;
+}
+
+static bool oss_depth(unsigned depth)
+{
+    if(depth > OSS_MAX_DEPTH)
+    {
+        ERR(COLOR_YELLOW "Properties are nested deeper than %u levels, which snapshots and compact dumps don't support" COLOR_RESET, OSS_MAX_DEPTH);
+        return false;
+    }
+    return true;
+}
+
+static bool oss_add(oss_t *oss, size_t off)
+{
+    if(oss->numObjs >= oss->capObjs)
+    {
+        size_t cap = oss->capObjs ? oss->capObjs * 2 : 0x100;
+        size_t *objs = realloc(oss->objs, cap * sizeof(*objs));
+        if(!objs)
+        {
+            return false;
+        }
+        oss->objs = objs;
+        oss->capObjs = cap;
+    }
+    oss->objs[oss->numObjs++] = off;
+    return true;
+}
+
+static void oss_print_str(common_ctx_t *ctx, const uint8_t *str, size_t len)
+{
+    common_buf_putc(ctx->out, '"');
+    if(ctx->true_json)
+    {
+        common_print_str(ctx, (const char*)str, len);
+    }
+    else
+    {
+        common_buf_write(ctx->out, str, len);
+    }
+    common_buf_putc(ctx->out, '"');
+}
+
+// Symbols carry a NUL terminator, strings don't.
+static const uint8_t* oss_str(const oss_t *oss, size_t *pos, uint32_t key, size_t *len)
+{
+    *len = key & OSS_DATA_MASK;
+    const uint8_t *str = oss_bytes(oss, pos, *len);
+    if(str && (key & OSS_TYPE_MASK) == OSS_SYMBOL && *len > 0 && str[*len - 1] == '\0')
+    {
+        --*len;
+    }
+    return str;
+}
+
+// Dictionary keys have to be strings, but may be back-references to one.
+static const uint8_t* oss_key(oss_t *oss, size_t *pos, bool record, size_t *len)
+{
+    size_t start = *pos;
+    uint32_t key;
+    if(!oss_word(oss, pos, &key))
+    {
+        return NULL;
+    }
+    size_t off = 0,
+           *strpos = pos;
+    if((key & OSS_TYPE_MASK) == OSS_OBJECT)
+    {
+        uint32_t idx = key & OSS_DATA_MASK;
+        off = idx < oss->numObjs ? oss->objs[idx] : oss->size;
+        if(!oss_word(oss, &off, &key))
+        {
+            return NULL;
+        }
+        strpos = &off;
+    }
+    else if(record && !oss_add(oss, start))
+    {
+        return NULL;
+    }
+    uint32_t type = key & OSS_TYPE_MASK;
+    if(type != OSS_SYMBOL && type != OSS_STRING)
+    {
+        return NULL;
+    }
+    return oss_str(oss, strpos, key, len);
+}
+
+// Output matches cfj_print_internal, except that sets keep their serialized order
+// here, while CFSet has an order of its own. Objects are recorded before their contents,
+// same as the kernel does. Back-references are printed by walking the stream
+// again at the object they point to, with record off.
+static bool oss_print_obj(oss_t *oss, common_ctx_t *ctx, size_t *pos, bool record, unsigned depth, bool *last)
+{
+    if(!oss_depth(depth) || oss->budget == 0)
+    {
+        return false;
+    }
+    --oss->budget;
+    size_t start = *pos;
+    uint32_t key;
+    if(!oss_word(oss, pos, &key))
+    {
+        return false;
+    }
+    uint32_t len = key & OSS_DATA_MASK,
+             type = key & OSS_TYPE_MASK;
+    *last = !!(key & OSS_END);
+    if(type == OSS_OBJECT)
+    {
+        if(len >= oss->numObjs)
+        {
+            return false;
+        }
+        size_t off = oss->objs[len];
+        bool dummy;
+        return oss_print_obj(oss, ctx, &off, false, depth + 1, &dummy);
+    }
+    if(record && !oss_add(oss, start))
+    {
+        return false;
+    }
+    const uint8_t *ptr = NULL;
+    switch(type)
+    {
+        case OSS_DICT:
+        case OSS_ARRAY:
+        case OSS_SET:
+        {
+            bool dict = type == OSS_DICT;
+            common_ctx_t newctx =
+            {
+                .true_json = ctx->true_json,
+                .bytes_raw = ctx->bytes_raw,
+                .first = true,
+                .compact = ctx->compact,
+                .lvl = ctx->lvl + 1,
+                .out = ctx->out,
+            };
+            common_buf_putc(ctx->out, dict ? '{' : '[');
+            bool end = len == 0;
+            while(!end)
+            {
+                if(ctx->compact)
+                {
+                    if(!newctx.first)
+                    {
+                        common_buf_putc(ctx->out, ',');
+                    }
+                    newctx.first = false;
+                }
+                else
+                {
+                    if(newctx.first)
+                    {
+                        common_buf_putc(ctx->out, '\n');
+                        newctx.first = false;
+                    }
+                    else
+                    {
+                        common_buf_write(ctx->out, ",\n", 2);
+                    }
+                    common_buf_pad(ctx->out, newctx.lvl * 4);
+                }
+                if(dict)
+                {
+                    size_t klen = 0;
+                    const uint8_t *kstr = oss_key(oss, pos, record, &klen);
+                    if(!kstr)
+                    {
+                        return false;
+                    }
+                    oss_print_str(&newctx, kstr, klen);
+                    common_buf_write(ctx->out, ": ", ctx->compact ? 1 : 2);
+                }
+                if(!oss_print_obj(oss, &newctx, pos, record, depth + 1, &end))
+                {
+                    return false;
+                }
+            }
+            if(!newctx.first && !ctx->compact)
+            {
+                common_buf_putc(ctx->out, '\n');
+                common_buf_pad(ctx->out, ctx->lvl * 4);
+            }
+            common_buf_putc(ctx->out, dict ? '}' : ']');
+            return true;
+        }
+        case OSS_NUMBER:
+        {
+            uint64_t val;
+            if(!oss_number(oss, pos, len, &val))
+            {
+                return false;
+            }
+            if(ctx->true_json)
+            {
+                common_buf_dec(ctx->out, val);
+            }
+            else
+            {
+                common_buf_hex(ctx->out, val);
+            }
+            return true;
+        }
+        case OSS_SYMBOL:
+        case OSS_STRING:
+        {
+            size_t size = 0;
+            if(!(ptr = oss_str(oss, pos, key, &size)))
+            {
+                return false;
+            }
+            oss_print_str(ctx, ptr, size);
+            return true;
+        }
+        case OSS_DATA:
+            if(!(ptr = oss_bytes(oss, pos, len)))
+            {
+                return false;
+            }
+            if(ctx->true_json)
+            {
+                common_print_bytes(ctx, ptr, len);
+            }
+            else if(len > 0)
+            {
+                common_print_hexdump(ctx, ptr, len);
+            }
+            return true;
+        case OSS_BOOLEAN:
+            common_buf_puts(ctx->out, len ? "true" : "false");
+            return true;
+    }
+    return false;
+}
+
+// Symbols and strings hash the same, and so do sets and arrays, since both come out the same
+// after unserializing. Dictionary entries are combined so that their order doesn't matter.
+static bool oss_hash_obj(oss_t *oss, size_t *pos, bool record, unsigned depth, bool *last, uint64_t *hash)
+{
+    if(!oss_depth(depth) || oss->budget == 0)
+    {
+        return false;
+    }
+    --oss->budget;
+    size_t start = *pos;
+    uint32_t key;
+    if(!oss_word(oss, pos, &key))
+    {
+        return false;
+    }
+    uint32_t len = key & OSS_DATA_MASK,
+             type = key & OSS_TYPE_MASK;
+    *last = !!(key & OSS_END);
+    if(type == OSS_OBJECT)
+    {
+        if(len >= oss->numObjs)
+        {
+            return false;
+        }
+        size_t off = oss->objs[len];
+        bool dummy;
+        return oss_hash_obj(oss, &off, false, depth + 1, &dummy, hash);
+    }
+    if(record && !oss_add(oss, start))
+    {
+        return false;
+    }
+    const uint8_t *ptr = NULL;
+    switch(type)
+    {
+        case OSS_DICT:
+        case OSS_ARRAY:
+        case OSS_SET:
+        {
+            bool dict = type == OSS_DICT;
+            uint64_t h = 0,
+                     num = 0;
+            bool end = len == 0;
+            while(!end)
+            {
+                uint64_t k = 0,
+                         v = 0;
+                if(dict)
+                {
+                    size_t klen = 0;
+                    const uint8_t *kstr = oss_key(oss, pos, record, &klen);
+                    if(!kstr)
+                    {
+                        return false;
+                    }
+                    k = common_hash(kstr, klen, OSS_STRING);
+                }
+                if(!oss_hash_obj(oss, pos, record, depth + 1, &end, &v))
+                {
+                    return false;
+                }
+                h = dict ? h + common_mix(k, v) : common_mix(h, v);
+                ++num;
+            }
+            *hash = common_mix(common_mix(dict ? OSS_DICT : OSS_ARRAY, h), num);
+            return true;
+        }
+        case OSS_NUMBER:
+        {
+            uint64_t val;
+            if(!oss_number(oss, pos, len, &val))
+            {
+                return false;
+            }
+            *hash = common_mix(OSS_NUMBER, val);
+            return true;
+        }
+        case OSS_SYMBOL:
+        case OSS_STRING:
+        {
+            size_t size = 0;
+            if(!(ptr = oss_str(oss, pos, key, &size)))
+            {
+                return false;
+            }
+            *hash = common_hash(ptr, size, OSS_STRING);
+            return true;
+        }
+        case OSS_DATA:
+            if(!(ptr = oss_bytes(oss, pos, len)))
+            {
+                return false;
+            }
+            *hash = common_hash(ptr, len, OSS_DATA);
+            return true;
+        case OSS_BOOLEAN:
+            *hash = common_mix(OSS_BOOLEAN, len != 0);
+            return true;
+    }
+    return false;
+}
+
+static bool oss_start(oss_t *oss, const uint8_t *buf, size_t size, size_t *pos)
+{
+    oss->buf = buf;
+    oss->size = buf ? size : 0;
+    oss->numObjs = 0;
+    oss->numKeys = 0;
+    oss->budget = OSS_BUDGET(oss->size);
+    oss->out.len = 0;
+    oss->out.err = false;
+    *pos = 0;
+    uint32_t magic = 0;
+    return oss_word(oss, pos, &magic) && magic == OSS_MAGIC;
+}
+
+// Output goes to oss->out, followed by a newline, same as cfj_print_buf.
+// On failure, whatever is in there is garbage.
+bool oss_format(oss_t *oss, const uint8_t *buf, size_t size, bool true_json, bool bytes_raw)
+{
+    common_ctx_t ctx =
+    {
+        .true_json = true_json,
+        .bytes_raw = bytes_raw,
+        .first = false,
+        .lvl = 0,
+        .out = &oss->out,
+    };
+    size_t pos = 0;
+    bool last = false;
+    if(!oss_start(oss, buf, size, &pos) || !oss_print_obj(oss, &ctx, &pos, true, 0, &last))
+    {
+        return false;
+    }
+    common_buf_putc(&oss->out, '\n');
+    return !oss->out.err;
+}
+
+// Plain JSON on a single line in oss->out, without a trailing newline.
+bool oss_format_compact(oss_t *oss, const uint8_t *buf, size_t size)
+{
+    common_ctx_t ctx =
+    {
+        .true_json = true,
+        .bytes_raw = false,
+        .first = false,
+        .compact = true,
+        .lvl = 0,
+        .out = &oss->out,
+    };
+    size_t pos = 0;
+    bool last = false;
+    return oss_start(oss, buf, size, &pos) && oss_print_obj(oss, &ctx, &pos, true, 0, &last) && !oss->out.err;
+}
+
+// Equal for data that is equal after unserializing.
+bool oss_hash(oss_t *oss, const uint8_t *buf, size_t size, uint64_t *hash)
+{
+    size_t pos = 0;
+    bool last = false;
+    return oss_start(oss, buf, size, &pos) && oss_hash_obj(oss, &pos, true, 0, &last, hash);
+}
+
+int oss_key_cmp(const void *a, const void *b)
+{
+    const oss_key_t *x = a,
+                    *y = b;
+    int r = memcmp(x->str, y->str, x->len < y->len ? x->len : y->len);
+    return r != 0 ? r : x->len < y->len ? -1 : x->len > y->len ? 1 : 0;
+}
+
+// Collects the keys of a top-level dictionary into oss->keys, sorted,
+// along with the hash and location of their values.
+bool oss_keys(oss_t *oss, const uint8_t *buf, size_t size)
+{
+    size_t pos = 0;
+    if(!oss_start(oss, buf, size, &pos))
+    {
+        return false;
+    }
+    size_t start = pos;
+    uint32_t key;
+    if(!oss_word(oss, &pos, &key) || (key & OSS_TYPE_MASK) != OSS_DICT || !oss_add(oss, start))
+    {
+        return false;
+    }
+    bool end = (key & OSS_DATA_MASK) == 0;
+    while(!end)
+    {
+        if(oss->numKeys >= oss->capKeys)
+        {
+            size_t cap = oss->capKeys ? oss->capKeys * 2 : 0x40;
+            oss_key_t *keys = realloc(oss->keys, cap * sizeof(*keys));
+            if(!keys)
+            {
+                return false;
+            }
+            oss->keys = keys;
+            oss->capKeys = cap;
+        }
+        oss_key_t *k = &oss->keys[oss->numKeys];
+        if(!(k->str = oss_key(oss, &pos, true, &k->len)))
+        {
+            return false;
+        }
+        k->off = pos;
+        if(!oss_hash_obj(oss, &pos, true, 1, &end, &k->hash))
+        {
+            return false;
+        }
+        ++oss->numKeys;
+    }
+    qsort(oss->keys, oss->numKeys, sizeof(*oss->keys), &oss_key_cmp);
+    return true;
+}
+
+// Prints a value found by oss_keys to oss->out, indented for lvl, without a newline.
+bool oss_format_at(oss_t *oss, size_t off, int lvl, bool true_json, bool bytes_raw)
+{
+    common_ctx_t ctx =
+    {
+        .true_json = true_json,
+        .bytes_raw = bytes_raw,
+        .first = false,
+        .lvl = lvl,
+        .out = &oss->out,
+    };
+    bool last = false;
+    oss->budget = OSS_BUDGET(oss->size);
+    oss->out.len = 0;
+    oss->out.err = false;
+    return oss_print_obj(oss, &ctx, &off, false, 0, &last) && !oss->out.err;
+}
+
+void oss_put(common_buf_t *out, uint32_t key, const void *data, size_t size)
+{
+    static const uint8_t zero[4] = {};
+    common_buf_write(out, &key, sizeof(key));
+    if(size)
+    {
+        common_buf_write(out, data, size);
+        common_buf_write(out, zero, (4 - (size & 3)) & 3);
+    }
+}
+
+// Back-references are copied in place, and keys are always written as symbols.
+static bool oss_flatten_obj(oss_t *oss, common_buf_t *out, size_t *pos, bool record, unsigned depth, bool *last)
+{
+    if(!oss_depth(depth) || oss->budget == 0)
+    {
+        return false;
+    }
+    --oss->budget;
+    size_t start = *pos;
+    uint32_t key;
+    if(!oss_word(oss, pos, &key))
+    {
+        return false;
+    }
+    uint32_t len = key & OSS_DATA_MASK,
+             type = key & OSS_TYPE_MASK;
+    *last = !!(key & OSS_END);
+    if(type == OSS_OBJECT)
+    {
+        if(len >= oss->numObjs)
+        {
+            return false;
+        }
+        size_t off = oss->objs[len];
+        bool dummy;
+        return oss_flatten_obj(oss, out, &off, false, depth + 1, &dummy);
+    }
+    if(record && !oss_add(oss, start))
+    {
+        return false;
+    }
+    const uint8_t *ptr = NULL;
+    switch(type)
+    {
+        case OSS_DICT:
+        case OSS_ARRAY:
+        case OSS_SET:
+        {
+            oss_put(out, type | len, NULL, 0);
+            bool end = len == 0;
+            while(!end)
+            {
+                if(type == OSS_DICT)
+                {
+                    size_t klen = 0;
+                    const uint8_t *kstr = oss_key(oss, pos, record, &klen);
+                    if(!kstr || klen >= OSS_DATA_MASK)
+                    {
+                        return false;
+                    }
+                    static const uint8_t zero[4] = {};
+                    oss_put(out, OSS_SYMBOL | (uint32_t)(klen + 1), NULL, 0);
+                    common_buf_write(out, kstr, klen);
+                    common_buf_write(out, zero, 4 - (klen & 3));
+                }
+                // The end marker depends on where the object is, not where it came from.
+                size_t hdr = out->len;
+                if(!oss_flatten_obj(oss, out, pos, record, depth + 1, &end))
+                {
+                    return false;
+                }
+                if(end && !out->err)
+                {
+                    uint32_t word;
+                    memcpy(&word, out->data + hdr, sizeof(word));
+                    word |= OSS_END;
+                    memcpy(out->data + hdr, &word, sizeof(word));
+                }
+            }
+            return true;
+        }
+        case OSS_NUMBER:
+            if(!(ptr = oss_bytes(oss, pos, sizeof(uint64_t))))
+            {
+                return false;
+            }
+            oss_put(out, type | len, ptr, sizeof(uint64_t));
+            return true;
+        case OSS_SYMBOL:
+        case OSS_STRING:
+        case OSS_DATA:
+            if(!(ptr = oss_bytes(oss, pos, len)))
+            {
+                return false;
+            }
+            oss_put(out, type | len, ptr, len);
+            return true;
+        case OSS_BOOLEAN:
+            oss_put(out, type | len, NULL, 0);
+            return true;
+    }
+    return false;
+}
+
+// Appends the object in buf to out, without magic and without any back-references.
+// On failure, out may have been partially written to.
+bool oss_flatten(oss_t *oss, const uint8_t *buf, size_t size, common_buf_t *out)
+{
+    size_t pos = 0;
+    bool last = false;
+    return oss_start(oss, buf, size, &pos) && oss_flatten_obj(oss, out, &pos, true, 0, &last) && !out->err;
+}
+
+// For reading a document object by object, rather than as a whole.
+bool oss_open(oss_t *oss, const uint8_t *buf, size_t size)
+{
+    return oss_start(oss, buf, size, &oss->pos);
+}
+
+// Reads the object at the cursor, or what it refers to. Containers can't be
+// read through a back-reference, since their contents aren't at the cursor.
+bool oss_next(oss_t *oss, oss_item_t *item)
+{
+    size_t start = oss->pos,
+           *pos = &oss->pos,
+           off = 0;
+    uint32_t key;
+    if(!oss_word(oss, pos, &key))
+    {
+        return false;
+    }
+    item->last = !!(key & OSS_END);
+    if((key & OSS_TYPE_MASK) == OSS_OBJECT)
+    {
+        uint32_t idx = key & OSS_DATA_MASK;
+        off = idx < oss->numObjs ? oss->objs[idx] : oss->size;
+        if(!oss_word(oss, &off, &key))
+        {
+            return false;
+        }
+        pos = &off;
+        uint32_t type = key & OSS_TYPE_MASK;
+        if(type == OSS_DICT || type == OSS_ARRAY || type == OSS_SET)
+        {
+            return false;
+        }
+    }
+    else if(!oss_add(oss, start))
+    {
+        return false;
+    }
+    item->type = key & OSS_TYPE_MASK;
+    item->len = key & OSS_DATA_MASK;
+    item->str = NULL;
+    item->size = 0;
+    item->val = 0;
+    switch(item->type)
+    {
+        case OSS_DICT:
+        case OSS_ARRAY:
+        case OSS_SET:
+            return true;
+        case OSS_NUMBER:
+            return oss_number(oss, pos, item->len, &item->val);
+        case OSS_SYMBOL:
+        case OSS_STRING:
+            item->str = oss_str(oss, pos, key, &item->size);
+            return item->str != NULL;
+        case OSS_DATA:
+            item->size = item->len;
+            item->str = oss_bytes(oss, pos, item->size);
+            return item->str != NULL;
+        case OSS_BOOLEAN:
+            item->val = item->len != 0;
+            return true;
+    }
+    return false;
+}
+
+// Steps over the whole object at the cursor, recording everything in it
+// so that back-references to it can be resolved later.
+bool oss_next_record(oss_t *oss)
+{
+    bool last = false;
+    uint64_t hash = 0;
+    oss->budget = OSS_BUDGET(oss->size);
+    return oss_hash_obj(oss, &oss->pos, true, 0, &last, &hash);
+}
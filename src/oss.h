@@ -0,0 +1,87 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#ifndef OSS_H
+#define OSS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+// Decoder for binary OSSerialize data that prints straight from the buffer,
+// without building CoreFoundation objects. Doesn't depend on IOKit or CF at all.
+// The same decoder should be reused for many buffers, so that its tables stay allocated.
+
+// Same as kOSSerialize* in iokit.h, which can't be used without IOKit headers.
+#define OSS_DICT        0x01000000U
+#define OSS_ARRAY       0x02000000U
+#define OSS_SET         0x03000000U
+#define OSS_NUMBER      0x04000000U
+#define OSS_SYMBOL      0x08000000U
+#define OSS_STRING      0x09000000U
+#define OSS_DATA        0x0a000000U
+#define OSS_BOOLEAN     0x0b000000U
+#define OSS_OBJECT      0x0c000000U
+#define OSS_TYPE_MASK   0x7F000000U
+#define OSS_DATA_MASK   0x00FFFFFFU
+#define OSS_END         0x80000000U
+#define OSS_MAGIC       0x000000d3U
+
+typedef struct
+{
+    const uint8_t *str;
+    size_t len;
+    uint64_t hash;      // of the value
+    size_t off;         // of the value, for oss_format_at
+} oss_key_t;
+
+typedef struct
+{
+    const uint8_t *buf;
+    size_t size;
+    size_t *objs;       // offset of every object seen so far, for back-references
+    size_t numObjs;
+    size_t capObjs;
+    size_t budget;      // nodes left to visit, so back-references can't blow up the output
+    oss_key_t *keys;
+    size_t numKeys;
+    size_t capKeys;
+    size_t pos;         // cursor for oss_open and oss_next
+    common_buf_t out;
+} oss_t;
+
+// One object read by oss_next. Containers are followed by their contents.
+typedef struct
+{
+    uint32_t type;
+    uint32_t len;
+    bool last;
+    const uint8_t *str; // strings, symbols and data
+    size_t size;
+    uint64_t val;       // numbers and booleans
+} oss_item_t;
+
+void oss_init(oss_t *oss);
+void oss_free(oss_t *oss);
+bool oss_format(oss_t *oss, const uint8_t *buf, size_t size, bool true_json, bool bytes_raw);
+bool oss_format_compact(oss_t *oss, const uint8_t *buf, size_t size);
+bool oss_hash(oss_t *oss, const uint8_t *buf, size_t size, uint64_t *hash);
+bool oss_keys(oss_t *oss, const uint8_t *buf, size_t size);
+int oss_key_cmp(const void *a, const void *b);
+bool oss_format_at(oss_t *oss, size_t off, int lvl, bool true_json, bool bytes_raw);
+bool oss_flatten(oss_t *oss, const uint8_t *buf, size_t size, common_buf_t *out);
+void oss_put(common_buf_t *out, uint32_t key, const void *data, size_t size);
+bool oss_open(oss_t *oss, const uint8_t *buf, size_t size);
+bool oss_next(oss_t *oss, oss_item_t *item);
+bool oss_next_record(oss_t *oss);
+
+#endif
@@ -0,0 +1,384 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "snap.h"
+#include "stats.h"
+
+#define SNAP_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+static bool snap_range(size_t size, uint64_t off, uint64_t len)
+{
+    return off <= size && len <= size - off && (off & 7) == 0;
+}
+
+// Only the header and table bounds are checked here, everything else is checked on access.
+// That way opening a snapshot costs the same no matter how large it is.
+bool snap_open(snap_t *snap, const char *path)
+{
+    memset(snap, 0, sizeof(*snap));
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        ERR(COLOR_RED "open(%s): %s" COLOR_RESET, path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        ERR(COLOR_RED "fstat(%s): %s" COLOR_RESET, path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if(st.st_size < (off_t)sizeof(snap_hdr_t))
+    {
+        ERR(COLOR_RED "%s: file too small" COLOR_RESET, path);
+        close(fd);
+        return false;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+    {
+        ERR(COLOR_RED "mmap(%s): %s" COLOR_RESET, path, strerror(errno));
+        return false;
+    }
+    snap->base = base;
+    snap->size = st.st_size;
+
+    const snap_hdr_t *hdr = base;
+    if(memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != SNAP_VERSION)
+    {
+        ERR(COLOR_RED "%s: not a registry snapshot, or wrong version" COLOR_RESET, path);
+        snap_close(snap);
+        return false;
+    }
+    if(
+        hdr->numEntries == 0 ||
+        !snap_range(snap->size, hdr->entriesOff, (uint64_t)hdr->numEntries * sizeof(snap_entry_t)) ||
+        !snap_range(snap->size, hdr->classesOff, (uint64_t)hdr->numClasses * sizeof(snap_class_t)) ||
+        !snap_range(snap->size, hdr->edgesOff,   (uint64_t)hdr->numEdges   * sizeof(uint32_t)) ||
+        !snap_range(snap->size, hdr->strsOff,    hdr->strsLen) ||
+        !snap_range(snap->size, hdr->dataOff,    hdr->dataLen) ||
+        hdr->strsLen == 0 || snap->base[hdr->strsOff + hdr->strsLen - 1] != '\0' ||
+        hdr->plane[sizeof(hdr->plane) - 1] != '\0'
+    )
+    {
+        ERR(COLOR_RED "%s: corrupt snapshot header" COLOR_RESET, path);
+        snap_close(snap);
+        return false;
+    }
+    snap->hdr     = hdr;
+    snap->entries = (const snap_entry_t*)(snap->base + hdr->entriesOff);
+    snap->classes = (const snap_class_t*)(snap->base + hdr->classesOff);
+    snap->edges   = (const uint32_t*)(snap->base + hdr->edgesOff);
+    snap->strs    = (const char*)(snap->base + hdr->strsOff);
+    snap->data    = snap->base + hdr->dataOff;
+    return true;
+}
+
+void snap_close(snap_t *snap)
+{
+    if(snap->base)
+    {
+        munmap((void*)snap->base, snap->size);
+    }
+    memset(snap, 0, sizeof(*snap));
+}
+
+const char* snap_str(const snap_t *snap, uint32_t off)
+{
+    return off < snap->hdr->strsLen ? snap->strs + off : "";
+}
+
+const char* snap_class_name(const snap_t *snap, uint32_t class)
+{
+    return class < snap->hdr->numClasses ? snap_str(snap, snap->classes[class].name) : "";
+}
+
+bool snap_conforms(const snap_t *snap, const snap_entry_t *entry, const char *class)
+{
+    // Bounded, in case the file has a loop in it
+    uint32_t c = entry->class;
+    for(uint32_t i = 0; c < snap->hdr->numClasses && i < snap->hdr->numClasses; ++i)
+    {
+        if(strcmp(snap_str(snap, snap->classes[c].name), class) == 0)
+        {
+            return true;
+        }
+        c = snap->classes[c].super;
+    }
+    return false;
+}
+
+const uint8_t* snap_props(const snap_t *snap, const snap_entry_t *entry, size_t *size)
+{
+    if(entry->props > snap->hdr->dataLen || entry->propsLen > snap->hdr->dataLen - entry->props)
+    {
+        return NULL;
+    }
+    *size = entry->propsLen;
+    return snap->data + entry->props;
+}
+
+// Hash of name and class only, for pairing up entries across snapshots.
+uint64_t snap_id_hash(const snap_t *snap, const snap_entry_t *entry)
+{
+    const char *name  = snap_str(snap, entry->name),
+               *class = snap_class_name(snap, entry->class);
+    return common_hash(class, strlen(class), common_hash(name, strlen(name), 0));
+}
+
+static uint32_t snap_hash(const char *str)
+{
+    uint32_t h = 0x811c9dc5;
+    for(; *str; ++str)
+    {
+        h = (h ^ (uint8_t)*str) * 0x01000193;
+    }
+    return h;
+}
+
+static uint32_t snap_writer_str(snap_writer_t *w, const char *str)
+{
+    uint32_t off = (uint32_t)w->strs.len;
+    common_buf_write(&w->strs, str, strlen(str) + 1);
+    return off;
+}
+
+void snap_writer_init(snap_writer_t *w)
+{
+    common_buf_init(&w->entries, NULL);
+    common_buf_init(&w->classes, NULL);
+    common_buf_init(&w->strs, NULL);
+    common_buf_init(&w->data, NULL);
+    w->tab = NULL;
+    w->tabCap = 0;
+    w->numEntries = 0;
+    w->numClasses = 0;
+    oss_init(&w->oss);
+    // Offset 0 is the empty string
+    common_buf_putc(&w->strs, '\0');
+}
+
+void snap_writer_free(snap_writer_t *w)
+{
+    common_buf_free(&w->entries);
+    common_buf_free(&w->classes);
+    common_buf_free(&w->strs);
+    common_buf_free(&w->data);
+    free(w->tab);
+    w->tab = NULL;
+    w->tabCap = 0;
+    oss_free(&w->oss);
+}
+
+// Returns the index of the class, adding it if necessary. New classes have no superclass until one is set.
+uint32_t snap_writer_class(snap_writer_t *w, const char *name, bool *added)
+{
+    *added = false;
+    if(w->numClasses * 2 >= w->tabCap)
+    {
+        size_t cap = w->tabCap ? w->tabCap * 2 : 0x400;
+        uint32_t *tab = calloc(cap, sizeof(uint32_t));
+        if(!tab)
+        {
+            w->classes.err = true;
+            return SNAP_NONE;
+        }
+        const snap_class_t *classes = (const snap_class_t*)w->classes.data;
+        for(uint32_t i = 0; i < w->numClasses; ++i)
+        {
+            size_t j = snap_hash(w->strs.data + classes[i].name) & (cap - 1);
+            while(tab[j] != 0)
+            {
+                j = (j + 1) & (cap - 1);
+            }
+            tab[j] = i + 1;
+        }
+        free(w->tab);
+        w->tab = tab;
+        w->tabCap = cap;
+    }
+    size_t j = snap_hash(name) & (w->tabCap - 1);
+    for(; w->tab[j] != 0; j = (j + 1) & (w->tabCap - 1))
+    {
+        const snap_class_t *class = (const snap_class_t*)w->classes.data + (w->tab[j] - 1);
+        if(strcmp(w->strs.data + class->name, name) == 0)
+        {
+            return w->tab[j] - 1;
+        }
+    }
+    snap_class_t class =
+    {
+        .name = snap_writer_str(w, name),
+        .super = SNAP_NONE,
+    };
+    common_buf_write(&w->classes, &class, sizeof(class));
+    if(w->classes.err || w->strs.err)
+    {
+        return SNAP_NONE;
+    }
+    w->tab[j] = ++w->numClasses;
+    *added = true;
+    return w->numClasses - 1;
+}
+
+void snap_writer_super(snap_writer_t *w, uint32_t class, uint32_t super)
+{
+    if(class < w->numClasses)
+    {
+        ((snap_class_t*)w->classes.data)[class].super = super;
+    }
+}
+
+uint32_t snap_writer_entry(snap_writer_t *w, uint64_t id, const char *name, uint32_t class, uint32_t parent, uint32_t depth, int32_t ret, const void *props, size_t propsLen)
+{
+    // Same as snap_id_hash, plus the properties or the error we got instead
+    const char *className = class < w->numClasses ? w->strs.data + ((const snap_class_t*)w->classes.data)[class].name : "";
+    uint64_t hash = common_hash(className, strlen(className), common_hash(name, strlen(name), 0)),
+             propsHash = 0;
+    if(ret != 0 || !props || !oss_hash(&w->oss, props, propsLen, &propsHash))
+    {
+        propsHash = common_hash(props, props ? propsLen : 0, (uint32_t)ret);
+    }
+    snap_entry_t entry =
+    {
+        .id = id,
+        .hash = common_mix(hash, propsHash),
+        .tree = 0,
+        .props = w->data.len,
+        .propsLen = (uint32_t)propsLen,
+        .propsRet = ret,
+        .name = snap_writer_str(w, name),
+        .class = class,
+        .parent = parent,
+        .depth = depth,
+        .firstChild = 0,
+        .numChildren = 0,
+    };
+    if(props)
+    {
+        common_buf_write(&w->data, props, propsLen);
+        // Keep payloads aligned
+        common_buf_pad(&w->data, SNAP_ALIGN(w->data.len) - w->data.len);
+    }
+    common_buf_write(&w->entries, &entry, sizeof(entry));
+    return w->numEntries++;
+}
+
+static bool snap_fwrite(FILE *f, const void *buf, size_t size)
+{
+    static const char zero[8] = { 0 };
+    return stats_fwrite(buf, size, f) == size && stats_fwrite(zero, SNAP_ALIGN(size) - size, f) == SNAP_ALIGN(size) - size;
+}
+
+bool snap_writer_save(snap_writer_t *w, const char *path, const char *plane)
+{
+    if(w->entries.err || w->classes.err || w->strs.err || w->data.err)
+    {
+        ERR(COLOR_RED "Failed to build snapshot: %s" COLOR_RESET, strerror(ENOMEM));
+        return false;
+    }
+
+    // Group child indices by parent, keeping iteration order within each group
+    snap_entry_t *entries = (snap_entry_t*)w->entries.data;
+    uint32_t numEdges = 0;
+    for(uint32_t i = 0; i < w->numEntries; ++i)
+    {
+        if(entries[i].parent < w->numEntries)
+        {
+            ++entries[entries[i].parent].numChildren;
+            ++numEdges;
+        }
+    }
+    uint32_t *edges = malloc((numEdges ? numEdges : 1) * sizeof(uint32_t));
+    if(!edges)
+    {
+        ERR(COLOR_RED "Failed to allocate edges: %s" COLOR_RESET, strerror(errno));
+        return false;
+    }
+    for(uint32_t i = 0, off = 0; i < w->numEntries; ++i)
+    {
+        entries[i].firstChild = off;
+        off += entries[i].numChildren;
+        entries[i].numChildren = 0;
+    }
+    for(uint32_t i = 0; i < w->numEntries; ++i)
+    {
+        if(entries[i].parent < w->numEntries)
+        {
+            snap_entry_t *parent = &entries[entries[i].parent];
+            edges[parent->firstChild + parent->numChildren++] = i;
+        }
+    }
+    // Children always come after their parent, so going backwards every subtree is done
+    // before it's added to its parent. Summing makes the order of children irrelevant.
+    for(uint32_t i = w->numEntries; i-- > 0; )
+    {
+        entries[i].tree = common_mix(entries[i].hash, common_mix(entries[i].tree, entries[i].numChildren));
+        if(entries[i].parent < i)
+        {
+            entries[entries[i].parent].tree += entries[i].tree;
+        }
+    }
+
+    snap_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version    = SNAP_VERSION;
+    hdr.numEntries = w->numEntries;
+    hdr.numClasses = w->numClasses;
+    hdr.numEdges   = numEdges;
+    hdr.entriesOff = SNAP_ALIGN(sizeof(hdr));
+    hdr.classesOff = SNAP_ALIGN(hdr.entriesOff + w->entries.len);
+    hdr.edgesOff   = SNAP_ALIGN(hdr.classesOff + w->classes.len);
+    hdr.strsOff    = SNAP_ALIGN(hdr.edgesOff + numEdges * sizeof(uint32_t));
+    hdr.strsLen    = w->strs.len;
+    hdr.dataOff    = SNAP_ALIGN(hdr.strsOff + w->strs.len);
+    hdr.dataLen    = w->data.len;
+    strncpy(hdr.plane, plane, sizeof(hdr.plane) - 1);
+
+    FILE *f = fopen(path, "wb");
+    if(!f)
+    {
+        ERR(COLOR_RED "fopen(%s): %s" COLOR_RESET, path, strerror(errno));
+        free(edges);
+        return false;
+    }
+    bool succ = snap_fwrite(f, &hdr, sizeof(hdr)) &&
+                snap_fwrite(f, w->entries.data, w->entries.len) &&
+                snap_fwrite(f, w->classes.data, w->classes.len) &&
+                snap_fwrite(f, edges, numEdges * sizeof(uint32_t)) &&
+                snap_fwrite(f, w->strs.data, w->strs.len) &&
+                snap_fwrite(f, w->data.data, w->data.len);
+    free(edges);
+    if(fclose(f) != 0)
+    {
+        succ = false;
+    }
+    if(!succ)
+    {
+        ERR(COLOR_RED "Failed to write %s: %s" COLOR_RESET, path, strerror(errno));
+    }
+    return succ;
+}
@@ -0,0 +1,120 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "oss.h"
+
+// Registry snapshot file layout, in host byte order:
+//
+//   snap_hdr_t
+//   snap_entry_t[numEntries]   registry entries in iteration order, root first
+//   snap_class_t[numClasses]   class table, each class pointing to its superclass
+//   uint32_t[numEdges]         child entry indices, grouped by parent
+//   char[strsLen]              NUL-terminated names, referenced by offset
+//   uint8_t[dataLen]           raw properties, as binary OSSerialize data
+//
+// All tables are 8-byte aligned and can be used in place after mmap.
+//
+// Every entry carries a hash of its name, class and properties, and a hash of
+// its whole subtree on top of that, so two snapshots can be diffed by only
+// descending into subtrees whose hashes differ. Neither depends on registry IDs
+// or on the order of properties or children.
+
+#define SNAP_MAGIC   "IOSNAP\0\0"
+#define SNAP_VERSION 2
+#define SNAP_NONE    UINT32_MAX
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numEntries;
+    uint32_t numClasses;
+    uint32_t numEdges;
+    uint64_t entriesOff;
+    uint64_t classesOff;
+    uint64_t edgesOff;
+    uint64_t strsOff;
+    uint64_t strsLen;
+    uint64_t dataOff;
+    uint64_t dataLen;
+    char plane[128];
+} snap_hdr_t;
+
+typedef struct
+{
+    uint64_t id;
+    uint64_t hash;
+    uint64_t tree;
+    uint64_t props;
+    uint32_t propsLen;
+    int32_t propsRet;
+    uint32_t name;
+    uint32_t class;
+    uint32_t parent;
+    uint32_t depth;
+    uint32_t firstChild;
+    uint32_t numChildren;
+} snap_entry_t;
+
+typedef struct
+{
+    uint32_t name;
+    uint32_t super;
+} snap_class_t;
+
+typedef struct
+{
+    const uint8_t *base;
+    size_t size;
+    const snap_hdr_t *hdr;
+    const snap_entry_t *entries;
+    const snap_class_t *classes;
+    const uint32_t *edges;
+    const char *strs;
+    const uint8_t *data;
+} snap_t;
+
+bool snap_open(snap_t *snap, const char *path);
+void snap_close(snap_t *snap);
+const char* snap_str(const snap_t *snap, uint32_t off);
+const char* snap_class_name(const snap_t *snap, uint32_t class);
+bool snap_conforms(const snap_t *snap, const snap_entry_t *entry, const char *class);
+const uint8_t* snap_props(const snap_t *snap, const snap_entry_t *entry, size_t *size);
+uint64_t snap_id_hash(const snap_t *snap, const snap_entry_t *entry);
+
+typedef struct
+{
+    common_buf_t entries;
+    common_buf_t classes;
+    common_buf_t strs;
+    common_buf_t data;
+    uint32_t *tab;
+    size_t tabCap;
+    oss_t oss;
+    uint32_t numEntries;
+    uint32_t numClasses;
+} snap_writer_t;
+
+void snap_writer_init(snap_writer_t *w);
+void snap_writer_free(snap_writer_t *w);
+uint32_t snap_writer_class(snap_writer_t *w, const char *name, bool *added);
+void snap_writer_super(snap_writer_t *w, uint32_t class, uint32_t super);
+uint32_t snap_writer_entry(snap_writer_t *w, uint64_t id, const char *name, uint32_t class, uint32_t parent, uint32_t depth, int32_t ret, const void *props, size_t propsLen);
+bool snap_writer_save(snap_writer_t *w, const char *path, const char *plane);
+
+#endif
@@ -0,0 +1,255 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifdef __APPLE__
+#   include <mach/mach_time.h>
+#endif
+
+#include "common.h"
+#include "stats.h"
+
+// Latencies are bucketed by power of two, with 4 linear steps in between,
+// so percentiles are accurate to within 25%. Values below 8ns are exact,
+// and no percentile is reported above the largest value actually seen.
+#define STATS_SUB       4
+#define STATS_BUCKETS   (64 * STATS_SUB)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_t;
+
+static const char *const stats_names[STATS_NUM] =
+{
+    [STATS_ROOT_ENTRY]              = "IORegistryGetRootEntry",
+    [STATS_CREATE_ITERATOR]         = "IORegistryCreateIterator",
+    [STATS_CHILD_ITERATOR]          = "IORegistryEntryGetChildIterator",
+    [STATS_ITERATOR_NEXT]           = "IOIteratorNext",
+    [STATS_GET_NAME]                = "IORegistryEntryGetName",
+    [STATS_GET_CLASS]               = "_IOObjectGetClass",
+    [STATS_CONFORMS]                = "IOObjectConformsTo",
+    [STATS_ENTRY_ID]                = "IORegistryEntryGetRegistryEntryID",
+    [STATS_GET_PATH]                = "IORegistryEntryGetPath",
+    [STATS_PROPERTIES]              = "IORegistryEntryCreateCFProperties",
+    [STATS_PROPERTY]                = "IORegistryEntryCreateCFProperty",
+    [STATS_GET_PROPERTY]            = "IORegistryEntryGetProperty",
+    [STATS_SET_PROPERTIES]          = "IORegistryEntrySetCFProperties",
+    [STATS_MATCHING]                = "IOServiceGetMatchingServices",
+    [STATS_MATCHING_NOTIFICATION]   = "IOServiceAddMatchingNotification",
+    [STATS_INTEREST_NOTIFICATION]   = "IOServiceAddInterestNotification",
+    [STATS_SERVICE_OPEN]            = "IOServiceOpen",
+    [STATS_SERVICE_CLOSE]           = "IOServiceClose",
+    [STATS_SUPERCLASS]              = "IOObjectCopySuperclassForClass",
+    [STATS_BUNDLE]                  = "IOObjectCopyBundleIdentifierForClass",
+    [STATS_FORMAT]                  = "format",
+    [STATS_WRITE]                   = "write",
+};
+
+static bool stats_enabled = false,
+            stats_json = false;
+static uint64_t stats_start = 0,
+                stats_written = 0;
+static stats_t stats[STATS_NUM];
+static uint64_t stats_counts[STATS_COUNT_NUM];
+
+// Time this thread spent writing, so that it can be taken out of format time.
+static __thread uint64_t stats_writing = 0;
+
+#ifdef __APPLE__
+static mach_timebase_info_data_t stats_timebase;
+#endif
+
+static uint64_t stats_now(void)
+{
+#ifdef __APPLE__
+    return mach_absolute_time() * stats_timebase.numer / stats_timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static size_t stats_bucket(uint64_t ns)
+{
+    if(ns < 2 * STATS_SUB)
+    {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return msb * STATS_SUB + ((ns >> (msb - 2)) & (STATS_SUB - 1));
+}
+
+// Largest value that lands in the bucket.
+static uint64_t stats_bucket_max(size_t idx)
+{
+    if(idx < 2 * STATS_SUB)
+    {
+        return idx;
+    }
+    size_t msb = idx / STATS_SUB,
+           sub = idx % STATS_SUB;
+    return ((STATS_SUB + sub + 1) << (msb - 2)) - 1;
+}
+
+static uint64_t stats_percentile(const stats_t *s, double p)
+{
+    uint64_t want = (uint64_t)(s->count * p),
+             seen = 0;
+    for(size_t i = 0; i < STATS_BUCKETS; ++i)
+    {
+        seen += s->buckets[i];
+        if(seen > want)
+        {
+            uint64_t max = stats_bucket_max(i);
+            return max < s->max ? max : s->max;
+        }
+    }
+    return 0;
+}
+
+static void stats_report(void)
+{
+    uint64_t t = stats_begin(STATS_WRITE);
+    fflush(stdout);
+    stats_end(STATS_WRITE, t);
+
+    uint64_t wall = stats_now() - stats_start;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    long rss = ru.ru_maxrss / 1024;
+#else
+    long rss = ru.ru_maxrss;
+#endif
+    uint64_t clients = stats_counts[STATS_USER_CLIENTS],
+             ipc = stats_counts[STATS_CLIENT_IPC];
+    if(stats_json)
+    {
+        fprintf(stderr, "{\"calls\":[");
+        bool first = true;
+        for(size_t i = 0; i < STATS_NUM; ++i)
+        {
+            const stats_t *s = &stats[i];
+            if(s->count == 0)
+            {
+                continue;
+            }
+            fprintf(stderr, "%s{\"call\":\"%s\",\"count\":%llu,\"total_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu}",
+                first ? "" : ",", stats_names[i], (unsigned long long)s->count, (unsigned long long)s->total,
+                (unsigned long long)stats_percentile(s, 0.5), (unsigned long long)stats_percentile(s, 0.99));
+            first = false;
+        }
+        fprintf(stderr, "],\"user_clients\":%llu,\"client_ipc\":%llu,\"bytes\":%llu,\"peak_rss_kb\":%ld,\"wall_ns\":%llu}\n",
+            (unsigned long long)clients, (unsigned long long)ipc, (unsigned long long)stats_written, rss, (unsigned long long)wall);
+        return;
+    }
+    fprintf(stderr, "%-40s %10s %12s %10s %10s\n", "call", "count", "total ms", "p50 us", "p99 us");
+    for(size_t i = 0; i < STATS_NUM; ++i)
+    {
+        const stats_t *s = &stats[i];
+        if(s->count == 0)
+        {
+            continue;
+        }
+        fprintf(stderr, "%-40s %10llu %12.3f %10.1f %10.1f\n", stats_names[i], (unsigned long long)s->count, s->total / 1e6,
+            stats_percentile(s, 0.5) / 1e3, stats_percentile(s, 0.99) / 1e3);
+    }
+    if(clients)
+    {
+        fprintf(stderr, "user clients resolved: %llu, IPC calls: %llu (%.1f per client)\n",
+            (unsigned long long)clients, (unsigned long long)ipc, (double)ipc / clients);
+    }
+    fprintf(stderr, "bytes written: %llu, peak RSS: %ld KB, wall time: %.3f ms\n", (unsigned long long)stats_written, rss, wall / 1e6);
+}
+
+void stats_enable(bool json)
+{
+    stats_json = json;
+    if(stats_enabled)
+    {
+        return;
+    }
+#ifdef __APPLE__
+    mach_timebase_info(&stats_timebase);
+#endif
+    stats_enabled = true;
+    stats_start = stats_now();
+    atexit(&stats_report);
+}
+
+uint64_t stats_begin(stats_kind_t kind)
+{
+    if(!stats_enabled)
+    {
+        return 0;
+    }
+    uint64_t now = stats_now();
+    return kind == STATS_FORMAT ? now - stats_writing : now;
+}
+
+void stats_end(stats_kind_t kind, uint64_t start)
+{
+    if(!start)
+    {
+        return;
+    }
+    uint64_t now = stats_now();
+    if(kind == STATS_FORMAT)
+    {
+        now -= stats_writing;
+    }
+    uint64_t ns = now > start ? now - start : 0;
+    if(kind == STATS_WRITE)
+    {
+        stats_writing += ns;
+    }
+    stats_t *s = &stats[kind];
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->total, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&s->max, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void stats_bytes(size_t num)
+{
+    if(stats_enabled)
+    {
+        __atomic_fetch_add(&stats_written, num, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_count(stats_count_t kind, size_t num)
+{
+    if(stats_enabled)
+    {
+        __atomic_fetch_add(&stats_counts[kind], num, __ATOMIC_RELAXED);
+    }
+}
+
+size_t stats_fwrite(const void *buf, size_t size, FILE *stream)
+{
+    uint64_t t = stats_begin(STATS_WRITE);
+    size_t num = fwrite(buf, 1, size, stream);
+    stats_end(STATS_WRITE, t);
+    stats_bytes(num);
+    return num;
+}
@@ -0,0 +1,73 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Counters and latency histograms for --stats. Everything is a no-op until
+// stats_enable() is called, and the report goes to stderr at exit.
+
+typedef enum
+{
+    STATS_ROOT_ENTRY,
+    STATS_CREATE_ITERATOR,
+    STATS_CHILD_ITERATOR,
+    STATS_ITERATOR_NEXT,
+    STATS_GET_NAME,
+    STATS_GET_CLASS,
+    STATS_CONFORMS,
+    STATS_ENTRY_ID,
+    STATS_GET_PATH,
+    STATS_PROPERTIES,
+    STATS_PROPERTY,
+    STATS_GET_PROPERTY,
+    STATS_SET_PROPERTIES,
+    STATS_MATCHING,
+    STATS_MATCHING_NOTIFICATION,
+    STATS_INTEREST_NOTIFICATION,
+    STATS_SERVICE_OPEN,
+    STATS_SERVICE_CLOSE,
+    STATS_SUPERCLASS,
+    STATS_BUNDLE,
+    STATS_FORMAT,       // excludes writes that happen while formatting
+    STATS_WRITE,
+    STATS_NUM,
+} stats_kind_t;
+
+// Plain counts, for things that aren't a single call.
+typedef enum
+{
+    STATS_USER_CLIENTS,
+    STATS_CLIENT_IPC,   // calls spent finding the class of those
+    STATS_COUNT_NUM,
+} stats_count_t;
+
+void stats_enable(bool json);
+uint64_t stats_begin(stats_kind_t kind);
+void stats_end(stats_kind_t kind, uint64_t start);
+void stats_bytes(size_t num);
+void stats_count(stats_count_t kind, size_t num);
+size_t stats_fwrite(const void *buf, size_t size, FILE *stream);
+
+// Times one call and evaluates to its result.
+#define STATS(kind, call) \
+({ \
+    uint64_t stats_start_ = stats_begin(kind); \
+    __typeof__(call) stats_ret_ = (call); \
+    stats_end(kind, stats_start_); \
+    stats_ret_; \
+})
+
+#endif
@@ -0,0 +1,261 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+// Round-trips the class list fixture through classtree_load(), classtree_write()
+// and classtree_map(), and makes sure damaged caches are rejected rather than used.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../classtree.h"
+#include "../common.h"
+
+static size_t numChecks = 0,
+              numFailed = 0;
+
+#define CHECK(cond, str, args...) \
+do \
+{ \
+    ++numChecks; \
+    if(!(cond)) \
+    { \
+        ERR(COLOR_RED "%s:%d: " str COLOR_RESET, __FILE__, __LINE__, ##args); \
+        ++numFailed; \
+    } \
+} while(0)
+
+static const char *const unknown[] =
+{
+    "", "IOServic", "IOServicee", "ioservice", "NotAClass", "OSObject ", "IOUserClient2023",
+};
+
+static const char* superName(const classtree_t *t, const char *name)
+{
+    uint32_t idx = classtree_find(t, name);
+    if(idx == CLASSTREE_NONE || t->classes[idx].super == CLASSTREE_NONE)
+    {
+        return NULL;
+    }
+    return classtree_name(t, t->classes[idx].super);
+}
+
+static bool extends(const classtree_t *t, const char *class, const char *super)
+{
+    uint32_t c = classtree_find(t, class),
+             s = classtree_find(t, super);
+    return c != CLASSTREE_NONE && s != CLASSTREE_NONE && classtree_extends(t, c, s);
+}
+
+static void checkTree(const classtree_t *t, const char *what)
+{
+    CHECK(t->num == 45, "%s: %u classes", what, t->num);
+    for(uint32_t i = 0; i < t->num; ++i)
+    {
+        CHECK(classtree_find(t, classtree_name(t, i)) == i, "%s: find(%s)", what, classtree_name(t, i));
+    }
+    for(size_t i = 0; i < sizeof(unknown) / sizeof(*unknown); ++i)
+    {
+        CHECK(classtree_find(t, unknown[i]) == CLASSTREE_NONE, "%s: found \"%s\"", what, unknown[i]);
+    }
+
+    const char *super = superName(t, "IOUserClient2022");
+    CHECK(super && strcmp(super, "IOUserClient") == 0, "%s: super of IOUserClient2022", what);
+    super = superName(t, "IOEventSource");
+    CHECK(super && strcmp(super, "OSObject") == 0, "%s: super of IOEventSource", what);
+    CHECK(!superName(t, "OSObject") && !superName(t, "OSMetaClassBase"), "%s: roots", what);
+
+    CHECK(extends(t, "RootDomainUserClient", "OSObject"), "%s: RootDomainUserClient extends OSObject", what);
+    CHECK(extends(t, "IOFramebuffer", "IOService"), "%s: IOFramebuffer extends IOService", what);
+    CHECK(extends(t, "IOService", "IOService"), "%s: IOService extends itself", what);
+    CHECK(!extends(t, "IOService", "IOUserClient"), "%s: IOService extends IOUserClient", what);
+    CHECK(!extends(t, "OSSymbol", "IORegistryEntry"), "%s: OSSymbol extends IORegistryEntry", what);
+    CHECK(!extends(t, "OSObject", "OSMetaClassBase"), "%s: OSObject extends OSMetaClassBase", what);
+    CHECK(!extends(t, "LoopA", "LoopB") && !extends(t, "LoopA", "LoopA"), "%s: loop", what);
+
+    // Everything extending IOUserClient, in preorder
+    uint32_t idx = classtree_find(t, "IOUserClient");
+    CHECK(idx != CLASSTREE_NONE && t->classes[idx].end - t->classes[idx].pre == 5, "%s: IOUserClient subtree", what);
+
+    const char *bundle = classtree_bundle(t, classtree_find(t, "IOService"));
+    CHECK(bundle && strcmp(bundle, "com.apple.kernel") == 0, "%s: bundle of IOService", what);
+    bundle = classtree_bundle(t, classtree_find(t, "IOUSBHostDevice"));
+    CHECK(bundle && strcmp(bundle, "com.apple.iokit.IOUSBHostFamily") == 0, "%s: bundle of IOUSBHostDevice", what);
+    CHECK(!classtree_bundle(t, classtree_find(t, "OSArray")), "%s: bundle of OSArray", what);
+}
+
+static void checkSave(const classtree_t *t, const char *fixture, const char *what)
+{
+    common_buf_t out;
+    common_buf_init(&out, NULL);
+    classtree_save(t, &out);
+    CHECK(out.len == strlen(fixture) && memcmp(out.data, fixture, out.len) == 0, "%s: saved list differs from fixture", what);
+    common_buf_free(&out);
+}
+
+static bool writeFile(const char *path, const void *buf, size_t size)
+{
+    FILE *f = fopen(path, "wb");
+    if(!f)
+    {
+        return false;
+    }
+    bool succ = fwrite(buf, 1, size, f) == size;
+    return fclose(f) == 0 && succ;
+}
+
+// Maps a damaged copy of the cache, which must fail and leave t untouched.
+// Written to its own file, since truncating the one t has mapped would pull the pages out from under it.
+static void checkReject(classtree_t *t, const char *path, const uint8_t *buf, size_t size, const char *what)
+{
+    if(!writeFile(path, buf, size))
+    {
+        CHECK(false, "%s: failed to write %s: %s", what, path, strerror(errno));
+        return;
+    }
+    uint32_t num = t->num;
+    CHECK(!classtree_map(t, path, "test"), "%s: damaged cache was accepted (size 0x%zx)", what, size);
+    CHECK(t->num == num, "%s: tree was modified", what);
+}
+
+static bool tmpPath(char *path)
+{
+    int fd = mkstemp(path);
+    if(fd < 0)
+    {
+        ERR(COLOR_RED "mkstemp: %s" COLOR_RESET, strerror(errno));
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+int main(int argc, const char **argv)
+{
+    if(argc != 2)
+    {
+        ERR("Usage: %s classtree.txt", argv[0]);
+        return -1;
+    }
+    FILE *f = fopen(argv[1], "r");
+    if(!f)
+    {
+        ERR(COLOR_RED "%s: %s" COLOR_RESET, argv[1], strerror(errno));
+        return -1;
+    }
+    common_buf_t fixture;
+    common_buf_init(&fixture, NULL);
+    char chunk[0x400];
+    size_t len;
+    while((len = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    {
+        common_buf_write(&fixture, chunk, len);
+    }
+    common_buf_putc(&fixture, '\0');
+    rewind(f);
+
+    classtree_t tree;
+    classtree_init(&tree);
+    CHECK(classtree_load(&tree, f), "load failed");
+    fclose(f);
+    CHECK(classtree_build(&tree), "build failed");
+    CHECK(classtree_set_bundle(&tree, classtree_find(&tree, "IOService"), "com.apple.kernel") &&
+          classtree_set_bundle(&tree, classtree_find(&tree, "IOUSBHostDevice"), "com.apple.iokit.IOUSBHostFamily"), "set_bundle failed");
+    checkTree(&tree, "loaded");
+    checkSave(&tree, fixture.data, "loaded");
+
+    char path[] = "/tmp/iokit-utils-test.XXXXXX",
+         damaged[] = "/tmp/iokit-utils-test.XXXXXX";
+    if(!tmpPath(path) || !tmpPath(damaged))
+    {
+        return -1;
+    }
+    CHECK(classtree_write(&tree, path, "test"), "write failed: %s", strerror(errno));
+
+    classtree_t mapped;
+    classtree_init(&mapped);
+    CHECK(!classtree_map(&mapped, path, "other kernel"), "cache for another key was accepted");
+    CHECK(!classtree_map(&mapped, "/nonexistent/ioclass.cache", "test"), "missing cache was accepted");
+    bool ok = classtree_map(&mapped, path, "test");
+    CHECK(ok, "map failed");
+    if(ok)
+    {
+        checkTree(&mapped, "mapped");
+        checkSave(&mapped, fixture.data, "mapped");
+
+        // Offsets of the tables in the file, as the reader found them
+        const uint8_t *base = mapped.map;
+        size_t size = mapped.mapSize,
+               tabOff = (const uint8_t*)mapped.tab - base,
+               classesOff = (const uint8_t*)mapped.classes - base,
+               strsOff = (const uint8_t*)mapped.strs.data - base;
+        uint8_t *copy = malloc(size);
+        if(!copy)
+        {
+            ERR(COLOR_RED "malloc: %s" COLOR_RESET, strerror(errno));
+            return -1;
+        }
+
+        // Only the alignment padding after the strings may be cut off
+        for(size_t i = 0; i < strsOff + mapped.strs.len; ++i)
+        {
+            checkReject(&mapped, damaged, base, i, "truncated");
+        }
+
+        memcpy(copy, base, size);
+        copy[0] ^= 0xff;
+        checkReject(&mapped, damaged, copy, size, "bad magic");
+
+        // No free slot would make every lookup of an unknown name spin forever
+        memcpy(copy, base, size);
+        for(size_t i = 0; i < mapped.tabCap; ++i)
+        {
+            uint32_t val = 1;
+            memcpy(copy + tabOff + i * sizeof(uint32_t), &val, sizeof(val));
+        }
+        checkReject(&mapped, damaged, copy, size, "full hash table");
+
+        memcpy(copy, base, size);
+        uint32_t val = mapped.num + 1;
+        memcpy(copy + tabOff, &val, sizeof(val));
+        checkReject(&mapped, damaged, copy, size, "hash table out of range");
+
+        memcpy(copy, base, size);
+        val = mapped.num;
+        memcpy(copy + classesOff + offsetof(classtree_class_t, super), &val, sizeof(val));
+        checkReject(&mapped, damaged, copy, size, "superclass out of range");
+
+        memcpy(copy, base, size);
+        val = (uint32_t)mapped.strs.len;
+        memcpy(copy + classesOff + offsetof(classtree_class_t, name), &val, sizeof(val));
+        checkReject(&mapped, damaged, copy, size, "name out of range");
+
+        memcpy(copy, base, size);
+        copy[strsOff + mapped.strs.len - 1] = 'x';
+        checkReject(&mapped, damaged, copy, size, "unterminated strings");
+
+        // Still the original tree after all of the above
+        checkTree(&mapped, "mapped after rejects");
+        free(copy);
+    }
+
+    unlink(path);
+    unlink(damaged);
+    classtree_free(&mapped);
+    classtree_free(&tree);
+    common_buf_free(&fixture);
+    LOG("classtree: %zu checks, %zu failed", numChecks, numFailed);
+    return numFailed == 0 ? 0 : -1;
+}
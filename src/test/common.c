@@ -0,0 +1,407 @@
+/* Copyright (c) 2022 Siguza
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * This Source Code Form is "Incompatible With Secondary Licenses", as
+ * defined by the Mozilla Public License, v. 2.0.
+**/
+
+// Checks the vectorized string scan against a plain byte loop,
+// so the SSE2 and NEON paths are both covered on the machine they run on,
+// and the number formatters against printf and strtod.
+
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common.h"
+
+// Enough for a few vector iterations plus the scalar tail, from every alignment
+#define TEST_SCAN_LEN   0x30
+#define TEST_SCAN_ALIGN 0x10
+
+static size_t numChecks = 0,
+              numFailed = 0;
+
+#define CHECK(cond, str, args...) \
+do \
+{ \
+    ++numChecks; \
+    if(!(cond)) \
+    { \
+        ERR(COLOR_RED "%s:%d: " str COLOR_RESET, __FILE__, __LINE__, ##args); \
+        ++numFailed; \
+    } \
+} while(0)
+
+static uint64_t rng = 0x853c49e6748fea9bULL;
+
+static uint32_t testRand(void)
+{
+    rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32_t)(rng >> 32);
+}
+
+static size_t refScan(const char *buf, size_t size)
+{
+    size_t i = 0;
+    for(; i < size; ++i)
+    {
+        uint8_t c = (uint8_t)buf[i];
+        if(c < 0x20 || c >= 0x80 || c == '"' || c == '\\')
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+// Escapes one byte at a time, which is what common_print_str has to match.
+static void refStr(common_buf_t *out, const char *buf, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    for(size_t i = 0; i < size; ++i)
+    {
+        uint8_t c = (uint8_t)buf[i];
+        if(c < 0x20 || c >= 0x80)
+        {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            common_buf_write(out, esc, sizeof(esc));
+        }
+        else
+        {
+            if(c == '"' || c == '\\')
+            {
+                common_buf_putc(out, '\\');
+            }
+            common_buf_putc(out, (char)c);
+        }
+    }
+}
+
+static void checkStr(const char *buf, size_t size)
+{
+    common_buf_t got, want;
+    common_buf_init(&got, NULL);
+    common_buf_init(&want, NULL);
+    common_ctx_t ctx = { .true_json = true, .first = true, .out = &got };
+    common_print_str(&ctx, buf, size);
+    refStr(&want, buf, size);
+    CHECK(got.len == want.len && (got.len == 0 || memcmp(got.data, want.data, got.len) == 0), "print_str differs for %zu bytes", size);
+    common_buf_free(&got);
+    common_buf_free(&want);
+}
+
+// Every byte value at every position, for every length and alignment around the vector width.
+// The byte right after the end is always one that needs escaping, so reading past size shows up too.
+static void testScanExhaustive(void)
+{
+    char mem[TEST_SCAN_ALIGN + TEST_SCAN_LEN + 1] __attribute__((aligned(16)));
+    for(size_t off = 0; off < TEST_SCAN_ALIGN; ++off)
+    {
+        char *buf = mem + off;
+        for(size_t len = 0; len <= TEST_SCAN_LEN; ++len)
+        {
+            memset(mem, 'a', sizeof(mem));
+            buf[len] = '"';
+            CHECK(common_str_scan(buf, len) == len, "clean: off %zu, len %zu", off, len);
+            for(size_t pos = 0; pos < len; ++pos)
+            {
+                for(unsigned int c = 0; c < 0x100; ++c)
+                {
+                    buf[pos] = (char)c;
+                    size_t want = refScan(buf, len),
+                           got = common_str_scan(buf, len);
+                    CHECK(got == want, "off %zu, len %zu, byte 0x%02x at %zu: got %zu, want %zu", off, len, c, pos, got, want);
+                }
+                buf[pos] = 'a';
+            }
+        }
+    }
+}
+
+// Random strings with several bytes that need escaping, mostly printable ones in between.
+static void testScanRandom(void)
+{
+    char buf[0x200];
+    for(size_t n = 0; n < 0x20000; ++n)
+    {
+        size_t len = testRand() % sizeof(buf);
+        uint32_t odds = 1 + testRand() % 64;
+        for(size_t i = 0; i < len; ++i)
+        {
+            uint32_t r = testRand();
+            buf[i] = r % odds == 0 ? (char)(r >> 8) : (char)(0x20 + (r >> 8) % 0x60);
+        }
+        size_t off = testRand() % 0x20;
+        off = off < len ? off : 0;
+        size_t want = refScan(buf + off, len - off),
+               got = common_str_scan(buf + off, len - off);
+        CHECK(got == want, "random %zu: got %zu, want %zu", n, got, want);
+        if(n % 0x10 == 0)
+        {
+            checkStr(buf + off, len - off);
+        }
+    }
+}
+
+static const char* format(common_buf_t *out, void (*fn)(common_buf_t*, uint64_t), uint64_t val)
+{
+    out->len = 0;
+    fn(out, val);
+    common_buf_putc(out, '\0');
+    return out->data;
+}
+
+static void checkInt(common_buf_t *out, uint64_t val)
+{
+    char want[0x20];
+    snprintf(want, sizeof(want), "%llu", (unsigned long long)val);
+    const char *got = format(out, common_buf_dec, val);
+    CHECK(strcmp(got, want) == 0, "dec: got %s, want %s", got, want);
+    snprintf(want, sizeof(want), "0x%llx", (unsigned long long)val);
+    got = format(out, common_buf_hex, val);
+    CHECK(strcmp(got, want) == 0, "hex: got %s, want %s", got, want);
+}
+
+// Every digit count and bit length with its neighbours, then random values of random length.
+static void testInt(void)
+{
+    common_buf_t out;
+    common_buf_init(&out, NULL);
+    for(uint64_t p = 1; p != 0; p = p > UINT64_MAX / 10 ? 0 : p * 10)
+    {
+        checkInt(&out, p - 1);
+        checkInt(&out, p);
+        checkInt(&out, p + 1);
+    }
+    for(int i = 0; i < 64; ++i)
+    {
+        uint64_t p = 1ULL << i;
+        checkInt(&out, p - 1);
+        checkInt(&out, p);
+        checkInt(&out, p + 1);
+    }
+    checkInt(&out, UINT64_MAX);
+    for(size_t n = 0; n < 0x10000; ++n)
+    {
+        uint64_t val = ((uint64_t)testRand() << 32) | testRand();
+        checkInt(&out, val >> (testRand() % 64));
+    }
+    common_buf_free(&out);
+}
+
+// Significant digits of a number as printed, without sign, point, leading or trailing zeroes.
+// Returns the decimal exponent of the first digit.
+static int digitsOf(const char *str, char *digits)
+{
+    int len = 0,
+        point = 0,
+        lead = 0;
+    bool seenPoint = false;
+    for(; *str && *str != 'e'; ++str)
+    {
+        if(*str == '-')
+        {
+            continue;
+        }
+        if(*str == '.')
+        {
+            seenPoint = true;
+            continue;
+        }
+        if(len == 0 && *str == '0')
+        {
+            lead += seenPoint;
+            continue;
+        }
+        digits[len++] = *str;
+        point += !seenPoint;
+    }
+    while(len > 1 && digits[len - 1] == '0')
+    {
+        --len;
+    }
+    digits[len] = '\0';
+    return (*str == 'e' ? atoi(str + 1) : 0) + (point > 0 ? point - 1 : -lead - 1);
+}
+
+// The fewest digits that read back as val. At that length, printf's correctly rounded
+// digits may fall just outside of what rounds to val while the next ones up or down don't.
+static int shortestOf(double val, char *digits)
+{
+    char tmp[0x40];
+    for(int prec = 0; prec < 17; ++prec)
+    {
+        snprintf(tmp, sizeof(tmp), "%.*e", prec, fabs(val));
+        uint64_t mant = 0;
+        const char *ptr = tmp;
+        for(; *ptr != 'e'; ++ptr)
+        {
+            if(*ptr != '.')
+            {
+                mant = mant * 10 + (*ptr - '0');
+            }
+        }
+        int exp = atoi(ptr + 1) - prec;
+        for(int d = 0; d < 3; ++d)
+        {
+            snprintf(tmp, sizeof(tmp), "%llue%d", (unsigned long long)(d == 0 ? mant : d == 1 ? mant + 1 : mant - 1), exp);
+            if(strtod(tmp, NULL) == fabs(val))
+            {
+                return digitsOf(tmp, digits);
+            }
+        }
+    }
+    snprintf(tmp, sizeof(tmp), "%.16e", val);
+    return digitsOf(tmp, digits);
+}
+
+static bool sameDouble(double a, double b)
+{
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static void checkDouble(common_buf_t *out, double val)
+{
+    out->len = 0;
+    common_buf_double(out, val);
+    common_buf_putc(out, '\0');
+    const char *got = out->data;
+    if(isnan(val))
+    {
+        CHECK(strcmp(got, "nan") == 0, "got %s for nan", got);
+        return;
+    }
+    if(isinf(val))
+    {
+        CHECK(strcmp(got, val < 0 ? "-inf" : "inf") == 0, "got %s for %g", got, val);
+        return;
+    }
+
+    char g17[0x40];
+    snprintf(g17, sizeof(g17), "%.17g", val);
+    CHECK(sameDouble(strtod(got, NULL), val), "%s: reads back as %.17g, want %s", got, strtod(got, NULL), g17);
+    CHECK(sameDouble(strtod(got, NULL), strtod(g17, NULL)), "%s: differs from %%.17g %s", got, g17);
+
+    // Always looks like a float, with an exponent only outside of 1e-4 to 1e17
+    CHECK(strchr(got, '.') || strchr(got, 'e'), "%s: looks like an integer", got);
+    if(val == 0)
+    {
+        CHECK(strcmp(got, signbit(val) ? "-0.0" : "0.0") == 0, "got %s for %s0", got, signbit(val) ? "-" : "");
+        return;
+    }
+    char gotDigits[0x20], wantDigits[0x20];
+    int gotExp = digitsOf(got, gotDigits),
+        wantExp = shortestOf(val, wantDigits);
+    CHECK(strcmp(gotDigits, wantDigits) == 0 && gotExp == wantExp, "%s: not the shortest, want %se%d (%s)", got, wantDigits, wantExp, g17);
+    bool sci = wantExp >= 17 || wantExp < -4;
+    CHECK(!strchr(got, 'e') == !sci, "%s: wrong notation for %s", got, g17);
+}
+
+static void testDouble(void)
+{
+    static const struct
+    {
+        double val;
+        const char *str;
+    } fixed[] =
+    {
+        { 0.0,                       "0.0" },
+        { -0.0,                      "-0.0" },
+        { 1.0,                       "1.0" },
+        { -1.5,                      "-1.5" },
+        { 0.1,                       "0.1" },
+        { 0.3,                       "0.3" },
+        { 1.0 / 3.0,                 "0.3333333333333333" },
+        { 123.456,                   "123.456" },
+        { 0.0001,                    "0.0001" },
+        { 0.00001,                   "1e-05" },
+        { 1e15,                      "1000000000000000.0" },
+        { 1e16,                      "10000000000000000.0" },
+        { 1e17,                      "1e+17" },
+        { 1.5e300,                   "1.5e+300" },
+        { 0x1p53,                    "9007199254740992.0" },
+        { 0x1p53 + 2,                "9007199254740994.0" },
+        { 0x1p64,                    "1.8446744073709552e+19" },
+        { DBL_MAX,                   "1.7976931348623157e+308" },
+        { DBL_MIN,                   "2.2250738585072014e-308" },
+        { 4.9406564584124654e-324,   "5e-324" },
+        { -4.9406564584124654e-324,  "-5e-324" },
+        { INFINITY,                  "inf" },
+        { -INFINITY,                 "-inf" },
+        { NAN,                       "nan" },
+    };
+    common_buf_t out;
+    common_buf_init(&out, NULL);
+    for(size_t i = 0; i < sizeof(fixed) / sizeof(*fixed); ++i)
+    {
+        out.len = 0;
+        common_buf_double(&out, fixed[i].val);
+        common_buf_putc(&out, '\0');
+        CHECK(strcmp(out.data, fixed[i].str) == 0, "got %s, want %s", out.data, fixed[i].str);
+        checkDouble(&out, fixed[i].val);
+    }
+
+    // Powers of ten and two, and their neighbours
+    for(int e = -325; e <= 309; ++e)
+    {
+        char tmp[0x10];
+        snprintf(tmp, sizeof(tmp), "1e%d", e);
+        double val = strtod(tmp, NULL);
+        checkDouble(&out, val);
+        checkDouble(&out, nextafter(val, 0));
+        checkDouble(&out, nextafter(val, INFINITY));
+        checkDouble(&out, -val);
+    }
+    for(int e = -1074; e <= 1023; ++e)
+    {
+        double val = ldexp(1, e);
+        checkDouble(&out, val);
+        checkDouble(&out, nextafter(val, 0));
+        checkDouble(&out, nextafter(val, INFINITY));
+    }
+
+    // Around the integers that are printed directly
+    for(int64_t i = -0x100; i <= 0x100; ++i)
+    {
+        checkDouble(&out, 0x1p53 + 2 * i);
+        checkDouble(&out, 0x1p52 + i);
+        checkDouble(&out, 0x1p52 + i + 0.5);
+        checkDouble(&out, (double)i);
+        checkDouble(&out, (double)i + 0.5);
+    }
+
+    // Random bit patterns, random subnormals and random short decimals
+    for(size_t n = 0; n < 0x10000; ++n)
+    {
+        uint64_t bits = ((uint64_t)testRand() << 32) | testRand();
+        double val;
+        memcpy(&val, &bits, sizeof(val));
+        checkDouble(&out, val);
+        bits &= 0x800fffffffffffffULL;
+        memcpy(&val, &bits, sizeof(val));
+        checkDouble(&out, val);
+        char tmp[0x20];
+        snprintf(tmp, sizeof(tmp), "%llue%d", (unsigned long long)(bits % 1000000000000ULL) >> (testRand() % 40), (int)(testRand() % 640) - 330);
+        checkDouble(&out, strtod(tmp, NULL));
+    }
+    common_buf_free(&out);
+}
+
+int main(void)
+{
+    testScanExhaustive();
+    testScanRandom();
+    testInt();
+    testDouble();
+    LOG("common: %zu checks, %zu failed", numChecks, numFailed);
+    return numFailed == 0 ? 0 : -1;
+}
@@ -0,0 +1,126 @@
+#!/bin/sh
+# Copyright (c) 2022 Siguza
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+# This Source Code Form is "Incompatible With Secondary Licenses", as
+# defined by the Mozilla Public License, v. 2.0.
+
+# Runs the fake ioscan and ioprint on one thread and on several,
+# and checks that the output is the same. Then checks that a snapshot
+# and a compact dump print the same as the live registry they came from,
+# and what iodiff makes of two snapshots.
+# Usage: pool.sh bin/fake
+
+set -u
+
+BIN="$1"
+TMP="$(mktemp -d)"
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+CHECKS=0
+
+export IOFAKE_ENTRIES=3000
+export IOFAKE_TYPES=4
+
+# Connection ports are handed out at random, so they're masked.
+ports()
+{
+    sed -E 's/[0-9a-f]{8}/PORT/g'
+}
+
+match()
+{
+    CHECKS=$((CHECKS + 1))
+    if ! cmp -s "$TMP/one" "$TMP/many"; then
+        echo "pool.sh: $1:" >&2
+        diff "$TMP/one" "$TMP/many" | head -n 10 >&2
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+same()
+{
+    match "$1 differs with $2 threads"
+}
+
+exits()
+{
+    CHECKS=$((CHECKS + 1))
+    if [ "$2" -ne "$3" ]; then
+        echo "pool.sh: $1 exited with $2 instead of $3" >&2
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+colors()
+{
+    sed "s/$(printf '\033')\[[0-9;]*m//g"
+}
+
+for t in 2 4 0; do
+    "$BIN/ioscan" -t 1 IOService 0 5 | ports > "$TMP/one"
+    "$BIN/ioscan" -t $t IOService 0 5 | ports > "$TMP/many"
+    same "ioscan IOService 0 5" $t
+
+    "$BIN/ioscan" -t 1 -s FakeDevice1 0 5 | ports > "$TMP/one"
+    "$BIN/ioscan" -t $t -s FakeDevice1 0 5 | ports > "$TMP/many"
+    same "ioscan -s FakeDevice1 0 5" $t
+
+    # Rows are streamed as they complete, so only the set of rows has to match
+    "$BIN/ioscan" -t 1 --format tsv IOService 0 5 | ports | sort > "$TMP/one"
+    "$BIN/ioscan" -t $t --format tsv IOService 0 5 | ports | sort > "$TMP/many"
+    same "ioscan --format tsv IOService 0 5" $t
+
+    for f in -j -k "--format ndjson" "-K IOFakeData,IOFakeIndex"; do
+        "$BIN/ioprint" -t 1 $f > "$TMP/one"
+        "$BIN/ioprint" -t $t $f > "$TMP/many"
+        same "ioprint $f" $t
+    done
+done
+
+# IOFakeSigned holds 8, 16 and 32 bit numbers, which have to come back sign-extended
+"$BIN/ioprint" -w "$TMP/snap"
+for f in -j -k "--format ndjson"; do
+    "$BIN/ioprint" $f > "$TMP/one"
+    "$BIN/ioprint" -r "$TMP/snap" $f > "$TMP/many"
+    match "ioprint -r $f differs from live $f"
+done
+
+"$BIN/ioprint" -c > "$TMP/dump"
+for f in -j -k "-o -j"; do
+    "$BIN/ioprint" $f > "$TMP/one"
+    "$BIN/ioexpand" $f "$TMP/dump" > "$TMP/many"
+    match "ioexpand $f differs from ioprint $f"
+done
+"$BIN/ioprint" -j -K IOFakeData,IOFakeIndex > "$TMP/one"
+"$BIN/ioprint" -c -K IOFakeData,IOFakeIndex | "$BIN/ioexpand" > "$TMP/many"
+match "ioexpand differs from ioprint -j -K IOFakeData,IOFakeIndex"
+
+"$BIN/iodiff" "$TMP/snap" "$TMP/snap" > "$TMP/many"
+exits "iodiff of the same snapshot" $? 0
+: > "$TMP/one"
+match "iodiff of the same snapshot printed something"
+
+# One more entry adds it below FakeDevice6@e, which changes its child count, and the root's build version
+IOFAKE_ENTRIES=30 "$BIN/ioprint" -w "$TMP/old"
+IOFAKE_ENTRIES=31 "$BIN/ioprint" -w "$TMP/new"
+printf '%s\n' \
+    '~ IOService:/ (IORegistryEntry)' \
+    '~ IOService:/FakeDevice2@2/FakeDevice6@6/FakeDevice6@e (FakeDevice6)' \
+    '+ IOService:/FakeDevice2@2/FakeDevice6@6/FakeDevice6@e/FakeDevice6@1e (FakeDevice6)' > "$TMP/one"
+"$BIN/iodiff" -q "$TMP/old" "$TMP/new" 2>/dev/null > "$TMP/out"
+exits "iodiff of an added entry" $? 1
+colors < "$TMP/out" > "$TMP/many"
+match "iodiff of an added entry"
+sed 's/^+/-/' "$TMP/one" > "$TMP/out"
+mv "$TMP/out" "$TMP/one"
+"$BIN/iodiff" -q "$TMP/new" "$TMP/old" 2>/dev/null > "$TMP/out"
+exits "iodiff of a removed entry" $? 1
+colors < "$TMP/out" > "$TMP/many"
+match "iodiff of a removed entry"
+
+echo "pool.sh: $CHECKS checks, $FAILED failed"
+[ "$FAILED" -eq 0 ]
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Copyright (c) 2022 Siguza
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+# This Source Code Form is "Incompatible With Secondary Licenses", as
+# defined by the Mozilla Public License, v. 2.0.
+
+# Plays events.txt back to the fake ioprint --watch and compares what it
+# prints, registry IDs included, with watch.txt.
+# Usage: watch.sh bin/fake src/test
+
+set -u
+
+BIN="$1"
+DIR="$2"
+TMP="$(mktemp -d)"
+trap 'rm -rf "$TMP"' EXIT
+ESC="$(printf '\033')"
+
+IOFAKE_ENTRIES=30 IOFAKE_EVENTS="$DIR/events.txt" "$BIN/ioprint" --watch > "$TMP/out"
+RET=$?
+sed "s/$ESC\[[0-9;]*m//g" "$TMP/out" > "$TMP/watch.txt"
+if [ "$RET" -ne 0 ]; then
+    echo "watch.sh: ioprint --watch exited with $RET" >&2
+    exit 1
+fi
+if ! cmp -s "$DIR/watch.txt" "$TMP/watch.txt"; then
+    echo "watch.sh: output differs from $DIR/watch.txt:" >&2
+    diff "$DIR/watch.txt" "$TMP/watch.txt" | head -n 10 >&2
+    exit 1
+fi
+echo "watch.sh: $(grep -c '^[-+~]' "$TMP/watch.txt") records match"